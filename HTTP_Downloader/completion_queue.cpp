@@ -0,0 +1,61 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "completion_queue.h"
+
+static HANDLE g_hIOCP = NULL;
+
+bool CreateCompletionQueue()
+{
+	g_hIOCP = CreateIoCompletionPort( INVALID_HANDLE_VALUE, NULL, 0, 0 );
+
+	return ( g_hIOCP != NULL );
+}
+
+void DestroyCompletionQueue()
+{
+	if ( g_hIOCP != NULL )
+	{
+		CloseHandle( g_hIOCP );
+		g_hIOCP = NULL;
+	}
+}
+
+// Sockets and files that were opened for overlapped IO post their completions to the queue.
+// A failure leaves the queue as it was.
+bool AssociateCompletionQueue( HANDLE handle, SOCKET_CONTEXT *context )
+{
+	return ( CreateIoCompletionPort( handle, g_hIOCP, ( ULONG_PTR )context, 0 ) != NULL );
+}
+
+bool PostCompletion( DWORD io_size, SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped )
+{
+	return ( PostQueuedCompletionStatus( g_hIOCP, io_size, ( ULONG_PTR )context, ( OVERLAPPED * )overlapped ) != FALSE );
+}
+
+// Returns false if the operation failed. overlapped will be NULL if nothing was dequeued.
+bool WaitForCompletion( DWORD *io_size, SOCKET_CONTEXT **context, OVERLAPPEDEX **overlapped )
+{
+	return ( GetQueuedCompletionStatus( g_hIOCP, io_size, ( ULONG_PTR * )context, ( OVERLAPPED ** )overlapped, INFINITE ) != FALSE );
+}
+
+bool IsCompletionQueueRunning()
+{
+	return ( g_hIOCP != NULL );
+}
@@ -0,0 +1,45 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _COMPLETION_QUEUE_H
+#define _COMPLETION_QUEUE_H
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+struct SOCKET_CONTEXT;
+struct OVERLAPPEDEX;
+
+// The connection state machine queues and waits for its completions through these functions only.
+// An IO completion port is the only implementation. The callers start the overlapped operations
+// themselves (WSARecv, WSASend, ConnectEx, AcceptEx, ReadFile, WriteFile) and expect them to finish here,
+// so a readiness based queue like epoll would also have to perform those operations on their behalf.
+
+bool CreateCompletionQueue();
+void DestroyCompletionQueue();
+
+bool AssociateCompletionQueue( HANDLE handle, SOCKET_CONTEXT *context );
+
+bool PostCompletion( DWORD io_size, SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped );
+bool WaitForCompletion( DWORD *io_size, SOCKET_CONTEXT **context, OVERLAPPEDEX **overlapped );
+
+bool IsCompletionQueueRunning();
+
+#endif
@@ -23,14 +23,18 @@
 #include "lite_ole32.h"
 #include "lite_shell32.h"
 #include "lite_zlib1.h"
+#include "lite_brotlidec.h"
+#include "lite_zstd.h"
 #include "lite_normaliz.h"
 
 #include "http_parsing.h"
 #include "ftp_parsing.h"
+#include "server_api.h"
 
 #include "utilities.h"
 #include "login_manager_utilities.h"
 #include "list_operations.h"
+#include "file_operations.h"
 
 #include "string_tables.h"
 #include "cmessagebox.h"
@@ -38,8 +42,7 @@
 #include "menus.h"
 
 #include "doublylinkedlist.h"
-
-HANDLE g_hIOCP = NULL;
+#include "download_observer.h"
 
 WSAEVENT g_cleanup_event[ 1 ];
 
@@ -107,6 +110,10 @@ DoublyLinkedList *download_queue = NULL;
 
 DoublyLinkedList *active_download_list = NULL;		// List of active DOWNLOAD_INFO objects.
 
+volatile LONG g_download_id = 0;
+
+dllrbt_tree *g_download_list = NULL;				// Every DOWNLOAD_INFO keyed by its id. The ids are given out in the order that the downloads are added.
+
 DoublyLinkedList *file_size_prompt_list = NULL;		// List of downloads that need to be prompted to continue.
 DoublyLinkedList *rename_file_prompt_list = NULL;	// List of downloads that need to be prompted to continue.
 DoublyLinkedList *last_modified_prompt_list = NULL;	// List of downloads that need to be prompted to continue.
@@ -115,6 +122,33 @@ DoublyLinkedList *move_file_queue = NULL;			// List of downloads that need to be
 
 HANDLE g_timeout_semaphore = NULL;
 
+DoublyLinkedList *g_timer_wheel[ TIMER_WHEEL_SLOTS ] = { NULL };	// Contexts hashed by the tick that they need to be checked for a timeout.
+unsigned long g_timer_wheel_tick = 0;								// The number of seconds the timer wheel has advanced.
+
+HANDLE g_rate_limit_timer_queue = NULL;
+HANDLE g_rate_limit_timer = NULL;						// The refill that's waiting to run. Only set while there are throttled contexts.
+
+DoublyLinkedList *range_checkpoint_queue = NULL;		// List of range checkpoints that are waiting to be written.
+RANGE_CHECKPOINT *g_range_checkpoint_writing = NULL;	// The checkpoint that the writer thread is writing.
+HANDLE g_range_checkpoint_semaphore = NULL;
+HANDLE g_range_checkpoint_event = NULL;					// Signaled when the writer thread is done with a checkpoint that's being closed.
+
+TOKEN_BUCKET g_session_bucket;							// Used when cfg_download_speed_limit is set.
+DoublyLinkedList *throttled_context_list = NULL;		// List of contexts that are waiting for tokens before they can process their received data.
+
+DoublyLinkedList *g_connection_pool = NULL;				// Idle keep-alive connections. The oldest are at the head.
+unsigned int g_connection_pool_count = 0;
+
+dllrbt_tree *g_dns_cache = NULL;						// DNS_CACHE_ENTRY values keyed by "host:port".
+DoublyLinkedList *g_dns_resolve_queue = NULL;			// DNS_CACHE_ENTRY values that need to be looked up.
+HANDLE g_dns_semaphore = NULL;
+volatile LONG g_dns_resolver_count = 0;
+
+unsigned long g_dns_cache_hits = 0;
+unsigned long g_dns_cache_misses = 0;
+unsigned long g_dns_lookups = 0;
+unsigned long long g_dns_lookup_time = 0;				// The total number of milliseconds spent in lookups.
+
 CRITICAL_SECTION context_list_cs;				// Guard access to the global context list.
 CRITICAL_SECTION active_download_list_cs;		// Guard access to the global active download list.
 CRITICAL_SECTION download_queue_cs;				// Guard access to the download queue.
@@ -123,6 +157,11 @@ CRITICAL_SECTION rename_file_prompt_list_cs;	// Guard access to the rename file
 CRITICAL_SECTION last_modified_prompt_list_cs;	// Guard access to the last modified prompt list.
 CRITICAL_SECTION move_file_queue_cs;			// Guard access to the move file queue.
 CRITICAL_SECTION cleanup_cs;
+CRITICAL_SECTION rate_limit_cs;					// Guard access to the token buckets and throttled context list.
+CRITICAL_SECTION range_checkpoint_cs;			// Guard access to the range checkpoint queue.
+CRITICAL_SECTION connection_pool_cs;			// Guard access to the connection pool.
+CRITICAL_SECTION dns_cache_cs;					// Guard access to the DNS cache and resolve queue.
+CRITICAL_SECTION download_list_cs;				// Guard access to the download list.
 
 LPFN_ACCEPTEX _AcceptEx = NULL;
 LPFN_CONNECTEX _ConnectEx = NULL;
@@ -141,6 +180,9 @@ bool move_file_process_active = false;
 
 unsigned int g_session_status_count[ 8 ] = { 0 };	// 8 states that can be considered finished (Completed, Stopped, Failed, etc.)
 
+unsigned long long g_session_total_downloaded = 0;
+unsigned long long g_session_downloaded_speed = 0;
+
 bool g_timers_running = false;
 
 void SetSessionStatusCount( unsigned int status )
@@ -173,28 +215,292 @@ void EnableTimers( bool timer_state )
 				ReleaseSemaphore( g_timeout_semaphore, 1, NULL );
 			}
 
+#ifndef HEADLESS_BUILD
 			if ( g_timer_semaphore != NULL )
 			{
 				ReleaseSemaphore( g_timer_semaphore, 1, NULL );
 			}
+#endif
 		}
 	}
 	else	// Let the timers complete their current task and then wait indefinitely.
 	{
+#ifndef HEADLESS_BUILD
 		UpdateMenus( true );
+#endif
 
 		g_timers_running = false;
 	}
 }
 
+// Gives the download its id and adds it to the download list.
+// The ids are given out in download_list_cs so that the list stays in the order that the downloads were added.
+void AddDownload( DOWNLOAD_INFO *di )
+{
+	EnterCriticalSection( &download_list_cs );
+
+	di->id = ( unsigned int )InterlockedIncrement( &g_download_id );
+
+	dllrbt_insert( g_download_list, ( void * )&di->id, ( void * )di );
+
+	LeaveCriticalSection( &download_list_cs );
+}
+
+// This needs to be done before the download is freed.
+void RemoveDownload( DOWNLOAD_INFO *di )
+{
+	EnterCriticalSection( &download_list_cs );
+
+	dllrbt_iterator *itr = dllrbt_find( g_download_list, ( void * )&di->id, false );
+	if ( itr != NULL )
+	{
+		dllrbt_remove( g_download_list, itr );
+	}
+
+	LeaveCriticalSection( &download_list_cs );
+}
+
+// This should be done in the download_list_cs critical section.
+DOWNLOAD_INFO *FindDownload( unsigned int id )
+{
+	return ( DOWNLOAD_INFO * )dllrbt_find( g_download_list, ( void * )&id, true );
+}
+
+// The next history save appends the download's entry to the history journal.
+// This needs to be done after the saved values have changed.
+void MarkDownloadChanged( DOWNLOAD_INFO *di )
+{
+	InterlockedIncrement( &di->history_changes );
+
+	download_history_changed = true;
+}
+
+// Calculates the elapsed time of the active downloads, and their speed and time remaining once a second has passed since they were last calculated.
+void UpdateDownloadSpeeds( QFILETIME &last_update )
+{
+	QFILETIME current_time;
+	GetSystemTimeAsFileTime( &current_time.ft );
+
+	// Determine the difference (in milliseconds) between the current time and our last update time.
+	unsigned long long time_difference = ( current_time.ull - last_update.ull ) / ( FILETIME_TICKS_PER_SECOND / 1000 );	// Use milliseconds.
+
+	// See if at least 1 second has elapsed since we last updated our speed and download time estimate.
+	bool update_speed = ( time_difference >= 1000 );	// Measure in milliseconds for better precision. 1000 milliseconds = 1 second.
+
+	unsigned long long session_downloaded_speed = 0;
+
+	EnterCriticalSection( &active_download_list_cs );
+
+	DoublyLinkedList *active_download_node = active_download_list;
+
+	while ( active_download_node != NULL && !g_end_program )
+	{
+		DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )active_download_node->data;
+
+		// Skip any files that can block us (large files that are currently allocating).
+		if ( di != NULL && TryEnterCriticalSection( &di->shared_cs ) == TRUE )
+		{
+			// If connecting, downloading, paused, or allocating then calculate the elapsed time.
+			if ( IS_STATUS( di->status,
+					STATUS_CONNECTING |
+					STATUS_DOWNLOADING |
+					STATUS_ALLOCATING_FILE ) )
+			{
+				di->time_elapsed = ( current_time.ull - di->start_time.QuadPart ) / FILETIME_TICKS_PER_SECOND;
+			}
+
+			// If downloading, then calculate the speed.
+			if ( di->status == STATUS_DOWNLOADING )
+			{
+				if ( update_speed )
+				{
+					// Get the speed.
+					di->speed = ( ( di->downloaded - di->last_downloaded ) * 1000 ) / time_difference;	// Multiply by 1000 to match the millisecond precision. Gives us bytes/second.
+
+					// Get the time remaining.
+					if ( di->speed > 0 && di->file_size > 0 && di->downloaded <= di->file_size )
+					{
+						// Get the remaining bytes and divide it by the speed.
+						di->time_remaining = ( di->file_size - di->downloaded ) / di->speed;
+					}
+					else	// The remaining time will be unknown if the download stalls.
+					{
+						di->time_remaining = 0;
+					}
+
+					// Save the download's progress with the next history save.
+					if ( di->downloaded != di->last_downloaded )
+					{
+						MarkDownloadChanged( di );
+					}
+
+					di->last_downloaded = di->downloaded;
+				}
+
+				session_downloaded_speed += di->speed;
+			}
+			else if ( IS_STATUS( di->status, STATUS_PAUSED | STATUS_QUEUED ) )
+			{
+				di->time_remaining = 0;
+				di->speed = 0;
+			}
+
+			LeaveCriticalSection( &di->shared_cs );
+		}
+
+		active_download_node = active_download_node->next;
+	}
+
+	LeaveCriticalSection( &active_download_list_cs );
+
+	if ( update_speed )
+	{
+		last_update = current_time;
+	}
+
+	g_session_downloaded_speed = session_downloaded_speed;
+}
+
+// These should be done in the context_list_cs critical section.
+void ScheduleContextTimer( SOCKET_CONTEXT *context, unsigned long ticks )
+{
+	if ( context->timer_node.data != NULL )
+	{
+		DLL_RemoveNode( &g_timer_wheel[ context->timer_expires & ( TIMER_WHEEL_SLOTS - 1 ) ], &context->timer_node );
+	}
+
+	if ( ticks == 0 )
+	{
+		ticks = 1;
+	}
+
+	context->timer_expires = g_timer_wheel_tick + ticks;
+
+	context->timer_node.data = context;
+	DLL_AddNode( &g_timer_wheel[ context->timer_expires & ( TIMER_WHEEL_SLOTS - 1 ) ], &context->timer_node, -1 );
+}
+
+void AddContextTimer( SOCKET_CONTEXT *context )
+{
+	if ( context != NULL )
+	{
+		InterlockedExchange( &context->last_activity, ( LONG )g_timer_wheel_tick );
+
+		ScheduleContextTimer( context, ( cfg_timeout > 0 ? cfg_timeout : TIMER_WHEEL_SLOTS ) );
+	}
+}
+
+void RemoveContextTimer( SOCKET_CONTEXT *context )
+{
+	if ( context != NULL && context->timer_node.data != NULL )
+	{
+		DLL_RemoveNode( &g_timer_wheel[ context->timer_expires & ( TIMER_WHEEL_SLOTS - 1 ) ], &context->timer_node );
+		context->timer_node.data = NULL;
+	}
+}
+
+// Makes the context time out on the next tick of the timer wheel.
+void ExpireContextTimer( SOCKET_CONTEXT *context )
+{
+	if ( context != NULL && context->timer_node.data != NULL )
+	{
+		// cfg_timeout can't be larger than USHRT_MAX.
+		InterlockedExchange( &context->last_activity, ( LONG )( g_timer_wheel_tick - USHRT_MAX ) );
+
+		ScheduleContextTimer( context, 1 );
+	}
+}
+
+// Returns the number of ticks until the context needs to be checked again.
+// This should be done in the context_list_cs and context's critical section.
+unsigned long ProcessContextTimer( SOCKET_CONTEXT *context )
+{
+	unsigned long idle_ticks = g_timer_wheel_tick - ( unsigned long )context->last_activity;
+
+	if ( context->cleanup != 0 || context->status == STATUS_ALLOCATING_FILE )
+	{
+		// The idle time doesn't count while we're cleaning up or allocating the file.
+		InterlockedExchange( &context->last_activity, ( LONG )g_timer_wheel_tick );
+
+		return ( cfg_timeout > 0 ? cfg_timeout : TIMER_WHEEL_SLOTS );
+	}
+
+	// Don't time out the Control connection.
+	// It'll be forced to time out if the Data connection times out.
+	if ( context->ftp_context != NULL && context->ftp_connection_type & FTP_CONNECTION_TYPE_CONTROL )
+	{
+		if ( cfg_ftp_send_keep_alive && context->ftp_connection_type == FTP_CONNECTION_TYPE_CONTROL )
+		{
+			if ( idle_ticks >= FTP_KEEP_ALIVE_INTERVAL )
+			{
+				InterlockedExchange( &context->last_activity, ( LONG )g_timer_wheel_tick );
+
+				SendFTPKeepAlive( context );
+
+				return FTP_KEEP_ALIVE_INTERVAL;
+			}
+
+			return FTP_KEEP_ALIVE_INTERVAL - idle_ticks;
+		}
+
+		InterlockedExchange( &context->last_activity, ( LONG )g_timer_wheel_tick );
+
+		return ( cfg_timeout > 0 ? cfg_timeout : TIMER_WHEEL_SLOTS );
+	}
+
+	unsigned long timeout = cfg_timeout;
+
+	// Idle keep-alive connections to our server don't need to stay open as long as connections that are in the middle of a request.
+	if ( context->keep_alive_idle && ( timeout == 0 || timeout > SERVER_KEEP_ALIVE_TIMEOUT ) )
+	{
+		timeout = SERVER_KEEP_ALIVE_TIMEOUT;
+	}
+
+	if ( timeout == 0 )
+	{
+		return TIMER_WHEEL_SLOTS;
+	}
+
+	// See if we've reached the timeout limit.
+	if ( idle_ticks >= timeout )
+	{
+		InterlockedExchange( &context->last_activity, ( LONG )g_timer_wheel_tick );
+
+		// Ignore paused and queued downloads, and contexts that are waiting on the rate limiter.
+		if ( IS_STATUS_NOT( context->status, STATUS_PAUSED | STATUS_QUEUED ) && context->throttle_node.data == NULL )
+		{
+			context->timed_out = TIME_OUT_TRUE;
+
+			context->cleanup = 2;	// Force the cleanup.
+
+			InterlockedIncrement( &context->pending_operations );
+
+			context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
+
+			PostCompletion( 0, context, &context->overlapped_close );
+		}
+
+		return timeout;
+	}
+
+	// Some IO has completed since the timer was armed. Check again when the remaining time has passed.
+	return timeout - idle_ticks;
+}
+
 DWORD WINAPI Timeout( LPVOID WorkThreadContext )
 {
 	bool run_timer = g_timers_running;
+	bool was_running = false;
+
+	DWORD last_tick_count = GetTickCount();
+
+	QFILETIME last_update;
+	last_update.ull = 0;
 
 	while ( !g_end_program )
 	{
-		// Check the timeout counter every second, or wait indefinitely if we're using the system default.
-		WaitForSingleObject( g_timeout_semaphore, ( run_timer ? ( cfg_timeout > 0 ? 1000 : INFINITE ) : INFINITE ) );
+		// Advance the timer wheel and update the download speeds every second while there are active downloads, or wait indefinitely.
+		WaitForSingleObject( g_timeout_semaphore, ( run_timer ? 1000 : INFINITE ) );
 
 		if ( g_end_program )
 		{
@@ -204,83 +510,1881 @@ DWORD WINAPI Timeout( LPVOID WorkThreadContext )
 		// This will allow the timer to go through at least one loop after it's been disabled (g_timers_running == false).
 		run_timer = g_timers_running;
 
-		if ( TryEnterCriticalSection( &context_list_cs ) == TRUE )
+		DWORD current_tick_count = GetTickCount();
+
+		// Don't count the time we spent waiting indefinitely.
+		if ( !was_running )
 		{
-			DoublyLinkedList *context_node = g_context_list;
+			last_tick_count = current_tick_count;
+		}
+
+		was_running = run_timer;
 
-			// Go through the list of active connections.
-			while ( context_node != NULL && context_node->data != NULL )
+		if ( TryEnterCriticalSection( &context_list_cs ) == TRUE )
+		{
+			// Process every slot that we've passed since the last time we ran. Semaphore releases can wake us early.
+			while ( ( current_tick_count - last_tick_count ) >= 1000 && !g_end_program )
 			{
-				if ( g_end_program )
+				last_tick_count += 1000;
+
+				++g_timer_wheel_tick;
+
+				DoublyLinkedList **slot = &g_timer_wheel[ g_timer_wheel_tick & ( TIMER_WHEEL_SLOTS - 1 ) ];
+				DoublyLinkedList *timer_node = *slot;
+
+				// Only the contexts in this slot need to be looked at.
+				while ( timer_node != NULL )
 				{
-					break;
+					SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )timer_node->data;
+
+					timer_node = timer_node->next;
+
+					// The slot also holds contexts that expire on a later rotation of the wheel.
+					if ( ( long )( context->timer_expires - g_timer_wheel_tick ) > 0 )
+					{
+						continue;
+					}
+
+					unsigned long ticks = 1;	// Try again on the next tick if the context is busy.
+
+					if ( TryEnterCriticalSection( &context->context_cs ) == TRUE )
+					{
+						ticks = ProcessContextTimer( context );
+
+						LeaveCriticalSection( &context->context_cs );
+					}
+
+					ScheduleContextTimer( context, ticks );
 				}
+			}
+
+			LeaveCriticalSection( &context_list_cs );
+		}
+
+		// The last pass after the timer has been disabled sets the session speed back to 0.
+		UpdateDownloadSpeeds( last_update );
+
+		EvictIdleConnections();
+	}
+
+	CloseHandle( g_timeout_semaphore );
+	g_timeout_semaphore = NULL;
+
+	_ExitThread( 0 );
+	return 0;
+}
+
+// This should be done in the rate_limit_cs critical section.
+void RefillTokenBucket( TOKEN_BUCKET *tb, unsigned long long rate, DWORD current_tick )
+{
+	DWORD elapsed = current_tick - tb->last_refill;
+
+	// Nothing accumulates when we're unlimited.
+	if ( rate == 0 )
+	{
+		tb->tokens = 0;
+		tb->last_refill = current_tick;
+
+		return;
+	}
+
+	// Don't let an idle bucket overflow the calculation below.
+	if ( elapsed > 1000 )
+	{
+		elapsed = 1000;
+	}
+
+	long long tokens = ( long long )( ( rate * elapsed ) / 1000 );
+
+	// Wait until at least one byte can be added so that slow rates don't lose the elapsed time.
+	if ( tokens > 0 )
+	{
+		tb->tokens += tokens;
+		tb->last_refill = current_tick;
+
+		// Allow at most a quarter of a second to burst.
+		long long burst = ( long long )( rate / 4 );
+		if ( burst < 1 )
+		{
+			burst = 1;
+		}
+
+		if ( tb->tokens > burst )
+		{
+			tb->tokens = burst;
+		}
+	}
+}
+
+// Each part of a limited download gets an equal share of the limit so that a fast part can't starve the others.
+// Returns 0 if the part doesn't need its own bucket.
+unsigned long long GetPartSpeedLimit( SOCKET_CONTEXT *context )
+{
+	if ( context->download_info == NULL || context->download_info->download_speed_limit == 0 )
+	{
+		return 0;
+	}
+
+	unsigned char active_parts = context->download_info->active_parts;
+	if ( active_parts <= 1 )
+	{
+		return 0;
+	}
+
+	unsigned long long part_speed_limit = context->download_info->download_speed_limit / active_parts;
+
+	return ( part_speed_limit > 0 ? part_speed_limit : 1 );
+}
+
+// The session, download, and part buckets must all have tokens.
+// This should be done in the context's critical section and the rate_limit_cs critical section.
+bool HasTokens( SOCKET_CONTEXT *context, DWORD current_tick )
+{
+	bool ret = true;
+
+	if ( cfg_download_speed_limit > 0 )
+	{
+		RefillTokenBucket( &g_session_bucket, cfg_download_speed_limit, current_tick );
+
+		ret = ( g_session_bucket.tokens > 0 );
+	}
+
+	if ( context->download_info != NULL && context->download_info->download_speed_limit > 0 )
+	{
+		RefillTokenBucket( &context->download_info->speed_limit_bucket, context->download_info->download_speed_limit, current_tick );
+
+		ret = ( ret && context->download_info->speed_limit_bucket.tokens > 0 );
+
+		unsigned long long part_speed_limit = GetPartSpeedLimit( context );
+		if ( part_speed_limit > 0 )
+		{
+			RefillTokenBucket( &context->speed_limit_bucket, part_speed_limit, current_tick );
+
+			ret = ( ret && context->speed_limit_bucket.tokens > 0 );
+		}
+	}
+
+	return ret;
+}
+
+// This should be done in the context's critical section and the rate_limit_cs critical section.
+void ConsumeTokens( SOCKET_CONTEXT *context, DWORD io_size )
+{
+	if ( cfg_download_speed_limit > 0 )
+	{
+		g_session_bucket.tokens -= io_size;
+	}
+
+	if ( context->download_info != NULL && context->download_info->download_speed_limit > 0 )
+	{
+		context->download_info->speed_limit_bucket.tokens -= io_size;
+
+		if ( GetPartSpeedLimit( context ) > 0 )
+		{
+			context->speed_limit_bucket.tokens -= io_size;
+		}
+	}
+}
+
+// Returns true if the context has been parked on the throttled context list.
+// The parked receive will be posted by RefillTokens() once the session and download buckets have tokens.
+// This should be done in the context's critical section.
+bool ThrottleContext( SOCKET_CONTEXT *context, DWORD io_size )
+{
+	bool parked = false;
+
+	// The rate limiter has already paid for this receive.
+	if ( context->tokens_acquired )
+	{
+		context->tokens_acquired = false;
+
+		return false;
+	}
+
+	if ( cfg_download_speed_limit == 0 &&
+	   ( context->download_info == NULL || context->download_info->download_speed_limit == 0 ) )
+	{
+		return false;
+	}
+
+	EnterCriticalSection( &rate_limit_cs );
+
+	if ( HasTokens( context, GetTickCount() ) )
+	{
+		ConsumeTokens( context, io_size );
+	}
+	else
+	{
+		context->current_bytes_read = io_size;
+
+		// The parked receive counts as a pending operation so that the context can't be cleaned up while it's waiting.
+		InterlockedIncrement( &context->pending_operations );
+
+		context->throttle_node.data = context;
+		DLL_AddNode( &throttled_context_list, &context->throttle_node, -1 );
+
+		ScheduleTokenRefill();
+
+		parked = true;
+	}
+
+	LeaveCriticalSection( &rate_limit_cs );
+
+	return parked;
+}
+
+// Keep track of how much of a plain connection's receive buffer is being filled.
+// A receive that fills the buffer means there's likely more data waiting on the socket.
+// This should be done in the context's critical section.
+void TrackReceiveSize( SOCKET_CONTEXT *context, DWORD io_size )
+{
+	// Receives into a buffer that's been offset for partial data are too small to tell us anything.
+	if ( io_size >= context->wsabuf.len && context->wsabuf.len > ( context->buffer_size >> 1 ) )
+	{
+		context->short_receives = 0;
+		if ( context->full_receives < 0xFF )
+		{
+			++context->full_receives;
+		}
+	}
+	else if ( io_size < ( context->buffer_size >> 2 ) )
+	{
+		context->full_receives = 0;
+		if ( context->short_receives < 0xFF )
+		{
+			++context->short_receives;
+		}
+	}
+	else
+	{
+		context->full_receives = 0;
+		context->short_receives = 0;
+	}
+}
+
+// Double the receive buffer if the last few receives have filled it, or halve it if they've mostly left it empty.
+// context->wsabuf keeps its offset into the buffer so that any partial data is preserved.
+// Receives are posted with this single buffer rather than a list of WSABUFs. The header, chunk, and FTP reply parsers all
+// work on one contiguous block, and growing the buffer reduces the number of completions just as well.
+// This must only be done right before a receive is posted.
+// This should be done in the context's critical section.
+void ResizeReceiveBuffer( SOCKET_CONTEXT *context )
+{
+	unsigned int buffer_size = context->buffer_size;
+
+	if ( context->full_receives >= RECEIVE_BUFFER_GROW_COUNT && buffer_size < RECEIVE_BUFFER_MAX_SIZE )
+	{
+		buffer_size = min( buffer_size * 2, RECEIVE_BUFFER_MAX_SIZE );
+	}
+	else if ( context->short_receives >= RECEIVE_BUFFER_SHRINK_COUNT && buffer_size > BUFFER_SIZE && context->wsabuf.buf == context->buffer )
+	{
+		buffer_size = max( buffer_size / 2, BUFFER_SIZE );
+	}
+	else
+	{
+		return;
+	}
+
+	context->full_receives = 0;
+	context->short_receives = 0;
+
+	unsigned int offset = ( unsigned int )( context->wsabuf.buf - context->buffer );
+
+	// Leave room for the sanity NULL character.
+	char *realloc_buffer = ( char * )GlobalReAlloc( context->buffer, sizeof( char ) * ( buffer_size + 1 ), GMEM_MOVEABLE );
+	if ( realloc_buffer != NULL )
+	{
+		context->buffer = realloc_buffer;
+		context->buffer_size = buffer_size;
+
+		context->wsabuf.buf = context->buffer + offset;
+		context->wsabuf.len = context->buffer_size - offset;
+	}
+}
+
+// Refill the buckets of the throttled contexts at a fixed interval.
+// The timer is only created while there are contexts waiting, and it runs once. RefillTokens() creates the next one if it's needed.
+VOID CALLBACK RefillTokens( PVOID lpParameter, BOOLEAN TimerOrWaitFired )
+{
+	// Parking enters the context's critical section before rate_limit_cs.
+	// Take the parked contexts so that each one can be checked in that same order.
+	EnterCriticalSection( &rate_limit_cs );
+
+	// The timer won't fire again. Its handle is released once we return.
+	if ( g_rate_limit_timer != NULL )
+	{
+		DeleteTimerQueueTimer( g_rate_limit_timer_queue, g_rate_limit_timer, NULL );
+		g_rate_limit_timer = NULL;
+	}
+
+	DoublyLinkedList *parked_list = throttled_context_list;
+	throttled_context_list = NULL;
+
+	LeaveCriticalSection( &rate_limit_cs );
+
+	DoublyLinkedList *waiting_list = NULL;
+
+	DWORD current_tick = GetTickCount();
+
+	// Contexts are resumed in the order they were parked so that every part gets its share of the limit.
+	while ( parked_list != NULL )
+	{
+		SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )parked_list->data;
+
+		DLL_RemoveNode( &parked_list, &context->throttle_node );
+
+		// pending_operations was incremented when the context was parked, so it can't be freed while we have it.
+		EnterCriticalSection( &context->context_cs );
+
+		bool resume = false;
+
+		// Stopped and closing contexts don't need to wait for tokens.
+		if ( context->cleanup != 0 ||
+			 IS_STATUS( context->status,
+				STATUS_STOPPED |
+				STATUS_REMOVE |
+				STATUS_RESTART |
+				STATUS_UPDATING ) )
+		{
+			resume = true;
+		}
+		else
+		{
+			EnterCriticalSection( &rate_limit_cs );
+
+			if ( HasTokens( context, current_tick ) )
+			{
+				ConsumeTokens( context, context->current_bytes_read );
+
+				context->tokens_acquired = true;
+
+				resume = true;
+			}
+
+			LeaveCriticalSection( &rate_limit_cs );
+		}
+
+		if ( resume )
+		{
+			context->throttle_node.data = NULL;
+
+			PostCompletion( context->current_bytes_read, context, &context->overlapped );
+		}
+		else
+		{
+			DLL_AddNode( &waiting_list, &context->throttle_node, -1 );
+		}
+
+		LeaveCriticalSection( &context->context_cs );
+	}
+
+	EnterCriticalSection( &rate_limit_cs );
+
+	// Contexts that were parked while we were checking go after the ones that are still waiting.
+	while ( throttled_context_list != NULL )
+	{
+		DoublyLinkedList *throttle_node = throttled_context_list;
+
+		DLL_RemoveNode( &throttled_context_list, throttle_node );
+		DLL_AddNode( &waiting_list, throttle_node, -1 );
+	}
+
+	throttled_context_list = waiting_list;
+
+	if ( throttled_context_list != NULL )
+	{
+		ScheduleTokenRefill();
+	}
+
+	LeaveCriticalSection( &rate_limit_cs );
+}
+
+// Creates the timer that will run RefillTokens() if it isn't already waiting.
+// This should be done in the rate_limit_cs critical section.
+void ScheduleTokenRefill()
+{
+	// The timer queue is gone once we've started shutting down.
+	if ( g_rate_limit_timer == NULL && g_rate_limit_timer_queue != NULL )
+	{
+		if ( CreateTimerQueueTimer( &g_rate_limit_timer, g_rate_limit_timer_queue, RefillTokens, NULL, RATE_LIMIT_INTERVAL, 0, WT_EXECUTEONLYONCE ) == FALSE )
+		{
+			g_rate_limit_timer = NULL;
+		}
+	}
+}
+
+// Sets the proxy that a connection for the protocol is made through. proxy_hostname points to the current proxy settings and isn't copied.
+void SetPooledConnectionProxy( POOLED_CONNECTION *pc, unsigned char protocol )
+{
+	// Same order that CreateConnection() uses to pick a proxy.
+	if ( cfg_enable_proxy && protocol == PROTOCOL_HTTP )
+	{
+		pc->proxy_type = 1;
+		pc->proxy_hostname = ( cfg_address_type == 0 ? cfg_hostname : NULL );
+		pc->proxy_ip_address = ( cfg_address_type == 0 ? 0 : cfg_ip_address );
+		pc->proxy_port = cfg_port;
+	}
+	else if ( cfg_enable_proxy_s && protocol == PROTOCOL_HTTPS )
+	{
+		pc->proxy_type = 2;
+		pc->proxy_hostname = ( cfg_address_type_s == 0 ? cfg_hostname_s : NULL );
+		pc->proxy_ip_address = ( cfg_address_type_s == 0 ? 0 : cfg_ip_address_s );
+		pc->proxy_port = cfg_port_s;
+	}
+	else if ( cfg_enable_proxy_socks )
+	{
+		pc->proxy_type = 3;
+		pc->proxy_hostname = ( cfg_address_type_socks == 0 ? cfg_hostname_socks : NULL );
+		pc->proxy_ip_address = ( cfg_address_type_socks == 0 ? 0 : cfg_ip_address_socks );
+		pc->proxy_port = cfg_port_socks;
+	}
+	else
+	{
+		pc->proxy_type = 0;
+		pc->proxy_hostname = NULL;
+		pc->proxy_ip_address = 0;
+		pc->proxy_port = 0;
+	}
+}
+
+// A pooled connection can only be reused for the same host and port, and through the same proxy.
+bool IsSamePooledConnection( POOLED_CONNECTION *pc1, POOLED_CONNECTION *pc2 )
+{
+	return ( pc1->port == pc2->port &&
+			 pc1->protocol == pc2->protocol &&
+			 pc1->proxy_type == pc2->proxy_type &&
+			 pc1->proxy_port == pc2->proxy_port &&
+			 pc1->proxy_ip_address == pc2->proxy_ip_address &&
+		   ( pc1->proxy_hostname == pc2->proxy_hostname ||
+		   ( pc1->proxy_hostname != NULL && pc2->proxy_hostname != NULL && lstrcmpiW( pc1->proxy_hostname, pc2->proxy_hostname ) == 0 ) ) &&
+			 lstrcmpiA( pc1->host, pc2->host ) == 0 );
+}
+
+// Determines whether the server has sent everything it's going to for our request and that the connection can be used for another one.
+bool IsConnectionReusable( SOCKET_CONTEXT *context )
+{
+	if ( context == NULL ||
+		 context->socket == INVALID_SOCKET ||
+		 context->download_info == NULL ||
+		 context->header_info.range_info == NULL ||
+	   ( context->request_info.protocol != PROTOCOL_HTTP &&
+		 context->request_info.protocol != PROTOCOL_HTTPS ) )
+	{
+		return false;
+	}
+
+	// Any data left in the SSL/TLS buffers belongs to the previous response.
+	if ( SSL_HasBufferedData( context->ssl ) )
+	{
+		return false;
+	}
+
+	RANGE_INFO *ri = context->header_info.range_info;
+
+	return ( context->status == STATUS_DOWNLOADING &&
+			 context->timed_out == TIME_OUT_FALSE &&
+			 context->header_info.connection == CONNECTION_KEEP_ALIVE &&
+			 context->header_info.content_encoding == CONTENT_ENCODING_NONE &&
+			!context->header_info.chunked_transfer &&
+			!context->range_split &&
+			 ri->range_end > 0 &&
+			 ri->content_offset == ( ( ri->range_end - ri->range_start ) + 1 ) );
+}
+
+void FreePooledConnection( POOLED_CONNECTION *pc )
+{
+	if ( pc->socket != INVALID_SOCKET )
+	{
+		_shutdown( pc->socket, SD_BOTH );
+		_closesocket( pc->socket );
+	}
+
+	if ( pc->ssl != NULL )
+	{
+		SSL_free( pc->ssl );
+	}
+
+	GlobalFree( pc->proxy_hostname );
+	GlobalFree( pc->host );
+	GlobalFree( pc );
+}
+
+// Park the context's socket and SSL/TLS state so that the next request to the same host can skip the connect and handshake.
+void AddPooledConnection( SOCKET_CONTEXT *context )
+{
+	POOLED_CONNECTION *pc = ( POOLED_CONNECTION * )GlobalAlloc( GPTR, sizeof( POOLED_CONNECTION ) );
+	if ( pc == NULL )
+	{
+		return;
+	}
+
+	int host_length = lstrlenA( context->request_info.host ) + 1;	// Include the NULL terminator.
+	pc->host = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * host_length );
+	_memcpy_s( pc->host, host_length, context->request_info.host, host_length );
+
+	pc->ssl = context->ssl;
+	pc->socket = context->socket;
+	pc->idle_time = GetTickCount();
+	pc->port = context->request_info.port;
+	pc->protocol = context->request_info.protocol;
+
+	SetPooledConnectionProxy( pc, context->request_info.protocol );
+
+	// The proxy settings can change while the connection is parked.
+	if ( pc->proxy_hostname != NULL )
+	{
+		int proxy_hostname_length = lstrlenW( pc->proxy_hostname ) + 1;	// Include the NULL terminator.
+		wchar_t *proxy_hostname = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * proxy_hostname_length );
+		_wmemcpy_s( proxy_hostname, proxy_hostname_length, pc->proxy_hostname, proxy_hostname_length );
+		pc->proxy_hostname = proxy_hostname;
+	}
+
+	pc->pool_node.data = pc;
+
+	context->ssl = NULL;
+	context->socket = INVALID_SOCKET;
+
+	POOLED_CONNECTION *oldest_host_pc = NULL;
+	unsigned int host_count = 0;
+
+	EnterCriticalSection( &connection_pool_cs );
+
+	// The oldest connections are at the head.
+	DoublyLinkedList *pool_node = g_connection_pool;
+	while ( pool_node != NULL )
+	{
+		POOLED_CONNECTION *t_pc = ( POOLED_CONNECTION * )pool_node->data;
+
+		if ( IsSamePooledConnection( t_pc, pc ) )
+		{
+			if ( oldest_host_pc == NULL )
+			{
+				oldest_host_pc = t_pc;
+			}
+
+			++host_count;
+		}
+
+		pool_node = pool_node->next;
+	}
+
+	POOLED_CONNECTION *del_pc = NULL;
+
+	if ( host_count >= CONNECTION_POOL_HOST_LIMIT )
+	{
+		del_pc = oldest_host_pc;
+	}
+	else if ( g_connection_pool_count >= CONNECTION_POOL_LIMIT )
+	{
+		del_pc = ( POOLED_CONNECTION * )g_connection_pool->data;
+	}
+
+	if ( del_pc != NULL )
+	{
+		DLL_RemoveNode( &g_connection_pool, &del_pc->pool_node );
+		--g_connection_pool_count;
+	}
+
+	DLL_AddNode( &g_connection_pool, &pc->pool_node, -1 );
+	++g_connection_pool_count;
+
+	LeaveCriticalSection( &connection_pool_cs );
+
+	if ( del_pc != NULL )
+	{
+		FreePooledConnection( del_pc );
+	}
+}
+
+// Hand the most recently parked connection for the context's host to the context.
+bool TakePooledConnection( SOCKET_CONTEXT *context )
+{
+	POOLED_CONNECTION *pc = NULL;
+
+	// Only the key fields are used.
+	POOLED_CONNECTION key;
+	key.host = context->request_info.host;
+	key.port = context->request_info.port;
+	key.protocol = context->request_info.protocol;
+	SetPooledConnectionProxy( &key, context->request_info.protocol );
+
+	DWORD current_tick = GetTickCount();
+
+	EnterCriticalSection( &connection_pool_cs );
+
+	// Look at the newest connections first since they're the least likely to have been closed by the server.
+	DoublyLinkedList *pool_node = ( g_connection_pool != NULL && g_connection_pool->prev != NULL ? g_connection_pool->prev : g_connection_pool );
+	while ( pool_node != NULL )
+	{
+		POOLED_CONNECTION *t_pc = ( POOLED_CONNECTION * )pool_node->data;
+
+		if ( ( current_tick - t_pc->idle_time ) < CONNECTION_POOL_IDLE_TIMEOUT &&
+			 IsSamePooledConnection( t_pc, &key ) )
+		{
+			pc = t_pc;
+
+			DLL_RemoveNode( &g_connection_pool, &pc->pool_node );
+			--g_connection_pool_count;
+
+			break;
+		}
+
+		// The head's prev is the tail.
+		pool_node = ( pool_node != g_connection_pool ? pool_node->prev : NULL );
+	}
+
+	LeaveCriticalSection( &connection_pool_cs );
+
+	if ( pc != NULL )
+	{
+		context->ssl = pc->ssl;
+		context->socket = pc->socket;
+
+		pc->ssl = NULL;
+		pc->socket = INVALID_SOCKET;
+
+		FreePooledConnection( pc );
+
+		return true;
+	}
+
+	return false;
+}
+
+// Close the connections that have been idle for too long. Done in the Timeout thread.
+void EvictIdleConnections()
+{
+	DoublyLinkedList *del_pool = NULL;
+
+	DWORD current_tick = GetTickCount();
+
+	EnterCriticalSection( &connection_pool_cs );
+
+	// The oldest connections are at the head.
+	while ( g_connection_pool != NULL )
+	{
+		POOLED_CONNECTION *pc = ( POOLED_CONNECTION * )g_connection_pool->data;
+
+		if ( ( current_tick - pc->idle_time ) < CONNECTION_POOL_IDLE_TIMEOUT )
+		{
+			break;
+		}
+
+		DLL_RemoveNode( &g_connection_pool, &pc->pool_node );
+		--g_connection_pool_count;
+
+		DLL_AddNode( &del_pool, &pc->pool_node, 0 );
+	}
+
+	LeaveCriticalSection( &connection_pool_cs );
+
+	// Close the sockets outside of the critical section.
+	while ( del_pool != NULL )
+	{
+		POOLED_CONNECTION *pc = ( POOLED_CONNECTION * )del_pool->data;
+
+		DLL_RemoveNode( &del_pool, &pc->pool_node );
+
+		FreePooledConnection( pc );
+	}
+}
+
+void FreeConnectionPool()
+{
+	EnterCriticalSection( &connection_pool_cs );
+
+	while ( g_connection_pool != NULL )
+	{
+		POOLED_CONNECTION *pc = ( POOLED_CONNECTION * )g_connection_pool->data;
+
+		DLL_RemoveNode( &g_connection_pool, &pc->pool_node );
+
+		FreePooledConnection( pc );
+	}
+
+	g_connection_pool_count = 0;
+
+	LeaveCriticalSection( &connection_pool_cs );
+}
+
+// The addrinfoW list is copied into a single allocation per node so that contexts can free it (and its nodes) independently of the DNS cache.
+// The copy is ordered for our connection attempts. The preferred address goes first and the rest alternate between IPv6 and IPv4 (RFC 8305).
+// This should be done in the dns_cache_cs.
+addrinfoW *CopyAddressInfo( DNS_CACHE_ENTRY *dce )
+{
+	addrinfoW *head = NULL;
+	addrinfoW *tail = NULL;
+
+	addrinfoW *family_head[ 2 ] = { NULL, NULL };	// 0 = IPv6, 1 = IPv4
+	addrinfoW *family_tail[ 2 ] = { NULL, NULL };
+
+	addrinfoW *address_info = dce->address_info;
+
+	while ( address_info != NULL )
+	{
+		addrinfoW *ai = ( addrinfoW * )GlobalAlloc( GPTR, sizeof( addrinfoW ) + address_info->ai_addrlen );
+		if ( ai == NULL )
+		{
+			break;
+		}
+
+		ai->ai_flags = address_info->ai_flags;
+		ai->ai_family = address_info->ai_family;
+		ai->ai_socktype = address_info->ai_socktype;
+		ai->ai_protocol = address_info->ai_protocol;
+		ai->ai_addrlen = address_info->ai_addrlen;
+		ai->ai_addr = ( struct sockaddr * )( ai + 1 );
+		_memcpy_s( ai->ai_addr, ai->ai_addrlen, address_info->ai_addr, address_info->ai_addrlen );
+
+		if ( head == NULL &&
+			 dce->preferred_address_length > 0 &&
+			 ai->ai_addrlen == ( size_t )dce->preferred_address_length &&
+			 _memcmp( ai->ai_addr, &dce->preferred_address, ai->ai_addrlen ) == 0 )
+		{
+			head = tail = ai;
+		}
+		else
+		{
+			unsigned char family = ( ai->ai_family == AF_INET6 ? 0 : 1 );
+
+			if ( family_tail[ family ] == NULL )
+			{
+				family_head[ family ] = ai;
+			}
+			else
+			{
+				family_tail[ family ]->ai_next = ai;
+			}
+
+			family_tail[ family ] = ai;
+		}
+
+		address_info = address_info->ai_next;
+	}
+
+	// Start with IPv6 unless the preferred address was IPv6.
+	unsigned char family = ( head != NULL && head->ai_family == AF_INET6 ? 1 : 0 );
+
+	while ( family_head[ 0 ] != NULL || family_head[ 1 ] != NULL )
+	{
+		if ( family_head[ family ] != NULL )
+		{
+			addrinfoW *ai = family_head[ family ];
+			family_head[ family ] = ai->ai_next;
+			ai->ai_next = NULL;
+
+			if ( tail == NULL )
+			{
+				head = ai;
+			}
+			else
+			{
+				tail->ai_next = ai;
+			}
+
+			tail = ai;
+		}
+
+		family ^= 1;
+	}
+
+	return head;
+}
+
+// The address that won the connection attempts is attempted first the next time we connect to the host.
+// This should be done in the context's critical section.
+void SetPreferredAddress( SOCKET_CONTEXT *context, addrinfoW *address_info )
+{
+	EnterCriticalSection( &dns_cache_cs );
+
+	// The cache entries are only freed when the cache is.
+	if ( g_dns_cache != NULL && context->dns_cache_entry != NULL && address_info->ai_addrlen <= sizeof( SOCKADDR_STORAGE ) )
+	{
+		_memcpy_s( &context->dns_cache_entry->preferred_address, sizeof( SOCKADDR_STORAGE ), address_info->ai_addr, address_info->ai_addrlen );
+		context->dns_cache_entry->preferred_address_length = ( int )address_info->ai_addrlen;
+	}
+
+	LeaveCriticalSection( &dns_cache_cs );
+}
+
+void FreeAddressInfo( addrinfoW *address_info )
+{
+	while ( address_info != NULL )
+	{
+		addrinfoW *del_address_info = address_info;
+		address_info = address_info->ai_next;
+
+		GlobalFree( del_address_info );
+	}
+}
+
+void FreeDNSCacheEntry( DNS_CACHE_ENTRY *dce )
+{
+	if ( dce->address_info != NULL )
+	{
+		_FreeAddrInfoW( dce->address_info );
+	}
+
+	GlobalFree( dce->key );
+	GlobalFree( dce->host );
+	GlobalFree( dce->port );
+	GlobalFree( dce );
+}
+
+// Set the context's address info from the DNS cache, or have it wait for the lookup to complete.
+// Contexts that wait will have IO_ResolveAddress posted once the lookup is done.
+char ResolveHost( SOCKET_CONTEXT *context, wchar_t *host, wchar_t *port )
+{
+	char dns_status = DNS_STATUS_FAILED;
+
+	int host_length = lstrlenW( host ) + 1;	// Include the NULL terminator.
+	int port_length = lstrlenW( port ) + 1;	// Include the NULL terminator.
+	int key_length = host_length + port_length;
+
+	wchar_t *key = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * key_length );
+	__snwprintf( key, key_length, L"%s:%s", host, port );
+
+	EnterCriticalSection( &dns_cache_cs );
+
+	DNS_CACHE_ENTRY *dce = ( DNS_CACHE_ENTRY * )dllrbt_find( g_dns_cache, ( void * )key, true );
+	if ( dce == NULL )
+	{
+		dce = ( DNS_CACHE_ENTRY * )GlobalAlloc( GPTR, sizeof( DNS_CACHE_ENTRY ) );
+
+		dce->key = key;
+
+		dce->host = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * host_length );
+		_wmemcpy_s( dce->host, host_length, host, host_length );
+
+		dce->port = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * port_length );
+		_wmemcpy_s( dce->port, port_length, port, port_length );
+
+		dllrbt_insert( g_dns_cache, ( void * )dce->key, ( void * )dce );
+	}
+	else
+	{
+		GlobalFree( key );
+
+		// The entry has expired. Look it up again.
+		if ( !dce->resolving && ( long )( dce->expires - GetTickCount() ) <= 0 )
+		{
+			if ( dce->address_info != NULL )
+			{
+				_FreeAddrInfoW( dce->address_info );
+				dce->address_info = NULL;
+			}
+
+			dce->status = 0;
+		}
+		else
+		{
+			++g_dns_cache_hits;	// Includes lookups that are already in progress.
+		}
+	}
+
+	if ( dce->address_info == NULL && dce->status == 0 && !dce->resolving )
+	{
+		++g_dns_cache_misses;
+
+		dce->resolving = true;
+
+		dce->resolve_node.data = dce;
+		DLL_AddNode( &g_dns_resolve_queue, &dce->resolve_node, -1 );
+
+		ReleaseSemaphore( g_dns_semaphore, 1, NULL );
+	}
+
+	context->dns_cache_entry = dce;
+
+	if ( dce->resolving )
+	{
+		// The resolver thread will post the completion.
+		InterlockedIncrement( &context->pending_operations );
+
+		context->overlapped.current_operation = IO_ResolveAddress;
+
+		context->dns_node.data = context;
+		DLL_AddNode( &dce->waiting_contexts, &context->dns_node, -1 );
+
+		dns_status = DNS_STATUS_PENDING;
+	}
+	else if ( dce->status == 0 )
+	{
+		context->address_info = CopyAddressInfo( dce );
+
+		dns_status = ( context->address_info != NULL ? DNS_STATUS_RESOLVED : DNS_STATUS_FAILED );
+	}
+
+	LeaveCriticalSection( &dns_cache_cs );
+
+	return dns_status;
+}
+
+DWORD WINAPI Resolver( LPVOID WorkThreadContext )
+{
+	struct addrinfoW hints;
+
+	while ( !g_end_program )
+	{
+		WaitForSingleObject( g_dns_semaphore, INFINITE );
+
+		if ( g_end_program )
+		{
+			break;
+		}
+
+		DNS_CACHE_ENTRY *dce = NULL;
+
+		EnterCriticalSection( &dns_cache_cs );
+
+		if ( g_dns_resolve_queue != NULL )
+		{
+			dce = ( DNS_CACHE_ENTRY * )g_dns_resolve_queue->data;
+
+			DLL_RemoveNode( &g_dns_resolve_queue, &dce->resolve_node );
+			dce->resolve_node.data = NULL;
+		}
+
+		LeaveCriticalSection( &dns_cache_cs );
+
+		if ( dce == NULL )
+		{
+			continue;
+		}
+
+		addrinfoW *address_info = NULL;
+
+		DWORD start_tick = GetTickCount();
+
+		// Get both IPv4 and IPv6 addresses. The connection attempts will race them against each other.
+		_memzero( &hints, sizeof( addrinfoW ) );
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_IP;
+
+		int nRet = _GetAddrInfoW( dce->host, dce->port, &hints, &address_info );
+
+		DWORD current_tick = GetTickCount();
+
+		EnterCriticalSection( &dns_cache_cs );
+
+		++g_dns_lookups;
+		g_dns_lookup_time += ( current_tick - start_tick );
+
+		if ( dce->orphaned )
+		{
+			if ( address_info != NULL )
+			{
+				_FreeAddrInfoW( address_info );
+			}
+
+			FreeDNSCacheEntry( dce );
+		}
+		else
+		{
+			dce->address_info = ( nRet == 0 ? address_info : NULL );
+			dce->status = ( nRet == 0 && address_info == NULL ? WSAHOST_NOT_FOUND : nRet );
+			dce->expires = current_tick + ( dce->status == 0 ? DNS_CACHE_TTL : DNS_NEGATIVE_CACHE_TTL );
+			dce->resolving = false;
+
+			while ( dce->waiting_contexts != NULL )
+			{
+				SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )dce->waiting_contexts->data;
+
+				DLL_RemoveNode( &dce->waiting_contexts, &context->dns_node );
+				context->dns_node.data = NULL;
+
+				// IO_ResolveAddress fails the connection if we don't set the address info.
+				if ( dce->status == 0 )
+				{
+					context->address_info = CopyAddressInfo( dce );
+				}
+
+				// pending_operations was incremented when the context started waiting.
+				PostCompletion( 0, context, &context->overlapped );
+			}
+		}
+
+		LeaveCriticalSection( &dns_cache_cs );
+	}
+
+	// The last thread to exit closes the semaphore.
+	if ( InterlockedDecrement( &g_dns_resolver_count ) == 0 )
+	{
+		CloseHandle( g_dns_semaphore );
+		g_dns_semaphore = NULL;
+	}
+
+	_ExitThread( 0 );
+	return 0;
+}
+
+// Must be done before the contexts are freed. Waiting contexts are forgotten and in progress lookups are left for the resolver threads to free.
+void FreeDNSCache()
+{
+	EnterCriticalSection( &dns_cache_cs );
+
+	g_dns_resolve_queue = NULL;
+
+	node_type *node = dllrbt_get_head( g_dns_cache );
+	while ( node != NULL )
+	{
+		DNS_CACHE_ENTRY *dce = ( DNS_CACHE_ENTRY * )node->val;
+
+		dce->waiting_contexts = NULL;
+
+		if ( dce->resolving && dce->resolve_node.data == NULL )
+		{
+			dce->orphaned = true;
+		}
+		else
+		{
+			FreeDNSCacheEntry( dce );
+		}
+
+		node = node->next;
+	}
+
+	dllrbt_delete_recursively( g_dns_cache );
+	g_dns_cache = NULL;
+
+	LeaveCriticalSection( &dns_cache_cs );
+}
+
+// Returns a free slot in the download's write cache, or NULL if they're all in use.
+// This should be done in the download's shared_cs.
+WRITE_CACHE_SLOT *GetWriteCacheSlot( DOWNLOAD_INFO *di )
+{
+	if ( di->write_cache == NULL )
+	{
+		di->write_cache = ( WRITE_CACHE_SLOT * )GlobalAlloc( GPTR, sizeof( WRITE_CACHE_SLOT ) * WRITE_CACHE_SLOTS );
+		if ( di->write_cache == NULL )
+		{
+			return NULL;
+		}
+	}
+
+	for ( unsigned char i = 0; i < WRITE_CACHE_SLOTS; ++i )
+	{
+		WRITE_CACHE_SLOT *slot = &di->write_cache[ i ];
+
+		if ( !slot->in_use )
+		{
+			// The buffers are allocated as they're needed and kept until the download is done.
+			if ( slot->buffer == NULL )
+			{
+				slot->buffer = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * WRITE_CACHE_SLOT_SIZE );
+				if ( slot->buffer == NULL )
+				{
+					return NULL;
+				}
+			}
+
+			slot->length = 0;
+			slot->written = 0;
+			slot->in_use = true;
+
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+// Nothing can be writing from the cache when it's freed.
+void FreeWriteCache( DOWNLOAD_INFO *di )
+{
+	if ( di->write_cache != NULL )
+	{
+		for ( unsigned char i = 0; i < WRITE_CACHE_SLOTS; ++i )
+		{
+			if ( di->write_cache[ i ].buffer != NULL )
+			{
+				GlobalFree( di->write_cache[ i ].buffer );
+			}
+		}
+
+		GlobalFree( di->write_cache );
+		di->write_cache = NULL;
+	}
+}
+
+// Write the unwritten part of the slot to the file. IO_WriteCache will release the slot once it's all been written.
+// Returns true if the write was queued (a pending write counts). The slot is released if the write fails.
+// This should be done in the context's critical section and the download's shared_cs.
+bool SubmitWriteCacheSlot( SOCKET_CONTEXT *context, WRITE_CACHE_SLOT *slot )
+{
+	LARGE_INTEGER li;
+	li.QuadPart = slot->file_offset + slot->written;
+
+	InterlockedIncrement( &context->pending_operations );
+
+	_memzero( &slot->overlapped.overlapped, sizeof( WSAOVERLAPPED ) );
+	slot->overlapped.overlapped.Offset = li.LowPart;
+	slot->overlapped.overlapped.OffsetHigh = li.HighPart;
+
+	// The write holds a pending operation on the context so that it isn't cleaned up (and the file closed) before the write is done.
+	slot->overlapped.context = context;
+	slot->overlapped.current_operation = IO_WriteCache;
+
+	BOOL bRet = WriteFile( context->download_info->hFile, slot->buffer + slot->written, slot->length - slot->written, NULL, ( OVERLAPPED * )&slot->overlapped );
+	if ( bRet == FALSE && ( GetLastError() != ERROR_IO_PENDING ) )
+	{
+		InterlockedDecrement( &context->pending_operations );
+
+		slot->in_use = false;
+
+		return false;
+	}
+
+	return true;
+}
+
+// Copy the data in write_wsabuf to the download's write cache and complete the IO_WriteFile right away so that the context can receive more data.
+// Data that continues where the context's slot left off is added to it. The slot is written once it's full, or when the context is closed.
+// If every slot is in use, then the data is written directly and the context has to wait for it.
+// Returns the same as WriteFile. This should be done in the context's critical section and the download's shared_cs.
+BOOL WriteFileCached( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped )
+{
+	LARGE_INTEGER li;
+	li.LowPart = overlapped->overlapped.Offset;
+	li.HighPart = overlapped->overlapped.OffsetHigh;
+
+	WRITE_CACHE_SLOT *slot = context->write_cache_slot;
+
+	// Write the slot if the data doesn't continue it or doesn't fit in it.
+	if ( slot != NULL &&
+	   ( slot->file_offset + slot->length != ( unsigned long long )li.QuadPart ||
+		 slot->length + context->write_wsabuf.len > WRITE_CACHE_SLOT_SIZE ) )
+	{
+		context->write_cache_slot = NULL;
+
+		if ( !SubmitWriteCacheSlot( context, slot ) )
+		{
+			return FALSE;	// GetLastError() has the reason.
+		}
+
+		slot = NULL;
+	}
+
+	if ( slot == NULL && context->write_wsabuf.len <= WRITE_CACHE_SLOT_SIZE )
+	{
+		slot = GetWriteCacheSlot( context->download_info );
+		if ( slot != NULL )
+		{
+			slot->file_offset = li.QuadPart;
+
+			context->write_cache_slot = slot;
+		}
+	}
+
+	if ( slot == NULL )
+	{
+		return WriteFile( context->download_info->hFile, context->write_wsabuf.buf, context->write_wsabuf.len, NULL, ( OVERLAPPED * )overlapped );
+	}
+
+	_memcpy_s( slot->buffer + slot->length, WRITE_CACHE_SLOT_SIZE - slot->length, context->write_wsabuf.buf, context->write_wsabuf.len );
+	slot->length += context->write_wsabuf.len;
+
+	if ( slot->length == WRITE_CACHE_SLOT_SIZE )
+	{
+		context->write_cache_slot = NULL;
+
+		if ( !SubmitWriteCacheSlot( context, slot ) )
+		{
+			return FALSE;	// GetLastError() has the reason.
+		}
+	}
+
+	// pending_operations was incremented by the caller.
+	PostCompletion( context->write_wsabuf.len, context, overlapped );
+
+	return TRUE;
+}
+
+// Write what's left in the context's slot. This should be done in the context's critical section.
+void FlushWriteCache( SOCKET_CONTEXT *context )
+{
+	if ( context->write_cache_slot != NULL )
+	{
+		EnterCriticalSection( &context->download_info->shared_cs );
+
+		WRITE_CACHE_SLOT *slot = context->write_cache_slot;
+		context->write_cache_slot = NULL;
+
+		if ( !SubmitWriteCacheSlot( context, slot ) )
+		{
+			context->download_info->status = STATUS_FILE_IO_ERROR;
+			context->status = STATUS_FILE_IO_ERROR;
+		}
+
+		LeaveCriticalSection( &context->download_info->shared_cs );
+	}
+}
+
+// Write what's left in the context's slot and wait for it to finish.
+// Used when the worker threads have exited and can't complete an IO_WriteCache.
+void FlushWriteCacheAndWait( SOCKET_CONTEXT *context )
+{
+	if ( context->write_cache_slot != NULL )
+	{
+		WRITE_CACHE_SLOT *slot = context->write_cache_slot;
+		context->write_cache_slot = NULL;
+
+		if ( context->download_info->hFile != INVALID_HANDLE_VALUE )
+		{
+			LARGE_INTEGER li;
+			li.QuadPart = slot->file_offset + slot->written;
+
+			OVERLAPPED overlapped;
+			_memzero( &overlapped, sizeof( OVERLAPPED ) );
+			overlapped.Offset = li.LowPart;
+			overlapped.OffsetHigh = li.HighPart;
+
+			HANDLE hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+			if ( hEvent != NULL )
+			{
+				// Setting the low-order bit keeps the completion from being queued to the completion port.
+				overlapped.hEvent = ( HANDLE )( ( ULONG_PTR )hEvent | 1 );
+
+				DWORD written = 0;
+				if ( WriteFile( context->download_info->hFile, slot->buffer + slot->written, slot->length - slot->written, NULL, &overlapped ) != FALSE || GetLastError() == ERROR_IO_PENDING )
+				{
+					GetOverlappedResult( context->download_info->hFile, &overlapped, &written, TRUE );
+				}
+
+				CloseHandle( hEvent );
+			}
+		}
+
+		slot->in_use = false;
+	}
+}
+
+// Handles a completed write from the download's write cache (IO_WriteCache).
+void HandleWriteCache( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, DWORD io_size, bool completed )
+{
+	WRITE_CACHE_SLOT *slot = ( WRITE_CACHE_SLOT * )overlapped;
+
+	bool failed;
+
+	EnterCriticalSection( &context->context_cs );
+
+	EnterCriticalSection( &context->download_info->shared_cs );
+
+	// Make sure we've written everything before we release the slot.
+	if ( completed && io_size > 0 && ( slot->written + io_size ) < slot->length )
+	{
+		slot->written += io_size;
+
+		failed = !SubmitWriteCacheSlot( context, slot );
+	}
+	else
+	{
+		failed = ( !completed || ( slot->written + io_size ) < slot->length ? true : false );
+
+		slot->in_use = false;	// Another part can use it now.
+	}
+
+	if ( failed )
+	{
+		context->download_info->status = STATUS_FILE_IO_ERROR;
+		context->status = STATUS_FILE_IO_ERROR;
+
+		// Stop the other parts from writing as well.
+		if ( context->download_info->hFile != INVALID_HANDLE_VALUE )
+		{
+			CloseHandle( context->download_info->hFile );
+			context->download_info->hFile = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	LeaveCriticalSection( &context->download_info->shared_cs );
+
+	if ( context->cleanup == 0 )
+	{
+		if ( failed )
+		{
+			context->cleanup = 2;	// Force the cleanup.
+
+			InterlockedIncrement( &context->pending_operations );
+
+			context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
+
+			PostCompletion( 0, context, &context->overlapped_close );
+		}
+	}
+	else if ( context->pending_operations == 0 )	// We were the last operation to complete while the context was being cleaned up.
+	{
+		InterlockedIncrement( &context->pending_operations );
+
+		context->overlapped_close.current_operation = IO_Close;
+
+		PostCompletion( 0, context, &context->overlapped_close );
+	}
+
+	LeaveCriticalSection( &context->context_cs );
+}
+
+// Builds the path of the download's range checkpoint. It's kept next to the file that's being written to.
+bool GetRangeCheckpointPath( DOWNLOAD_INFO *di, wchar_t file_path[] )
+{
+	if ( cfg_use_temp_download_directory )
+	{
+		GetTemporaryFilePath( di, file_path );
+	}
+	else
+	{
+		GetDownloadFilePath( di, file_path );
+	}
+
+	int file_path_length = lstrlenW( file_path );
+	if ( file_path_length + RANGE_CHECKPOINT_SUFFIX_LENGTH >= MAX_PATH )
+	{
+		return false;
+	}
+
+	_wmemcpy_s( file_path + file_path_length, MAX_PATH - file_path_length, RANGE_CHECKPOINT_SUFFIX, RANGE_CHECKPOINT_SUFFIX_LENGTH + 1 );
+
+	return true;
+}
+
+unsigned long GetRangeCheckpointChecksum( char *buffer, unsigned int buffer_length )
+{
+	unsigned long checksum = 2166136261;
+
+	for ( unsigned int i = 0; i < buffer_length; ++i )
+	{
+		checksum = ( checksum ^ ( unsigned char )buffer[ i ] ) * 16777619;
+	}
+
+	return checksum;
+}
+
+// Records how much of each range is on the disk in buffer, and returns the number of bytes used. The sequence number and checksum are set when it's written.
+// Data that's in the write cache, or that's being written from it, isn't counted. A range only counts up to the first byte that's still in a slot.
+// This should be done in the download's shared_cs. The ranges' file_write_offset values are updated in it.
+unsigned int BuildRangeCheckpoint( DOWNLOAD_INFO *di, char *buffer )
+{
+	unsigned char range_count = 0;
+
+	unsigned int pos = sizeof( unsigned int ) + sizeof( unsigned char );	// The range count is set after the ranges have been counted.
+
+	DoublyLinkedList *range_node = di->range_list;
+	while ( range_node != NULL && range_count < RANGE_LIST_LIMIT )
+	{
+		RANGE_INFO *ri = ( RANGE_INFO * )range_node->data;
+
+		unsigned long long file_write_offset = ri->file_write_offset;
+
+		if ( di->write_cache != NULL )
+		{
+			for ( unsigned char i = 0; i < WRITE_CACHE_SLOTS; ++i )
+			{
+				WRITE_CACHE_SLOT *slot = &di->write_cache[ i ];
+				if ( slot->in_use )
+				{
+					unsigned long long slot_offset = slot->file_offset + slot->written;
+					if ( slot_offset >= ri->range_start && slot_offset < file_write_offset )
+					{
+						file_write_offset = slot_offset;
+					}
+				}
+			}
+		}
+
+		unsigned long long content_offset = ( file_write_offset > ri->range_start ? file_write_offset - ri->range_start : 0 );
+
+		_memcpy_s( buffer + pos, RANGE_CHECKPOINT_SLOT_SIZE - pos, &ri->range_start, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( buffer + pos, RANGE_CHECKPOINT_SLOT_SIZE - pos, &ri->range_end, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( buffer + pos, RANGE_CHECKPOINT_SLOT_SIZE - pos, &ri->content_length, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( buffer + pos, RANGE_CHECKPOINT_SLOT_SIZE - pos, &content_offset, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( buffer + pos, RANGE_CHECKPOINT_SLOT_SIZE - pos, &file_write_offset, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		++range_count;
+
+		range_node = range_node->next;
+	}
+
+	buffer[ sizeof( unsigned int ) ] = range_count;
+
+	return pos;
+}
+
+// Writes the ranges in buffer to the checkpoint's next slot. buffer must have room for the checksum.
+// The checkpoint has two slots that are written to alternately. A write that's interrupted leaves the other slot intact.
+// If flush_data is set, then the download's file is flushed before the checkpoint is written.
+// Only one thread can write a checkpoint at a time. The writer thread has it while it's g_range_checkpoint_writing.
+void WriteRangeCheckpoint( RANGE_CHECKPOINT *rc, char *buffer, unsigned int length, bool flush_data )
+{
+	unsigned int sequence = rc->sequence + 1;
+	_memcpy_s( buffer, RANGE_CHECKPOINT_SLOT_SIZE, &sequence, sizeof( unsigned int ) );
+
+	unsigned long checksum = GetRangeCheckpointChecksum( buffer, length );
+	_memcpy_s( buffer + length, RANGE_CHECKPOINT_SLOT_SIZE - length, &checksum, sizeof( unsigned long ) );
+	length += sizeof( unsigned long );
+
+	// The data has to be on the disk before the checkpoint says it is.
+	if ( flush_data && FlushFileBuffers( rc->hFile_data ) == FALSE )
+	{
+		return;
+	}
+
+	LARGE_INTEGER li;
+	li.QuadPart = RANGE_CHECKPOINT_HEADER_SIZE + ( ( sequence & 1 ) * RANGE_CHECKPOINT_SLOT_SIZE );
+	SetFilePointerEx( rc->hFile, li, NULL, FILE_BEGIN );
+
+	DWORD write = 0;
+	if ( WriteFile( rc->hFile, buffer, length, &write, NULL ) != FALSE && write == length &&
+	   ( !flush_data || FlushFileBuffers( rc->hFile ) != FALSE ) )
+	{
+		rc->sequence = sequence;
+	}
+}
+
+// Flushes the files and writes the checkpoints that UpdateRangeCheckpoint has queued so that the IOCP worker threads don't wait on the disk.
+// A download that's queued again before it's written only has its latest ranges written.
+// The writer owns g_range_checkpoint_semaphore once it's been started. It's only closed in the range_checkpoint_cs critical section.
+DWORD WINAPI RangeCheckpointWriter( LPVOID WorkThreadContext )
+{
+	char *buffer = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * RANGE_CHECKPOINT_SLOT_SIZE );
+
+	while ( !g_end_program )
+	{
+		WaitForSingleObject( g_range_checkpoint_semaphore, INFINITE );
+
+		if ( g_end_program )
+		{
+			break;
+		}
+
+		EnterCriticalSection( &range_checkpoint_cs );
+
+		RANGE_CHECKPOINT *rc = NULL;
+		unsigned int length = 0;
+
+		if ( range_checkpoint_queue != NULL )
+		{
+			rc = ( RANGE_CHECKPOINT * )range_checkpoint_queue->data;
+
+			DLL_RemoveNode( &range_checkpoint_queue, &rc->queue_node );
+			rc->queue_node.data = NULL;
+
+			// CloseRangeCheckpoint will wait for us to finish before it frees the checkpoint.
+			g_range_checkpoint_writing = rc;
+
+			length = rc->length;
+
+			if ( buffer != NULL )
+			{
+				_memcpy_s( buffer, RANGE_CHECKPOINT_SLOT_SIZE, rc->buffer, length );
+			}
+		}
+
+		LeaveCriticalSection( &range_checkpoint_cs );
+
+		if ( rc != NULL )
+		{
+			if ( buffer != NULL )
+			{
+				WriteRangeCheckpoint( rc, buffer, length, true );
+			}
+
+			EnterCriticalSection( &range_checkpoint_cs );
+
+			g_range_checkpoint_writing = NULL;
+
+			if ( rc->close_waiting )
+			{
+				rc->close_waiting = false;
+
+				SetEvent( g_range_checkpoint_event );
+			}
+
+			LeaveCriticalSection( &range_checkpoint_cs );
+		}
+	}
+
+	GlobalFree( buffer );
+
+	// Nothing can release the semaphore once it's been closed.
+	EnterCriticalSection( &range_checkpoint_cs );
+
+	CloseHandle( g_range_checkpoint_semaphore );
+	g_range_checkpoint_semaphore = NULL;
+
+	LeaveCriticalSection( &range_checkpoint_cs );
+
+	_ExitThread( 0 );
+	return 0;
+}
+
+// Creates the download's range checkpoint once its file has been opened, and records the ranges that it starts with.
+// Nothing has been written to the file yet, so the first checkpoint doesn't need to flush it. The file may still be allocating.
+// This should be done in the download's shared_cs.
+void OpenRangeCheckpoint( DOWNLOAD_INFO *di )
+{
+	if ( di->range_checkpoint != NULL || ( di->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
+	{
+		return;
+	}
+
+	wchar_t file_path[ MAX_PATH ];
+	if ( !GetRangeCheckpointPath( di, file_path ) )
+	{
+		return;
+	}
+
+	RANGE_CHECKPOINT *rc = ( RANGE_CHECKPOINT * )GlobalAlloc( GPTR, sizeof( RANGE_CHECKPOINT ) );
+	if ( rc == NULL )
+	{
+		return;
+	}
+
+	// The writer thread flushes its own handle so that it isn't affected by the download's handle being closed.
+	if ( DuplicateHandle( GetCurrentProcess(), di->hFile, GetCurrentProcess(), &rc->hFile_data, 0, FALSE, DUPLICATE_SAME_ACCESS ) != FALSE )
+	{
+		rc->hFile = CreateFile( file_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+		if ( rc->hFile != INVALID_HANDLE_VALUE )
+		{
+			DWORD write = 0;
+			if ( WriteFile( rc->hFile, MAGIC_ID_RANGE_CHECKPOINT, RANGE_CHECKPOINT_HEADER_SIZE, &write, NULL ) != FALSE && write == RANGE_CHECKPOINT_HEADER_SIZE )
+			{
+				rc->last_time = GetTickCount();
+
+				rc->length = BuildRangeCheckpoint( di, rc->buffer );
+
+				WriteRangeCheckpoint( rc, rc->buffer, rc->length, false );
+
+				di->range_checkpoint = rc;
+
+				return;
+			}
+
+			CloseHandle( rc->hFile );
+		}
+
+		CloseHandle( rc->hFile_data );
+	}
+
+	GlobalFree( rc );
+}
+
+// Queues a checkpoint for the writer thread after RANGE_CHECKPOINT_BYTES have been written to the file, or after RANGE_CHECKPOINT_INTERVAL has elapsed.
+// This should be done in the download's shared_cs.
+void UpdateRangeCheckpoint( DOWNLOAD_INFO *di, DWORD io_size )
+{
+	RANGE_CHECKPOINT *rc = di->range_checkpoint;
+	if ( rc == NULL )
+	{
+		return;
+	}
+
+	rc->bytes += io_size;
+
+	DWORD current_time = GetTickCount();
+
+	if ( rc->bytes >= RANGE_CHECKPOINT_BYTES || ( current_time - rc->last_time ) >= RANGE_CHECKPOINT_INTERVAL )
+	{
+		char buffer[ RANGE_CHECKPOINT_SLOT_SIZE ];
+		unsigned int length = BuildRangeCheckpoint( di, buffer );
+
+		EnterCriticalSection( &range_checkpoint_cs );
+
+		// Replace the ranges of a queued checkpoint that hasn't been written yet.
+		_memcpy_s( rc->buffer, RANGE_CHECKPOINT_SLOT_SIZE, buffer, length );
+		rc->length = length;
+
+		if ( rc->queue_node.data == NULL && g_range_checkpoint_semaphore != NULL )
+		{
+			rc->queue_node.data = rc;
+			DLL_AddNode( &range_checkpoint_queue, &rc->queue_node, -1 );
+
+			ReleaseSemaphore( g_range_checkpoint_semaphore, 1, NULL );
+		}
+
+		LeaveCriticalSection( &range_checkpoint_cs );
+
+		rc->bytes = 0;
+		rc->last_time = current_time;
+	}
+}
+
+// If the checkpoint isn't deleted, then a final checkpoint is written before it's closed. Nothing can be writing to the file.
+// The checkpoint is deleted when the download is completed, restarted, or removed.
+void CloseRangeCheckpoint( DOWNLOAD_INFO *di, bool delete_checkpoint )
+{
+	RANGE_CHECKPOINT *rc = di->range_checkpoint;
+	if ( rc != NULL )
+	{
+		bool wait = false;
+
+		EnterCriticalSection( &range_checkpoint_cs );
+
+		if ( rc->queue_node.data != NULL )
+		{
+			DLL_RemoveNode( &range_checkpoint_queue, &rc->queue_node );
+			rc->queue_node.data = NULL;
+		}
+
+		if ( g_range_checkpoint_writing == rc )
+		{
+			rc->close_waiting = true;
+
+			wait = true;
+		}
+
+		LeaveCriticalSection( &range_checkpoint_cs );
+
+		// The writer thread signals the event once it's done with the checkpoint.
+		if ( wait )
+		{
+			WaitForSingleObject( g_range_checkpoint_event, INFINITE );
+		}
+
+		if ( !delete_checkpoint )
+		{
+			EnterCriticalSection( &di->shared_cs );
+			rc->length = BuildRangeCheckpoint( di, rc->buffer );
+			LeaveCriticalSection( &di->shared_cs );
+
+			WriteRangeCheckpoint( rc, rc->buffer, rc->length, true );
+		}
+
+		CloseHandle( rc->hFile );
+		CloseHandle( rc->hFile_data );
+
+		GlobalFree( rc );
+
+		di->range_checkpoint = NULL;
+	}
+
+	if ( delete_checkpoint && !( di->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
+	{
+		wchar_t file_path[ MAX_PATH ];
+		if ( GetRangeCheckpointPath( di, file_path ) )
+		{
+			DeleteFileW( file_path );
+		}
+	}
+}
+
+// Replaces the ranges of a download that was loaded from the download history with the ones in its checkpoint.
+// The download history is only saved every so often and its ranges can include data that never made it to the disk.
+// The checkpoint's ranges were on the disk when it was written. Returns true if the ranges were replaced.
+bool ReconcileRangeCheckpoint( DOWNLOAD_INFO *di )
+{
+	bool reconciled = false;
+
+	if ( di->download_operations & DOWNLOAD_OPERATION_SIMULATE )
+	{
+		return false;
+	}
+
+	wchar_t file_path[ MAX_PATH ];
+	if ( !GetRangeCheckpointPath( di, file_path ) )
+	{
+		return false;
+	}
+
+	HANDLE hFile_checkpoint = CreateFile( file_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile_checkpoint == INVALID_HANDLE_VALUE )
+	{
+		return false;
+	}
+
+	// The ranges are useless if the file they were written to is gone.
+	file_path[ lstrlenW( file_path ) - RANGE_CHECKPOINT_SUFFIX_LENGTH ] = 0;
+	if ( GetFileAttributes( file_path ) != INVALID_FILE_ATTRIBUTES )
+	{
+		char *buffer = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( RANGE_CHECKPOINT_HEADER_SIZE + ( RANGE_CHECKPOINT_SLOT_SIZE * 2 ) ) );
+		if ( buffer != NULL )
+		{
+			DWORD read = 0;
+			ReadFile( hFile_checkpoint, buffer, RANGE_CHECKPOINT_HEADER_SIZE + ( RANGE_CHECKPOINT_SLOT_SIZE * 2 ), &read, NULL );
+
+			if ( read >= RANGE_CHECKPOINT_HEADER_SIZE && _memcmp( buffer, MAGIC_ID_RANGE_CHECKPOINT, RANGE_CHECKPOINT_HEADER_SIZE ) == 0 )
+			{
+				char *slot = NULL;
+				unsigned int slot_length = 0;
+				unsigned int slot_sequence = 0;
+
+				// Use the valid slot that was written last.
+				for ( unsigned char i = 0; i < 2; ++i )
+				{
+					DWORD offset = RANGE_CHECKPOINT_HEADER_SIZE + ( i * RANGE_CHECKPOINT_SLOT_SIZE );
+					if ( offset + sizeof( unsigned int ) + sizeof( unsigned char ) + sizeof( unsigned long ) > read )
+					{
+						break;
+					}
+
+					char *p = buffer + offset;
+
+					unsigned int sequence;
+					_memcpy_s( &sequence, sizeof( unsigned int ), p, sizeof( unsigned int ) );
+
+					unsigned char range_count = p[ sizeof( unsigned int ) ];
+
+					unsigned int length = sizeof( unsigned int ) + sizeof( unsigned char ) + ( range_count * RANGE_CHECKPOINT_RANGE_SIZE );
+					if ( offset + length + sizeof( unsigned long ) > read )
+					{
+						continue;
+					}
+
+					unsigned long checksum;
+					_memcpy_s( &checksum, sizeof( unsigned long ), p + length, sizeof( unsigned long ) );
+
+					if ( range_count > 0 && checksum == GetRangeCheckpointChecksum( p, length ) && ( slot == NULL || sequence > slot_sequence ) )
+					{
+						slot = p;
+						slot_length = length;
+						slot_sequence = sequence;
+					}
+				}
+
+				if ( slot != NULL )
+				{
+					DoublyLinkedList *range_list = NULL;
+					unsigned long long downloaded = 0;
+
+					reconciled = true;
+
+					for ( unsigned int pos = sizeof( unsigned int ) + sizeof( unsigned char ); pos < slot_length; pos += RANGE_CHECKPOINT_RANGE_SIZE )
+					{
+						RANGE_INFO *ri = ( RANGE_INFO * )GlobalAlloc( GPTR, sizeof( RANGE_INFO ) );
+						if ( ri == NULL )
+						{
+							reconciled = false;
+
+							break;
+						}
+
+						_memcpy_s( &ri->range_start, sizeof( unsigned long long ), slot + pos, sizeof( unsigned long long ) );
+						_memcpy_s( &ri->range_end, sizeof( unsigned long long ), slot + pos + ( sizeof( unsigned long long ) * 1 ), sizeof( unsigned long long ) );
+						_memcpy_s( &ri->content_length, sizeof( unsigned long long ), slot + pos + ( sizeof( unsigned long long ) * 2 ), sizeof( unsigned long long ) );
+						_memcpy_s( &ri->content_offset, sizeof( unsigned long long ), slot + pos + ( sizeof( unsigned long long ) * 3 ), sizeof( unsigned long long ) );
+						_memcpy_s( &ri->file_write_offset, sizeof( unsigned long long ), slot + pos + ( sizeof( unsigned long long ) * 4 ), sizeof( unsigned long long ) );
+
+						DoublyLinkedList *range_node = DLL_CreateNode( ( void * )ri );
+						DLL_AddNode( &range_list, range_node, -1 );
+
+						// A range that's been written past its end wasn't written by the checkpointed download.
+						if ( ri->file_write_offset < ri->range_start ||
+						   ( ri->range_end > 0 && ri->file_write_offset > ri->range_end + 1 ) )
+						{
+							reconciled = false;
+
+							break;
+						}
 
-				SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )context_node->data;
+						downloaded += ri->content_offset;
+					}
 
-				if ( TryEnterCriticalSection( &context->context_cs ) == TRUE )
-				{
-					if ( context->cleanup == 0 && context->status != STATUS_ALLOCATING_FILE )
+					if ( reconciled )
 					{
-						// Don't increment the Control connection's timeout value.
-						// It'll be forced to time out if the Data connection times out.
-						if ( context->ftp_context != NULL && context->ftp_connection_type & FTP_CONNECTION_TYPE_CONTROL )
+						DoublyLinkedList *range_node;
+						while ( di->range_list != NULL )
 						{
-							if ( cfg_ftp_send_keep_alive && context->ftp_connection_type == FTP_CONNECTION_TYPE_CONTROL )
-							{
-								InterlockedIncrement( &context->keep_alive_timeout );	// Increment the timeout counter.
+							range_node = di->range_list;
+							di->range_list = di->range_list->next;
 
-								if ( context->keep_alive_timeout >= 30 )
-								{
-									InterlockedExchange( &context->keep_alive_timeout, 0 );	// Reset timeout counter.
-
-									SendFTPKeepAlive( context );
-								}
-							}
+							GlobalFree( range_node->data );
+							GlobalFree( range_node );
 						}
-						else
-						{
-							InterlockedIncrement( &context->timeout );	// Increment the timeout counter.
-
-							// See if we've reached the timeout limit.
-							if ( ( context->timeout >= cfg_timeout ) && ( cfg_timeout > 0 ) )
-							{
-								// Ignore paused and queued downloads.
-								if ( IS_STATUS( context->status, STATUS_PAUSED | STATUS_QUEUED ) )
-								{
-									InterlockedExchange( &context->timeout, 0 );	// Reset timeout counter.
-								}
-								else
-								{
-									context->timed_out = TIME_OUT_TRUE;
 
-									context->cleanup = 2;	// Force the cleanup.
+						di->range_list = range_list;
+						di->print_range_list = di->range_list;
 
-									InterlockedIncrement( &context->pending_operations );
-
-									context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
+						di->downloaded = downloaded;
+						di->last_downloaded = downloaded;
+					}
+					else
+					{
+						DoublyLinkedList *range_node;
+						while ( range_list != NULL )
+						{
+							range_node = range_list;
+							range_list = range_list->next;
 
-									PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
-								}
-							}
+							GlobalFree( range_node->data );
+							GlobalFree( range_node );
 						}
 					}
-
-					LeaveCriticalSection( &context->context_cs );
 				}
-
-				context_node = context_node->next;
 			}
 
-			LeaveCriticalSection( &context_list_cs );
+			GlobalFree( buffer );
 		}
 	}
 
-	CloseHandle( g_timeout_semaphore );
-	g_timeout_semaphore = NULL;
+	CloseHandle( hFile_checkpoint );
 
-	_ExitThread( 0 );
-	return 0;
+	return reconciled;
+}
+
+// Completed downloads don't need their ranges anymore, but they're kept for as long as the download is in the list.
+// Replace them with a single range that covers the file. The range list is rebuilt if the download is restarted.
+// This should be done in the download's shared_cs if the download is in the list.
+// The list draws the ranges without a lock, so a listed download's ranges are freed through the observer's ReleaseRanges.
+void ReleaseCompletedRanges( DOWNLOAD_INFO *di )
+{
+	if ( di->range_list == NULL || di->range_list->next == NULL )
+	{
+		return;
+	}
+
+	DoublyLinkedList *range_node = di->range_list->next;
+	di->range_list->next = NULL;
+
+	while ( range_node != NULL )
+	{
+		DoublyLinkedList *del_range_node = range_node;
+		range_node = range_node->next;
+
+		GlobalFree( del_range_node->data );
+		GlobalFree( del_range_node );
+	}
+
+	RANGE_INFO *ri = ( RANGE_INFO * )di->range_list->data;
+	ri->range_start = 0;
+	ri->range_end = ( di->file_size > 0 ? di->file_size - 1 : 0 );
+	ri->content_length = di->file_size;
+	ri->content_offset = di->downloaded;
+	ri->file_write_offset = di->downloaded;
+
+	di->print_range_list = di->range_list;
+	di->range_list_end = NULL;
+	di->range_queue = NULL;
+}
+
+// Completed downloads that are read from the download history have a packed filename. It only has room for its characters.
+// It's enlarged before anything can rewrite it. The packed copy is freed with the download since another thread may still be reading it.
+void PromoteDownload( DOWNLOAD_INFO *di )
+{
+	EnterCriticalSection( &di->shared_cs );
+
+	if ( di->packed_filename == NULL && GlobalSize( di->filename ) < sizeof( wchar_t ) * MAX_PATH )
+	{
+		wchar_t *filename = ( wchar_t * )GlobalAlloc( GPTR, sizeof( wchar_t ) * MAX_PATH );
+		if ( filename != NULL )
+		{
+			_wmemcpy_s( filename, MAX_PATH, di->filename, GlobalSize( di->filename ) / sizeof( wchar_t ) );
+
+			di->packed_filename = di->filename;
+			di->filename = filename;
+		}
+	}
+
+	LeaveCriticalSection( &di->shared_cs );
 }
 
 void InitializeServerInfo()
@@ -474,8 +2578,7 @@ DWORD WINAPI IOCPDownloader( LPVOID pArgs )
 		goto CLEANUP;
 	}
 
-	g_hIOCP = CreateIoCompletionPort( INVALID_HANDLE_VALUE, NULL, 0, 0 );
-    if ( g_hIOCP == NULL )
+	if ( !CreateCompletionQueue() )
 	{
 		goto CLEANUP;
 	}
@@ -489,7 +2592,7 @@ DWORD WINAPI IOCPDownloader( LPVOID pArgs )
 		DWORD dwThreadId;
 
 		// Create worker threads to service the overlapped I/O requests.
-		hThread = _CreateThread( NULL, 0, IOCPConnection, g_hIOCP, 0, &dwThreadId );
+		hThread = _CreateThread( NULL, 0, IOCPConnection, NULL, 0, &dwThreadId );
 		if ( hThread == NULL )
 		{
 			break;
@@ -499,6 +2602,22 @@ DWORD WINAPI IOCPDownloader( LPVOID pArgs )
 		hThread = INVALID_HANDLE_VALUE;
 	}
 
+	// These need to exist before any download can be started.
+	g_dns_cache = dllrbt_create( dllrbt_compare_w );
+
+	g_dns_semaphore = CreateSemaphore( NULL, 0, LONG_MAX, NULL );
+
+	for ( unsigned char i = 0; i < DNS_RESOLVER_THREADS; ++i )
+	{
+		HANDLE resolver_handle = _CreateThread( NULL, 0, Resolver, NULL, 0, NULL );
+		if ( resolver_handle != NULL )
+		{
+			InterlockedIncrement( &g_dns_resolver_count );
+
+			CloseHandle( resolver_handle );
+		}
+	}
+
 	if ( cfg_enable_server )
 	{
 		StartServer();
@@ -516,16 +2635,27 @@ DWORD WINAPI IOCPDownloader( LPVOID pArgs )
 	SetThreadPriority( timeout_handle, THREAD_PRIORITY_LOWEST );
 	CloseHandle( timeout_handle );
 
+	g_rate_limit_timer_queue = CreateTimerQueue();
+
+	g_range_checkpoint_semaphore = CreateSemaphore( NULL, 0, LONG_MAX, NULL );
+	g_range_checkpoint_event = CreateEvent( NULL, FALSE, FALSE, NULL );
+
+	CloseHandle( _CreateThread( NULL, 0, RangeCheckpointWriter, NULL, 0, NULL ) );
+
+	g_api_poll_semaphore = CreateSemaphore( NULL, 0, 1, NULL );
+
+	CloseHandle( _CreateThread( NULL, 0, APIPoller, NULL, 0, NULL ) );
+
 	_WSAWaitForMultipleEvents( 1, g_cleanup_event, TRUE, WSA_INFINITE, FALSE );
 
 	g_end_program = true;
 
 	// Causes the IOCP worker threads to exit.
-	if ( g_hIOCP != NULL )
+	if ( IsCompletionQueueRunning() )
 	{
 		for ( DWORD i = 0; i < dwThreadCount; ++i )
 		{
-			PostQueuedCompletionStatus( g_hIOCP, 0, 0, NULL );
+			PostCompletion( 0, NULL, NULL );
 		}
 	}
 
@@ -547,6 +2677,40 @@ DWORD WINAPI IOCPDownloader( LPVOID pArgs )
 		ReleaseSemaphore( g_timeout_semaphore, 1, NULL );
 	}
 
+	// Stop new refills from being scheduled, and wait for one that's running to finish with its contexts before they're freed below.
+	EnterCriticalSection( &rate_limit_cs );
+
+	HANDLE rate_limit_timer_queue = g_rate_limit_timer_queue;
+	g_rate_limit_timer_queue = NULL;
+	g_rate_limit_timer = NULL;
+
+	LeaveCriticalSection( &rate_limit_cs );
+
+	if ( rate_limit_timer_queue != NULL )
+	{
+		DeleteTimerQueueEx( rate_limit_timer_queue, INVALID_HANDLE_VALUE );
+	}
+
+	// The writer may have already closed its semaphore.
+	EnterCriticalSection( &range_checkpoint_cs );
+
+	if ( g_range_checkpoint_semaphore != NULL )
+	{
+		ReleaseSemaphore( g_range_checkpoint_semaphore, 1, NULL );
+	}
+
+	LeaveCriticalSection( &range_checkpoint_cs );
+
+	if ( g_api_poll_semaphore != NULL )
+	{
+		ReleaseSemaphore( g_api_poll_semaphore, 1, NULL );
+	}
+
+	if ( g_dns_semaphore != NULL )
+	{
+		ReleaseSemaphore( g_dns_semaphore, DNS_RESOLVER_THREADS, NULL );
+	}
+
 	if ( g_listen_socket != INVALID_SOCKET )
 	{
 		_shutdown( g_listen_socket, SD_BOTH );
@@ -557,18 +2721,39 @@ DWORD WINAPI IOCPDownloader( LPVOID pArgs )
 	// Clean up our listen context.
 	FreeListenContext();
 
+	// Forget any contexts that are waiting on a lookup before they're freed.
+	FreeDNSCache();
+
 	// Clean up our context list.
 	FreeContexts();
 
-	download_queue = NULL;
-	total_downloading = 0;
+	// Close any idle keep-alive connections.
+	FreeConnectionPool();
+
+	// Any parked contexts will have been freed above.
+	throttled_context_list = NULL;
+
+	// The checkpoints were closed with their downloads above.
+	range_checkpoint_queue = NULL;
+
+	if ( g_range_checkpoint_event != NULL )
+	{
+		CloseHandle( g_range_checkpoint_event );
+		g_range_checkpoint_event = NULL;
+	}
+
+	api_poll_list = NULL;
 
-	if ( g_hIOCP != NULL )
+	for ( unsigned int i = 0; i < TIMER_WHEEL_SLOTS; ++i )
 	{
-		CloseHandle( g_hIOCP );
-		g_hIOCP = NULL;
+		g_timer_wheel[ i ] = NULL;
 	}
 
+	download_queue = NULL;
+	total_downloading = 0;
+
+	DestroyCompletionQueue();
+
 CLEANUP:
 
 	if ( g_ThreadHandles != NULL )
@@ -660,8 +2845,7 @@ SOCKET_CONTEXT *UpdateCompletionPort( SOCKET socket, bool use_ssl, unsigned char
 			context->ssl = ssl;
 		}
 
-		g_hIOCP = CreateIoCompletionPort( ( HANDLE )socket, g_hIOCP, ( DWORD_PTR )context, 0 );
-		if ( g_hIOCP != NULL )
+		if ( AssociateCompletionQueue( ( HANDLE )socket, context ) )
 		{
 			if ( add_context )
 			{
@@ -675,6 +2859,8 @@ SOCKET_CONTEXT *UpdateCompletionPort( SOCKET socket, bool use_ssl, unsigned char
 				// Add to the global download list.
 				DLL_AddNode( &g_context_list, &context->context_node, 0 );
 
+				AddContextTimer( context );
+
 				LeaveCriticalSection( &context_list_cs );
 			}
 		}
@@ -796,96 +2982,356 @@ SOCKET CreateListenSocket()
 		goto CLEANUP;
 	}
 
-	nRet = _bind( socket, addrlocal->ai_addr, ( int )addrlocal->ai_addrlen );
-	if ( nRet == SOCKET_ERROR )
-	{
-		goto CLEANUP;
+	nRet = _bind( socket, addrlocal->ai_addr, ( int )addrlocal->ai_addrlen );
+	if ( nRet == SOCKET_ERROR )
+	{
+		goto CLEANUP;
+	}
+
+	nRet = _listen( socket, SOMAXCONN );
+	if ( nRet == SOCKET_ERROR )
+	{
+		goto CLEANUP;
+	}
+
+	// We need only do this once.
+	if ( _AcceptEx == NULL )
+	{
+		// Load the AcceptEx extension function from the provider.
+		// It doesn't matter what socket we use so long as it's valid.
+		nRet = _WSAIoctl( socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &acceptex_guid, sizeof( acceptex_guid ), &_AcceptEx, sizeof( _AcceptEx ), &bytes, NULL, NULL );
+		if ( nRet == SOCKET_ERROR )
+		{
+			goto CLEANUP;
+		}
+	}
+
+	listen_socket = socket;
+	socket = INVALID_SOCKET;
+
+CLEANUP:
+
+	if ( socket != INVALID_SOCKET )
+	{
+		_closesocket( socket );
+	}
+
+	if ( addrlocal != NULL )
+	{
+		_FreeAddrInfoW( addrlocal );
+	}
+
+	return listen_socket;
+}
+
+char CreateAcceptSocket( SOCKET listen_socket, bool use_ipv6 )
+{
+	int nRet = 0;
+	DWORD dwRecvNumBytes = 0;
+
+	if ( g_listen_context == NULL )
+	{
+		g_listen_context = UpdateCompletionPort( listen_socket, cfg_server_enable_ssl, cfg_server_ssl_version, false, true );
+		if ( g_listen_context == NULL )
+		{
+			return LA_STATUS_FAILED;
+		}
+	}
+
+	// The accept socket will inherit the listen socket's properties when it completes. IPv6 doesn't actually have to be set here.
+	g_listen_context->socket = CreateSocket( use_ipv6 );
+	if ( g_listen_context->socket == INVALID_SOCKET )
+	{
+		return LA_STATUS_FAILED;
+	}
+
+	InterlockedIncrement( &g_listen_context->pending_operations );
+
+	// Accept a connection without waiting for any data. (dwReceiveDataLength = 0)
+	nRet = _AcceptEx( listen_socket, g_listen_context->socket, ( LPVOID )( g_listen_context->buffer ), 0, sizeof( SOCKADDR_STORAGE ) + 16, sizeof( SOCKADDR_STORAGE ) + 16, &dwRecvNumBytes, ( OVERLAPPED * )&g_listen_context->overlapped );
+	if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
+	{
+		InterlockedDecrement( &g_listen_context->pending_operations );
+
+		return LA_STATUS_FAILED;
+	}
+
+	return LA_STATUS_OK;
+}
+
+SOCKET CreateSocket( bool IPv6 )
+{
+	int nZero = 0;
+	SOCKET socket = INVALID_SOCKET;
+
+	socket = _WSASocketW( ( IPv6 ? AF_INET6 : AF_INET ), SOCK_STREAM, IPPROTO_IP, NULL, 0, WSA_FLAG_OVERLAPPED ); 
+	if ( socket != INVALID_SOCKET )
+	{
+		// Disable send buffering on the socket.
+		_setsockopt( socket, SOL_SOCKET, SO_SNDBUF, ( char * )&nZero, sizeof( nZero ) );
+	}
+
+	return socket;
+}
+
+// Socket must be bound before we can use it with ConnectEx.
+int BindSocket( SOCKET socket, bool IPv6 )
+{
+	struct sockaddr_in ipv4_addr;
+	struct sockaddr_in6 ipv6_addr;
+
+	if ( IPv6 )
+	{
+		_memzero( &ipv6_addr, sizeof( ipv6_addr ) );
+		ipv6_addr.sin6_family = AF_INET6;
+		//ipv6_addr.sin6_addr = in6addr_any;	// This assignment requires the CRT, but it's all zeros anyway and it gets set by _memzero().
+		//ipv6_addr.sin6_port = 0;
+		return _bind( socket, ( SOCKADDR * )&ipv6_addr, sizeof( ipv6_addr ) );
+	}
+	else
+	{
+		_memzero( &ipv4_addr, sizeof( ipv4_addr ) );
+		ipv4_addr.sin_family = AF_INET;
+		//ipv4_addr.sin_addr.s_addr = INADDR_ANY;
+		//ipv4_addr.sin_port = 0;
+		return _bind( socket, ( SOCKADDR * )&ipv4_addr, sizeof( ipv4_addr ) );
+	}
+}
+
+// Close the sockets of the connection attempts that are in progress and don't start any new ones.
+// The attempts will complete with a failure and be ignored.
+// This should be done in the context's critical section.
+void CancelConnectAttempts( SOCKET_CONTEXT *context )
+{
+	context->connect_address = NULL;
+
+	for ( unsigned char i = 0; i < CONNECT_ATTEMPT_LIMIT; ++i )
+	{
+		if ( context->connect_attempts[ i ].socket != INVALID_SOCKET )
+		{
+			SOCKET s = context->connect_attempts[ i ].socket;
+			context->connect_attempts[ i ].socket = INVALID_SOCKET;
+			_shutdown( s, SD_BOTH );
+			_closesocket( s );	// Forces the ConnectEx to complete.
+		}
+	}
+}
+
+// Start a connection attempt to the next address. Addresses that can't be attempted (an unsupported address family, etc.) are skipped.
+// Returns false if there are no more addresses or all of the attempts are in progress.
+// This should be done in the context's critical section.
+bool StartConnectAttempt( SOCKET_CONTEXT *context )
+{
+	CONNECT_ATTEMPT *ca = NULL;
+
+	for ( unsigned char i = 0; i < CONNECT_ATTEMPT_LIMIT; ++i )
+	{
+		if ( context->connect_attempts[ i ].address == NULL )
+		{
+			ca = &context->connect_attempts[ i ];
+
+			break;
+		}
+	}
+
+	if ( ca == NULL )
+	{
+		return false;
+	}
+
+	while ( context->connect_address != NULL )
+	{
+		addrinfoW *address_info = context->connect_address;
+		context->connect_address = address_info->ai_next;
+
+		bool use_ipv6 = ( address_info->ai_family == AF_INET6 ? true : false );
+
+		SOCKET socket = CreateSocket( use_ipv6 );
+		if ( socket == INVALID_SOCKET )
+		{
+			continue;
+		}
+
+		if ( !AssociateCompletionQueue( ( HANDLE )socket, NULL ) ||
+			 BindSocket( socket, use_ipv6 ) == SOCKET_ERROR )
+		{
+			_closesocket( socket );
+
+			continue;
+		}
+
+		ca->address = address_info;
+		ca->socket = socket;
+
+		InterlockedIncrement( &context->pending_operations );
+
+		ca->overlapped.current_operation = IO_ConnectAttempt;
+
+		DWORD lpdwBytesSent = 0;
+		BOOL bRet = _ConnectEx( socket, address_info->ai_addr, ( int )address_info->ai_addrlen, NULL, 0, &lpdwBytesSent, ( OVERLAPPED * )&ca->overlapped );
+		if ( bRet == FALSE && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
+		{
+			InterlockedDecrement( &context->pending_operations );
+
+			ca->address = NULL;
+			ca->socket = INVALID_SOCKET;
+
+			_closesocket( socket );
+
+			continue;
+		}
+
+		return true;
 	}
 
-	nRet = _listen( socket, SOMAXCONN );
-	if ( nRet == SOCKET_ERROR )
-	{
-		goto CLEANUP;
-	}
+	return false;
+}
 
-	// We need only do this once.
-	if ( _AcceptEx == NULL )
+VOID CALLBACK ConnectAttemptTimer( PVOID lpParameter, BOOLEAN TimerOrWaitFired )
+{
+	SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )lpParameter;
+
+	// pending_operations was incremented when the timer was created.
+	PostCompletion( 0, context, &context->overlapped_connect_delay );
+}
+
+// Start the next connection attempt if the ones in progress haven't connected within CONNECT_ATTEMPT_DELAY.
+// This should be done in the context's critical section.
+void ScheduleConnectAttempt( SOCKET_CONTEXT *context )
+{
+	if ( context->connect_timer == NULL && context->connect_address != NULL )
 	{
-		// Load the AcceptEx extension function from the provider.
-		// It doesn't matter what socket we use so long as it's valid.
-		nRet = _WSAIoctl( socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &acceptex_guid, sizeof( acceptex_guid ), &_AcceptEx, sizeof( _AcceptEx ), &bytes, NULL, NULL );
-		if ( nRet == SOCKET_ERROR )
+		InterlockedIncrement( &context->pending_operations );
+
+		context->overlapped_connect_delay.current_operation = IO_ConnectDelay;
+
+		if ( CreateTimerQueueTimer( &context->connect_timer, NULL, ConnectAttemptTimer, ( PVOID )context, CONNECT_ATTEMPT_DELAY, 0, WT_EXECUTEONLYONCE ) == FALSE )
 		{
-			goto CLEANUP;
+			context->connect_timer = NULL;
+
+			InterlockedDecrement( &context->pending_operations );
 		}
 	}
+}
 
-	listen_socket = socket;
-	socket = INVALID_SOCKET;
+// Race a connection attempt to each address of the host. The first one to connect is handed to IO_Connect.
+bool StartConnectAttempts( SOCKET_CONTEXT *context )
+{
+	bool ret = false;
 
-CLEANUP:
+	// An attempt can complete (and start the next one) before we've scheduled the delay.
+	EnterCriticalSection( &context->context_cs );
 
-	if ( socket != INVALID_SOCKET )
-	{
-		_closesocket( socket );
-	}
+	context->connect_address = context->address_info;
 
-	if ( addrlocal != NULL )
+	if ( StartConnectAttempt( context ) )
 	{
-		_FreeAddrInfoW( addrlocal );
+		ScheduleConnectAttempt( context );
+
+		ret = true;
 	}
 
-	return listen_socket;
+	LeaveCriticalSection( &context->context_cs );
+
+	return ret;
 }
 
-char CreateAcceptSocket( SOCKET listen_socket, bool use_ipv6 )
+// Handles a completed connection attempt (IO_ConnectAttempt) or the delay before the next one (IO_ConnectDelay).
+// Returns true if the context needs to be closed. That's when the last attempt failed, or the last pending operation completed while we were cleaning up.
+bool HandleConnectAttempt( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool connected )
 {
-	int nRet = 0;
-	DWORD dwRecvNumBytes = 0;
+	bool close_context = false;
 
-	if ( g_listen_context == NULL )
+	EnterCriticalSection( &context->context_cs );
+
+	// We're still waiting for a connection if the context isn't closing and no attempt has won.
+	bool connecting = ( context->cleanup == 0 && context->socket == INVALID_SOCKET ? true : false );
+
+	if ( overlapped->current_operation == IO_ConnectDelay )
 	{
-		g_listen_context = UpdateCompletionPort( listen_socket, cfg_server_enable_ssl, cfg_server_ssl_version, false, true );
-		if ( g_listen_context == NULL )
+		DeleteTimerQueueTimer( NULL, context->connect_timer, NULL );
+		context->connect_timer = NULL;
+
+		if ( connecting && StartConnectAttempt( context ) )
 		{
-			return LA_STATUS_FAILED;
+			ScheduleConnectAttempt( context );
 		}
 	}
-
-	// The accept socket will inherit the listen socket's properties when it completes. IPv6 doesn't actually have to be set here.
-	g_listen_context->socket = CreateSocket( use_ipv6 );
-	if ( g_listen_context->socket == INVALID_SOCKET )
+	else
 	{
-		return LA_STATUS_FAILED;
-	}
+		CONNECT_ATTEMPT *ca = ( CONNECT_ATTEMPT * )overlapped;
 
-	InterlockedIncrement( &g_listen_context->pending_operations );
+		addrinfoW *address_info = ca->address;
+		SOCKET socket = ca->socket;	// INVALID_SOCKET if the attempt was cancelled.
 
-	// Accept a connection without waiting for any data. (dwReceiveDataLength = 0)
-	nRet = _AcceptEx( listen_socket, g_listen_context->socket, ( LPVOID )( g_listen_context->buffer ), 0, sizeof( SOCKADDR_STORAGE ) + 16, sizeof( SOCKADDR_STORAGE ) + 16, &dwRecvNumBytes, ( OVERLAPPED * )&g_listen_context->overlapped );
-	if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
-	{
-		InterlockedDecrement( &g_listen_context->pending_operations );
+		ca->address = NULL;
+		ca->socket = INVALID_SOCKET;
 
-		return LA_STATUS_FAILED;
-	}
+		if ( connected && connecting && socket != INVALID_SOCKET )
+		{
+			context->socket = socket;
 
-	return LA_STATUS_OK;
-}
+			CancelConnectAttempts( context );
 
-SOCKET CreateSocket( bool IPv6 )
-{
-	int nZero = 0;
-	SOCKET socket = INVALID_SOCKET;
+			SetPreferredAddress( context, address_info );
 
-	socket = _WSASocketW( ( IPv6 ? AF_INET6 : AF_INET ), SOCK_STREAM, IPPROTO_IP, NULL, 0, WSA_FLAG_OVERLAPPED ); 
-	if ( socket != INVALID_SOCKET )
+			// IO_Connect will continue as if we had made a single connection.
+			InterlockedIncrement( &context->pending_operations );
+
+			context->overlapped.current_operation = IO_Connect;
+
+			PostCompletion( 0, context, &context->overlapped );
+		}
+		else
+		{
+			if ( socket != INVALID_SOCKET )
+			{
+				_closesocket( socket );
+			}
+
+			// Don't wait for the delay to attempt the next address.
+			if ( connecting && StartConnectAttempt( context ) )
+			{
+				ScheduleConnectAttempt( context );
+			}
+		}
+	}
+
+	// Nothing else is in progress. Either every attempt failed, or we're the last operation to complete during the cleanup.
+	if ( context->pending_operations == 0 )
 	{
-		// Disable send buffering on the socket.
-		_setsockopt( socket, SOL_SOCKET, SO_SNDBUF, ( char * )&nZero, sizeof( nZero ) );
+		if ( context->cleanup == 0 )
+		{
+			context->cleanup = 1;	// Auto cleanup.
+
+			close_context = true;
+
+			if ( IS_STATUS_NOT( context->status,
+					STATUS_STOPPED |
+					STATUS_REMOVE |
+					STATUS_RESTART |
+					STATUS_UPDATING ) )	// Stop, Stop and Remove, Restart, or Updating.
+			{
+				// Every address has been attempted. There's nothing for RetryTimedOut to try.
+				context->timed_out = TIME_OUT_TRUE;
+
+				if ( IS_STATUS( context->status, STATUS_PAUSED ) )
+				{
+					context->is_paused = true;	// Tells us how to stop the download if it's pausing/paused.
+
+					close_context = false;
+				}
+			}
+		}
+		else	// Auto cleanup. A forced cleanup still has its IO_Close pending.
+		{
+			close_context = true;
+		}
 	}
 
-	return socket;
+	LeaveCriticalSection( &context->context_cs );
+
+	return close_context;
 }
 
 SECURITY_STATUS DecryptRecv( SOCKET_CONTEXT *context, DWORD &io_size )
@@ -964,6 +3410,46 @@ SECURITY_STATUS DecryptRecv( SOCKET_CONTEXT *context, DWORD &io_size )
 	return scRet;
 }
 
+// Like DecryptRecv, but the data of a single record is left where it was decrypted and returned in decrypted_data.
+// Any records after it are decrypted (continue_decrypt is set) once the data has been processed.
+SECURITY_STATUS DecryptRecvInPlace( SOCKET_CONTEXT *context, DWORD &io_size, char **decrypted_data )
+{
+	SECURITY_STATUS scRet;
+
+	if ( context->ssl->rd.scRet == SEC_E_INCOMPLETE_MESSAGE )
+	{
+		context->ssl->cbIoBuffer += io_size;
+	}
+	else
+	{
+		context->ssl->cbIoBuffer = io_size;
+	}
+
+	io_size = 0;
+
+	context->ssl->continue_decrypt = false;
+
+	// Skip any records that had no data. An empty buffer returns SEC_E_INCOMPLETE_MESSAGE.
+	do
+	{
+		scRet = SSL_WSARecv_DecryptInPlace( context->ssl, decrypted_data, io_size );
+	}
+	while ( scRet == SEC_E_OK && io_size == 0 );
+
+	if ( scRet == SEC_E_OK )
+	{
+		context->ssl->continue_decrypt = ( context->ssl->cbIoBuffer > 0 );
+	}
+	else if ( scRet != SEC_E_INCOMPLETE_MESSAGE && scRet != SEC_I_RENEGOTIATE )
+	{
+		context->ssl->cbIoBuffer = 0;
+	}
+
+	RecordDecryptedData( io_size, false );
+
+	return scRet;
+}
+
 THREAD_RETURN RenameFilePrompt( void *pArguments )
 {
 	SOCKET_CONTEXT *context = NULL;
@@ -1003,12 +3489,12 @@ THREAD_RETURN RenameFilePrompt( void *pArguments )
 				int filename_length = GetTemporaryFilePath( di, file_path );
 
 				filename_offset = g_temp_download_directory_length + 1;
-				file_extension_offset = filename_offset + get_file_extension_offset( di->file_path + di->filename_offset, filename_length );
+				file_extension_offset = filename_offset + get_file_extension_offset( di->filename, filename_length );
 			}
 			else
 			{
 				filename_offset = di->filename_offset;
-				file_extension_offset = di->file_extension_offset;
+				file_extension_offset = di->filename_offset + di->file_extension_offset;
 
 				GetDownloadFilePath( di, file_path );
 			}
@@ -1020,7 +3506,7 @@ THREAD_RETURN RenameFilePrompt( void *pArguments )
 				{
 					__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___already_exists, file_path );
 
-					g_rename_file_cmb_ret = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_RENAMEOVERWRITESKIPALL );
+					g_rename_file_cmb_ret = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_RENAMEOVERWRITESKIPALL );
 				}
 			}
 
@@ -1047,7 +3533,7 @@ THREAD_RETURN RenameFilePrompt( void *pArguments )
 					{
 						__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___could_not_be_renamed, file_path );
 
-						g_rename_file_cmb_ret2 = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_OKALL );
+						g_rename_file_cmb_ret2 = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_OKALL );
 					}
 
 					EnterCriticalSection( &context->context_cs );
@@ -1062,7 +3548,7 @@ THREAD_RETURN RenameFilePrompt( void *pArguments )
 
 						context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-						PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
+						PostCompletion( 0, context, &context->overlapped_close );
 					}
 
 					LeaveCriticalSection( &context->context_cs );
@@ -1075,7 +3561,7 @@ THREAD_RETURN RenameFilePrompt( void *pArguments )
 
 					context->overlapped.current_operation = IO_ResumeGetContent;
 
-					PostQueuedCompletionStatus( g_hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+					PostCompletion( context->current_bytes_read, context, &context->overlapped );
 
 					LeaveCriticalSection( &context->context_cs );
 				}
@@ -1094,7 +3580,7 @@ THREAD_RETURN RenameFilePrompt( void *pArguments )
 
 					context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-					PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
+					PostCompletion( 0, context, &context->overlapped_close );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -1107,7 +3593,7 @@ THREAD_RETURN RenameFilePrompt( void *pArguments )
 
 				context->overlapped.current_operation = IO_ResumeGetContent;
 
-				PostQueuedCompletionStatus( g_hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+				PostCompletion( context->current_bytes_read, context, &context->overlapped );
 
 				LeaveCriticalSection( &context->context_cs );
 			}
@@ -1171,7 +3657,7 @@ THREAD_RETURN FileSizePrompt( void *pArguments )
 
 				wchar_t prompt_message[ MAX_PATH + 512 ];
 				__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___will_be___size, file_path, di->file_size );
-				g_file_size_cmb_ret = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_YESNOALL );
+				g_file_size_cmb_ret = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_YESNOALL );
 			}
 
 			EnterCriticalSection( &context->context_cs );
@@ -1195,7 +3681,7 @@ THREAD_RETURN FileSizePrompt( void *pArguments )
 
 					context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-					PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
+					PostCompletion( 0, context, &context->overlapped_close );
 				}
 			}
 			else	// Continue where we left off when getting the content.
@@ -1204,7 +3690,7 @@ THREAD_RETURN FileSizePrompt( void *pArguments )
 
 				context->overlapped.current_operation = IO_ResumeGetContent;
 
-				PostQueuedCompletionStatus( g_hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+				PostCompletion( context->current_bytes_read, context, &context->overlapped );
 			}
 
 			LeaveCriticalSection( &context->context_cs );
@@ -1274,7 +3760,7 @@ THREAD_RETURN LastModifiedPrompt( void *pArguments )
 				{
 					__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___has_been_modified, file_path );
 
-					g_last_modified_cmb_ret = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_CONTINUERESTARTSKIPALL );
+					g_last_modified_cmb_ret = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_CONTINUERESTARTSKIPALL );
 				}
 			}
 
@@ -1299,7 +3785,7 @@ THREAD_RETURN LastModifiedPrompt( void *pArguments )
 
 					context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-					PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
+					PostCompletion( 0, context, &context->overlapped_close );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -1318,7 +3804,7 @@ THREAD_RETURN LastModifiedPrompt( void *pArguments )
 
 					context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-					PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
+					PostCompletion( 0, context, &context->overlapped_close );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -1338,7 +3824,7 @@ THREAD_RETURN LastModifiedPrompt( void *pArguments )
 
 				context->overlapped.current_operation = IO_ResumeGetContent;
 
-				PostQueuedCompletionStatus( g_hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+				PostCompletion( context->current_bytes_read, context, &context->overlapped );
 
 				LeaveCriticalSection( &context->context_cs );
 			}
@@ -1363,14 +3849,13 @@ THREAD_RETURN LastModifiedPrompt( void *pArguments )
 
 DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 {
-	HANDLE hIOCP = ( HANDLE )WorkThreadContext;
 	OVERLAPPEDEX *overlapped = NULL;
 	DWORD io_size = 0;
 	SOCKET_CONTEXT *context = NULL;
 	IO_OPERATION *current_operation = NULL;
 	IO_OPERATION *next_operation = NULL;
 
-	BOOL completion_status = TRUE;
+	bool completion_status = true;
 
 	bool use_ssl = false;
 
@@ -1381,7 +3866,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 	while ( true )
 	{
-		completion_status = GetQueuedCompletionStatus( hIOCP, &io_size, ( ULONG_PTR * )&context, ( OVERLAPPED ** )&overlapped, INFINITE );
+		completion_status = WaitForCompletion( &io_size, &context, &overlapped );
 
 		if ( g_end_program )
 		{
@@ -1400,13 +3885,29 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 			continue;
 		}
 
-		InterlockedExchange( &context->timeout, 0 );	// Reset timeout counter.
+		InterlockedExchange( &context->last_activity, ( LONG )g_timer_wheel_tick );	// Re-arm the timeout. The timer wheel will pick up the new deadline when the old one expires.
 
 		InterlockedDecrement( &context->pending_operations );
 
 		use_ssl = ( context->ssl != NULL ? true : false );
 
-		if ( completion_status == FALSE )
+		// Connection attempts race each other. A failed attempt only closes the context if it was the last one.
+		if ( *current_operation == IO_ConnectAttempt || *current_operation == IO_ConnectDelay )
+		{
+			if ( !HandleConnectAttempt( context, overlapped, completion_status ) )
+			{
+				continue;
+			}
+
+			*current_operation = IO_Close;
+		}
+		else if ( *current_operation == IO_WriteCache )	// The slot can be reused as soon as it's released. Don't touch it after we've handled it.
+		{
+			HandleWriteCache( context, overlapped, io_size, completion_status );
+
+			continue;
+		}
+		else if ( !completion_status )
 		{
 			EnterCriticalSection( &context->context_cs );
 
@@ -1503,20 +4004,9 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 						skip_process = true;
 					}
-					else if ( ( cfg_download_speed_limit > 0 &&
-							  ( g_session_total_downloaded - g_session_last_total_downloaded ) > cfg_download_speed_limit ) ||
-							  ( context->download_info != NULL &&
-								context->download_info->download_speed_limit > 0 &&
-							  ( context->download_info->downloaded - context->download_info->last_downloaded ) > context->download_info->download_speed_limit ) ) // Preempt the next receive.
+					else if ( *current_operation == IO_GetContent &&
+							  ThrottleContext( context, io_size ) )	// Preempt the next receive until the speed limit allows it.
 					{
-						Sleep( 1 );	// Prevents high CPU usage for some reason.
-
-						context->current_bytes_read = io_size;
-
-						InterlockedIncrement( &context->pending_operations );
-
-						PostQueuedCompletionStatus( hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
-
 						skip_process = true;
 					}
 
@@ -1586,7 +4076,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 							ftp_control_context->overlapped.current_operation = IO_Close;
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )ftp_control_context, ( WSAOVERLAPPED * )&ftp_control_context->overlapped );
+							PostCompletion( 0, ftp_control_context, &ftp_control_context->overlapped );
 						}
 
 						LeaveCriticalSection( &ftp_control_context->context_cs );
@@ -1683,7 +4173,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							{
 								new_context->overlapped.current_operation = IO_Close;
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )new_context, ( WSAOVERLAPPED * )&new_context->overlapped );
+								PostCompletion( 0, new_context, &new_context->overlapped );
 							}
 						}
 						else if ( new_context->cleanup == 2 )	// If we've forced the cleanup, then allow it to continue its steps.
@@ -1696,7 +4186,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 							new_context->overlapped.current_operation = IO_Close;
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )new_context, ( WSAOVERLAPPED * )&new_context->overlapped );
+							PostCompletion( 0, new_context, &new_context->overlapped );
 						}
 
 						LeaveCriticalSection( &new_context->context_cs );
@@ -1716,7 +4206,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -1728,6 +4218,45 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 			}
 			break;
 
+			case IO_ResolveAddress:
+			{
+				bool connection_failed = false;
+
+				EnterCriticalSection( &context->context_cs );
+
+				if ( context->cleanup == 0 )
+				{
+					// The resolver thread will have set the address info if the lookup succeeded.
+					if ( context->address_info == NULL ||
+						!CreateConnection( context, context->request_info.host, context->request_info.port ) )
+					{
+						context->status = STATUS_FAILED;
+
+						connection_failed = true;
+					}
+				}
+				else if ( context->cleanup == 2 )	// If we've forced the cleanup, then allow it to continue its steps.
+				{
+					context->cleanup = 1;	// Auto cleanup.
+				}
+				else	// We've already shutdown and/or closed the connection.
+				{
+					connection_failed = true;
+				}
+
+				if ( connection_failed )
+				{
+					InterlockedIncrement( &context->pending_operations );
+
+					*current_operation = IO_Close;
+
+					PostCompletion( 0, context, overlapped );
+				}
+
+				LeaveCriticalSection( &context->context_cs );
+			}
+			break;
+
 			case IO_Connect:
 			{
 				bool connection_failed = false;
@@ -1737,12 +4266,13 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 				if ( context->cleanup == 0 )
 				{
 					// Allow the connect socket to inherit the properties of the previously set properties.
-					// Must be done so that shutdown() will work.
-					nRet = _setsockopt( context->socket, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0 );
+					// Must be done so that shutdown() will work. Pooled connections have already done this.
+					nRet = ( context->pooled_connection ? 0 : _setsockopt( context->socket, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0 ) );
 					if ( nRet != SOCKET_ERROR )
 					{
-						if ( context->request_info.protocol == PROTOCOL_HTTPS ||
-							 context->request_info.protocol == PROTOCOL_FTPS )	// FTPES starts out unencrypted and is upgraded later.
+						if ( !context->pooled_connection &&
+						   ( context->request_info.protocol == PROTOCOL_HTTPS ||
+							 context->request_info.protocol == PROTOCOL_FTPS ) )	// FTPES starts out unencrypted and is upgraded later.
 						{
 							char shared_protocol = ( context->download_info != NULL ? context->download_info->ssl_version : 0 );
 							DWORD protocol = 0;
@@ -1797,8 +4327,41 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						{
 							InterlockedIncrement( &context->pending_operations );
 
+							// Pooled connections have already been through the proxy and handshake steps below.
+							if ( context->pooled_connection )
+							{
+								context->wsabuf.buf = context->buffer;
+								context->wsabuf.len = context->buffer_size;
+
+								*next_operation = IO_GetContent;
+
+								ConstructRequest( context, false );
+
+								if ( context->ssl != NULL )
+								{
+									SSL_WSASend( context, overlapped, &context->wsabuf, sent );
+									if ( !sent )
+									{
+										InterlockedDecrement( &context->pending_operations );
+
+										connection_failed = true;
+									}
+								}
+								else
+								{
+									*current_operation = IO_Write;
+
+									nRet = _WSASend( context->socket, &context->wsabuf, 1, NULL, dwFlags, ( WSAOVERLAPPED * )overlapped, NULL );
+									if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
+									{
+										InterlockedDecrement( &context->pending_operations );
+
+										connection_failed = true;
+									}
+								}
+							}
 							// If it's an HTTPS or FTPS (not FTPES) request and we're not going through a SSL/TLS proxy, then begin the SSL/TLS handshake.
-							if ( ( context->request_info.protocol == PROTOCOL_HTTPS ||
+							else if ( ( context->request_info.protocol == PROTOCOL_HTTPS ||
 								   context->request_info.protocol == PROTOCOL_FTPS ) &&
 								   !cfg_enable_proxy_s && !cfg_enable_proxy_socks )
 							{
@@ -1907,7 +4470,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -1977,7 +4540,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 									*current_operation = IO_Shutdown;
 
-									PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+									PostCompletion( 0, context, overlapped );
 								}
 							}
 							else
@@ -1989,7 +4552,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 								{
 									*current_operation = IO_Shutdown;
 
-									PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+									PostCompletion( 0, context, overlapped );
 								}
 							}
 						}
@@ -2004,7 +4567,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							{
 								*current_operation = IO_Shutdown;
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( 0, context, overlapped );
 							}
 						}
 					}
@@ -2016,7 +4579,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 						*current_operation = IO_Close;
 
-						PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+						PostCompletion( 0, context, overlapped );
 					}
 				}
 				else if ( context->cleanup == 2 )	// If we've forced the cleanup, then allow it to continue its steps.
@@ -2029,7 +4592,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -2076,7 +4639,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						if ( context->ssl->cbIoBuffer > 0 )
 						{
 							// The request was sent with the handshake.
-							PostQueuedCompletionStatus( hIOCP, context->ssl->cbIoBuffer, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( context->ssl->cbIoBuffer, context, overlapped );
 						}
 						else
 						{
@@ -2088,7 +4651,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							{
 								*current_operation = IO_Shutdown;
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( 0, context, overlapped );
 							}
 						}
 					}
@@ -2109,7 +4672,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						SSL_free( context->ssl );
 						context->ssl = NULL;
 
-						PostQueuedCompletionStatus( hIOCP, bytes_read, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );*/
+						PostCompletion( bytes_read, context, overlapped );*/
 
 						*current_operation = IO_Write;
 						*next_operation = IO_Close;	// This is closed because the SSL connection was never established. An SSL shutdown would just fail.
@@ -2132,7 +4695,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						{
 							*current_operation = IO_Close;
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 					}
 					else if ( scRet != SEC_I_CONTINUE_NEEDED && scRet != SEC_E_INCOMPLETE_MESSAGE && scRet != SEC_I_INCOMPLETE_CREDENTIALS )	// Stop handshake and close the connection.
@@ -2141,7 +4704,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 						*current_operation = IO_Close;
 
-						PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+						PostCompletion( 0, context, overlapped );
 					}
 				}
 				else if ( context->cleanup == 2 )	// If we've forced the cleanup, then allow it to continue its steps.
@@ -2154,7 +4717,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -2186,7 +4749,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						{
 							*current_operation = IO_Close;
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 					}
 					else if ( content_status == CONTENT_STATUS_FAILED )
@@ -2198,7 +4761,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						// We don't need to shutdown the SSL/TLS connection since it will not have been established yet.
 						*current_operation = IO_Close;
 
-						PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+						PostCompletion( 0, context, overlapped );
 					}
 					else// if ( content_status == CONTENT_STATUS_GET_CONTENT );
 					{
@@ -2216,7 +4779,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							context->header_info.content_encoding = CONTENT_ENCODING_NONE;
 							context->header_info.chunked_transfer = false;
 							//context->header_info.etag = false;
-							context->header_info.got_chunk_start = false;
+							context->header_info.chunk_state = CHUNK_STATE_SIZE_START;
 							context->header_info.got_chunk_terminator = false;
 
 							context->header_info.range_info->content_length = 0;	// We must reset this to get the real request length (not the length of the 2XX request).
@@ -2236,7 +4799,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							{
 								*current_operation = IO_Shutdown;
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( 0, context, overlapped );
 							}
 						}
 						else	// Proxy can't/won't tunnel SSL/TLS connections, or authentication is required.
@@ -2301,7 +4864,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 								// We don't need to shutdown the SSL/TLS connection since it will not have been established yet.
 								*current_operation = IO_Close;
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( 0, context, overlapped );
 							}
 						}
 					}
@@ -2316,7 +4879,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -2464,7 +5027,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 									{
 										*current_operation = IO_Close;
 
-										PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+										PostCompletion( 0, context, overlapped );
 									}
 								}
 								else	// HTTP
@@ -2505,7 +5068,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 				{
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -2515,6 +5078,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 			case IO_GetContent:
 			case IO_ResumeGetContent:
 			case IO_GetRequest:
+			case IO_ResumeGetRequest:
 			{
 				EnterCriticalSection( &context->context_cs );
 
@@ -2524,8 +5088,15 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					DWORD bytes_decrypted = io_size;
 
-					//if ( *current_operation == IO_GetContent || *current_operation == IO_GetRequest )
-					if ( *current_operation != IO_ResumeGetContent )
+					char *decrypted_data = NULL;
+
+					// Pipelined requests were decrypted along with the request before them.
+					if ( *current_operation == IO_ResumeGetRequest )
+					{
+						*current_operation = IO_GetRequest;
+					}
+					//else if ( *current_operation == IO_GetContent || *current_operation == IO_GetRequest )
+					else if ( *current_operation != IO_ResumeGetContent )
 					{
 						context->current_bytes_read = 0;
 
@@ -2537,8 +5108,28 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 								bytes_decrypted = context->ssl->cbIoBuffer;
 							}
 
-							scRet = DecryptRecv( context, bytes_decrypted );
+							// Once the response header has been handled, its content can be processed where it was decrypted.
+							// It's written (or copied to the write cache) before we receive again, so nothing is received over it while it's in use.
+							// Partial data that's being kept at the start of our buffer still needs the decrypted data copied after it.
+							if ( *current_operation == IO_GetContent &&
+								 context->content_status == CONTENT_STATUS_GET_CONTENT &&
+								 context->wsabuf.buf == context->buffer &&
+								 context->request_info.protocol != PROTOCOL_FTP &&
+								 context->request_info.protocol != PROTOCOL_FTPS &&
+								 context->request_info.protocol != PROTOCOL_FTPES &&
+								 SSL_CanDecryptInPlace( context->ssl ) )
+							{
+								scRet = DecryptRecvInPlace( context, bytes_decrypted, &decrypted_data );
+							}
+							else
+							{
+								scRet = DecryptRecv( context, bytes_decrypted );
+
+								RecordDecryptedData( bytes_decrypted, true );
+							}
 						}
+
+						context->decrypted_data = decrypted_data;
 					}
 
 					if ( bytes_decrypted > 0 )
@@ -2546,12 +5137,27 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						//if ( *current_operation == IO_GetContent || *current_operation == IO_GetRequest )
 						if ( *current_operation != IO_ResumeGetContent )
 						{
-							context->current_bytes_read = bytes_decrypted + ( DWORD )( context->wsabuf.buf - context->buffer );
+							if ( !use_ssl && *current_operation == IO_GetContent && context->download_info != NULL )
+							{
+								TrackReceiveSize( context, bytes_decrypted );
+							}
 
-							context->wsabuf.buf = context->buffer;
-							context->wsabuf.len = context->buffer_size;
+							if ( context->decrypted_data != NULL )
+							{
+								context->current_bytes_read = bytes_decrypted;
+
+								// The record's MAC or tag follows its data, so this stays inside the IO buffer.
+								context->decrypted_data[ context->current_bytes_read ] = 0;	// Sanity.
+							}
+							else
+							{
+								context->current_bytes_read = bytes_decrypted + ( DWORD )( context->wsabuf.buf - context->buffer );
+
+								context->wsabuf.buf = context->buffer;
+								context->wsabuf.len = context->buffer_size;
 
-							context->wsabuf.buf[ context->current_bytes_read ] = 0;	// Sanity.
+								context->wsabuf.buf[ context->current_bytes_read ] = 0;	// Sanity.
+							}
 						}
 						else
 						{
@@ -2568,7 +5174,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							}
 							else
 							{
-								content_status = GetHTTPResponseContent( context, context->wsabuf.buf, context->current_bytes_read );
+								content_status = GetHTTPResponseContent( context, ( context->decrypted_data != NULL ? context->decrypted_data : context->wsabuf.buf ), context->current_bytes_read );
 							}
 						}
 						else// if ( *current_operation == IO_GetRequest )
@@ -2610,7 +5216,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 						*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
 
-						PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+						PostCompletion( 0, context, overlapped );
 					}
 					else if ( content_status == CONTENT_STATUS_HANDLE_RESPONSE )
 					{
@@ -2622,7 +5228,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 							*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 					}
 					else if ( content_status == CONTENT_STATUS_HANDLE_REQUEST )
@@ -2635,7 +5241,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 							*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 					}
 					else if ( content_status == FTP_CONTENT_STATUS_HANDLE_REQUEST )
@@ -2646,7 +5252,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 							*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 					}
 					else if ( content_status == CONTENT_STATUS_READ_MORE_CONTENT || content_status == CONTENT_STATUS_READ_MORE_HEADER ) // Read more header information, or continue to read more content. Do not reset context->wsabuf since it may have been offset to handle partial data.
@@ -2661,7 +5267,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							{
 								// We need to post a non-zero status to avoid our code shutting down the connection.
 								// We'll use context->current_bytes_read for that, but it can be anything that's not zero.
-								PostQueuedCompletionStatus( hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( context->current_bytes_read, context, overlapped );
 							}
 							else
 							{
@@ -2670,18 +5276,23 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 								{
 									*current_operation = IO_Shutdown;
 
-									PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+									PostCompletion( 0, context, overlapped );
 								}
 							}
 						}
 						else
 						{
+							if ( content_status == CONTENT_STATUS_READ_MORE_CONTENT )
+							{
+								ResizeReceiveBuffer( context );
+							}
+
 							nRet = _WSARecv( context->socket, &context->wsabuf, 1, NULL, &dwFlags, ( WSAOVERLAPPED * )overlapped, NULL );
 							if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
 							{
 								*current_operation = IO_Close;
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( 0, context, overlapped );
 							}
 						}
 					}
@@ -2696,7 +5307,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -2711,14 +5322,17 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 				{
 					EnterCriticalSection( &context->download_info->shared_cs );
 					context->download_info->downloaded += io_size;				// The total amount of data (decoded) that was saved/simulated.
+
+					context->header_info.range_info->file_write_offset += io_size;	// The size of the non-encoded/decoded data that we're writing to the file.
+
+					// The checkpoint's snapshot of the ranges is taken under the same lock that updates them.
+					UpdateRangeCheckpoint( context->download_info, io_size );
 					LeaveCriticalSection( &context->download_info->shared_cs );
 
 					EnterCriticalSection( &session_totals_cs );
 					g_session_total_downloaded += io_size;
 					LeaveCriticalSection( &session_totals_cs );
 
-					context->header_info.range_info->file_write_offset += io_size;	// The size of the non-encoded/decoded data that we're writing to the file.
-
 					// Make sure we've written everything before we do anything else.
 					if ( io_size < context->write_wsabuf.len )
 					{
@@ -2729,12 +5343,18 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						context->write_wsabuf.buf += io_size;
 						context->write_wsabuf.len -= io_size;
 
-						BOOL bRet = WriteFile( context->download_info->hFile, context->write_wsabuf.buf, context->write_wsabuf.len, NULL, ( WSAOVERLAPPED * )overlapped );
+						// Continue from where the write left off.
+						LARGE_INTEGER li;
+						li.QuadPart = context->header_info.range_info->file_write_offset;
+						overlapped->overlapped.Offset = li.LowPart;
+						overlapped->overlapped.OffsetHigh = li.HighPart;
+
+						BOOL bRet = WriteFileCached( context, overlapped );
 						if ( bRet == FALSE && ( GetLastError() != ERROR_IO_PENDING ) )
 						{
 							*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 
 						LeaveCriticalSection( &context->download_info->shared_cs );
@@ -2754,7 +5374,11 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						context->header_info.range_info->content_offset += context->content_offset;	// The true amount that was downloaded. Allows us to resume if we stop the download.
 						context->content_offset = 0;
 
-						if ( context->header_info.chunked_transfer )
+						if ( content_status == CONTENT_STATUS_DECOMPRESS_MORE )
+						{
+							// Don't close the connection until the rest of the decompressed data has been written.
+						}
+						else if ( context->header_info.chunked_transfer )
 						{
 							if ( ( context->parts == 1 && context->header_info.connection == CONNECTION_KEEP_ALIVE && context->header_info.got_chunk_terminator ) ||
 								 ( context->parts > 1 && ( context->header_info.range_info->content_offset >= ( ( context->header_info.range_info->range_end - context->header_info.range_info->range_start ) + 1 ) ) ) )
@@ -2763,7 +5387,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 								*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( 0, context, overlapped );
 
 								content_status = CONTENT_STATUS_NONE;
 							}
@@ -2771,18 +5395,22 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						else
 						{
 							// We need to force the keep-alive connections closed since the server will just keep it open after we've gotten all the data.
+							// Ranged parts must also be closed since StealRange() can shorten their range while they're downloading.
 							if ( ( ( ( context->request_info.protocol == PROTOCOL_FTP ||
 									   context->request_info.protocol == PROTOCOL_FTPS ||
 									   context->request_info.protocol == PROTOCOL_FTPES ) && context->parts > 1 ) ||
 								   context->header_info.connection == CONNECTION_KEEP_ALIVE ) &&
 								 ( context->header_info.range_info->content_length == 0 ||
-								 ( context->header_info.range_info->content_offset >= ( ( context->header_info.range_info->range_end - context->header_info.range_info->range_start ) + 1 ) ) ) )
+								 ( context->header_info.range_info->content_offset >= ( ( context->header_info.range_info->range_end - context->header_info.range_info->range_start ) + 1 ) ) ) ||
+								 ( context->parts > 1 &&
+								   context->header_info.range_info->content_offset >= ( ( context->header_info.range_info->range_end - context->header_info.range_info->range_start ) + 1 ) ) )
 							{
 								InterlockedIncrement( &context->pending_operations );
 
-								*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
+								// Don't shutdown the SSL/TLS connection if CleanupConnection() is going to park it in the connection pool.
+								*current_operation = ( use_ssl && !IsConnectionReusable( context ) ? IO_Shutdown : IO_Close );
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+								PostCompletion( 0, context, overlapped );
 
 								content_status = CONTENT_STATUS_NONE;
 							}
@@ -2796,7 +5424,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 							*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 						else if ( content_status == CONTENT_STATUS_HANDLE_RESPONSE )
 						{
@@ -2804,10 +5432,18 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 							{
 								InterlockedIncrement( &context->pending_operations );
 
-								*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
+								*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
+
+								PostCompletion( 0, context, overlapped );
+							}
+						}
+						else if ( content_status == CONTENT_STATUS_DECOMPRESS_MORE )	// Continue with the data we've already received.
+						{
+							InterlockedIncrement( &context->pending_operations );
+
+							*current_operation = IO_ResumeGetContent;
 
-								PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
-							}
+							PostCompletion( context->current_bytes_read, context, overlapped );
 						}
 						else if ( content_status == CONTENT_STATUS_READ_MORE_CONTENT || content_status == CONTENT_STATUS_READ_MORE_HEADER ) // Read more header information, or continue to read more content. Do not reset context->wsabuf since it may have been offset to handle partial data.
 						{
@@ -2821,7 +5457,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 								{
 									// We need to post a non-zero status to avoid our code shutting down the connection.
 									// We'll use context->current_bytes_read for that, but it can be anything that's not zero.
-									PostQueuedCompletionStatus( hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+									PostCompletion( context->current_bytes_read, context, overlapped );
 								}
 								else
 								{
@@ -2830,18 +5466,23 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 									{
 										*current_operation = IO_Shutdown;
 
-										PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+										PostCompletion( 0, context, overlapped );
 									}
 								}
 							}
 							else
 							{
+								if ( content_status == CONTENT_STATUS_READ_MORE_CONTENT )
+								{
+									ResizeReceiveBuffer( context );
+								}
+
 								nRet = _WSARecv( context->socket, &context->wsabuf, 1, NULL, &dwFlags, ( WSAOVERLAPPED * )overlapped, NULL );
 								if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
 								{
 									*current_operation = IO_Close;
 
-									PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+									PostCompletion( 0, context, overlapped );
 								}
 							}
 						}
@@ -2857,7 +5498,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -2889,7 +5530,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						{
 							*current_operation = IO_Close;
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 					}
 					else	// All the data that we wanted to send has been sent. Post our next operation.
@@ -2899,12 +5540,30 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						context->wsabuf.buf = context->buffer;
 						context->wsabuf.len = context->buffer_size;
 
-						if ( *current_operation == IO_ServerHandshakeResponse ||
-							 *current_operation == IO_ClientHandshakeResponse ||
-							 *current_operation == IO_Shutdown ||
-							 *current_operation == IO_Close )
+						// Handle any pipelined requests before we read from the socket again.
+						if ( *current_operation == IO_GetRequest && context->pipeline_length > 0 )
+						{
+							DWORD pipeline_length = context->pipeline_length;
+							context->pipeline_length = 0;
+
+							_memcpy_s( context->buffer, context->buffer_size, context->pipeline_buffer, pipeline_length );
+
+							*current_operation = IO_ResumeGetRequest;
+
+							PostCompletion( pipeline_length, context, overlapped );
+						}
+						else if ( *current_operation == IO_GetRequest && use_ssl && context->ssl->continue_decrypt )
 						{
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							// The remaining records need to be decrypted. We need to post a non-zero status to avoid our code shutting down the connection.
+							PostCompletion( context->ssl->cbIoBuffer, context, overlapped );
+						}
+						else if ( *current_operation == IO_ServerHandshakeResponse ||
+								  *current_operation == IO_ClientHandshakeResponse ||
+								  *current_operation == IO_APIResponse ||
+								  *current_operation == IO_Shutdown ||
+								  *current_operation == IO_Close )
+						{
+							PostCompletion( 0, context, overlapped );
 						}
 						else	// Read more data.
 						{
@@ -2917,7 +5576,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 								{
 									*current_operation = IO_Shutdown;
 
-									PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+									PostCompletion( 0, context, overlapped );
 								}
 							}
 							else
@@ -2927,10 +5586,88 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 								{
 									*current_operation = IO_Close;
 
-									PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+									PostCompletion( 0, context, overlapped );
+								}
+							}
+						}
+					}
+				}
+				else if ( context->cleanup == 2 )	// If we've forced the cleanup, then allow it to continue its steps.
+				{
+					context->cleanup = 1;	// Auto cleanup.
+				}
+				else	// We've already shutdown and/or closed the connection.
+				{
+					InterlockedIncrement( &context->pending_operations );
+
+					*current_operation = IO_Close;
+
+					PostCompletion( 0, context, overlapped );
+				}
+
+				LeaveCriticalSection( &context->context_cs );
+			}
+			break;
+
+			case IO_APIResponse:	// Send the next chunk of a server API response, check a parked event stream for changes, or continue a URL submission.
+			{
+				EnterCriticalSection( &context->context_cs );
+
+				if ( context->cleanup == 0 )
+				{
+					char content_status = CONTENT_STATUS_HANDLE_REQUEST;
+
+					// A URL submission stopped receiving until one of its batches was added.
+					if ( context->api_info != NULL && context->api_info->request == API_REQUEST_ADD_URLS && !context->api_info->sent_header )
+					{
+						content_status = ResumeAPIIngest( context );
+					}
+
+					if ( content_status == CONTENT_STATUS_HANDLE_REQUEST )
+					{
+						if ( MakeResponse( context ) == CONTENT_STATUS_FAILED )
+						{
+							InterlockedIncrement( &context->pending_operations );
+
+							*current_operation = ( use_ssl ? IO_Shutdown : IO_Close );
+
+							PostCompletion( 0, context, overlapped );
+						}
+					}
+					else if ( content_status == CONTENT_STATUS_READ_MORE_CONTENT )
+					{
+						InterlockedIncrement( &context->pending_operations );
+
+						*current_operation = IO_GetRequest;
+
+						if ( use_ssl )
+						{
+							if ( context->ssl->continue_decrypt )
+							{
+								// We need to post a non-zero status to avoid our code shutting down the connection.
+								PostCompletion( context->current_bytes_read, context, overlapped );
+							}
+							else
+							{
+								SSL_WSARecv( context, overlapped, sent );
+								if ( !sent )
+								{
+									*current_operation = IO_Shutdown;
+
+									PostCompletion( 0, context, overlapped );
 								}
 							}
 						}
+						else
+						{
+							nRet = _WSARecv( context->socket, &context->wsabuf, 1, NULL, &dwFlags, ( WSAOVERLAPPED * )overlapped, NULL );
+							if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
+							{
+								*current_operation = IO_Close;
+
+								PostCompletion( 0, context, overlapped );
+							}
+						}
 					}
 				}
 				else if ( context->cleanup == 2 )	// If we've forced the cleanup, then allow it to continue its steps.
@@ -2943,7 +5680,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -2970,7 +5707,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						{
 							*current_operation = IO_Close;
 
-							PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+							PostCompletion( 0, context, overlapped );
 						}
 					}
 				}
@@ -2984,7 +5721,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -3001,6 +5738,8 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 				{
 					context->cleanup += 10;	// Allow IO_Write to continue to process.
 
+					context->header_info.connection = CONNECTION_CLOSE;	// Keeps CleanupConnection() from adding the connection to the connection pool.
+
 					*next_operation = IO_Close;
 
 					InterlockedIncrement( &context->pending_operations );
@@ -3032,7 +5771,7 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 					*current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 				}*/
 
 				LeaveCriticalSection( &context->context_cs );
@@ -3049,6 +5788,9 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 
 				EnterCriticalSection( &context->context_cs );
 
+				// Anything left in the write cache needs to be written before we can clean up.
+				FlushWriteCache( context );
+
 				if ( context->pending_operations > 0 )
 				{
 					cleanup = false;
@@ -3062,6 +5804,8 @@ DWORD WINAPI IOCPConnection( LPVOID WorkThreadContext )
 						_shutdown( s, SD_BOTH );
 						_closesocket( s );	// Saves us from having to post if there's already a pending IO operation. Should force the operation to complete.
 					}
+
+					CancelConnectAttempts( context );
 				}
 
 				LeaveCriticalSection( &context->context_cs );
@@ -3098,6 +5842,13 @@ SOCKET_CONTEXT *CreateSocketContext()
 			context->overlapped.context = context;
 			context->overlapped_close.context = context;
 			context->overlapped_keep_alive.context = context;
+			context->overlapped_connect_delay.context = context;
+
+			for ( unsigned char i = 0; i < CONNECT_ATTEMPT_LIMIT; ++i )
+			{
+				context->connect_attempts[ i ].overlapped.context = context;
+				context->connect_attempts[ i ].socket = INVALID_SOCKET;
+			}
 
 			InitializeCriticalSection( &context->context_cs );
 		}
@@ -3128,14 +5879,26 @@ bool CreateConnection( SOCKET_CONTEXT *context, char *host, unsigned short port
 	wchar_t wcs_ip[ 16 ];
 	wchar_t wport[ 6 ];
 
+	context->range_split = false;
+	context->pooled_connection = false;
+
+	// Reuse an idle keep-alive connection to the same host if one is available. IO_Connect will skip straight to sending the request.
+	if ( context->download_info != NULL && TakePooledConnection( context ) )
+	{
+		context->pooled_connection = true;
+
+		InterlockedIncrement( &context->pending_operations );
+
+		context->overlapped.current_operation = IO_Connect;
+
+		PostCompletion( 0, context, &context->overlapped );
+
+		return true;
+	}
+
 	if ( context->address_info == NULL )
 	{
 		// Resolve the remote host.
-		_memzero( &hints, sizeof( addrinfoW ) );
-		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_IP;
-
 		if ( cfg_enable_proxy && context->request_info.protocol == PROTOCOL_HTTP )
 		{
 			__snwprintf( wport, 6, L"%hu", cfg_port );
@@ -3213,21 +5976,18 @@ bool CreateConnection( SOCKET_CONTEXT *context, char *host, unsigned short port
 			t_whost = whost;
 		}
 
-		nRet = _GetAddrInfoW( whost, wport, &hints, &context->address_info );
-		if ( nRet == WSAHOST_NOT_FOUND )
-		{
-			use_ipv6 = true;
-
-			hints.ai_family = AF_INET6;	// Try IPv6
-			nRet = _GetAddrInfoW( whost, wport, &hints, &context->address_info );
-		}
+		char dns_status = ResolveHost( context, whost, wport );
 
 		GlobalFree( t_whost );
 
-		if ( nRet != 0 )
+		if ( dns_status == DNS_STATUS_FAILED )
 		{
 			return false;
 		}
+		else if ( dns_status == DNS_STATUS_PENDING )	// IO_ResolveAddress will call us again once the lookup has completed.
+		{
+			return true;
+		}
 	}
 
 	if ( cfg_enable_proxy_socks &&
@@ -3256,42 +6016,28 @@ bool CreateConnection( SOCKET_CONTEXT *context, char *host, unsigned short port
 		GlobalFree( whost );
 	}
 
-	SOCKET socket = CreateSocket( use_ipv6 );
-	if ( socket == INVALID_SOCKET )
+	// Race the host's addresses against each other. HandleConnectAttempt will post IO_Connect for the one that wins.
+	if ( context->address_info->ai_next != NULL )
 	{
-		return false;
+		return StartConnectAttempts( context );
 	}
 
-	context->socket = socket;
+	use_ipv6 = ( context->address_info->ai_family == AF_INET6 ? true : false );
 
-	g_hIOCP = CreateIoCompletionPort( ( HANDLE )socket, g_hIOCP, 0/*( ULONG_PTR )context*/, 0 );
-	if ( g_hIOCP == NULL )
+	SOCKET socket = CreateSocket( use_ipv6 );
+	if ( socket == INVALID_SOCKET )
 	{
 		return false;
 	}
 
-	// Socket must be bound before we can use it with ConnectEx.
-	struct sockaddr_in ipv4_addr;
-	struct sockaddr_in6 ipv6_addr;
+	context->socket = socket;
 
-	if ( use_ipv6 )
-	{
-		_memzero( &ipv6_addr, sizeof( ipv6_addr ) );
-		ipv6_addr.sin6_family = AF_INET6;
-		//ipv6_addr.sin6_addr = in6addr_any;	// This assignment requires the CRT, but it's all zeros anyway and it gets set by _memzero().
-		//ipv6_addr.sin6_port = 0;
-		nRet = _bind( socket, ( SOCKADDR * )&ipv6_addr, sizeof( ipv6_addr ) );
-	}
-	else
+	if ( !AssociateCompletionQueue( ( HANDLE )socket, NULL/*context*/ ) )
 	{
-		_memzero( &ipv4_addr, sizeof( ipv4_addr ) );
-		ipv4_addr.sin_family = AF_INET;
-		//ipv4_addr.sin_addr.s_addr = INADDR_ANY;
-		//ipv4_addr.sin_port = 0;
-		nRet = _bind( socket, ( SOCKADDR * )&ipv4_addr, sizeof( ipv4_addr ) );
+		return false;
 	}
 
-	if ( nRet == SOCKET_ERROR )
+	if ( BindSocket( socket, use_ipv6 ) == SOCKET_ERROR )
 	{
 		return false;
 	}
@@ -3476,6 +6222,11 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 		return;
 	}
 
+	load_deferred_history_entry( di );
+
+	// The filename of a completed download may be packed. It can be rewritten once the download starts.
+	PromoteDownload( di );
+
 	unsigned char add_state = 0;
 
 	PROTOCOL protocol = PROTOCOL_UNKNOWN;
@@ -3500,14 +6251,14 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 			int filename_length = GetTemporaryFilePath( di, file_path );
 
 			filename_offset = g_temp_download_directory_length + 1;
-			file_extension_offset = filename_offset + get_file_extension_offset( di->file_path + di->filename_offset, filename_length );
+			file_extension_offset = filename_offset + get_file_extension_offset( di->filename, filename_length );
 		}
 		else
 		{
 			GetDownloadFilePath( di, file_path );
 
 			filename_offset = di->filename_offset;
-			file_extension_offset = di->file_extension_offset;
+			file_extension_offset = di->filename_offset + di->file_extension_offset;
 		}
 
 		// See if the file exits.
@@ -3529,7 +6280,7 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 				{
 					__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___already_exists, file_path );
 
-					g_rename_file_cmb_ret = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_RENAMEOVERWRITESKIPALL );
+					g_rename_file_cmb_ret = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_RENAMEOVERWRITESKIPALL );
 				}
 
 				// Rename the file and try again.
@@ -3551,7 +6302,7 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 						{
 							__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___could_not_be_renamed, file_path );
 
-							g_rename_file_cmb_ret2 = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_OKALL );
+							g_rename_file_cmb_ret2 = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_OKALL );
 						}
 
 						di->status = STATUS_SKIPPED;
@@ -3575,6 +6326,8 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 
 		if ( skip_start )
 		{
+			MarkDownloadChanged( di );
+
 			return;
 		}
 	}
@@ -3755,7 +6508,7 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 				char *utf8_cfg_val = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * cfg_val_length ); // Size includes the null character.
 				WideCharToMultiByte( CP_UTF8, 0, host, host_length + 1, utf8_cfg_val, cfg_val_length, NULL, NULL );
 
-				context->request_info.host = utf8_cfg_val;
+				context->request_info.host = InternString( utf8_cfg_val, true );	// Every part of the download connects to the same host.
 
 				cfg_val_length = WideCharToMultiByte( CP_UTF8, 0, resource, resource_length + 1, NULL, 0, NULL, NULL );
 				utf8_cfg_val = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * cfg_val_length ); // Size includes the null character.
@@ -3807,6 +6560,8 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 				// Add to the global download list.
 				DLL_AddNode( &g_context_list, &context->context_node, 0 );
 
+				AddContextTimer( context );
+
 				LeaveCriticalSection( &context_list_cs );
 
 				EnterCriticalSection( &di->shared_cs );
@@ -3843,6 +6598,8 @@ void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exists )
 
 	LeaveCriticalSection( &cleanup_cs );
 
+	MarkDownloadChanged( di );
+
 	GlobalFree( host );
 	GlobalFree( resource );
 }
@@ -3863,7 +6620,7 @@ dllrbt_tree *CreateFilenameTree()
 		di = ( DOWNLOAD_INFO * )tmp_node->data;
 		if ( di != NULL )
 		{
-			filename = GlobalStrDupW( di->file_path + di->filename_offset );
+			filename = GlobalStrDupW( di->filename );
 
 			if ( dllrbt_insert( filename_tree, ( void * )filename, ( void * )filename ) != DLLRBT_STATUS_OK )
 			{
@@ -3884,7 +6641,7 @@ dllrbt_tree *CreateFilenameTree()
 		di = ( DOWNLOAD_INFO * )tmp_node->data;
 		if ( di != NULL )
 		{
-			filename = GlobalStrDupW( di->file_path + di->filename_offset );
+			filename = GlobalStrDupW( di->filename );
 
 			if ( dllrbt_insert( filename_tree, ( void * )filename, ( void * )filename ) != DLLRBT_STATUS_OK )
 			{
@@ -3958,11 +6715,11 @@ bool RenameFile( DOWNLOAD_INFO *di, dllrbt_tree *filename_tree, wchar_t *file_pa
 	while ( GetFileAttributes( new_file_path ) != INVALID_FILE_ATTRIBUTES );
 
 	// Set the new filename.
-	_wmemcpy_s( di->file_path + di->filename_offset, MAX_PATH - di->filename_offset, new_file_path + filename_offset, MAX_PATH - di->filename_offset );
-	di->file_path[ MAX_PATH - 1 ] = 0;	// Sanity.
+	_wmemcpy_s( di->filename, MAX_PATH - di->filename_offset, new_file_path + filename_offset, MAX_PATH - di->filename_offset );
+	di->filename[ MAX_PATH - di->filename_offset - 1 ] = 0;	// Sanity.
 
 	// Get the new file extension offset.
-	di->file_extension_offset = di->filename_offset + get_file_extension_offset( di->file_path + di->filename_offset, lstrlenW( di->file_path + di->filename_offset ) );
+	di->file_extension_offset = get_file_extension_offset( di->filename, lstrlenW( di->filename ) );
 
 	return true;
 }
@@ -3975,7 +6732,7 @@ ICON_INFO *CacheIcon( DOWNLOAD_INFO *di, SHFILEINFO *sfi )
 	{
 		// Cache our file's icon.
 		EnterCriticalSection( &icon_cache_cs );
-		ii = ( ICON_INFO * )dllrbt_find( g_icon_handles, ( void * )( di->file_path + di->file_extension_offset ), true );
+		ii = ( ICON_INFO * )dllrbt_find( g_icon_handles, ( void * )( di->filename + di->file_extension_offset ), true );
 		if ( ii == NULL )
 		{
 			bool destroy = true;
@@ -3992,7 +6749,7 @@ ICON_INFO *CacheIcon( DOWNLOAD_INFO *di, SHFILEINFO *sfi )
 			}
 
 			// Use an unknown file type icon for extensionless files.
-			_SHGetFileInfoW( ( di->file_path[ di->file_extension_offset ] != 0 ? di->file_path + di->file_extension_offset : L" " ), FILE_ATTRIBUTE_NORMAL, sfi, sizeof( SHFILEINFO ), SHGFI_USEFILEATTRIBUTES | SHGFI_ICON | SHGFI_SMALLICON );
+			_SHGetFileInfoW( ( di->filename[ di->file_extension_offset ] != 0 ? di->filename + di->file_extension_offset : L" " ), FILE_ATTRIBUTE_NORMAL, sfi, sizeof( SHFILEINFO ), SHGFI_USEFILEATTRIBUTES | SHGFI_ICON | SHGFI_SMALLICON );
 
 			if ( destroy )
 			{
@@ -4001,7 +6758,7 @@ ICON_INFO *CacheIcon( DOWNLOAD_INFO *di, SHFILEINFO *sfi )
 
 			ii = ( ICON_INFO * )GlobalAlloc( GMEM_FIXED, sizeof( DOWNLOAD_INFO ) );
 
-			ii->file_extension = GlobalStrDupW( di->file_path + di->file_extension_offset );
+			ii->file_extension = GlobalStrDupW( di->filename + di->file_extension_offset );
 			ii->icon = sfi->hIcon;
 
 			ii->count = 1;
@@ -4024,6 +6781,41 @@ ICON_INFO *CacheIcon( DOWNLOAD_INFO *di, SHFILEINFO *sfi )
 	return ii;
 }
 
+// Formats the time that the download was added.
+// Entries loaded from the download history don't format it until it's first displayed.
+wchar_t *GetDownloadAddTime( DOWNLOAD_INFO *di )
+{
+	if ( di->w_add_time == NULL )
+	{
+		SYSTEMTIME st;
+		FILETIME ft;
+		ft.dwHighDateTime = di->add_time.HighPart;
+		ft.dwLowDateTime = di->add_time.LowPart;
+		FileTimeToSystemTime( &ft, &st );
+
+		int buffer_length = 0;
+
+		#ifndef NTDLL_USE_STATIC_LIB
+			//buffer_length = 64;	// Should be enough to hold most translated values.
+			buffer_length = __snwprintf( NULL, 0, L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) ) + 1;	// Include the NULL character.
+		#else
+			buffer_length = _scwprintf( L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) ) + 1;	// Include the NULL character.
+		#endif
+
+		wchar_t *w_add_time = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * buffer_length );
+
+		__snwprintf( w_add_time, buffer_length, L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) );
+
+		// Another thread may have formatted it first.
+		if ( InterlockedCompareExchangePointer( ( volatile PVOID * )&di->w_add_time, w_add_time, NULL ) != NULL )
+		{
+			GlobalFree( w_add_time );
+		}
+	}
+
+	return di->w_add_time;
+}
+
 DWORD WINAPI AddURL( void *add_info )
 {
 	if ( add_info == NULL )
@@ -4261,12 +7053,13 @@ DWORD WINAPI AddURL( void *add_info )
 			   host != NULL && resource != NULL && port != 0 )
 		{
 			DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )GlobalAlloc( GPTR, sizeof( DOWNLOAD_INFO ) );
+			di->filename = ( wchar_t * )GlobalAlloc( GPTR, sizeof( wchar_t ) * MAX_PATH );
 
 			if ( !( ai->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
 			{
+				// Every URL that's added at the same time shares the directory.
+				di->download_directory = InternString( ai->download_directory );
 				di->filename_offset = lstrlenW( ai->download_directory );
-				_wmemcpy_s( di->file_path, MAX_PATH, ai->download_directory, di->filename_offset );
-				di->file_path[ di->filename_offset ] = 0;	// Sanity.
 
 				++di->filename_offset;	// Include the NULL terminator.
 			}
@@ -4346,20 +7139,20 @@ DWORD WINAPI AddURL( void *add_info )
 
 				w_filename_length = min( w_filename_length, ( int )( MAX_PATH - di->filename_offset - 1 ) );
 
-				_wmemcpy_s( di->file_path + di->filename_offset, MAX_PATH - di->filename_offset, current_directory, w_filename_length );
-				di->file_path[ di->filename_offset + w_filename_length ] = 0;	// Sanity.
+				_wmemcpy_s( di->filename, MAX_PATH - di->filename_offset, current_directory, w_filename_length );
+				di->filename[ w_filename_length ] = 0;	// Sanity.
 
-				EscapeFilename( di->file_path + di->filename_offset );
+				EscapeFilename( di->filename );
 
 				GlobalFree( directory );
 			}
 			else	// Shouldn't happen.
 			{
 				w_filename_length = 11;
-				_wmemcpy_s( di->file_path + di->filename_offset, MAX_PATH - di->filename_offset, L"NO_FILENAME\0", 12 );
+				_wmemcpy_s( di->filename, MAX_PATH - di->filename_offset, L"NO_FILENAME\0", 12 );
 			}
 
-			di->file_extension_offset = di->filename_offset + get_file_extension_offset( di->file_path + di->filename_offset, w_filename_length );
+			di->file_extension_offset = get_file_extension_offset( di->filename, w_filename_length );
 
 			di->hFile = INVALID_HANDLE_VALUE;
 
@@ -4448,23 +7241,17 @@ DWORD WINAPI AddURL( void *add_info )
 
 			if ( ai->utf8_cookies != NULL && cookies_length > 0 )
 			{
-				di->cookies = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( cookies_length + 1 ) );
-				_memcpy_s( di->cookies, cookies_length + 1, ai->utf8_cookies, cookies_length );
-				di->cookies[ cookies_length ] = 0;	// Sanity.
+				di->cookies = InternString( ai->utf8_cookies );
 			}
 
 			if ( ai->utf8_headers != NULL && headers_length > 0 )
 			{
-				di->headers = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( headers_length + 1 ) );
-				_memcpy_s( di->headers, headers_length + 1, ai->utf8_headers, headers_length );
-				di->headers[ headers_length ] = 0;	// Sanity.
+				di->headers = InternString( ai->utf8_headers );
 			}
 
 			if ( ai->utf8_data != NULL && data_length > 0 )
 			{
-				di->data = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( data_length + 1 ) );
-				_memcpy_s( di->data, data_length + 1, ai->utf8_data, data_length );
-				di->data[ data_length ] = 0;	// Sanity.
+				di->data = InternString( ai->utf8_data );
 			}
 
 			SYSTEMTIME st;
@@ -4476,28 +7263,13 @@ DWORD WINAPI AddURL( void *add_info )
 			di->add_time.LowPart = ft.dwLowDateTime;
 			di->add_time.HighPart = ft.dwHighDateTime;
 
-			int buffer_length = 0;
-
-			#ifndef NTDLL_USE_STATIC_LIB
-				//buffer_length = 64;	// Should be enough to hold most translated values.
-				buffer_length = __snwprintf( NULL, 0, L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) ) + 1;	// Include the NULL character.
-			#else
-				buffer_length = _scwprintf( L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) ) + 1;	// Include the NULL character.
-			#endif
-
-			di->w_add_time = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * buffer_length );
-
-			__snwprintf( di->w_add_time, buffer_length, L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) );
+			GetDownloadAddTime( di );
 
 			EnterCriticalSection( &cleanup_cs );
 
-			LVITEM lvi;
-			_memzero( &lvi, sizeof( LVITEM ) );
-			lvi.mask = LVIF_PARAM | LVIF_TEXT;
-			lvi.iItem = ( int )_SendMessageW( g_hWnd_files, LVM_GETITEMCOUNT, 0, 0 );
-			lvi.lParam = ( LPARAM )di;
-			lvi.pszText = di->file_path + di->filename_offset;
-			_SendMessageW( g_hWnd_files, LVM_INSERTITEM, 0, ( LPARAM )&lvi );
+			AddDownload( di );
+
+			g_download_observer->AddItem( di );
 
 			if ( !( ai->download_operations & DOWNLOAD_OPERATION_ADD_STOPPED ) )
 			{
@@ -4535,19 +7307,15 @@ DWORD WINAPI AddURL( void *add_info )
 	GlobalFree( ai->utf8_cookies );
 	GlobalFree( ai->auth_info.username );
 	GlobalFree( ai->auth_info.password );
+	bool api_batch = ai->api_batch;
+
 	GlobalFree( ai->download_directory );
 	GlobalFree( ai->urls );
 	GlobalFree( ai );
 
-	if ( cfg_sort_added_and_updating_items &&
-		 cfg_sorted_column_index != COLUMN_NUM )	// #
+	if ( cfg_sort_added_and_updating_items )
 	{
-		SORT_INFO si;
-		si.column = GetColumnIndexFromVirtualIndex( cfg_sorted_column_index, download_columns, NUM_COLUMNS );
-		si.hWnd = g_hWnd_files;
-		si.direction = cfg_sorted_direction;
-
-		_SendMessageW( g_hWnd_files, LVM_SORTITEMS, ( WPARAM )&si, ( LPARAM )( PFNLVCOMPARE )DMCompareFunc );
+		g_download_observer->SortItems();
 	}
 
 	ProcessingList( false );
@@ -4562,6 +7330,12 @@ DWORD WINAPI AddURL( void *add_info )
 
 	LeaveCriticalSection( &worker_cs );
 
+	// Let the server API hand off its next batch.
+	if ( api_batch )
+	{
+		ReleaseAPIURLBatch();
+	}
+
 	_ExitThread( 0 );
 	return 0;
 }
@@ -4630,7 +7404,7 @@ bool RetryTimedOut( SOCKET_CONTEXT *context )
 		context->address_info = context->address_info->ai_next;
 		old_address_info->ai_next = NULL;
 
-		_FreeAddrInfoW( old_address_info );
+		FreeAddressInfo( old_address_info );
 
 		// If we're going to restart the download, then we need to reset these values.
 		context->header_info.chunk_length = 0;
@@ -4640,7 +7414,7 @@ bool RetryTimedOut( SOCKET_CONTEXT *context )
 		context->header_info.content_encoding = CONTENT_ENCODING_NONE;
 		context->header_info.chunked_transfer = false;
 		//context->header_info.etag = false;
-		context->header_info.got_chunk_start = false;
+		context->header_info.chunk_state = CHUNK_STATE_SIZE_START;
 		context->header_info.got_chunk_terminator = false;
 
 		if ( context->header_info.range_info != NULL )
@@ -4711,6 +7485,7 @@ THREAD_RETURN ProcessMoveQueue( void *pArguments )
 
 	wchar_t prompt_message[ MAX_PATH + 512 ];
 	wchar_t file_path[ MAX_PATH ];
+	wchar_t download_file_path[ MAX_PATH ];
 
 	do
 	{
@@ -4733,15 +7508,15 @@ THREAD_RETURN ProcessMoveQueue( void *pArguments )
 
 			GetTemporaryFilePath( di, file_path );
 
-			di->file_path[ di->filename_offset - 1 ] = L'\\';	// Replace the download directory NULL terminator with a directory slash.
-
 			di->status &= ~STATUS_QUEUED;
 
 			DWORD move_type = MOVEFILE_COPY_ALLOWED;
 
 			while ( true )
 			{
-				if ( MoveFileWithProgressW( file_path, di->file_path, MoveFileProgress, di, move_type ) == FALSE )
+				GetDownloadFilePath( di, download_file_path );	// The file may have been renamed.
+
+				if ( MoveFileWithProgressW( file_path, download_file_path, MoveFileProgress, di, move_type ) == FALSE )
 				{
 					if ( GetLastError() == ERROR_FILE_EXISTS )
 					{
@@ -4757,9 +7532,9 @@ THREAD_RETURN ProcessMoveQueue( void *pArguments )
 								 g_rename_file_cmb_ret != CMBIDOVERWRITEALL &&
 								 g_rename_file_cmb_ret != CMBIDSKIPALL )
 							{
-								__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___already_exists, di->file_path );
+								__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___already_exists, download_file_path );
 
-								g_rename_file_cmb_ret = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_RENAMEOVERWRITESKIPALL );
+								g_rename_file_cmb_ret = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_RENAMEOVERWRITESKIPALL );
 							}
 
 							// Rename the file and try again.
@@ -4770,7 +7545,7 @@ THREAD_RETURN ProcessMoveQueue( void *pArguments )
 								// Creates a tree of active and queued downloads.
 								dllrbt_tree *add_files_tree = CreateFilenameTree();
 
-								bool rename_succeeded = RenameFile( di, add_files_tree, di->file_path, di->filename_offset, di->file_extension_offset );
+								bool rename_succeeded = RenameFile( di, add_files_tree, download_file_path, di->filename_offset, di->filename_offset + di->file_extension_offset );
 
 								// The tree is only used to determine duplicate filenames.
 								DestroyFilenameTree( add_files_tree );
@@ -4781,7 +7556,7 @@ THREAD_RETURN ProcessMoveQueue( void *pArguments )
 									{
 										__snwprintf( prompt_message, MAX_PATH + 512, ST_V_PROMPT___could_not_be_renamed, file_path );
 
-										g_rename_file_cmb_ret2 = CMessageBoxW( g_hWnd_main, prompt_message, PROGRAM_CAPTION, CMB_ICONWARNING | CMB_OKALL );
+										g_rename_file_cmb_ret2 = g_download_observer->Prompt( prompt_message, CMB_ICONWARNING | CMB_OKALL );
 									}
 
 									di->status = STATUS_SKIPPED;
@@ -4823,7 +7598,7 @@ THREAD_RETURN ProcessMoveQueue( void *pArguments )
 				break;
 			}
 
-			di->file_path[ di->filename_offset - 1 ] = 0;	// Restore.
+			MarkDownloadChanged( di );
 		}
 
 		EnterCriticalSection( &move_file_queue_cs );
@@ -4879,6 +7654,8 @@ void AddToMoveFileQueue( DOWNLOAD_INFO *di )
 				move_file_process_active = false;
 
 				di->status = STATUS_STOPPED;
+
+				MarkDownloadChanged( di );
 			}
 			else
 			{
@@ -4890,6 +7667,123 @@ void AddToMoveFileQueue( DOWNLOAD_INFO *di )
 	}
 }
 
+// Split the largest remaining range that another part is downloading and return a new range node for its upper half.
+// The download_info's shared_cs must be held by the caller.
+DoublyLinkedList *StealRange( SOCKET_CONTEXT *context )
+{
+	DOWNLOAD_INFO *di = context->download_info;
+
+	if ( context->parts <= 1 ||
+	   ( context->request_info.protocol != PROTOCOL_HTTP &&
+		 context->request_info.protocol != PROTOCOL_HTTPS ) )
+	{
+		return NULL;
+	}
+
+	// Make sure we can save the new range in the download history.
+	unsigned short range_count = 0;
+	DoublyLinkedList *range_node = di->range_list;
+	while ( range_node != NULL )
+	{
+		++range_count;
+
+		range_node = range_node->next;
+	}
+
+	if ( range_count >= RANGE_LIST_LIMIT )
+	{
+		return NULL;
+	}
+
+	DoublyLinkedList *new_range_node = NULL;
+
+	// Contexts whose lock we can't get are skipped. Another thread may be holding it while it waits for the shared_cs.
+	SOCKET_CONTEXT *victim = NULL;
+	unsigned long long largest_remaining = 0;
+
+	DoublyLinkedList *context_node = di->parts_list;
+	while ( context_node != NULL )
+	{
+		SOCKET_CONTEXT *part_context = ( SOCKET_CONTEXT * )context_node->data;
+
+		if ( part_context != NULL && part_context != context && part_context->header_info.range_info != NULL )
+		{
+			RANGE_INFO *ri = part_context->header_info.range_info;
+
+			unsigned long long range_length = ( ri->range_end - ri->range_start ) + 1;
+			unsigned long long downloaded = ri->content_offset + part_context->content_offset;
+
+			if ( downloaded < range_length && ( range_length - downloaded ) > largest_remaining )
+			{
+				largest_remaining = range_length - downloaded;
+				victim = part_context;
+			}
+		}
+
+		context_node = context_node->next;
+	}
+
+	if ( victim != NULL && largest_remaining >= RANGE_STEAL_MINIMUM &&
+		 TryEnterCriticalSection( &victim->context_cs ) == TRUE )
+	{
+		RANGE_INFO *ri = victim->header_info.range_info;
+
+		// Only split ranges whose data is written to the file as it arrives.
+		if ( victim->cleanup == 0 &&
+			 IS_STATUS( victim->status, STATUS_DOWNLOADING ) &&
+			 victim->header_info.http_status == 206 &&
+			 victim->header_info.content_encoding == CONTENT_ENCODING_NONE &&
+			!victim->header_info.chunked_transfer &&
+			 ri != NULL )
+		{
+			unsigned long long range_length = ( ri->range_end - ri->range_start ) + 1;
+			unsigned long long downloaded = ri->content_offset + victim->content_offset;	// Include any write that's still pending.
+
+			if ( downloaded < range_length && ( range_length - downloaded ) >= RANGE_STEAL_MINIMUM )
+			{
+				range_node = di->range_list;
+				while ( range_node != NULL && range_node->data != ri )
+				{
+					range_node = range_node->next;
+				}
+
+				if ( range_node != NULL )
+				{
+					RANGE_INFO *new_ri = ( RANGE_INFO * )GlobalAlloc( GPTR, sizeof( RANGE_INFO ) );
+
+					new_ri->range_start = ri->range_start + downloaded + ( ( range_length - downloaded ) / 2 );
+					new_ri->range_end = ri->range_end;
+					new_ri->file_write_offset = new_ri->range_start;
+
+					// The victim will stop reading once it reaches its new range end.
+					ri->range_end = new_ri->range_start - 1;
+					victim->range_split = true;
+
+					// Keep the range list ordered by its file offsets.
+					new_range_node = DLL_CreateNode( ( void * )new_ri );
+					new_range_node->prev = range_node;
+					new_range_node->next = range_node->next;
+
+					if ( range_node->next != NULL )
+					{
+						range_node->next->prev = new_range_node;
+					}
+					else	// The new node is the tail.
+					{
+						di->range_list->prev = new_range_node;
+					}
+
+					range_node->next = new_range_node;
+				}
+			}
+		}
+
+		LeaveCriticalSection( &victim->context_cs );
+	}
+
+	return new_range_node;
+}
+
 bool CleanupFTPContexts( SOCKET_CONTEXT *context )
 {
 	bool skip_cleanup = false;
@@ -4933,8 +7827,11 @@ bool CleanupFTPContexts( SOCKET_CONTEXT *context )
 					if ( context->timed_out != TIME_OUT_FALSE )
 					{
 						// Force the Control connection to time out.
-						// Make sure it's larger than 300 and less than LONG_MAX.
-						InterlockedExchange( &context->ftp_context->timeout, SHRT_MAX );
+						EnterCriticalSection( &context_list_cs );
+
+						ExpireContextTimer( context->ftp_context );
+
+						LeaveCriticalSection( &context_list_cs );
 					}
 
 					if ( context->ftp_context->ftp_connection_type & FTP_CONNECTION_TYPE_CONTROL_WAIT )	// Control is waiting.
@@ -4943,7 +7840,7 @@ bool CleanupFTPContexts( SOCKET_CONTEXT *context )
 
 						context->ftp_context->overlapped_close.current_operation = IO_Close;	// No need to shutdown.
 
-						PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context->ftp_context, ( OVERLAPPED * )&context->ftp_context->overlapped_close );
+						PostCompletion( 0, context->ftp_context, &context->ftp_context->overlapped_close );
 					}
 
 					context->ftp_context->ftp_context = NULL;
@@ -5035,6 +7932,8 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 		// Remove from the global download list.
 		DLL_RemoveNode( &g_context_list, &context->context_node );
 
+		RemoveContextTimer( context );
+
 		LeaveCriticalSection( &context_list_cs );
 
 		// Remove from the parts list.
@@ -5042,8 +7941,17 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 		{
 			if ( context->download_info != NULL )
 			{
+				// The response is complete and the server is keeping the connection open. Let another request use it.
+				if ( IsConnectionReusable( context ) )
+				{
+					AddPooledConnection( context );
+				}
+
 				bool incomplete_part = false;
 
+				// A pooled connection that the server closed while it was idle shouldn't count against our retries.
+				bool stale_connection = ( context->pooled_connection && context->header_info.http_status == 0 );
+
 				if ( context->header_info.range_info != NULL &&  
 				   ( context->header_info.range_info->content_offset < ( ( context->header_info.range_info->range_end - context->header_info.range_info->range_start ) + 1 ) ) )
 				{
@@ -5052,12 +7960,15 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 				// Connecting, Downloading, Paused.
 				if ( incomplete_part &&
-					 context->retries < cfg_retry_parts_count &&
+				   ( stale_connection || context->retries < cfg_retry_parts_count ) &&
 				   ( IS_STATUS( context->status,
 						STATUS_CONNECTING |
 						STATUS_DOWNLOADING ) ) )
 				{
-					++context->retries;
+					if ( !stale_connection )
+					{
+						++context->retries;
+					}
 
 					if ( context->socket != INVALID_SOCKET )
 					{
@@ -5076,6 +7987,8 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 					DLL_AddNode( &g_context_list, &context->context_node, 0 );
 
+					AddContextTimer( context );
+
 					LeaveCriticalSection( &context_list_cs );
 
 					// If we're going to restart the download, then we need to reset these values.
@@ -5086,7 +7999,7 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 					context->header_info.content_encoding = CONTENT_ENCODING_NONE;
 					context->header_info.chunked_transfer = false;
 					//context->header_info.etag = false;
-					context->header_info.got_chunk_start = false;
+					context->header_info.chunk_state = CHUNK_STATE_SIZE_START;
 					context->header_info.got_chunk_terminator = false;
 
 					if ( context->header_info.range_info != NULL )
@@ -5119,6 +8032,8 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 						DLL_RemoveNode( &g_context_list, &context->context_node );
 
+						RemoveContextTimer( context );
+
 						LeaveCriticalSection( &context_list_cs );
 					}
 					else
@@ -5146,6 +8061,8 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 					if ( context->download_info->active_parts > 0 )
 					{
+						DoublyLinkedList *range_queue_node = NULL;
+
 						// If incomplete_part is tested below and is true and the new range fails, then the download will stop.
 						// If incomplete_part is not tested, then all queued ranges will be tried until they either all succeed or all fail.
 						if ( /*!incomplete_part &&*/
@@ -5153,16 +8070,25 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 								STATUS_STOPPED |
 								STATUS_REMOVE |
 								STATUS_RESTART |
-								STATUS_UPDATING ) &&
-							 context->download_info->range_queue != NULL &&
-							 context->download_info->range_queue != context->download_info->range_list_end )
+								STATUS_UPDATING ) )
+						{
+							if ( context->download_info->range_queue != NULL &&
+								 context->download_info->range_queue != context->download_info->range_list_end )
+							{
+								range_queue_node = context->download_info->range_queue;
+								context->download_info->range_queue = context->download_info->range_queue->next;
+							}
+							else if ( !incomplete_part )	// Nothing is queued. Help out the part that has the most left to download.
+							{
+								range_queue_node = StealRange( context );
+							}
+						}
+
+						if ( range_queue_node != NULL )
 						{
 							// Add back to the parts list.
 							DLL_AddNode( &context->download_info->parts_list, &context->parts_node, -1 );
 
-							DoublyLinkedList *range_queue_node = context->download_info->range_queue;
-							context->download_info->range_queue = context->download_info->range_queue->next;
-
 							context->retries = 0;
 
 							if ( context->socket != INVALID_SOCKET )
@@ -5182,6 +8108,8 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 							DLL_AddNode( &g_context_list, &context->context_node, 0 );
 
+							AddContextTimer( context );
+
 							LeaveCriticalSection( &context_list_cs );
 
 							// If we're going to restart the download, then we need to reset these values.
@@ -5192,7 +8120,7 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 							context->header_info.content_encoding = CONTENT_ENCODING_NONE;
 							context->header_info.chunked_transfer = false;
 							//context->header_info.etag = false;
-							context->header_info.got_chunk_start = false;
+							context->header_info.chunk_state = CHUNK_STATE_SIZE_START;
 							context->header_info.got_chunk_terminator = false;
 
 							context->header_info.range_info = ( RANGE_INFO * )range_queue_node->data;
@@ -5222,6 +8150,8 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 								DLL_RemoveNode( &g_context_list, &context->context_node );
 
+								RemoveContextTimer( context );
+
 								LeaveCriticalSection( &context_list_cs );
 
 								--context->download_info->active_parts;
@@ -5285,6 +8215,9 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 							else
 							{
 								context->download_info->status = STATUS_COMPLETED;
+
+								// The list may still be drawing the ranges. They're freed once it has stopped.
+								g_download_observer->ReleaseRanges( context->download_info );
 							}
 
 							EnterCriticalSection( &active_download_list_cs );
@@ -5302,12 +8235,21 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 							context->download_info->time_remaining = 0;
 							context->download_info->speed = 0;
 
+							MarkDownloadChanged( context->download_info );
+
+							// Every part has been cleaned up, so the last checkpoint has all of the ranges' progress.
+							CloseRangeCheckpoint( context->download_info, ( context->download_info->status == STATUS_COMPLETED ||
+																			IS_STATUS( context->status, STATUS_REMOVE | STATUS_RESTART ) ) );
+
 							if ( context->download_info->hFile != INVALID_HANDLE_VALUE )
 							{
 								CloseHandle( context->download_info->hFile );
 								context->download_info->hFile = INVALID_HANDLE_VALUE;
 							}
 
+							// Every part has been cleaned up, so nothing is writing from the cache.
+							FreeWriteCache( context->download_info );
+
 							FILETIME ft;
 							GetSystemTimeAsFileTime( &ft );
 							ULARGE_INTEGER current_time;
@@ -5321,7 +8263,7 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 							{
 								// Find the icon info
 								EnterCriticalSection( &icon_cache_cs );
-								dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( context->download_info->file_path + context->download_info->file_extension_offset ), false );
+								dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( context->download_info->filename + context->download_info->file_extension_offset ), false );
 								// Free its values and remove it from the tree if there are no other items using it.
 								if ( itr != NULL )
 								{
@@ -5347,9 +8289,9 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 								GlobalFree( context->download_info->url );
 								GlobalFree( context->download_info->w_add_time );
-								GlobalFree( context->download_info->cookies );
-								GlobalFree( context->download_info->headers );
-								GlobalFree( context->download_info->data );
+								ReleaseString( context->download_info->cookies );
+								ReleaseString( context->download_info->headers );
+								ReleaseString( context->download_info->data );
 								//GlobalFree( context->download_info->etag );
 								GlobalFree( context->download_info->auth_info.username );
 								GlobalFree( context->download_info->auth_info.password );
@@ -5368,28 +8310,24 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 								if ( !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) &&
 									IS_STATUS( context->status, STATUS_DELETE ) )
 								{
-									wchar_t *file_path_delete;
-
 									wchar_t file_path[ MAX_PATH ];
 									if ( cfg_use_temp_download_directory )
 									{
 										GetTemporaryFilePath( context->download_info, file_path );
-
-										file_path_delete = file_path;
 									}
 									else
 									{
-										// We're freeing this anyway so it's safe to modify.
-										context->download_info->file_path[ context->download_info->filename_offset - 1 ] = L'\\';	// Replace the download directory NULL terminator with a directory slash.
-
-										file_path_delete = context->download_info->file_path;
+										GetDownloadFilePath( context->download_info, file_path );
 									}
 
-									DeleteFileW( file_path_delete );
+									DeleteFileW( file_path );
 								}
 
 								DeleteCriticalSection( &context->download_info->shared_cs );
 
+								ReleaseString( context->download_info->download_directory );
+								GlobalFree( context->download_info->filename );
+								GlobalFree( context->download_info->packed_filename );
 								GlobalFree( context->download_info );
 								context->download_info = NULL;
 							}
@@ -5490,6 +8428,13 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 		if ( !retry_context_connection )
 		{
+			// Only at shutdown will there be attempts in progress, or data left in the write cache.
+			CancelConnectAttempts( context );
+
+			if ( context->download_info != NULL ) { FlushWriteCacheAndWait( context ); }
+
+			if ( context->connect_timer != NULL ) { DeleteTimerQueueTimer( NULL, context->connect_timer, INVALID_HANDLE_VALUE ); }
+
 			if ( context->socket != INVALID_SOCKET )
 			{
 				_shutdown( context->socket, SD_BOTH );
@@ -5506,14 +8451,23 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 
 			if ( context->ssl != NULL ) { SSL_free( context->ssl ); }
 
-			if ( context->address_info != NULL ) { _FreeAddrInfoW( context->address_info ); }
+			if ( context->address_info != NULL ) { FreeAddressInfo( context->address_info ); }
 			if ( context->proxy_address_info != NULL ) { _FreeAddrInfoW( context->proxy_address_info ); }
 
 			if ( context->decompressed_buf != NULL ) { GlobalFree( context->decompressed_buf ); }
 			if ( zlib1_state == ZLIB1_STATE_RUNNING ) { _inflateEnd( &context->stream ); }
+			if ( context->brotli_decoder != NULL ) { _BrotliDecoderDestroyInstance( ( BrotliDecoderState * )context->brotli_decoder ); }
+			if ( context->zstd_decoder != NULL ) { _ZSTD_freeDStream( ( ZSTD_DStream * )context->zstd_decoder ); }
 
 			FreePOSTInfo( &context->post_info );
 
+			FreeAPIInfo( &context->api_info );
+
+			if ( context->pipeline_buffer != NULL )
+			{
+				GlobalFree( context->pipeline_buffer );
+			}
+
 			FreeAuthInfo( &context->header_info.digest_info );
 			FreeAuthInfo( &context->header_info.proxy_digest_info );
 
@@ -5544,7 +8498,7 @@ void CleanupConnection( SOCKET_CONTEXT *context )
 				dllrbt_delete_recursively( context->header_info.cookie_tree );
 			}
 
-			if ( context->request_info.host != NULL ) { GlobalFree( context->request_info.host ); }
+			ReleaseString( context->request_info.host );
 			if ( context->request_info.resource != NULL ) { GlobalFree( context->request_info.resource ); }
 
 			if ( context->request_info.auth_info.username != NULL ) { GlobalFree( context->request_info.auth_info.username ); }
@@ -23,14 +23,61 @@
 #include "ssl.h"
 #include "doublylinkedlist.h"
 #include "dllrbt.h"
+#include "completion_queue.h"
 #include "zlib.h"
 
 #include <mswsock.h>
 
 #define BUFFER_SIZE				16384	// Maximum size of an SSL record.
 
+#define DECOMPRESS_BUFFER_SIZE		65536	// The most decompressed data that a context will write at once.
+
+#define RECEIVE_BUFFER_MAX_SIZE		1048576	// The largest that a plain (non-SSL/TLS) connection's receive buffer can grow to.
+#define RECEIVE_BUFFER_GROW_COUNT	4		// The number of consecutive receives that fill the buffer before it's doubled.
+#define RECEIVE_BUFFER_SHRINK_COUNT	32		// The number of consecutive receives that use less than a quarter of the buffer before it's halved.
+
 #define MAX_FILE_SIZE			4294967296	// 4GB
 
+#define TIMER_WHEEL_SLOTS		64	// Must be a power of 2. Each slot represents one second.
+#define FTP_KEEP_ALIVE_INTERVAL	30	// The number of idle seconds before a keep-alive is sent on an FTP Control connection.
+
+#define RATE_LIMIT_INTERVAL		25	// The number of milliseconds to wait before refilling the token buckets of throttled contexts.
+
+#define CONNECTION_POOL_LIMIT			64		// The maximum number of idle connections that we'll keep open.
+#define CONNECTION_POOL_HOST_LIMIT		8		// The maximum number of idle connections that we'll keep open for each host.
+#define CONNECTION_POOL_IDLE_TIMEOUT	15000	// The number of milliseconds an idle connection is kept open.
+
+#define SERVER_KEEP_ALIVE_TIMEOUT		15		// The number of seconds an idle keep-alive connection to our server is kept open.
+
+#define DNS_RESOLVER_THREADS			2		// The number of threads that perform host lookups.
+#define DNS_CACHE_TTL					60000	// The number of milliseconds a successful lookup is reused. GetAddrInfoW doesn't give us the record's TTL.
+#define DNS_NEGATIVE_CACHE_TTL			10000	// The number of milliseconds a failed lookup is reused.
+
+#define CONNECT_ATTEMPT_LIMIT	3		// The number of connection attempts that can race each other when a host has more than one address.
+#define CONNECT_ATTEMPT_DELAY	250		// The number of milliseconds to wait for an attempt before starting the next one (RFC 8305).
+
+#define WRITE_CACHE_SLOTS		16		// The number of slots in a download's write cache.
+#define WRITE_CACHE_SLOT_SIZE	131072	// The number of bytes a slot can hold before it's written to the file.
+
+#define RANGE_CHECKPOINT_BYTES		8388608	// The number of bytes written to a download's file before its range checkpoint is written.
+#define RANGE_CHECKPOINT_INTERVAL	5000	// The number of milliseconds before a download's range checkpoint is written if fewer bytes have been written.
+
+#define MAGIC_ID_RANGE_CHECKPOINT		"HDM\x40"	// Version 1
+#define RANGE_CHECKPOINT_HEADER_SIZE	4
+#define RANGE_CHECKPOINT_SUFFIX			L".checkpoint"
+#define RANGE_CHECKPOINT_SUFFIX_LENGTH	11
+// The range start, range end, content length, content offset, and file write offset.
+#define RANGE_CHECKPOINT_RANGE_SIZE		( sizeof( unsigned long long ) * 5 )
+// The sequence number, range count, ranges, and checksum.
+#define RANGE_CHECKPOINT_SLOT_SIZE		( sizeof( unsigned int ) + sizeof( unsigned char ) + ( RANGE_LIST_LIMIT * RANGE_CHECKPOINT_RANGE_SIZE ) + sizeof( unsigned long ) )
+
+#define DNS_STATUS_FAILED		0
+#define DNS_STATUS_RESOLVED		1
+#define DNS_STATUS_PENDING		2
+
+#define RANGE_STEAL_MINIMUM		524288	// The smallest remainder (in bytes) of an active range that an idle part will split off and download.
+#define RANGE_LIST_LIMIT		255		// The range count is saved as an unsigned char in the download history.
+
 #define STATUS_NONE						0x00000000
 #define STATUS_CONNECTING				0x00000001
 #define STATUS_DOWNLOADING				0x00000002
@@ -74,6 +121,8 @@
 #define CONTENT_ENCODING_GZIP		1
 #define CONTENT_ENCODING_DEFLATE	2
 #define CONTENT_ENCODING_UNHANDLED	3
+#define CONTENT_ENCODING_BROTLI		4
+#define CONTENT_ENCODING_ZSTD		5
 
 #define AUTH_TYPE_NONE			0
 #define AUTH_TYPE_BASIC			1
@@ -92,6 +141,21 @@
 #define CONTENT_STATUS_ALLOCATE_FILE		8
 #define CONTENT_STATUS_HANDLE_RESPONSE		9	// Deals with HTTP status 206 and 401 responses.
 #define CONTENT_STATUS_HANDLE_REQUEST		10
+#define CONTENT_STATUS_DECOMPRESS_MORE		11	// The decompressed data didn't fit in one write. Continue decompressing once it's been written.
+
+// Chunked transfer decoding states.
+#define CHUNK_STATE_SIZE_START		0
+#define CHUNK_STATE_SIZE			1
+#define CHUNK_STATE_EXTENSION		2
+#define CHUNK_STATE_SIZE_LF			3
+#define CHUNK_STATE_DATA			4
+#define CHUNK_STATE_DATA_CR			5
+#define CHUNK_STATE_DATA_LF			6
+#define CHUNK_STATE_TRAILER_START	7
+#define CHUNK_STATE_TRAILER			8
+#define CHUNK_STATE_TRAILER_LF		9
+#define CHUNK_STATE_END_LF			10
+#define CHUNK_STATE_DONE			11
 
 #define SOCKS_STATUS_FAILED				   -1
 #define SOCKS_STATUS_NONE					0
@@ -145,7 +209,13 @@ enum IO_OPERATION
 	IO_Write,
 	IO_Shutdown,
 	IO_Close,
-	IO_KeepAlive
+	IO_KeepAlive,
+	IO_ResolveAddress,
+	IO_ConnectAttempt,
+	IO_ConnectDelay,
+	IO_WriteCache,
+	IO_APIResponse,
+	IO_ResumeGetRequest
 };
 
 struct AUTH_CREDENTIALS
@@ -174,6 +244,43 @@ struct RANGE_INFO
 	unsigned long long	file_write_offset;	// The offset of our written data. It may be larger than our content offset because of compression.
 };
 
+struct TOKEN_BUCKET
+{
+	long long			tokens;			// The number of bytes that can be processed. Goes negative if a receive was larger than what was available.
+	DWORD				last_refill;	// The tick count of the last refill.
+};
+
+struct POOLED_CONNECTION
+{
+	DoublyLinkedList	pool_node;		// Self reference to the g_connection_pool.
+	char				*host;
+	SSL					*ssl;
+	SOCKET				socket;
+	DWORD				idle_time;		// The tick count of when the connection was parked.
+	wchar_t				*proxy_hostname;	// NULL if the proxy was set with an IP address.
+	unsigned long		proxy_ip_address;
+	unsigned short		proxy_port;
+	unsigned short		port;
+	unsigned char		protocol;
+	unsigned char		proxy_type;		// The proxy that the connection was made through. 0 = none, 1 = HTTP, 2 = HTTPS, 3 = SOCKS.
+};
+
+struct DNS_CACHE_ENTRY
+{
+	DoublyLinkedList	resolve_node;		// Self reference to the g_dns_resolve_queue.
+	wchar_t				*key;				// "host:port"
+	wchar_t				*host;
+	wchar_t				*port;
+	addrinfoW			*address_info;
+	DoublyLinkedList	*waiting_contexts;	// Contexts that are waiting for the lookup to complete.
+	SOCKADDR_STORAGE	preferred_address;	// The address of the last connection attempt that won. It's attempted first.
+	int					preferred_address_length;
+	DWORD				expires;			// The tick count of when the entry needs to be looked up again.
+	int					status;				// The value returned by GetAddrInfoW.
+	bool				resolving;
+	bool				orphaned;			// The cache was freed while the lookup was in progress. The resolver thread will free the entry.
+};
+
 struct AUTH_INFO
 {
 	char				*realm;
@@ -207,10 +314,10 @@ struct HEADER_INFO
 	unsigned short		http_status;
 	unsigned char		http_method;
 	unsigned char		connection;			// 0 = none/not found, 1 = keep-alive, 2 = close
-	unsigned char		content_encoding;	// 0 = none/not found, 1 = gzip, 2 = deflate, 3 = unhandled
+	unsigned char		content_encoding;	// 0 = none/not found, 1 = gzip, 2 = deflate, 3 = unhandled, 4 = br, 5 = zstd
 	bool				chunked_transfer;
 	//bool				etag;
-	bool				got_chunk_start;
+	unsigned char		chunk_state;		// The chunked transfer decoder's position in the chunk framing.
 	bool				got_chunk_terminator;
 };
 
@@ -239,7 +346,38 @@ struct OVERLAPPEDEX
 	IO_OPERATION		next_operation;
 };
 
+struct CONNECT_ATTEMPT
+{
+	OVERLAPPEDEX		overlapped;		// Must be first. The completed overlapped is cast back to its attempt.
+	addrinfoW			*address;		// The address that's being attempted. NULL if the attempt isn't in progress.
+	SOCKET				socket;
+};
+
+struct WRITE_CACHE_SLOT
+{
+	OVERLAPPEDEX		overlapped;		// Must be first. The completed overlapped is cast back to its slot.
+	char				*buffer;
+	unsigned long long	file_offset;	// The offset in the file that the buffer is written to.
+	unsigned int		length;
+	unsigned int		written;
+	bool				in_use;
+};
+
 struct DOWNLOAD_INFO;
+struct API_INFO;
+
+struct RANGE_CHECKPOINT
+{
+	DoublyLinkedList	queue_node;		// Self reference to the range_checkpoint_queue. data is NULL if it's not queued.
+	HANDLE				hFile;			// The checkpoint file.
+	HANDLE				hFile_data;		// A duplicate of the download's file handle. It's flushed before the checkpoint is written.
+	unsigned long long	bytes;			// The number of bytes written to the file since the last checkpoint was queued.
+	DWORD				last_time;		// The tick count of the last queued checkpoint.
+	unsigned int		sequence;		// The sequence number of the last checkpoint that was written.
+	unsigned int		length;			// The length of the ranges in buffer.
+	bool				close_waiting;	// CloseRangeCheckpoint is waiting for the writer thread to finish with it.
+	char				buffer[ RANGE_CHECKPOINT_SLOT_SIZE ];	// The latest ranges. They're written by the writer thread.
+};
 
 struct SOCKET_CONTEXT
 {
@@ -254,9 +392,16 @@ struct SOCKET_CONTEXT
 	OVERLAPPEDEX		overlapped;
 	OVERLAPPEDEX		overlapped_close;
 	OVERLAPPEDEX		overlapped_keep_alive;
+	OVERLAPPEDEX		overlapped_connect_delay;	// Posted by the connect timer to start the next connection attempt.
+
+	CONNECT_ATTEMPT		connect_attempts[ CONNECT_ATTEMPT_LIMIT ];
 
 	DoublyLinkedList	context_node;	// Self reference to the g_context_list.
 	DoublyLinkedList	parts_node;		// Self reference to the parts_list of this context's download_info.
+	DoublyLinkedList	throttle_node;	// Self reference to the throttled_context_list.
+	TOKEN_BUCKET		speed_limit_bucket;	// The part's share of its download's download_speed_limit.
+	DoublyLinkedList	timer_node;		// Self reference to the g_timer_wheel slot that it's hashed to.
+	DoublyLinkedList	dns_node;		// Self reference to the waiting_contexts of the DNS_CACHE_ENTRY it's waiting on.
 
 	WSABUF				wsabuf;
 	WSABUF				write_wsabuf;
@@ -270,14 +415,27 @@ struct SOCKET_CONTEXT
 
 	addrinfoW			*address_info;			// Address info of the server we're connecting to.
 	addrinfoW			*proxy_address_info;	// Address info of the server that we want to proxy.
+	addrinfoW			*connect_address;		// The next address in address_info to attempt a connection to.
+
+	DNS_CACHE_ENTRY		*dns_cache_entry;		// The entry that address_info was copied from.
+
+	HANDLE				connect_timer;
+
+	WRITE_CACHE_SLOT	*write_cache_slot;	// The slot in the download's write cache that we're filling.
 
 	char				*buffer;
+	char				*decrypted_data;	// Response content that was decrypted in place. Points into ssl->pbIoBuffer and is used instead of buffer if it's set.
 	char				*decompressed_buf;
+	char				*pipeline_buffer;	// Holds the pipelined requests that arrived with the request we're responding to.
+	void				*brotli_decoder;	// BrotliDecoderState. gzip and deflate use stream.
+	void				*zstd_decoder;		// ZSTD_DStream.
 
 	DOWNLOAD_INFO		*download_info;
 
 	POST_INFO			*post_info;
 
+	API_INFO			*api_info;		// Set when the request is for the JSON status/control API.
+
 	SSL					*ssl;
     SOCKET				socket;
 	SOCKET				listen_socket;	// Used for active (EPRT/PORT) FTP connections.
@@ -286,12 +444,15 @@ struct SOCKET_CONTEXT
 
 	unsigned int		buffer_size;
 	unsigned int		decompressed_buf_size;
+	unsigned int		pipeline_buffer_size;
+	unsigned int		pipeline_length;
 
 	unsigned int		status;
 
 	volatile LONG		pending_operations;
-	volatile LONG		timeout;
-	volatile LONG		keep_alive_timeout;
+	volatile LONG		last_activity;		// The timer wheel tick of the last completed IO operation.
+
+	unsigned long		timer_expires;		// The timer wheel tick at which the context is checked for a timeout.
 
 	char				content_status;
 
@@ -302,6 +463,9 @@ struct SOCKET_CONTEXT
 
 	unsigned char		retries;			// The number of times a context connection has been retried.
 
+	unsigned char		full_receives;		// The number of consecutive receives that filled the buffer.
+	unsigned char		short_receives;		// The number of consecutive receives that used less than a quarter of the buffer.
+
 	unsigned char		timed_out;
 
 	unsigned char		cleanup;			// In cleanup function, or in worker thread doing/calling cleanup.
@@ -316,6 +480,16 @@ struct SOCKET_CONTEXT
 	bool				processed_header;
 
 	bool				is_paused;			// The last IO has completed while status is in the paused state.
+
+	bool				tokens_acquired;	// The rate limiter has already consumed the tokens for the parked receive.
+
+	bool				range_split;		// Another part has taken over the end of our range. The server will send more than we need.
+
+	bool				decompress_more;	// The decompression buffer filled up before all of the received data was decompressed.
+
+	bool				pooled_connection;	// The socket was taken from the connection pool rather than being connected.
+
+	bool				keep_alive_idle;	// Our server is waiting for the next request on a keep-alive connection.
 };
 
 struct ADD_INFO
@@ -331,6 +505,7 @@ struct ADD_INFO
 	unsigned char		download_operations;
 	unsigned char		method;		// 1 = GET, 2 = POST
 	char				ssl_version;
+	bool				api_batch;	// The URLs were streamed to the server API. See ReleaseAPIURLBatch().
 };
 
 struct RENAME_INFO
@@ -342,13 +517,17 @@ struct RENAME_INFO
 
 struct DOWNLOAD_INFO
 {
-	wchar_t				file_path[ MAX_PATH ];
+	wchar_t				*download_directory;	// Interned with InternString. Downloads in the same directory share it. NULL if the download is simulated.
+	wchar_t				*filename;			// It has room for MAX_PATH - filename_offset characters unless it's packed.
+	wchar_t				*packed_filename;	// The packed filename that PromoteDownload replaced. NULL = filename was never packed.
 	CRITICAL_SECTION	shared_cs;
 	DoublyLinkedList	download_node;		// Self reference to the active download_list.
 	DoublyLinkedList	queue_node;			// Self reference to the download_queue.
 	ULARGE_INTEGER		add_time;
 	ULARGE_INTEGER		start_time;
 	ULARGE_INTEGER		last_modified;
+	TOKEN_BUCKET		speed_limit_bucket;	// Used when download_speed_limit is set.
+	WRITE_CACHE_SLOT	*write_cache;		// WRITE_CACHE_SLOTS slots that the parts copy their data to. It's written to the file in the background.
 	unsigned long long	last_downloaded;
 	unsigned long long	downloaded;
 	unsigned long long	file_size;
@@ -370,9 +549,14 @@ struct DOWNLOAD_INFO
 	char				*data;				// POST payload.
 	//char				*etag;
 	HANDLE				hFile;
-	unsigned int		filename_offset;
-	unsigned int		file_extension_offset;
+	RANGE_CHECKPOINT	*range_checkpoint;	// The range checkpoint that's written while the file is open. NULL if it's not open.
+	unsigned int		filename_offset;	// The length of download_directory, including its NULL terminator. It's where the filename starts in the file's path.
+	unsigned int		file_extension_offset;	// The offset of the file extension in filename.
 	unsigned int		status;
+	unsigned int		id;					// Identifies the download in the server API. Not saved in the download history.
+	unsigned int		history_key;		// Identifies the entry in the history journal. 0 = Not saved yet.
+	char				*history_entry;		// The deferred values of a completed download in the mapped history file. NULL = They've been read.
+	volatile LONG		history_changes;	// The number of changes since the entry was last saved to the download history. 0 = Unchanged.
 	unsigned char		parts;
 	unsigned char		active_parts;
 	unsigned char		parts_limit;		// This is set if we reduce an active download's parts number.
@@ -396,6 +580,7 @@ SECURITY_STATUS SSL_WSASend( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped,
 SECURITY_STATUS SSL_WSARecv( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent );
 
 SECURITY_STATUS SSL_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumberOfBytesDecrypted );
+SECURITY_STATUS SSL_WSARecv_DecryptInPlace( SSL *ssl, char **data, DWORD &data_length );
 
 SECURITY_STATUS SSL_WSAShutdown( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent );
 
@@ -412,12 +597,41 @@ bool LoadConnectEx();
 void CleanupConnection( SOCKET_CONTEXT *context );
 
 SOCKET CreateSocket( bool IPv6 = false );
+void CancelConnectAttempts( SOCKET_CONTEXT *context );
+
+BOOL WriteFileCached( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped );
+void FreeWriteCache( DOWNLOAD_INFO *di );
+
+void OpenRangeCheckpoint( DOWNLOAD_INFO *di );
+void UpdateRangeCheckpoint( DOWNLOAD_INFO *di, DWORD io_size );
+void CloseRangeCheckpoint( DOWNLOAD_INFO *di, bool delete_checkpoint );
+bool ReconcileRangeCheckpoint( DOWNLOAD_INFO *di );
+void ReleaseCompletedRanges( DOWNLOAD_INFO *di );
+void PromoteDownload( DOWNLOAD_INFO *di );
 
 void FreeContexts();
 void FreeListenContext();
 
 void EnableTimers( bool timer_state );
 
+void AddContextTimer( SOCKET_CONTEXT *context );
+void RemoveContextTimer( SOCKET_CONTEXT *context );
+
+void ScheduleTokenRefill();
+
+void FreeAddressInfo( addrinfoW *address_info );
+
+bool IsConnectionReusable( SOCKET_CONTEXT *context );
+void EvictIdleConnections();
+void FreeConnectionPool();
+
+void AddDownload( DOWNLOAD_INFO *di );
+void RemoveDownload( DOWNLOAD_INFO *di );
+DOWNLOAD_INFO *FindDownload( unsigned int id );
+void MarkDownloadChanged( DOWNLOAD_INFO *di );
+
+void UpdateDownloadSpeeds( QFILETIME &last_update );
+
 DWORD WINAPI AddURL( void *add_info );
 void StartDownload( DOWNLOAD_INFO *di, bool check_if_file_exits );
 
@@ -430,6 +644,7 @@ THREAD_RETURN FileSizePrompt( void *pArguments );
 THREAD_RETURN LastModifiedPrompt( void *pArguments );
 
 ICON_INFO *CacheIcon( DOWNLOAD_INFO *di, SHFILEINFO *sfi );
+wchar_t *GetDownloadAddTime( DOWNLOAD_INFO *di );
 
 void FreePOSTInfo( POST_INFO **post_info );
 
@@ -440,8 +655,6 @@ void CleanupServerInfo();
 void StartServer();
 void CleanupServer();
 
-extern HANDLE g_hIOCP;
-
 extern bool g_end_program;
 
 extern WSAEVENT g_cleanup_event[ 1 ];
@@ -454,12 +667,26 @@ extern CRITICAL_SECTION rename_file_prompt_list_cs;		// Guard access to the rena
 extern CRITICAL_SECTION last_modified_prompt_list_cs;	// Guard access to the last modified prompt list.
 extern CRITICAL_SECTION move_file_queue_cs;				// Guard access to the move file queue.
 extern CRITICAL_SECTION cleanup_cs;
+extern CRITICAL_SECTION rate_limit_cs;					// Guard access to the token buckets and throttled context list.
+extern CRITICAL_SECTION range_checkpoint_cs;			// Guard access to the range checkpoint queue.
+extern CRITICAL_SECTION connection_pool_cs;				// Guard access to the connection pool.
+extern CRITICAL_SECTION dns_cache_cs;					// Guard access to the DNS cache and resolve queue.
+extern CRITICAL_SECTION download_list_cs;				// Guard access to the download list.
+
+extern unsigned long g_dns_cache_hits;
+extern unsigned long g_dns_cache_misses;
+extern unsigned long g_dns_lookups;
+extern unsigned long long g_dns_lookup_time;
 
 extern LPFN_ACCEPTEX _AcceptEx;
 extern LPFN_CONNECTEX _ConnectEx;
 
 extern DoublyLinkedList *g_context_list;
 
+extern volatile LONG g_download_id;					// The last id that was given to a download.
+
+extern dllrbt_tree *g_download_list;				// Every DOWNLOAD_INFO keyed by its id.
+
 extern unsigned long total_downloading;
 extern DoublyLinkedList *download_queue;
 
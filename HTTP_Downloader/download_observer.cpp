@@ -0,0 +1,178 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "globals.h"
+#include "connection.h"
+#include "utilities.h"
+#include "cmessagebox.h"
+
+#include "download_observer.h"
+
+#ifndef HEADLESS_BUILD
+bool g_headless = false;
+#else
+bool g_headless = true;
+#endif
+
+HEADLESS_POLICY g_headless_rename_policy = HEADLESS_POLICY_RENAME;
+HEADLESS_POLICY g_headless_file_size_policy = HEADLESS_POLICY_SKIP;
+HEADLESS_POLICY g_headless_last_modified_policy = HEADLESS_POLICY_SKIP;
+
+#ifndef HEADLESS_BUILD
+
+void GUI_AddItem( DOWNLOAD_INFO *di )
+{
+	LVITEM lvi;
+	_memzero( &lvi, sizeof( LVITEM ) );
+	lvi.mask = LVIF_PARAM | LVIF_TEXT;
+	lvi.iItem = ( int )_SendMessageW( g_hWnd_files, LVM_GETITEMCOUNT, 0, 0 );
+	lvi.lParam = ( LPARAM )di;
+	lvi.pszText = di->filename;
+	_SendMessageW( g_hWnd_files, LVM_INSERTITEM, 0, ( LPARAM )&lvi );
+}
+
+void GUI_RemoveItem( DOWNLOAD_INFO *di )
+{
+	LVFINDINFO lvfi;
+	_memzero( &lvfi, sizeof( LVFINDINFO ) );
+	lvfi.flags = LVFI_PARAM;
+	lvfi.lParam = ( LPARAM )di;
+
+	int index = ( int )_SendMessageW( g_hWnd_files, LVM_FINDITEM, ( WPARAM )-1, ( LPARAM )&lvfi );
+	if ( index != -1 )
+	{
+		_SendMessageW( g_hWnd_files, LVM_DELETEITEM, index, 0 );
+	}
+
+	// Is our update window open and are we removing the item we want to update? Close the window if we are.
+	if ( di == g_update_download_info )
+	{
+		g_update_download_info = NULL;
+
+		_SendMessageW( g_hWnd_update_download, WM_DESTROY_ALT, 0, 0 );
+	}
+
+	_SendMessageW( g_hWnd_main, WM_RESET_PROGRESS, 0, ( LPARAM )di );
+}
+
+void GUI_SortItems()
+{
+	if ( cfg_sorted_column_index != COLUMN_NUM )	// #
+	{
+		SORT_INFO si;
+		si.column = GetColumnIndexFromVirtualIndex( cfg_sorted_column_index, download_columns, NUM_COLUMNS );
+		si.hWnd = g_hWnd_files;
+		si.direction = cfg_sorted_direction;
+
+		_SendMessageW( g_hWnd_files, LVM_SORTITEMS, ( WPARAM )&si, ( LPARAM )( PFNLVCOMPARE )DMCompareFunc );
+	}
+}
+
+int GUI_Prompt( wchar_t *message, unsigned int type )
+{
+	return CMessageBoxW( g_hWnd_main, message, PROGRAM_CAPTION, type );
+}
+
+// The list draws the ranges without a lock, so the main thread frees them.
+// The item may be removed before the message is handled, so it's found again by its id.
+void GUI_ReleaseRanges( DOWNLOAD_INFO *di )
+{
+	_PostMessageW( g_hWnd_main, WM_RELEASE_RANGES, di->id, 0 );
+}
+
+#endif
+
+// The items are only kept in the engine's download list.
+void Headless_AddItem( DOWNLOAD_INFO *di )
+{
+}
+
+void Headless_RemoveItem( DOWNLOAD_INFO *di )
+{
+	di->print_range_list = NULL;
+}
+
+// Items are kept in the order they were added.
+void Headless_SortItems()
+{
+}
+
+// The "All" values are returned so that the engine remembers the choice for the remaining downloads.
+int Headless_Prompt( wchar_t *message, unsigned int type )
+{
+	unsigned int buttons = ( type & 0x0F );
+
+	if ( buttons == CMB_RENAMEOVERWRITESKIPALL )
+	{
+		if ( g_headless_rename_policy == HEADLESS_POLICY_OVERWRITE )
+		{
+			return CMBIDOVERWRITEALL;
+		}
+		else if ( g_headless_rename_policy == HEADLESS_POLICY_SKIP )
+		{
+			return CMBIDSKIPALL;
+		}
+
+		return CMBIDRENAMEALL;
+	}
+	else if ( buttons == CMB_YESNOALL )
+	{
+		return ( g_headless_file_size_policy == HEADLESS_POLICY_DOWNLOAD ? CMBIDYESALL : CMBIDNOALL );
+	}
+	else if ( buttons == CMB_CONTINUERESTARTSKIPALL )
+	{
+		if ( g_headless_last_modified_policy == HEADLESS_POLICY_CONTINUE )
+		{
+			return CMBIDCONTINUEALL;
+		}
+		else if ( g_headless_last_modified_policy == HEADLESS_POLICY_RESTART )
+		{
+			return CMBIDRESTARTALL;
+		}
+
+		return CMBIDSKIPALL;
+	}
+	else if ( buttons == CMB_OKALL )
+	{
+		return CMBIDOKALL;
+	}
+
+	return CMBIDFAIL;
+}
+
+// Nothing draws the ranges.
+void Headless_ReleaseRanges( DOWNLOAD_INFO *di )
+{
+	ReleaseCompletedRanges( di );
+}
+
+DOWNLOAD_OBSERVER g_headless_download_observer = { Headless_AddItem, Headless_RemoveItem, Headless_SortItems, Headless_Prompt, Headless_ReleaseRanges };
+
+#ifndef HEADLESS_BUILD
+DOWNLOAD_OBSERVER g_gui_download_observer = { GUI_AddItem, GUI_RemoveItem, GUI_SortItems, GUI_Prompt, GUI_ReleaseRanges };
+
+DOWNLOAD_OBSERVER *g_download_observer = &g_gui_download_observer;
+#else
+DOWNLOAD_OBSERVER *g_download_observer = &g_headless_download_observer;
+#endif
+
+// The DOWNLOAD_INFO values are released when the process exits.
+void InitializeHeadlessObserver()
+{
+	g_download_observer = &g_headless_download_observer;
+}
@@ -0,0 +1,69 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DOWNLOAD_OBSERVER_H
+#define _DOWNLOAD_OBSERVER_H
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#define HEADLESS_EXIT_EVENT		L"HTTP Downloader Headless Exit"
+
+struct DOWNLOAD_INFO;
+
+// The download engine reports new and removed items and asks its questions through the active observer.
+// The engine keeps its own download list (g_download_list), so nothing needs to be read back from the observer.
+// The GUI observer uses the listview and message boxes.
+// The headless observer answers each prompt with the configured policy.
+struct DOWNLOAD_OBSERVER
+{
+	void ( *AddItem )( DOWNLOAD_INFO *di );
+	void ( *RemoveItem )( DOWNLOAD_INFO *di );				// Called before the item is freed, and outside of cleanup_cs.
+	void ( *SortItems )();
+	int ( *Prompt )( wchar_t *message, unsigned int type );	// Returns one of the CMBID values.
+	void ( *ReleaseRanges )( DOWNLOAD_INFO *di );			// Frees a completed item's ranges once nothing is reading them. Called in the item's shared_cs, so it mustn't wait on another thread.
+};
+
+void InitializeHeadlessObserver();
+
+extern DOWNLOAD_OBSERVER *g_download_observer;
+
+#ifndef HEADLESS_BUILD
+extern DOWNLOAD_OBSERVER g_gui_download_observer;
+#endif
+extern DOWNLOAD_OBSERVER g_headless_download_observer;
+
+// How the headless observer answers each prompt.
+enum HEADLESS_POLICY
+{
+	HEADLESS_POLICY_RENAME,
+	HEADLESS_POLICY_OVERWRITE,
+	HEADLESS_POLICY_SKIP,
+	HEADLESS_POLICY_DOWNLOAD,
+	HEADLESS_POLICY_CONTINUE,
+	HEADLESS_POLICY_RESTART
+};
+
+extern bool g_headless;
+
+extern HEADLESS_POLICY g_headless_rename_policy;		// Rename, overwrite, or skip.
+extern HEADLESS_POLICY g_headless_file_size_policy;		// Download, or skip.
+extern HEADLESS_POLICY g_headless_last_modified_policy;	// Continue, restart, or skip.
+
+#endif
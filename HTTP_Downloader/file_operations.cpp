@@ -27,6 +27,7 @@
 
 #include "ftp_parsing.h"
 #include "connection.h"
+#include "download_observer.h"
 
 wchar_t *UTF8StringToWideString( char *utf8_string, int string_length )
 {
@@ -1022,20 +1023,19 @@ char read_config()
 
 	if ( ret_status != 0 )
 	{
-		cfg_odd_row_font_settings.font = _CreateFontIndirectW( &g_default_log_font );
 		//cfg_odd_row_font_settings.lf = g_default_log_font;
 		_memcpy_s( &cfg_odd_row_font_settings.lf, sizeof( LOGFONT ), &g_default_log_font, sizeof( LOGFONT ) );
 
-		cfg_even_row_font_settings.font = _CreateFontIndirectW( &g_default_log_font );
 		//cfg_even_row_font_settings.lf = g_default_log_font;
 		_memcpy_s( &cfg_even_row_font_settings.lf, sizeof( LOGFONT ), &g_default_log_font, sizeof( LOGFONT ) );
 	}
-	else
-	{
-		cfg_odd_row_font_settings.font = _CreateFontIndirectW( &cfg_odd_row_font_settings.lf );
 
-		cfg_even_row_font_settings.font = _CreateFontIndirectW( &cfg_even_row_font_settings.lf );
-	}
+	// The headless build keeps the font settings so that they're saved back unchanged.
+#ifndef HEADLESS_BUILD
+	cfg_odd_row_font_settings.font = _CreateFontIndirectW( &cfg_odd_row_font_settings.lf );
+
+	cfg_even_row_font_settings.font = _CreateFontIndirectW( &cfg_even_row_font_settings.lf );
+#endif
 
 	if ( cfg_default_download_directory == NULL )
 	{
@@ -1854,764 +1854,1720 @@ char save_config()
 	return ret_status;
 }
 
-char read_download_history( wchar_t *file_path )
-{
-	char ret_status = 0;
-
-	HANDLE hFile_read = CreateFile( file_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
-	if ( hFile_read != INVALID_HANDLE_VALUE )
-	{
-		DWORD read = 0, total_read = 0, offset = 0, last_entry = 0, last_total = 0;
+CRITICAL_SECTION history_journal_cs;	// Guards the history journal state and the removed history keys.
 
-		char *p = NULL;
+unsigned long long history_generation = 0;		// Matches the history file to its journal. 0 = the history file needs to be rewritten on the next save.
+unsigned long long history_journal_size = 0;	// The length of the valid records in the journal.
+unsigned long long history_snapshot_size = 0;
 
-		ULARGE_INTEGER		add_time;
-		unsigned long long	downloaded;
-		unsigned long long	file_size;
-		unsigned long long	download_speed_limit;
+unsigned int g_next_history_key = 1;
 
-		char				*download_directory;
-		unsigned int		download_directory_length;
-		char				*filename;
-		unsigned int		filename_length;
+unsigned int *removed_history_keys = NULL;
+unsigned int removed_history_key_count = 0;
+unsigned int removed_history_key_capacity = 0;
 
-		wchar_t				*url;
-		DoublyLinkedList	*range_list;
-		unsigned char		parts;
-		unsigned char		parts_limit;
-		unsigned int		status;
+// Hashes the journal records so that an incomplete record can be detected.
+unsigned long hash_download_history_entry( char *entry, unsigned int entry_length )
+{
+	unsigned long hash = HISTORY_HASH_SEED;
 
-		char				*cookies;
-		char				*headers;
-		char				*data;
+	for ( unsigned int i = 0; i < entry_length; ++i )
+	{
+		hash = ( hash ^ ( unsigned char )entry[ i ] ) * 16777619;
+	}
 
-		char				*username;
-		char				*password;
+	return hash;
+}
 
-		char				ssl_version;
+// The journal is kept next to the history file.
+bool get_download_history_path( wchar_t *file_path, wchar_t *suffix, int suffix_length, wchar_t *new_file_path )
+{
+	int file_path_length = lstrlenW( file_path );
+	if ( file_path_length + suffix_length >= MAX_PATH )
+	{
+		return false;
+	}
 
-		bool				processed_header;
-		unsigned char		download_operations;
-		unsigned char		method;
+	_wmemcpy_s( new_file_path, MAX_PATH, file_path, file_path_length );
+	_wmemcpy_s( new_file_path + file_path_length, MAX_PATH - file_path_length, suffix, suffix_length );
+	new_file_path[ file_path_length + suffix_length ] = 0;	// Sanity.
 
-		ULARGE_INTEGER		last_modified;
+	return true;
+}
 
-		unsigned char range_count;
+// Returns the number of characters in the string, including the NULL terminator, without reading past the available bytes.
+// If there's no NULL terminator, then the returned length will exceed the available bytes.
+int get_history_string_length( char *p, DWORD available )
+{
+	int length = 0;
+	while ( ( DWORD )length < available && p[ length ] != 0 )
+	{
+		++length;
+	}
 
-		char magic_identifier[ 4 ];
-		ReadFile( hFile_read, magic_identifier, sizeof( char ) * 4, &read, NULL );
-		if ( read == 4 && _memcmp( magic_identifier, MAGIC_ID_DOWNLOADS, 4 ) == 0 )
-		{
-			DWORD fz = GetFileSize( hFile_read, NULL ) - 4;
+	return length + 1;
+}
 
-			char *history_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( 524288 + 1 ) );	// 512 KB buffer.
+int get_history_wide_string_length( char *p, DWORD available )
+{
+	int length = 0;
+	while ( ( DWORD )( ( length + 1 ) * sizeof( wchar_t ) ) <= available && ( ( wchar_t * )p )[ length ] != 0 )
+	{
+		++length;
+	}
 
-			SHFILEINFO *sfi = ( SHFILEINFO * )GlobalAlloc( GMEM_FIXED, sizeof( SHFILEINFO ) );
+	return length + 1;
+}
 
-			while ( total_read < fz )
-			{
-				ReadFile( hFile_read, history_buf, sizeof( char ) * 524288, &read, NULL );
-
-				history_buf[ read ] = 0;	// Guarantee a NULL terminated buffer.
-
-				// Make sure that we have at least part of the entry. This is the minimum size an entry could be.
-				// Include 3 wide NULL strings and 3 char NULL strings.
-				// Include 2 ints for username and password lengths.
-				// Include 1 unsigned char for range info.
-				if ( read < ( ( ( sizeof( ULONGLONG ) * 2 ) + ( sizeof( unsigned long long ) * 3 ) + ( sizeof( unsigned char ) * 5 ) + sizeof( unsigned int ) + sizeof( bool ) ) +
-							  ( ( sizeof( wchar_t ) * 3 ) + ( sizeof( char ) * 3 ) ) +
-								( sizeof( int ) * 2 ) + 
-								  sizeof( unsigned char ) ) )
-				{
-					break;
-				}
+// Parses the values that follow the filename in an entry. Returns false if they're incomplete.
+// offset is the number of bytes of the entry that have been parsed, and it's updated to include the values.
+bool read_download_history_values( DOWNLOAD_INFO *di, char *p, DWORD available, DWORD &offset )
+{
+	wchar_t				*url = NULL;
+	DoublyLinkedList	*range_list = NULL;
 
-				total_read += read;
+	char				*cookies = NULL;
+	char				*headers = NULL;
+	char				*data = NULL;
 
-				// Prevent an infinite loop if a really really long entry causes us to jump back to the same point in the file.
-				// If it's larger than our buffer, then the file is probably invalid/corrupt.
-				if ( total_read == last_total )
-				{
-					break;
-				}
+	char				*username = NULL;
+	char				*password = NULL;
 
-				last_total = total_read;
+	unsigned char range_count;
 
-				p = history_buf;
-				offset = last_entry = 0;
+	int string_length;
 
-				while ( offset < read )
-				{
-					download_directory = NULL;
-					download_directory_length = 0;
-					filename = NULL;
-					filename_length = 0;
-					url = NULL;
-					cookies = NULL;
-					headers = NULL;
-					data = NULL;
-					username = NULL;
-					password = NULL;
-					range_list = NULL;
-
-					// Add Time.
-					offset += sizeof( ULONGLONG );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &add_time.QuadPart, sizeof( ULONGLONG ), p, sizeof( ULONGLONG ) );
-					p += sizeof( ULONGLONG );
-
-					// Downloaded
-					offset += sizeof( unsigned long long );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &downloaded, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-					p += sizeof( unsigned long long );
-
-					// File Size
-					offset += sizeof( unsigned long long );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &file_size, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-					p += sizeof( unsigned long long );
-
-					// Download Speed Limit
-					offset += sizeof( unsigned long long );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &download_speed_limit, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-					p += sizeof( unsigned long long );
-
-					// Parts
-					offset += sizeof( unsigned char );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &parts, sizeof( unsigned char ), p, sizeof( unsigned char ) );
-					p += sizeof( unsigned char );
-
-					// Parts Limit
-					offset += sizeof( unsigned char );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &parts_limit, sizeof( unsigned char ), p, sizeof( unsigned char ) );
-					p += sizeof( unsigned char );
-
-					// Status
-					offset += sizeof( unsigned int );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &status, sizeof( unsigned int ), p, sizeof( unsigned int ) );
-					p += sizeof( unsigned int );
-
-					// SSL Version
-					offset += sizeof( char );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &ssl_version, sizeof( char ), p, sizeof( char ) );
-					p += sizeof( char );
-
-					// Create Range
-					offset += sizeof( bool );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &processed_header, sizeof( bool ), p, sizeof( bool ) );
-					p += sizeof( bool );
-
-					// Download Operations
-					offset += sizeof( unsigned char );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &download_operations, sizeof( unsigned char ), p, sizeof( unsigned char ) );
-					p += sizeof( unsigned char );
-
-					// Method
-					offset += sizeof( unsigned char );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &method, sizeof( unsigned char ), p, sizeof( unsigned char ) );
-					p += sizeof( unsigned char );
-
-					// Last Modified
-					offset += sizeof( ULONGLONG );
-					if ( offset >= read ) { goto CLEANUP; }
-					_memcpy_s( &last_modified.QuadPart, sizeof( ULONGLONG ), p, sizeof( ULONGLONG ) );
-					p += sizeof( ULONGLONG );
-
-					// Download Directory
-					int string_length = lstrlenW( ( wchar_t * )p ) + 1;
-
-					offset += ( string_length * sizeof( wchar_t ) );
-					if ( offset >= read ) { goto CLEANUP; }
-
-					download_directory = p;
-					download_directory_length = string_length;
-
-					p += ( string_length * sizeof( wchar_t ) );
-
-					// Filename
-					string_length = lstrlenW( ( wchar_t * )p ) + 1;
-
-					offset += ( string_length * sizeof( wchar_t ) );
-					if ( offset >= read ) { goto CLEANUP; }
-
-					filename = p;
-					filename_length = string_length - 1;
-
-					p += ( string_length * sizeof( wchar_t ) );
-
-					// URL
-					string_length = lstrlenW( ( wchar_t * )p ) + 1;
-
-					offset += ( string_length * sizeof( wchar_t ) );
-					if ( offset >= read ) { goto CLEANUP; }
-
-					url = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * string_length );
-					_wmemcpy_s( url, string_length, p, string_length );
-					*( url + ( string_length - 1 ) ) = 0;	// Sanity
-
-					p += ( string_length * sizeof( wchar_t ) );
-
-					// Cookies
-					string_length = lstrlenA( ( char * )p ) + 1;
-
-					offset += string_length;
-					if ( offset >= read ) { goto CLEANUP; }
+	// URL
+	string_length = get_history_wide_string_length( p, available - offset );
 
-					// Let's not allocate an empty string.
-					if ( string_length > 1 )
-					{
-						cookies = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * string_length );
-						_memcpy_s( cookies, string_length, p, string_length );
-						*( cookies + ( string_length - 1 ) ) = 0;	// Sanity
-					}
+	offset += ( string_length * sizeof( wchar_t ) );
+	if ( offset >= available ) { goto CLEANUP; }
 
-					p += string_length;
+	url = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * string_length );
+	_wmemcpy_s( url, string_length, p, string_length );
+	*( url + ( string_length - 1 ) ) = 0;	// Sanity
 
-					// Headers
-					string_length = lstrlenA( ( char * )p ) + 1;
+	p += ( string_length * sizeof( wchar_t ) );
 
-					offset += string_length;
-					if ( offset >= read ) { goto CLEANUP; }
+	// Cookies
+	string_length = get_history_string_length( p, available - offset );
 
-					// Let's not allocate an empty string.
-					if ( string_length > 1 )
-					{
-						headers = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * string_length );
-						_memcpy_s( headers, string_length, p, string_length );
-						*( headers + ( string_length - 1 ) ) = 0;	// Sanity
-					}
+	offset += string_length;
+	if ( offset >= available ) { goto CLEANUP; }
 
-					p += string_length;
+	// Let's not allocate an empty string.
+	if ( string_length > 1 )
+	{
+		cookies = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * string_length );
+		_memcpy_s( cookies, string_length, p, string_length );
+		*( cookies + ( string_length - 1 ) ) = 0;	// Sanity
+	}
 
-					// Data
-					string_length = lstrlenA( ( char * )p ) + 1;
+	p += string_length;
 
-					offset += string_length;
-					if ( offset >= read ) { goto CLEANUP; }
+	// Headers
+	string_length = get_history_string_length( p, available - offset );
 
-					// Let's not allocate an empty string.
-					if ( string_length > 1 )
-					{
-						data = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * string_length );
-						_memcpy_s( data, string_length, p, string_length );
-						*( data + ( string_length - 1 ) ) = 0;	// Sanity
-					}
+	offset += string_length;
+	if ( offset >= available ) { goto CLEANUP; }
 
-					p += string_length;
+	// Let's not allocate an empty string.
+	if ( string_length > 1 )
+	{
+		headers = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * string_length );
+		_memcpy_s( headers, string_length, p, string_length );
+		*( headers + ( string_length - 1 ) ) = 0;	// Sanity
+	}
 
-					// Username
-					offset += sizeof( int );
-					if ( offset >= read ) { goto CLEANUP; }
+	p += string_length;
 
-					// Length of the string - not including the NULL character.
-					_memcpy_s( &string_length, sizeof( int ), p, sizeof( int ) );
-					p += sizeof( int );
+	// Data
+	string_length = get_history_string_length( p, available - offset );
 
-					offset += string_length;
-					if ( offset >= read ) { goto CLEANUP; }
-					if ( string_length > 0 )
-					{
-						// string_length does not contain the NULL character of the string.
-						username = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( string_length + 1 ) );
-						_memcpy_s( username, string_length, p, string_length );
-						username[ string_length ] = 0; // Sanity;
+	offset += string_length;
+	if ( offset >= available ) { goto CLEANUP; }
 
-						decode_cipher( username, string_length );
+	// Let's not allocate an empty string.
+	if ( string_length > 1 )
+	{
+		data = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * string_length );
+		_memcpy_s( data, string_length, p, string_length );
+		*( data + ( string_length - 1 ) ) = 0;	// Sanity
+	}
 
-						p += string_length;
-					}
+	p += string_length;
 
-					// Password
-					offset += sizeof( int );
-					if ( offset >= read ) { goto CLEANUP; }
+	// Username
+	offset += sizeof( int );
+	if ( offset >= available ) { goto CLEANUP; }
 
-					// Length of the string - not including the NULL character.
-					_memcpy_s( &string_length, sizeof( int ), p, sizeof( int ) );
-					p += sizeof( int );
+	// Length of the string - not including the NULL character.
+	_memcpy_s( &string_length, sizeof( int ), p, sizeof( int ) );
+	p += sizeof( int );
 
-					offset += string_length;
-					if ( offset >= read ) { goto CLEANUP; }
-					if ( string_length > 0 )
-					{
-						// string_length does not contain the NULL character of the string.
-						password = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( string_length + 1 ) );
-						_memcpy_s( password, string_length, p, string_length );
-						password[ string_length ] = 0; // Sanity;
+	// A damaged entry can have a negative length or one that goes past the end.
+	if ( string_length < 0 || ( DWORD )string_length >= available - offset ) { goto CLEANUP; }
+	offset += string_length;
+	if ( string_length > 0 )
+	{
+		// string_length does not contain the NULL character of the string.
+		username = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( string_length + 1 ) );
+		_memcpy_s( username, string_length, p, string_length );
+		username[ string_length ] = 0; // Sanity;
 
-						decode_cipher( password, string_length );
+		decode_cipher( username, string_length );
 
-						p += string_length;
-					}
+		p += string_length;
+	}
 
-					// Range Info.
-					offset += sizeof( unsigned char );
-					if ( offset <= read )
-					{
-						range_count = *p;
-						p += sizeof( unsigned char );
+	// Password
+	offset += sizeof( int );
+	if ( offset >= available ) { goto CLEANUP; }
 
-						for ( unsigned char i = 0; i < range_count; ++i )
-						{
-							offset += ( sizeof( unsigned long long ) * 5 );
-							if ( offset > read ) { goto CLEANUP; }
+	// Length of the string - not including the NULL character.
+	_memcpy_s( &string_length, sizeof( int ), p, sizeof( int ) );
+	p += sizeof( int );
 
-							RANGE_INFO *ri = ( RANGE_INFO * )GlobalAlloc( GPTR, sizeof( RANGE_INFO ) );
+	if ( string_length < 0 || ( DWORD )string_length >= available - offset ) { goto CLEANUP; }
+	offset += string_length;
+	if ( string_length > 0 )
+	{
+		// string_length does not contain the NULL character of the string.
+		password = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * ( string_length + 1 ) );
+		_memcpy_s( password, string_length, p, string_length );
+		password[ string_length ] = 0; // Sanity;
 
-							_memcpy_s( &ri->range_start, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-							p += sizeof( unsigned long long );
+		decode_cipher( password, string_length );
 
-							_memcpy_s( &ri->range_end, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-							p += sizeof( unsigned long long );
+		p += string_length;
+	}
 
-							_memcpy_s( &ri->content_length, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-							p += sizeof( unsigned long long );
+	// Range Info.
+	offset += sizeof( unsigned char );
+	if ( offset <= available )
+	{
+		range_count = *p;
+		p += sizeof( unsigned char );
 
-							_memcpy_s( &ri->content_offset, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-							p += sizeof( unsigned long long );
+		for ( unsigned char i = 0; i < range_count; ++i )
+		{
+			offset += ( sizeof( unsigned long long ) * 5 );
+			if ( offset > available ) { goto CLEANUP; }
 
-							_memcpy_s( &ri->file_write_offset, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
-							p += sizeof( unsigned long long );
+			RANGE_INFO *ri = ( RANGE_INFO * )GlobalAlloc( GPTR, sizeof( RANGE_INFO ) );
 
-							DoublyLinkedList *range_node = DLL_CreateNode( ( void * )ri );
-							DLL_AddNode( &range_list, range_node, -1 );
-						}
-					}
+			_memcpy_s( &ri->range_start, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+			p += sizeof( unsigned long long );
 
-					last_entry = offset;	// This value is the ending offset of the last valid entry.
+			_memcpy_s( &ri->range_end, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+			p += sizeof( unsigned long long );
 
-					DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )GlobalAlloc( GPTR, sizeof( DOWNLOAD_INFO ) );
+			_memcpy_s( &ri->content_length, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+			p += sizeof( unsigned long long );
 
-					di->hFile = INVALID_HANDLE_VALUE;
+			_memcpy_s( &ri->content_offset, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+			p += sizeof( unsigned long long );
 
-					di->add_time.QuadPart = add_time.QuadPart;
-					di->downloaded = downloaded;
-					di->last_downloaded = downloaded;
-					di->file_size = file_size;
-					di->download_speed_limit = download_speed_limit;
-					di->parts = parts;
-					di->parts_limit = parts_limit;
-					di->status = status;
-					di->ssl_version = ssl_version;
-					di->processed_header = processed_header;
-					di->download_operations = download_operations;
-					di->method = method;
-					di->last_modified.QuadPart = last_modified.QuadPart;
-					di->url = url;
-					di->cookies = cookies;
-					di->headers = headers;
-					di->data = data;
-					di->auth_info.username = username;
-					di->auth_info.password = password;
+			_memcpy_s( &ri->file_write_offset, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+			p += sizeof( unsigned long long );
 
-					di->range_list = range_list;
-					di->print_range_list = di->range_list;
+			DoublyLinkedList *range_node = DLL_CreateNode( ( void * )ri );
+			DLL_AddNode( &range_list, range_node, -1 );
+		}
+	}
 
-					_wmemcpy_s( di->file_path, MAX_PATH, download_directory, download_directory_length );
-					di->file_path[ download_directory_length ] = 0;	// Sanity.
+	di->url = url;
+	di->cookies = InternString( cookies, true );
+	di->headers = InternString( headers, true );
+	di->data = InternString( data, true );
+	di->auth_info.username = username;
+	di->auth_info.password = password;
 
-					di->filename_offset = download_directory_length;	// Includes the NULL terminator.
+	di->range_list = range_list;
 
-					_wmemcpy_s( di->file_path + di->filename_offset, MAX_PATH - di->filename_offset, filename, filename_length + 1 );
-					di->file_path[ di->filename_offset + filename_length + 1 ] = 0;	// Sanity.
+	return true;
 
-					di->file_extension_offset = di->filename_offset + get_file_extension_offset( di->file_path + di->filename_offset, filename_length );
+CLEANUP:
+	GlobalFree( url );
+	GlobalFree( cookies );
+	GlobalFree( headers );
+	GlobalFree( data );
+	GlobalFree( username );
+	GlobalFree( password );
 
-					// Cache our file's icon.
-					ICON_INFO *ii = CacheIcon( di, sfi );
+	DoublyLinkedList *range_node;
+	while ( range_list != NULL )
+	{
+		range_node = range_list;
+		range_list = range_list->next;
 
-					if ( ii != NULL )
-					{
-						di->icon = &ii->icon;
-					}
+		GlobalFree( range_node->data );
+		GlobalFree( range_node );
+	}
 
-					InitializeCriticalSection( &di->shared_cs );
+	return false;
+}
 
-					SYSTEMTIME st;
-					FILETIME ft;
-					ft.dwHighDateTime = di->add_time.HighPart;
-					ft.dwLowDateTime = di->add_time.LowPart;
-					FileTimeToSystemTime( &ft, &st );
+// Parses the entry that p points to. Returns NULL if the entry is incomplete.
+// entry_length is set to the number of bytes that the entry uses.
+// If defer_values is set, then the values that follow the filename of a completed download are read when they're first needed. p must stay valid until then.
+DOWNLOAD_INFO *read_download_history_entry( char *p, DWORD available, DWORD &entry_length, bool defer_values )
+{
+	DWORD offset = 0;
+
+	ULARGE_INTEGER		add_time;
+	unsigned long long	downloaded;
+	unsigned long long	file_size;
+	unsigned long long	download_speed_limit;
+
+	char				*download_directory = NULL;
+	unsigned int		download_directory_length = 0;
+	char				*filename = NULL;
+	unsigned int		filename_length = 0;
+
+	unsigned char		parts;
+	unsigned char		parts_limit;
+	unsigned int		status;
+
+	char				ssl_version;
+
+	bool				processed_header;
+	unsigned char		download_operations;
+	unsigned char		method;
+
+	ULARGE_INTEGER		last_modified;
+
+	int string_length;
+
+	unsigned int filename_size;
+
+	wchar_t directory[ MAX_PATH ];
 
-					int buffer_length = 0;
+	DOWNLOAD_INFO *di;
 
-					#ifndef NTDLL_USE_STATIC_LIB
-						//buffer_length = 64;	// Should be enough to hold most translated values.
-						buffer_length = __snwprintf( NULL, 0, L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) ) + 1;	// Include the NULL character.
-					#else
-						buffer_length = _scwprintf( L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) ) + 1;	// Include the NULL character.
-					#endif
+	// Add Time.
+	offset += sizeof( ULONGLONG );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &add_time.QuadPart, sizeof( ULONGLONG ), p, sizeof( ULONGLONG ) );
+	p += sizeof( ULONGLONG );
 
-					di->w_add_time = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * buffer_length );
+	// Downloaded
+	offset += sizeof( unsigned long long );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &downloaded, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+	p += sizeof( unsigned long long );
 
-					__snwprintf( di->w_add_time, buffer_length, L"%s, %s %d, %04d %d:%02d:%02d %s", GetDay( st.wDayOfWeek ), GetMonth( st.wMonth ), st.wDay, st.wYear, ( st.wHour > 12 ? st.wHour - 12 : ( st.wHour != 0 ? st.wHour : 12 ) ), st.wMinute, st.wSecond, ( st.wHour >= 12 ? L"PM" : L"AM" ) );
+	// File Size
+	offset += sizeof( unsigned long long );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &file_size, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+	p += sizeof( unsigned long long );
 
+	// Download Speed Limit
+	offset += sizeof( unsigned long long );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &download_speed_limit, sizeof( unsigned long long ), p, sizeof( unsigned long long ) );
+	p += sizeof( unsigned long long );
 
-					LVITEM lvi;
-					_memzero( &lvi, sizeof( LVITEM ) );
-					lvi.mask = LVIF_PARAM | LVIF_TEXT;
-					lvi.iItem = ( int )_SendMessageW( g_hWnd_files, LVM_GETITEMCOUNT, 0, 0 );
-					lvi.lParam = ( LPARAM )di;
-					lvi.pszText = di->file_path + di->filename_offset;
-					_SendMessageW( g_hWnd_files, LVM_INSERTITEM, 0, ( LPARAM )&lvi );
+	// Parts
+	offset += sizeof( unsigned char );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &parts, sizeof( unsigned char ), p, sizeof( unsigned char ) );
+	p += sizeof( unsigned char );
 
-					if ( IS_STATUS( di->status, STATUS_PAUSED ) )	// Paused
-					{
-						di->status = STATUS_STOPPED;	// Stopped
-					}
-					else if ( IS_STATUS( di->status,
-								 STATUS_CONNECTING |
-								 STATUS_DOWNLOADING |
-								 STATUS_RESTART ) )	// Connecting, Downloading, Queued, or Restarting
-					{
-						if ( cfg_resume_downloads )
-						{
-							download_history_changed = true;
+	// Parts Limit
+	offset += sizeof( unsigned char );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &parts_limit, sizeof( unsigned char ), p, sizeof( unsigned char ) );
+	p += sizeof( unsigned char );
 
-							StartDownload( di, false );
-						}
-						else
-						{
-							di->status = STATUS_STOPPED;	// Stopped
-						}
-					}
-					else if ( di->status == STATUS_ALLOCATING_FILE )	// If we were allocating the file, then set it to a File IO Error.
-					{
-						di->status = STATUS_FILE_IO_ERROR;
-					}
+	// Status
+	offset += sizeof( unsigned int );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &status, sizeof( unsigned int ), p, sizeof( unsigned int ) );
+	p += sizeof( unsigned int );
 
-					continue;
+	// SSL Version
+	offset += sizeof( char );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &ssl_version, sizeof( char ), p, sizeof( char ) );
+	p += sizeof( char );
 
-	CLEANUP:
-					GlobalFree( url );
-					GlobalFree( cookies );
-					GlobalFree( headers );
-					GlobalFree( data );
-					GlobalFree( username );
-					GlobalFree( password );
+	// Create Range
+	offset += sizeof( bool );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &processed_header, sizeof( bool ), p, sizeof( bool ) );
+	p += sizeof( bool );
 
-					DoublyLinkedList *range_node;
-					while ( range_list != NULL )
-					{
-						range_node = range_list;
-						range_list = range_list->next;
+	// Download Operations
+	offset += sizeof( unsigned char );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &download_operations, sizeof( unsigned char ), p, sizeof( unsigned char ) );
+	p += sizeof( unsigned char );
 
-						GlobalFree( range_node->data );
-						GlobalFree( range_node );
-					}
+	// Method
+	offset += sizeof( unsigned char );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &method, sizeof( unsigned char ), p, sizeof( unsigned char ) );
+	p += sizeof( unsigned char );
 
-					// Go back to the last valid entry.
-					if ( total_read < fz )
-					{
-						total_read -= ( read - last_entry );
-						SetFilePointer( hFile_read, total_read + 4, NULL, FILE_BEGIN );	// Offset past the magic identifier.
-					}
+	// Last Modified
+	offset += sizeof( ULONGLONG );
+	if ( offset >= available ) { goto CLEANUP; }
+	_memcpy_s( &last_modified.QuadPart, sizeof( ULONGLONG ), p, sizeof( ULONGLONG ) );
+	p += sizeof( ULONGLONG );
+
+	// Download Directory
+	string_length = get_history_wide_string_length( p, available - offset );
 
-					break;
-				}
-			}
+	offset += ( string_length * sizeof( wchar_t ) );
+	if ( offset >= available ) { goto CLEANUP; }
 
-			GlobalFree( sfi );
+	download_directory = p;
+	download_directory_length = string_length;
 
-			GlobalFree( history_buf );
+	p += ( string_length * sizeof( wchar_t ) );
 
-			if ( cfg_sorted_column_index != COLUMN_NUM )		// #
-			{
-				SORT_INFO si;
-				si.column = GetColumnIndexFromVirtualIndex( cfg_sorted_column_index, download_columns, NUM_COLUMNS );
-				si.hWnd = g_hWnd_files;
-				si.direction = cfg_sorted_direction;
+	// Filename
+	string_length = get_history_wide_string_length( p, available - offset );
 
-				_SendMessageW( g_hWnd_files, LVM_SORTITEMS, ( WPARAM )&si, ( LPARAM )( PFNLVCOMPARE )DMCompareFunc );
-			}
-		}
-		else
-		{
-			ret_status = -2;	// Bad file format.
-		}
+	offset += ( string_length * sizeof( wchar_t ) );
+	if ( offset >= available ) { goto CLEANUP; }
 
-		CloseHandle( hFile_read );	
-	}
-	else
+	filename = p;
+	filename_length = string_length - 1;
+
+	// The directory, filename, and their NULL terminators must fit in a MAX_PATH file path.
+	if ( download_directory_length + filename_length + 1 >= MAX_PATH ) { goto CLEANUP; }
+
+	p += ( string_length * sizeof( wchar_t ) );
+
+	di = ( DOWNLOAD_INFO * )GlobalAlloc( GPTR, sizeof( DOWNLOAD_INFO ) );
+
+	// A completed download's filename is packed. It's enlarged if the download is restarted or renamed.
+	filename_size = ( status == STATUS_COMPLETED ? filename_length + 1 : MAX_PATH );
+	di->filename = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * filename_size );
+	if ( di->filename == NULL )
 	{
-		ret_status = -1;	// Can't open file for reading.
-	}
-
-	return ret_status;
-}
+		GlobalFree( di );
 
-char save_download_history( wchar_t *file_path )
-{
-	char ret_status = 0;
+		goto CLEANUP;
+	}
 
-	HANDLE hFile_downloads = CreateFile( file_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
-	if ( hFile_downloads != INVALID_HANDLE_VALUE )
+	// A completed download's remaining values aren't needed to display it.
+	if ( defer_values && status == STATUS_COMPLETED )
 	{
-		//int size = ( 32768 + 1 );
-		int size = ( 524288 + 1 );
-		int pos = 0;
-		DWORD write = 0;
-
-		char *write_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * size );
-
-		_memcpy_s( write_buf + pos, size - pos, MAGIC_ID_DOWNLOADS, sizeof( char ) * 4 );	// Magic identifier for the call log history.
-		pos += ( sizeof( char ) * 4 );
+		di->history_entry = p;
 
-		int item_count = ( int )_SendMessageW( g_hWnd_files, LVM_GETITEMCOUNT, 0, 0 );
+		entry_length = available;
+	}
+	else
+	{
+		if ( !read_download_history_values( di, p, available, offset ) )
+		{
+			GlobalFree( di->filename );
+			GlobalFree( di );
 
-		LVITEM lvi;
-		_memzero( &lvi, sizeof( LVITEM ) );
-		lvi.mask = LVIF_PARAM;
+			goto CLEANUP;
+		}
 
-		for ( lvi.iItem = 0; lvi.iItem < item_count; ++lvi.iItem )
-		{
-			_SendMessageW( g_hWnd_files, LVM_GETITEM, 0, ( LPARAM )&lvi );
+		entry_length = ( offset <= available ? offset : available );	// This value is the length of the valid entry.
+	}
 
-			DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )lvi.lParam;
+	di->hFile = INVALID_HANDLE_VALUE;
 
-			// lstrlen is safe for NULL values.
-			int download_directory_length = di->filename_offset * sizeof( wchar_t );	// Includes the NULL terminator.
-			int filename_length = ( lstrlenW( di->file_path + di->filename_offset ) + 1 ) * sizeof( wchar_t );
-			int url_length = ( lstrlenW( di->url ) + 1 ) * sizeof( wchar_t );
+	di->add_time.QuadPart = add_time.QuadPart;
+	di->downloaded = downloaded;
+	di->last_downloaded = downloaded;
+	di->file_size = file_size;
+	di->download_speed_limit = download_speed_limit;
+	di->parts = parts;
+	di->parts_limit = parts_limit;
+	di->status = status;
+	di->ssl_version = ssl_version;
+	di->processed_header = processed_header;
+	di->download_operations = download_operations;
+	di->method = method;
+	di->last_modified.QuadPart = last_modified.QuadPart;
 
-			int cookies_length = lstrlenA( di->cookies ) + 1;
-			int headers_length = lstrlenA( di->headers ) + 1;
-			int data_length = lstrlenA( di->data ) + 1;
+	di->print_range_list = di->range_list;
 
-			int username_length = lstrlenA( di->auth_info.username );
-			int password_length = lstrlenA( di->auth_info.password );
+	// Entries in the same directory share it.
+	_wmemcpy_s( directory, MAX_PATH, download_directory, download_directory_length );
+	directory[ download_directory_length - 1 ] = 0;	// Sanity.
 
-			// See if the next entry can fit in the buffer. If it can't, then we dump the buffer.
-			if ( ( signed )( pos + filename_length + download_directory_length + url_length + cookies_length + headers_length + data_length + username_length + password_length +
-						   ( sizeof( int ) * 2 ) + ( sizeof( ULONGLONG ) * 2 ) + ( sizeof( unsigned long long ) * 3 ) + ( sizeof( unsigned char ) * 5 ) + sizeof( unsigned int ) + sizeof( bool ) ) > size )
-			{
-				// Dump the buffer.
-				WriteFile( hFile_downloads, write_buf, pos, &write, NULL );
-				pos = 0;
-			}
+	di->download_directory = InternString( directory );
 
-			_memcpy_s( write_buf + pos, size - pos, &di->add_time.QuadPart, sizeof( ULONGLONG ) );
-			pos += sizeof( ULONGLONG );
+	di->filename_offset = download_directory_length;	// Includes the NULL terminator.
 
-			_memcpy_s( write_buf + pos, size - pos, &di->downloaded, sizeof( unsigned long long ) );
-			pos += sizeof( unsigned long long );
+	_wmemcpy_s( di->filename, filename_size, filename, filename_length + 1 );
+	di->filename[ filename_length ] = 0;	// Sanity.
 
-			_memcpy_s( write_buf + pos, size - pos, &di->file_size, sizeof( unsigned long long ) );
-			pos += sizeof( unsigned long long );
+	di->file_extension_offset = get_file_extension_offset( di->filename, filename_length );
 
-			_memcpy_s( write_buf + pos, size - pos, &di->download_speed_limit, sizeof( unsigned long long ) );
-			pos += sizeof( unsigned long long );
+	return di;
 
-			_memcpy_s( write_buf + pos, size - pos, &di->parts, sizeof( unsigned char ) );
-			pos += sizeof( unsigned char );
+CLEANUP:
+	return NULL;
+}
 
-			_memcpy_s( write_buf + pos, size - pos, &di->parts_limit, sizeof( unsigned char ) );
-			pos += sizeof( unsigned char );
 
-			_memcpy_s( write_buf + pos, size - pos, &di->status, sizeof( unsigned int ) );
-			pos += sizeof( unsigned int );
+CRITICAL_SECTION history_view_cs;	// Guards the view of the history file that deferred entries are read from.
 
-			_memcpy_s( write_buf + pos, size - pos, &di->ssl_version, sizeof( char ) );
-			pos += sizeof( char );
+char *history_view = NULL;		// The history file stays mapped while it has entries whose values haven't been read.
+DWORD history_view_size = 0;
 
-			_memcpy_s( write_buf + pos, size - pos, &di->processed_header, sizeof( bool ) );
-			pos += sizeof( bool );
+// Reads the values of an entry that were deferred when the download history was loaded.
+// The history_view_cs critical section must be held by the caller.
+void read_deferred_history_entry( DOWNLOAD_INFO *di )
+{
+	if ( di->history_entry != NULL )
+	{
+		DWORD offset = 0;
+		if ( !read_download_history_values( di, di->history_entry, ( DWORD )( ( history_view + history_view_size ) - di->history_entry ), offset ) )
+		{
+			// The entry is damaged, but it can still be displayed and removed.
+			di->url = GlobalStrDupW( L"" );
+		}
 
-			_memcpy_s( write_buf + pos, size - pos, &di->download_operations, sizeof( unsigned char ) );
-			pos += sizeof( unsigned char );
+		// The list draws print_range_list without a lock, so it's set after the ranges are released.
+		if ( di->status == STATUS_COMPLETED )
+		{
+			ReleaseCompletedRanges( di );
+		}
 
-			_memcpy_s( write_buf + pos, size - pos, &di->method, sizeof( unsigned char ) );
-			pos += sizeof( unsigned char );
+		di->print_range_list = di->range_list;
 
-			_memcpy_s( write_buf + pos, size - pos, &di->last_modified.QuadPart, sizeof( ULONGLONG ) );
-			pos += sizeof( ULONGLONG );
+		// The values are set before anyone can see that they've been read.
+		InterlockedExchangePointer( ( void ** )&di->history_entry, NULL );
+	}
+}
 
-			_memcpy_s( write_buf + pos, size - pos, di->file_path, download_directory_length );
-			pos += download_directory_length;
+// This needs to be done before a download's URL, cookies, headers, data, credentials, or ranges are used.
+void load_deferred_history_entry( DOWNLOAD_INFO *di )
+{
+	if ( di == NULL || di->history_entry == NULL )
+	{
+		return;
+	}
 
-			_memcpy_s( write_buf + pos, size - pos, di->file_path + di->filename_offset, filename_length );
-			pos += filename_length;
+	EnterCriticalSection( &history_view_cs );
 
-			_memcpy_s( write_buf + pos, size - pos, di->url, url_length );
-			pos += url_length;
+	read_deferred_history_entry( di );
 
-			_memcpy_s( write_buf + pos, size - pos, di->cookies, cookies_length );
-			pos += cookies_length;
+	LeaveCriticalSection( &history_view_cs );
+}
 
-			_memcpy_s( write_buf + pos, size - pos, di->headers, headers_length );
-			pos += headers_length;
+// The history file can't be replaced while it's mapped. If read_entries is set, then every deferred entry is read before the view is unmapped.
+// The entries must have been freed if read_entries is not set.
+void unmap_download_history( bool read_entries )
+{
+	if ( read_entries )
+	{
+		EnterCriticalSection( &download_list_cs );
+	}
 
-			_memcpy_s( write_buf + pos, size - pos, di->data, data_length );
-			pos += data_length;
+	EnterCriticalSection( &history_view_cs );
 
-			if ( di->auth_info.username != NULL )
+	if ( history_view != NULL )
+	{
+		if ( read_entries )
+		{
+			node_type *node = dllrbt_get_head( g_download_list );
+			while ( node != NULL )
 			{
-				_memcpy_s( write_buf + pos, size - pos, &username_length, sizeof( int ) );
-				pos += sizeof( int );
+				read_deferred_history_entry( ( DOWNLOAD_INFO * )node->val );
 
-				_memcpy_s( write_buf + pos, size - pos, di->auth_info.username, username_length );
-				encode_cipher( write_buf + pos, username_length );
-				pos += username_length;
-			}
-			else
-			{
-				_memset( write_buf + pos, 0, sizeof( int ) );
-				pos += sizeof( int );
+				node = node->next;
 			}
+		}
 
-			if ( di->auth_info.password != NULL )
-			{
-				_memcpy_s( write_buf + pos, size - pos, &password_length, sizeof( int ) );
-				pos += sizeof( int );
+		UnmapViewOfFile( history_view );
+		history_view = NULL;
+		history_view_size = 0;
+	}
 
-				_memcpy_s( write_buf + pos, size - pos, di->auth_info.password, password_length );
-				encode_cipher( write_buf + pos, password_length );
-				pos += password_length;
-			}
-			else
-			{
-				_memset( write_buf + pos, 0, sizeof( int ) );
-				pos += sizeof( int );
-			}
+	LeaveCriticalSection( &history_view_cs );
 
-			unsigned char range_count = 0;
-			DoublyLinkedList *range_node = di->range_list;
-			while ( range_node != NULL )
-			{
-				++range_count;
+	if ( read_entries )
+	{
+		LeaveCriticalSection( &download_list_cs );
+	}
+}
 
-				range_node = range_node->next;
-			}
+// Frees an entry that was replaced or removed by the history journal.
+void free_download_history_entry( DOWNLOAD_INFO *di )
+{
+	GlobalFree( di->url );
+	ReleaseString( di->cookies );
+	ReleaseString( di->headers );
+	ReleaseString( di->data );
+	GlobalFree( di->auth_info.username );
+	GlobalFree( di->auth_info.password );
+
+	DoublyLinkedList *range_node;
+	while ( di->range_list != NULL )
+	{
+		range_node = di->range_list;
+		di->range_list = di->range_list->next;
 
-			// See if the next entry can fit in the buffer. If it can't, then we dump the buffer.
-			if ( ( signed )( pos + sizeof( unsigned char ) + ( sizeof( unsigned long long ) * 5 ) ) > size )
-			{
-				// Dump the buffer.
-				WriteFile( hFile_downloads, write_buf, pos, &write, NULL );
-				pos = 0;
-			}
+		GlobalFree( range_node->data );
+		GlobalFree( range_node );
+	}
 
-			_memcpy_s( write_buf + pos, size - pos, &range_count, sizeof( unsigned char ) );
-			pos += sizeof( unsigned char );
+	ReleaseString( di->download_directory );
+	GlobalFree( di->filename );
+	GlobalFree( di );
+}
 
-			range_node = di->range_list;
-			while ( range_node != NULL )
-			{
-				RANGE_INFO *ri = ( RANGE_INFO * )range_node->data;
+// Adds a parsed entry to the download list. Downloads that were active when the history was saved are resumed.
+void add_download_history_entry( DOWNLOAD_INFO *di, SHFILEINFO *sfi )
+{
+	// Cache our file's icon.
+	ICON_INFO *ii = CacheIcon( di, sfi );
 
-				//_memcpy_s( write_buf + pos, size - pos, ri, sizeof( RANGE_INFO ) );
-				//pos += sizeof( RANGE_INFO );
+	if ( ii != NULL )
+	{
+		di->icon = &ii->icon;
+	}
 
-				_memcpy_s( write_buf + pos, size - pos, &ri->range_start, sizeof( unsigned long long ) );
-				pos += sizeof( unsigned long long );
+	InitializeCriticalSection( &di->shared_cs );
 
-				_memcpy_s( write_buf + pos, size - pos, &ri->range_end, sizeof( unsigned long long ) );
-				pos += sizeof( unsigned long long );
+	// Use the ranges that were on the disk if the program didn't exit cleanly.
+	if ( di->status != STATUS_COMPLETED && di->range_list != NULL && ReconcileRangeCheckpoint( di ) )
+	{
+		MarkDownloadChanged( di );
+	}
+	else if ( di->status == STATUS_COMPLETED )
+	{
+		ReleaseCompletedRanges( di );
+	}
 
-				_memcpy_s( write_buf + pos, size - pos, &ri->content_length, sizeof( unsigned long long ) );
-				pos += sizeof( unsigned long long );
+	// w_add_time is formatted when it's first displayed.
 
-				_memcpy_s( write_buf + pos, size - pos, &ri->content_offset, sizeof( unsigned long long ) );
-				pos += sizeof( unsigned long long );
+	AddDownload( di );
 
-				_memcpy_s( write_buf + pos, size - pos, &ri->file_write_offset, sizeof( unsigned long long ) );
-				pos += sizeof( unsigned long long );
+	g_download_observer->AddItem( di );
 
-				range_node = range_node->next;
-			}
+	if ( IS_STATUS( di->status, STATUS_PAUSED ) )	// Paused
+	{
+		di->status = STATUS_STOPPED;	// Stopped
+	}
+	else if ( IS_STATUS( di->status,
+				 STATUS_CONNECTING |
+				 STATUS_DOWNLOADING |
+				 STATUS_RESTART ) )	// Connecting, Downloading, Queued, or Restarting
+	{
+		if ( cfg_resume_downloads )
+		{
+			StartDownload( di, false );
 		}
-
-		// If there's anything remaining in the buffer, then write it to the file.
-		if ( pos > 0 )
+		else
 		{
-			WriteFile( hFile_downloads, write_buf, pos, &write, NULL );
+			di->status = STATUS_STOPPED;	// Stopped
 		}
-
-		GlobalFree( write_buf );
-
-		CloseHandle( hFile_downloads );
 	}
-	else
+	else if ( di->status == STATUS_ALLOCATING_FILE )	// If we were allocating the file, then set it to a File IO Error.
 	{
-		ret_status = -1;	// Can't open file for writing.
+		di->status = STATUS_FILE_IO_ERROR;
 	}
-
-	return ret_status;
 }
 
-char save_download_history_csv_file( wchar_t *file_path )
+// Reads the journal of the history file and finds the last record of each key.
+// Returns NULL if the journal is missing, or if it belongs to an older history file. The older journal's changes are already in the history file.
+HISTORY_RECORD *read_download_history_journal( wchar_t *journal_path, unsigned long long generation, char **journal_buf, unsigned int &record_count )
 {
-	char ret_status = 0;
+	HISTORY_RECORD *records = NULL;
 
-	HANDLE hFile_download_history = CreateFile( file_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
-	if ( hFile_download_history != INVALID_HANDLE_VALUE )
+	record_count = 0;
+
+	HANDLE hFile_journal = CreateFile( journal_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile_journal != INVALID_HANDLE_VALUE )
 	{
-		int size = ( 32768 + 1 );
-		int pos = 0;
-		DWORD write = 0;
-		char unix_timestamp[ 21 ];
-		_memzero( unix_timestamp, 21 );
-		char file_size[ 21 ];
-		_memzero( file_size, 21 );
-		char downloaded[ 21 ];
-		_memzero( downloaded, 21 );
+		DWORD read = 0;
+		DWORD fz = GetFileSize( hFile_journal, NULL );
 
-		char *write_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * size );
+		if ( fz != INVALID_FILE_SIZE && fz >= HISTORY_JOURNAL_HEADER_SIZE )
+		{
+			*journal_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * fz );
+			if ( *journal_buf != NULL )
+			{
+				ReadFile( hFile_journal, *journal_buf, fz, &read, NULL );
 
-		// Write the UTF-8 BOM and CSV column titles.
-		WriteFile( hFile_download_history, "\xEF\xBB\xBF\"Filename\",\"Download Directory\",\"Date and Time Added\",\"Unix Timestamp\",\"Downloaded (bytes)\",\"File Size (bytes)\",\"URL\"", 120, &write, NULL );
+				unsigned long long journal_generation = 0;
+				if ( read == fz )
+				{
+					_memcpy_s( &journal_generation, sizeof( unsigned long long ), *journal_buf + 4, sizeof( unsigned long long ) );
+				}
 
-		int item_count = ( int )_SendMessageW( g_hWnd_files, LVM_GETITEMCOUNT, 0, 0 );
+				if ( read == fz && _memcmp( *journal_buf, MAGIC_ID_DOWNLOAD_JOURNAL, 4 ) == 0 && journal_generation == generation )
+				{
+					unsigned char type;
+					unsigned int key;
+					unsigned int entry_length;
+					unsigned long checksum;
 
-		LVITEM lvi;
-		_memzero( &lvi, sizeof( LVITEM ) );
-		lvi.mask = LVIF_PARAM;
+					unsigned int max_key = 0;
 
-		for ( lvi.iItem = 0; lvi.iItem < item_count; ++lvi.iItem )
-		{
-			_SendMessageW( g_hWnd_files, LVM_GETITEM, 0, ( LPARAM )&lvi );
+					// The first pass finds the last valid record. Anything after it was left by an incomplete save.
+					DWORD offset = HISTORY_JOURNAL_HEADER_SIZE;
+					while ( offset + HISTORY_RECORD_HEADER_SIZE <= fz )
+					{
+						char *p = *journal_buf + offset;
 
-			DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )lvi.lParam;
+						type = *p;
+						_memcpy_s( &key, sizeof( unsigned int ), p + 1, sizeof( unsigned int ) );
+						_memcpy_s( &entry_length, sizeof( unsigned int ), p + 5, sizeof( unsigned int ) );
+						_memcpy_s( &checksum, sizeof( unsigned long ), p + 9, sizeof( unsigned long ) );
 
-			int download_directory_length = WideCharToMultiByte( CP_UTF8, 0, di->file_path, -1, NULL, 0, NULL, NULL );
-			char *utf8_download_directory = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * download_directory_length ); // Size includes the null character.
-			download_directory_length = WideCharToMultiByte( CP_UTF8, 0, di->file_path, -1, utf8_download_directory, download_directory_length, NULL, NULL ) - 1;
+						if ( type < HISTORY_RECORD_ADD || type > HISTORY_RECORD_REMOVE || key == 0 ||
+							 entry_length > fz - ( offset + HISTORY_RECORD_HEADER_SIZE ) ||
+							 checksum != hash_download_history_entry( p + HISTORY_RECORD_HEADER_SIZE, entry_length ) )
+						{
+							break;
+						}
 
-			int filename_length = WideCharToMultiByte( CP_UTF8, 0, di->file_path + di->filename_offset, -1, NULL, 0, NULL, NULL );
-			char *utf8_filename = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * filename_length ); // Size includes the null character.
-			filename_length = WideCharToMultiByte( CP_UTF8, 0, di->file_path + di->filename_offset, -1, utf8_filename, filename_length, NULL, NULL ) - 1;
+						if ( key > max_key )
+						{
+							max_key = key;
+						}
 
-			int time_length = WideCharToMultiByte( CP_UTF8, 0, di->w_add_time, -1, NULL, 0, NULL, NULL );
-			char *utf8_time = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * time_length ); // Size includes the null character.
-			time_length = WideCharToMultiByte( CP_UTF8, 0, di->w_add_time, -1, utf8_time, time_length, NULL, NULL ) - 1;
+						offset += HISTORY_RECORD_HEADER_SIZE + entry_length;
+					}
 
-			int url_length = WideCharToMultiByte( CP_UTF8, 0, di->url, -1, NULL, 0, NULL, NULL );
-			char *utf8_url = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * url_length ); // Size includes the null character.
-			url_length = WideCharToMultiByte( CP_UTF8, 0, di->url, -1, utf8_url, url_length, NULL, NULL ) - 1;
+					history_journal_size = offset;
 
-			char *escaped_url = escape_csv( utf8_url );
-			if ( escaped_url != NULL )
-			{
-				GlobalFree( utf8_url );
+					records = ( HISTORY_RECORD * )GlobalAlloc( GPTR, sizeof( HISTORY_RECORD ) * ( max_key + 1 ) );
+					if ( records != NULL )
+					{
+						record_count = max_key + 1;
 
-				utf8_url = escaped_url;
-				url_length = lstrlenA( utf8_url );
-			}
+						// The second pass keeps the last record of each key.
+						offset = HISTORY_JOURNAL_HEADER_SIZE;
+						while ( offset < history_journal_size )
+						{
+							char *p = *journal_buf + offset;
 
-			// Convert the time into a 32bit Unix timestamp.
-			ULARGE_INTEGER date;
-			date.HighPart = di->add_time.HighPart;
-			date.LowPart = di->add_time.LowPart;
+							_memcpy_s( &key, sizeof( unsigned int ), p + 1, sizeof( unsigned int ) );
+							_memcpy_s( &entry_length, sizeof( unsigned int ), p + 5, sizeof( unsigned int ) );
 
-			date.QuadPart -= ( 11644473600000 * 10000 );
+							records[ key ].type = *p;
+							records[ key ].entry = p + HISTORY_RECORD_HEADER_SIZE;
+							records[ key ].entry_length = entry_length;
+
+							offset += HISTORY_RECORD_HEADER_SIZE + entry_length;
+						}
+					}
+				}
+
+				if ( records == NULL )
+				{
+					GlobalFree( *journal_buf );
+					*journal_buf = NULL;
+				}
+			}
+		}
+
+		CloseHandle( hFile_journal );
+	}
+
+	return records;
+}
+
+// If load_journal is set, then the file is the program's download history and its journal is applied to the entries.
+char read_download_history( wchar_t *file_path, bool load_journal )
+{
+	char ret_status = 0;
+
+	if ( load_journal )
+	{
+		EnterCriticalSection( &history_journal_cs );
+
+		history_generation = 0;
+		history_journal_size = 0;
+		history_snapshot_size = 0;
+	}
+
+	HANDLE hFile_read = CreateFile( file_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile_read != INVALID_HANDLE_VALUE )
+	{
+		DWORD read = 0, offset = 0, entry_length = 0;
+
+		DWORD header_length = 4;
+
+		unsigned long long generation = 0;
+
+		bool has_index = false;
+
+		char magic_identifier[ 4 ];
+		ReadFile( hFile_read, magic_identifier, sizeof( char ) * 4, &read, NULL );
+		if ( read == 4 && _memcmp( magic_identifier, MAGIC_ID_DOWNLOADS, 4 ) == 0 )
+		{
+			has_index = true;
+		}
+
+		if ( has_index || ( read == 4 && _memcmp( magic_identifier, MAGIC_ID_DOWNLOADS_6, 4 ) == 0 ) )
+		{
+			ReadFile( hFile_read, &generation, sizeof( unsigned long long ), &read, NULL );
+			if ( read != sizeof( unsigned long long ) )
+			{
+				generation = 0;
+			}
+
+			header_length += sizeof( unsigned long long );
+		}
+		else if ( read != 4 || _memcmp( magic_identifier, MAGIC_ID_DOWNLOADS_5, 4 ) != 0 )
+		{
+			ret_status = -2;	// Bad file format.
+		}
+
+		if ( ret_status == 0 )
+		{
+			DWORD fz = GetFileSize( hFile_read, NULL );
+
+			char *journal_buf = NULL;
+			HISTORY_RECORD *records = NULL;
+			unsigned int record_count = 0;
+			unsigned int key = 0;
+
+			if ( load_journal && generation != 0 )
+			{
+				wchar_t journal_path[ MAX_PATH ];
+				if ( get_download_history_path( file_path, L"_journal", 8, journal_path ) )
+				{
+					records = read_download_history_journal( journal_path, generation, &journal_buf, record_count );
+				}
+
+				// The history file will be rewritten on the next save if it doesn't have a valid journal.
+				if ( records != NULL )
+				{
+					history_generation = generation;
+				}
+			}
+
+			SHFILEINFO *sfi = ( SHFILEINFO * )GlobalAlloc( GMEM_FIXED, sizeof( SHFILEINFO ) );
+
+			// The entries are parsed directly from a view of the file rather than being copied into a buffer.
+			HANDLE hFileMapping = NULL;
+			char *file_view = NULL;
+
+			if ( fz != INVALID_FILE_SIZE && fz > header_length )
+			{
+				hFileMapping = CreateFileMapping( hFile_read, NULL, PAGE_READONLY, 0, 0, NULL );
+				if ( hFileMapping != NULL )
+				{
+					file_view = ( char * )MapViewOfFile( hFileMapping, FILE_MAP_READ, 0, 0, 0 );
+				}
+			}
+
+			if ( file_view != NULL )
+			{
+				DWORD entries_end = fz;
+
+				// The file ends with the offset of each entry, followed by the entry count and the offset of the index.
+				char *index = NULL;
+				unsigned int index_count = 0;
+
+				if ( has_index && fz >= header_length + HISTORY_INDEX_TRAILER_SIZE )
+				{
+					unsigned int index_offset;
+					_memcpy_s( &index_count, sizeof( unsigned int ), file_view + ( fz - HISTORY_INDEX_TRAILER_SIZE ), sizeof( unsigned int ) );
+					_memcpy_s( &index_offset, sizeof( unsigned int ), file_view + ( fz - sizeof( unsigned int ) ), sizeof( unsigned int ) );
+
+					DWORD index_length = fz - HISTORY_INDEX_TRAILER_SIZE - index_offset;
+
+					// A file without a valid index is read in order.
+					if ( index_offset >= header_length && index_offset <= fz - HISTORY_INDEX_TRAILER_SIZE &&
+						 index_length % sizeof( unsigned int ) == 0 && index_length / sizeof( unsigned int ) == index_count )
+					{
+						index = file_view + index_offset;
+						entries_end = index_offset;
+					}
+				}
+
+				// The index gives each entry's length, so a completed download's values can be read when they're first needed.
+				// The view is kept until then.
+				bool defer_values = false;
+				unsigned int deferred_count = 0;
+
+				if ( load_journal && index != NULL )
+				{
+					EnterCriticalSection( &history_view_cs );
+
+					if ( history_view == NULL )
+					{
+						history_view = file_view;
+						history_view_size = fz;
+
+						defer_values = true;
+					}
+
+					LeaveCriticalSection( &history_view_cs );
+				}
+
+				offset = header_length;	// Offset past the header.
+
+				while ( offset < entries_end )
+				{
+					DWORD next_offset = entries_end;
+
+					if ( index != NULL )
+					{
+						if ( key >= index_count )
+						{
+							break;
+						}
+
+						_memcpy_s( &offset, sizeof( DWORD ), index + ( key * sizeof( unsigned int ) ), sizeof( unsigned int ) );
+
+						if ( key + 1 < index_count )
+						{
+							_memcpy_s( &next_offset, sizeof( DWORD ), index + ( ( key + 1 ) * sizeof( unsigned int ) ), sizeof( unsigned int ) );
+						}
+
+						if ( offset < header_length || offset >= next_offset || next_offset > entries_end )
+						{
+							break;	// The index is damaged.
+						}
+					}
+
+					++key;	// The entry's position in the file.
+
+					DOWNLOAD_INFO *di = NULL;
+
+					// The index lets us skip an entry that the journal replaces.
+					if ( index == NULL || key >= record_count || records[ key ].type == HISTORY_RECORD_NONE )
+					{
+						di = read_download_history_entry( file_view + offset, next_offset - offset, entry_length, defer_values );
+
+						if ( index == NULL )
+						{
+							if ( di == NULL )
+							{
+								break;	// The rest of the file is incomplete.
+							}
+
+							next_offset = offset + entry_length;
+						}
+					}
+
+					// Apply the last change that the journal has for the entry.
+					if ( key < record_count && records[ key ].type != HISTORY_RECORD_NONE )
+					{
+						if ( di != NULL )
+						{
+							free_download_history_entry( di );
+							di = NULL;
+						}
+
+						if ( records[ key ].type != HISTORY_RECORD_REMOVE )
+						{
+							DWORD record_entry_length;
+							di = read_download_history_entry( records[ key ].entry, records[ key ].entry_length, record_entry_length, false );
+						}
+
+						records[ key ].type = HISTORY_RECORD_NONE;	// Handled.
+					}
+
+					offset = next_offset;
+
+					if ( di != NULL )
+					{
+						if ( di->history_entry != NULL )
+						{
+							++deferred_count;
+						}
+
+						if ( load_journal )
+						{
+							di->history_key = key;
+						}
+
+						add_download_history_entry( di, sfi );
+					}
+				}
+
+				if ( defer_values && deferred_count > 0 )
+				{
+					file_view = NULL;	// It's unmapped once the history file is replaced, or when the program exits.
+				}
+				else if ( defer_values )
+				{
+					EnterCriticalSection( &history_view_cs );
+
+					history_view = NULL;
+					history_view_size = 0;
+
+					LeaveCriticalSection( &history_view_cs );
+				}
+
+				if ( file_view != NULL )
+				{
+					UnmapViewOfFile( file_view );
+				}
+			}
+
+			if ( hFileMapping != NULL )
+			{
+				CloseHandle( hFileMapping );
+			}
+
+			// The remaining records are for entries that were added after the history file was written.
+			for ( unsigned int i = 1; i < record_count; ++i )
+			{
+				if ( records[ i ].type == HISTORY_RECORD_ADD || records[ i ].type == HISTORY_RECORD_UPDATE )
+				{
+					DWORD record_entry_length;
+					DOWNLOAD_INFO *di = read_download_history_entry( records[ i ].entry, records[ i ].entry_length, record_entry_length, false );
+					if ( di != NULL )
+					{
+						di->history_key = i;
+
+						add_download_history_entry( di, sfi );
+					}
+				}
+			}
+
+			if ( load_journal )
+			{
+				g_next_history_key = ( record_count > key + 1 ? record_count : key + 1 );
+
+				history_snapshot_size = ( fz != INVALID_FILE_SIZE ? fz : 0 );
+			}
+
+			GlobalFree( records );
+			GlobalFree( journal_buf );
+
+			GlobalFree( sfi );
+
+			g_download_observer->SortItems();
+		}
+
+		CloseHandle( hFile_read );
+	}
+	else
+	{
+		ret_status = -1;	// Can't open file for reading.
+	}
+
+	if ( load_journal )
+	{
+		LeaveCriticalSection( &history_journal_cs );
+	}
+
+	return ret_status;
+}
+
+// Writes the entry to the buffer at buffer_offset. The buffer is enlarged if the entry doesn't fit.
+// Returns the length of the entry, or 0 if the buffer couldn't be enlarged.
+unsigned int write_download_history_entry( DOWNLOAD_INFO *di, char **buffer, unsigned int &buffer_size, unsigned int buffer_offset )
+{
+	load_deferred_history_entry( di );
+
+	// lstrlen is safe for NULL values.
+	int download_directory_length = di->filename_offset * sizeof( wchar_t );	// Includes the NULL terminator.
+	int filename_length = ( lstrlenW( di->filename ) + 1 ) * sizeof( wchar_t );
+	int url_length = ( lstrlenW( di->url ) + 1 ) * sizeof( wchar_t );
+
+	int cookies_length = lstrlenA( di->cookies ) + 1;
+	int headers_length = lstrlenA( di->headers ) + 1;
+	int data_length = lstrlenA( di->data ) + 1;
+
+	int username_length = lstrlenA( di->auth_info.username );
+	int password_length = lstrlenA( di->auth_info.password );
+
+	// Active parts can split their ranges while we're saving them.
+	EnterCriticalSection( &di->shared_cs );
+
+	unsigned char range_count = 0;
+	DoublyLinkedList *range_node = di->range_list;
+	while ( range_node != NULL )
+	{
+		++range_count;
+
+		range_node = range_node->next;
+	}
+
+	unsigned int entry_length = download_directory_length + filename_length + url_length + cookies_length + headers_length + data_length + username_length + password_length +
+							  ( sizeof( int ) * 2 ) + ( sizeof( ULONGLONG ) * 2 ) + ( sizeof( unsigned long long ) * 3 ) + ( sizeof( unsigned char ) * 5 ) + sizeof( unsigned int ) + sizeof( bool ) +
+								sizeof( unsigned char ) + ( range_count * ( sizeof( unsigned long long ) * 5 ) );
+
+	if ( buffer_offset + entry_length > buffer_size )
+	{
+		char *realloc_buffer = ( char * )GlobalReAlloc( *buffer, sizeof( char ) * ( buffer_offset + entry_length ), GMEM_MOVEABLE );
+		if ( realloc_buffer == NULL )
+		{
+			LeaveCriticalSection( &di->shared_cs );
+
+			return 0;
+		}
+
+		*buffer = realloc_buffer;
+		buffer_size = buffer_offset + entry_length;
+	}
+
+	char *write_buf = *buffer;
+	unsigned int size = buffer_size;
+	unsigned int pos = buffer_offset;
+
+	_memcpy_s( write_buf + pos, size - pos, &di->add_time.QuadPart, sizeof( ULONGLONG ) );
+	pos += sizeof( ULONGLONG );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->downloaded, sizeof( unsigned long long ) );
+	pos += sizeof( unsigned long long );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->file_size, sizeof( unsigned long long ) );
+	pos += sizeof( unsigned long long );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->download_speed_limit, sizeof( unsigned long long ) );
+	pos += sizeof( unsigned long long );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->parts, sizeof( unsigned char ) );
+	pos += sizeof( unsigned char );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->parts_limit, sizeof( unsigned char ) );
+	pos += sizeof( unsigned char );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->status, sizeof( unsigned int ) );
+	pos += sizeof( unsigned int );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->ssl_version, sizeof( char ) );
+	pos += sizeof( char );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->processed_header, sizeof( bool ) );
+	pos += sizeof( bool );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->download_operations, sizeof( unsigned char ) );
+	pos += sizeof( unsigned char );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->method, sizeof( unsigned char ) );
+	pos += sizeof( unsigned char );
+
+	_memcpy_s( write_buf + pos, size - pos, &di->last_modified.QuadPart, sizeof( ULONGLONG ) );
+	pos += sizeof( ULONGLONG );
+
+	_memcpy_s( write_buf + pos, size - pos, ( di->download_directory != NULL ? di->download_directory : L"" ), download_directory_length );
+	pos += download_directory_length;
+
+	_memcpy_s( write_buf + pos, size - pos, di->filename, filename_length );
+	pos += filename_length;
+
+	_memcpy_s( write_buf + pos, size - pos, di->url, url_length );
+	pos += url_length;
+
+	_memcpy_s( write_buf + pos, size - pos, di->cookies, cookies_length );
+	pos += cookies_length;
+
+	_memcpy_s( write_buf + pos, size - pos, di->headers, headers_length );
+	pos += headers_length;
+
+	_memcpy_s( write_buf + pos, size - pos, di->data, data_length );
+	pos += data_length;
+
+	if ( di->auth_info.username != NULL )
+	{
+		_memcpy_s( write_buf + pos, size - pos, &username_length, sizeof( int ) );
+		pos += sizeof( int );
+
+		_memcpy_s( write_buf + pos, size - pos, di->auth_info.username, username_length );
+		encode_cipher( write_buf + pos, username_length );
+		pos += username_length;
+	}
+	else
+	{
+		_memset( write_buf + pos, 0, sizeof( int ) );
+		pos += sizeof( int );
+	}
+
+	if ( di->auth_info.password != NULL )
+	{
+		_memcpy_s( write_buf + pos, size - pos, &password_length, sizeof( int ) );
+		pos += sizeof( int );
+
+		_memcpy_s( write_buf + pos, size - pos, di->auth_info.password, password_length );
+		encode_cipher( write_buf + pos, password_length );
+		pos += password_length;
+	}
+	else
+	{
+		_memset( write_buf + pos, 0, sizeof( int ) );
+		pos += sizeof( int );
+	}
+
+	_memcpy_s( write_buf + pos, size - pos, &range_count, sizeof( unsigned char ) );
+	pos += sizeof( unsigned char );
+
+	range_node = di->range_list;
+	while ( range_node != NULL )
+	{
+		RANGE_INFO *ri = ( RANGE_INFO * )range_node->data;
+
+		//_memcpy_s( write_buf + pos, size - pos, ri, sizeof( RANGE_INFO ) );
+		//pos += sizeof( RANGE_INFO );
+
+		_memcpy_s( write_buf + pos, size - pos, &ri->range_start, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( write_buf + pos, size - pos, &ri->range_end, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( write_buf + pos, size - pos, &ri->content_length, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( write_buf + pos, size - pos, &ri->content_offset, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		_memcpy_s( write_buf + pos, size - pos, &ri->file_write_offset, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		range_node = range_node->next;
+	}
+
+	LeaveCriticalSection( &di->shared_cs );
+
+	return entry_length;
+}
+
+// Copies data to the write buffer. The buffer is written to the file when the data doesn't fit. Data that's larger than the buffer is written directly.
+bool buffer_download_history_data( HANDLE hFile, char *write_buf, unsigned int &pos, char *data, unsigned int data_length )
+{
+	bool write_success = true;
+
+	DWORD write = 0;
+
+	if ( pos + data_length > HISTORY_WRITE_BUFFER_SIZE )
+	{
+		// Dump the buffer.
+		if ( WriteFile( hFile, write_buf, pos, &write, NULL ) == FALSE || write != pos )
+		{
+			write_success = false;
+		}
+
+		pos = 0;
+	}
+
+	if ( data_length > HISTORY_WRITE_BUFFER_SIZE )
+	{
+		if ( WriteFile( hFile, data, data_length, &write, NULL ) == FALSE || write != data_length )
+		{
+			write_success = false;
+		}
+	}
+	else
+	{
+		_memcpy_s( write_buf + pos, HISTORY_WRITE_BUFFER_SIZE - pos, data, data_length );
+		pos += data_length;
+	}
+
+	return write_success;
+}
+
+// Writes every entry to the history file.
+// If save_keys is set, then the file is the one that the history journal is applied to. Each entry's key becomes its position in the file.
+char write_download_history_file( wchar_t *file_path, unsigned long long generation, bool save_keys )
+{
+	char ret_status = 0;
+
+	HANDLE hFile_downloads = CreateFile( file_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile_downloads != INVALID_HANDLE_VALUE )
+	{
+		bool write_success = true;
+
+		unsigned int pos = 0;
+		unsigned long long total_written = 0;
+		unsigned int key = 0;
+
+		char *write_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * HISTORY_WRITE_BUFFER_SIZE );
+
+		unsigned int entry_buf_size = 4096;
+		char *entry_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * entry_buf_size );
+
+		_memcpy_s( write_buf + pos, HISTORY_WRITE_BUFFER_SIZE - pos, MAGIC_ID_DOWNLOADS, sizeof( char ) * 4 );	// Magic identifier for the call log history.
+		pos += ( sizeof( char ) * 4 );
+
+		_memcpy_s( write_buf + pos, HISTORY_WRITE_BUFFER_SIZE - pos, &generation, sizeof( unsigned long long ) );
+		pos += sizeof( unsigned long long );
+
+		total_written = pos;
+
+		// The entries are written in the order that they were added.
+		EnterCriticalSection( &download_list_cs );
+
+		// Each entry's offset is written to an index at the end of the file.
+		unsigned int entry_count = 0;
+		unsigned int index_count = 0;
+
+		node_type *node = dllrbt_get_head( g_download_list );
+		while ( node != NULL )
+		{
+			++entry_count;
+
+			node = node->next;
+		}
+
+		unsigned int *index = ( unsigned int * )GlobalAlloc( GMEM_FIXED, sizeof( unsigned int ) * ( entry_count > 0 ? entry_count : 1 ) );
+		if ( index == NULL )
+		{
+			write_success = false;
+		}
+
+		node = dllrbt_get_head( g_download_list );
+		while ( node != NULL && write_success )
+		{
+			DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )node->val;
+
+			node = node->next;
+
+			// Changes that are made while the entry is written are saved again.
+			LONG changes = di->history_changes;
+
+			unsigned int entry_length = write_download_history_entry( di, &entry_buf, entry_buf_size, 0 );
+			if ( entry_length == 0 )
+			{
+				write_success = false;
+
+				continue;
+			}
+
+			if ( !buffer_download_history_data( hFile_downloads, write_buf, pos, entry_buf, entry_length ) )
+			{
+				write_success = false;
+			}
+
+			index[ index_count++ ] = ( unsigned int )total_written;
+
+			total_written += entry_length;
+
+			if ( save_keys )
+			{
+				di->history_key = ++key;
+
+				InterlockedExchangeAdd( &di->history_changes, -changes );
+			}
+		}
+
+		LeaveCriticalSection( &download_list_cs );
+
+		if ( write_success )
+		{
+			unsigned int trailer[ 2 ];
+			trailer[ 0 ] = index_count;
+			trailer[ 1 ] = ( unsigned int )total_written;	// The index offset.
+
+			if ( !buffer_download_history_data( hFile_downloads, write_buf, pos, ( char * )index, sizeof( unsigned int ) * index_count ) ||
+				 !buffer_download_history_data( hFile_downloads, write_buf, pos, ( char * )trailer, HISTORY_INDEX_TRAILER_SIZE ) )
+			{
+				write_success = false;
+			}
+
+			total_written += ( sizeof( unsigned int ) * index_count ) + HISTORY_INDEX_TRAILER_SIZE;
+		}
+
+		GlobalFree( index );
+
+		// If there's anything remaining in the buffer, then write it to the file.
+		if ( pos > 0 )
+		{
+			DWORD write = 0;
+			if ( WriteFile( hFile_downloads, write_buf, pos, &write, NULL ) == FALSE || write != pos )
+			{
+				write_success = false;
+			}
+		}
+
+		if ( save_keys )
+		{
+			// The file must be on the disk before it replaces the old one.
+			if ( FlushFileBuffers( hFile_downloads ) == FALSE )
+			{
+				write_success = false;
+			}
+
+			history_snapshot_size = total_written;
+
+			g_next_history_key = key + 1;
+		}
+
+		GlobalFree( entry_buf );
+		GlobalFree( write_buf );
+
+		CloseHandle( hFile_downloads );
+
+		if ( !write_success )
+		{
+			ret_status = -1;
+		}
+	}
+	else
+	{
+		ret_status = -1;	// Can't open file for writing.
+	}
+
+	return ret_status;
+}
+
+// Rewrites the history file with every entry and starts a new journal for it.
+// The new history file replaces the old one only after it's been completely written. The old journal doesn't match the new history file's generation, so a crash at any point leaves a usable pair.
+char compact_download_history( wchar_t *file_path, wchar_t *journal_path )
+{
+	char ret_status = -1;
+
+	unsigned long long generation = history_generation + 1;
+
+	history_generation = 0;	// If we fail, then the next save will try again.
+
+	// The history file is still mapped if it has deferred entries.
+	unmap_download_history( true );
+
+	wchar_t temp_file_path[ MAX_PATH ];
+	if ( get_download_history_path( file_path, L".tmp", 4, temp_file_path ) )
+	{
+		ret_status = write_download_history_file( temp_file_path, generation, true );
+		if ( ret_status == 0 && MoveFileExW( temp_file_path, file_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ) != FALSE )
+		{
+			HANDLE hFile_journal = CreateFile( journal_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+			if ( hFile_journal != INVALID_HANDLE_VALUE )
+			{
+				char header[ HISTORY_JOURNAL_HEADER_SIZE ];
+				_memcpy_s( header, HISTORY_JOURNAL_HEADER_SIZE, MAGIC_ID_DOWNLOAD_JOURNAL, sizeof( char ) * 4 );
+				_memcpy_s( header + 4, HISTORY_JOURNAL_HEADER_SIZE - 4, &generation, sizeof( unsigned long long ) );
+
+				DWORD write = 0;
+				if ( WriteFile( hFile_journal, header, HISTORY_JOURNAL_HEADER_SIZE, &write, NULL ) != FALSE && write == HISTORY_JOURNAL_HEADER_SIZE &&
+					 FlushFileBuffers( hFile_journal ) != FALSE )
+				{
+					history_generation = generation;
+					history_journal_size = HISTORY_JOURNAL_HEADER_SIZE;
+				}
+
+				CloseHandle( hFile_journal );
+			}
+		}
+		else
+		{
+			DeleteFileW( temp_file_path );
+
+			ret_status = -1;
+		}
+	}
+
+	// The history file has every entry that's still in the list.
+	removed_history_key_count = 0;
+
+	return ret_status;
+}
+
+// Saves the program's download history.
+// The entries that were added or marked as changed since the last save, and the keys of the entries that were removed, are appended to the history journal.
+// The journal is compacted into the history file once it's larger than the history file.
+char update_download_history( wchar_t *file_path )
+{
+	char ret_status = 0;
+
+	wchar_t journal_path[ MAX_PATH ];
+	if ( !get_download_history_path( file_path, L"_journal", 8, journal_path ) )
+	{
+		return save_download_history( file_path );
+	}
+
+	EnterCriticalSection( &history_journal_cs );
+
+	HANDLE hFile_journal = INVALID_HANDLE_VALUE;
+
+	// The history file is rewritten if it doesn't have a journal. It may be from an older version, or the last save failed.
+	if ( history_generation != 0 )
+	{
+		hFile_journal = CreateFile( journal_path, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	}
+
+	if ( hFile_journal != INVALID_HANDLE_VALUE )
+	{
+		bool write_success = true;
+
+		unsigned int pos = 0;
+		unsigned long long total_written = 0;
+
+		// Anything after the last valid record was left by an incomplete save. Overwrite it.
+		LARGE_INTEGER li;
+		li.QuadPart = history_journal_size;
+		SetFilePointer( hFile_journal, li.LowPart, &li.HighPart, FILE_BEGIN );
+
+		char *write_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * HISTORY_WRITE_BUFFER_SIZE );
+
+		unsigned int record_buf_size = 4096;
+		char *record_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * record_buf_size );
+
+		unsigned char type;
+		unsigned int key;
+		unsigned long hash;
+
+		EnterCriticalSection( &download_list_cs );
+
+		node_type *node = dllrbt_get_head( g_download_list );
+
+		while ( true )
+		{
+			unsigned int entry_length = 0;
+
+			if ( node != NULL )
+			{
+				DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )node->val;
+
+				node = node->next;
+
+				// Changes that are made while the entry is written are saved again.
+				LONG changes = di->history_changes;
+
+				// Only the entries that were added or changed since the last save are written.
+				if ( di->history_key == 0 )
+				{
+					type = HISTORY_RECORD_ADD;
+				}
+				else if ( changes != 0 )
+				{
+					type = HISTORY_RECORD_UPDATE;
+				}
+				else
+				{
+					continue;
+				}
+
+				// The entry is written after the record header.
+				entry_length = write_download_history_entry( di, &record_buf, record_buf_size, HISTORY_RECORD_HEADER_SIZE );
+				if ( entry_length == 0 )
+				{
+					write_success = false;
+
+					continue;
+				}
+
+				if ( di->history_key == 0 )
+				{
+					di->history_key = g_next_history_key++;
+				}
+
+				InterlockedExchangeAdd( &di->history_changes, -changes );
+
+				// The hash lets the journal reader detect a torn record.
+				hash = hash_download_history_entry( record_buf + HISTORY_RECORD_HEADER_SIZE, entry_length );
+
+				key = di->history_key;
+			}
+			else	// Save the removed entries after the added and changed ones.
+			{
+				for ( unsigned int j = 0; j < removed_history_key_count; ++j )
+				{
+					type = HISTORY_RECORD_REMOVE;
+					key = removed_history_keys[ j ];
+					hash = hash_download_history_entry( NULL, 0 );
+
+					record_buf[ 0 ] = type;
+					_memcpy_s( record_buf + 1, record_buf_size - 1, &key, sizeof( unsigned int ) );
+					_memcpy_s( record_buf + 5, record_buf_size - 5, &entry_length, sizeof( unsigned int ) );
+					_memcpy_s( record_buf + 9, record_buf_size - 9, &hash, sizeof( unsigned long ) );
+
+					if ( !buffer_download_history_data( hFile_journal, write_buf, pos, record_buf, HISTORY_RECORD_HEADER_SIZE ) )
+					{
+						write_success = false;
+					}
+
+					total_written += HISTORY_RECORD_HEADER_SIZE;
+				}
+
+				break;
+			}
+
+			record_buf[ 0 ] = type;
+			_memcpy_s( record_buf + 1, record_buf_size - 1, &key, sizeof( unsigned int ) );
+			_memcpy_s( record_buf + 5, record_buf_size - 5, &entry_length, sizeof( unsigned int ) );
+			_memcpy_s( record_buf + 9, record_buf_size - 9, &hash, sizeof( unsigned long ) );
+
+			if ( !buffer_download_history_data( hFile_journal, write_buf, pos, record_buf, HISTORY_RECORD_HEADER_SIZE + entry_length ) )
+			{
+				write_success = false;
+			}
+
+			total_written += HISTORY_RECORD_HEADER_SIZE + entry_length;
+		}
+
+		LeaveCriticalSection( &download_list_cs );
+
+		// If there's anything remaining in the buffer, then write it to the file.
+		if ( pos > 0 )
+		{
+			DWORD write = 0;
+			if ( WriteFile( hFile_journal, write_buf, pos, &write, NULL ) == FALSE || write != pos )
+			{
+				write_success = false;
+			}
+		}
+
+		if ( write_success && FlushFileBuffers( hFile_journal ) != FALSE )
+		{
+			SetEndOfFile( hFile_journal );
+
+			history_journal_size += total_written;
+		}
+		else
+		{
+			write_success = false;
+		}
+
+		GlobalFree( record_buf );
+		GlobalFree( write_buf );
+
+		CloseHandle( hFile_journal );
+
+		removed_history_key_count = 0;
+
+		if ( !write_success )
+		{
+			ret_status = compact_download_history( file_path, journal_path );
+		}
+		else if ( history_journal_size > HISTORY_JOURNAL_COMPACT_SIZE && history_journal_size > history_snapshot_size )
+		{
+			ret_status = compact_download_history( file_path, journal_path );
+		}
+	}
+	else
+	{
+		ret_status = compact_download_history( file_path, journal_path );
+	}
+
+	LeaveCriticalSection( &history_journal_cs );
+
+	return ret_status;
+}
+
+// Remembers the key of a removed entry so that its removal can be saved to the history journal.
+void remove_download_history_entry( DOWNLOAD_INFO *di )
+{
+	if ( di == NULL || di->history_key == 0 )
+	{
+		return;
+	}
+
+	EnterCriticalSection( &history_journal_cs );
+
+	if ( removed_history_key_count == removed_history_key_capacity )
+	{
+		unsigned int capacity = ( removed_history_key_capacity > 0 ? removed_history_key_capacity * 2 : 64 );
+
+		unsigned int *keys;
+		if ( removed_history_keys == NULL )
+		{
+			keys = ( unsigned int * )GlobalAlloc( GMEM_FIXED, sizeof( unsigned int ) * capacity );
+		}
+		else
+		{
+			keys = ( unsigned int * )GlobalReAlloc( removed_history_keys, sizeof( unsigned int ) * capacity, GMEM_MOVEABLE );
+		}
+
+		if ( keys != NULL )
+		{
+			removed_history_keys = keys;
+			removed_history_key_capacity = capacity;
+		}
+	}
+
+	if ( removed_history_key_count < removed_history_key_capacity )
+	{
+		removed_history_keys[ removed_history_key_count++ ] = di->history_key;
+	}
+	else	// We couldn't remember the key. Rewrite the history file on the next save.
+	{
+		history_generation = 0;
+	}
+
+	LeaveCriticalSection( &history_journal_cs );
+}
+
+void free_removed_history_keys()
+{
+	if ( removed_history_keys != NULL )
+	{
+		GlobalFree( removed_history_keys );
+		removed_history_keys = NULL;
+	}
+
+	removed_history_key_count = 0;
+	removed_history_key_capacity = 0;
+}
+
+// Writes the entire history to a file. Used for exporting the download list.
+char save_download_history( wchar_t *file_path )
+{
+	return write_download_history_file( file_path, 0, false );
+}
+
+char save_download_history_csv_file( wchar_t *file_path )
+{
+	char ret_status = 0;
+
+	HANDLE hFile_download_history = CreateFile( file_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile_download_history != INVALID_HANDLE_VALUE )
+	{
+		int size = ( 32768 + 1 );
+		int pos = 0;
+		DWORD write = 0;
+		char unix_timestamp[ 21 ];
+		_memzero( unix_timestamp, 21 );
+		char file_size[ 21 ];
+		_memzero( file_size, 21 );
+		char downloaded[ 21 ];
+		_memzero( downloaded, 21 );
+
+		char *write_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * size );
+
+		// Write the UTF-8 BOM and CSV column titles.
+		WriteFile( hFile_download_history, "\xEF\xBB\xBF\"Filename\",\"Download Directory\",\"Date and Time Added\",\"Unix Timestamp\",\"Downloaded (bytes)\",\"File Size (bytes)\",\"URL\"", 120, &write, NULL );
+
+		EnterCriticalSection( &download_list_cs );
+
+		node_type *node = dllrbt_get_head( g_download_list );
+		while ( node != NULL )
+		{
+			DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )node->val;
+
+			node = node->next;
+
+			wchar_t *download_directory = ( di->download_directory != NULL ? di->download_directory : L"" );
+
+			int download_directory_length = WideCharToMultiByte( CP_UTF8, 0, download_directory, -1, NULL, 0, NULL, NULL );
+			char *utf8_download_directory = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * download_directory_length ); // Size includes the null character.
+			download_directory_length = WideCharToMultiByte( CP_UTF8, 0, download_directory, -1, utf8_download_directory, download_directory_length, NULL, NULL ) - 1;
+
+			int filename_length = WideCharToMultiByte( CP_UTF8, 0, di->filename, -1, NULL, 0, NULL, NULL );
+			char *utf8_filename = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * filename_length ); // Size includes the null character.
+			filename_length = WideCharToMultiByte( CP_UTF8, 0, di->filename, -1, utf8_filename, filename_length, NULL, NULL ) - 1;
+
+			wchar_t *w_add_time = GetDownloadAddTime( di );
+
+			int time_length = WideCharToMultiByte( CP_UTF8, 0, w_add_time, -1, NULL, 0, NULL, NULL );
+			char *utf8_time = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * time_length ); // Size includes the null character.
+			time_length = WideCharToMultiByte( CP_UTF8, 0, w_add_time, -1, utf8_time, time_length, NULL, NULL ) - 1;
+
+			load_deferred_history_entry( di );
+
+			int url_length = WideCharToMultiByte( CP_UTF8, 0, di->url, -1, NULL, 0, NULL, NULL );
+			char *utf8_url = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * url_length ); // Size includes the null character.
+			url_length = WideCharToMultiByte( CP_UTF8, 0, di->url, -1, utf8_url, url_length, NULL, NULL ) - 1;
+
+			char *escaped_url = escape_csv( utf8_url );
+			if ( escaped_url != NULL )
+			{
+				GlobalFree( utf8_url );
+
+				utf8_url = escaped_url;
+				url_length = lstrlenA( utf8_url );
+			}
+
+			// Convert the time into a 32bit Unix timestamp.
+			ULARGE_INTEGER date;
+			date.HighPart = di->add_time.HighPart;
+			date.LowPart = di->add_time.LowPart;
+
+			date.QuadPart -= ( 11644473600000 * 10000 );
 #ifdef _WIN64
 			date.QuadPart /= FILETIME_TICKS_PER_SECOND;
 #else
@@ -2687,6 +3643,8 @@ char save_download_history_csv_file( wchar_t *file_path )
 			GlobalFree( utf8_url );
 		}
 
+		LeaveCriticalSection( &download_list_cs );
+
 		// If there's anything remaining in the buffer, then write it to the file.
 		if ( pos > 0 )
 		{
@@ -20,14 +20,49 @@
 #define _FILE_OPERATIONS_H
 
 #define MAGIC_ID_SETTINGS		"HDM\x04"	// Version 5
-#define MAGIC_ID_DOWNLOADS		"HDM\x14"	// Version 5
+#define MAGIC_ID_DOWNLOADS		"HDM\x16"	// Version 7
+#define MAGIC_ID_DOWNLOADS_6	"HDM\x15"	// Version 6. Read only.
+#define MAGIC_ID_DOWNLOADS_5	"HDM\x14"	// Version 5. Read only.
 #define MAGIC_ID_LOGINS			"HDM\x20"	// Version 1
+#define MAGIC_ID_DOWNLOAD_JOURNAL	"HDM\x30"	// Version 1
+
+#define HISTORY_WRITE_BUFFER_SIZE		524288	// 512 KB buffer.
+#define HISTORY_JOURNAL_COMPACT_SIZE	1048576	// The journal is compacted into the history file once it's larger than 1 MB and larger than the history file.
+#define HISTORY_HASH_SEED				2166136261
+
+// The entry count and the offset of the entry index. They're the last values in the history file.
+#define HISTORY_INDEX_TRAILER_SIZE		( sizeof( unsigned int ) * 2 )
+
+// The magic identifier and generation.
+#define HISTORY_JOURNAL_HEADER_SIZE		( sizeof( char ) * 4 + sizeof( unsigned long long ) )
+// The type, key, entry length, and checksum of a record.
+#define HISTORY_RECORD_HEADER_SIZE		( sizeof( unsigned char ) + ( sizeof( unsigned int ) * 2 ) + sizeof( unsigned long ) )
+
+#define HISTORY_RECORD_NONE		0
+#define HISTORY_RECORD_ADD		1
+#define HISTORY_RECORD_UPDATE	2
+#define HISTORY_RECORD_REMOVE	3
+
+struct DOWNLOAD_INFO;
+
+struct HISTORY_RECORD
+{
+	char			*entry;			// Points into the journal buffer.
+	unsigned int	entry_length;
+	unsigned char	type;
+};
 
 char read_config();
 char save_config();
 
-char read_download_history( wchar_t *file_path );
+char read_download_history( wchar_t *file_path, bool load_journal = false );
 char save_download_history( wchar_t *file_path );
+char update_download_history( wchar_t *file_path );
+void remove_download_history_entry( DOWNLOAD_INFO *di );
+void free_removed_history_keys();
+
+void load_deferred_history_entry( DOWNLOAD_INFO *di );
+void unmap_download_history( bool read_entries );
 
 char save_download_history_csv_file( wchar_t *file_path );
 
@@ -36,4 +71,7 @@ wchar_t *read_url_list_file( wchar_t *file_path, unsigned int &url_list_length )
 wchar_t *UTF8StringToWideString( char *utf8_string, int string_length );
 char *WideStringToUTF8String( wchar_t *wide_string, int *utf8_string_length, int buffer_offset = 0 );
 
+extern CRITICAL_SECTION history_journal_cs;	// Guards the history journal state and the removed history keys.
+extern CRITICAL_SECTION history_view_cs;	// Guards the view of the history file that deferred entries are read from.
+
 #endif
@@ -480,7 +480,7 @@ char MakeRangeDataRequest( SOCKET_CONTEXT *context )
 			new_context->got_last_modified = context->got_last_modified;			// No need to get the date/time again.
 			new_context->show_file_size_prompt = context->show_file_size_prompt;	// No need to prompt again.
 
-			new_context->request_info.host = GlobalStrDupA( context->request_info.host );
+			new_context->request_info.host = InternString( context->request_info.host );
 			new_context->request_info.port = context->request_info.port;
 			new_context->request_info.resource = GlobalStrDupA( context->request_info.resource );
 			new_context->request_info.protocol = context->request_info.protocol;
@@ -516,6 +516,8 @@ char MakeRangeDataRequest( SOCKET_CONTEXT *context )
 			
 			DLL_AddNode( &g_context_list, &new_context->context_node, 0 );
 
+			AddContextTimer( new_context );
+
 			LeaveCriticalSection( &context_list_cs );
 
 			// Add to the parts list.
@@ -569,11 +571,11 @@ void SetDataContextValues( SOCKET_CONTEXT *context, SOCKET_CONTEXT *new_context
 
 		if ( context->header_info.connection == FTP_MODE_PASSIVE )			// Passive mode only.
 		{
-			new_context->request_info.host = GlobalStrDupA( context->header_info.url_location.host );	// We retrieved this on port 21.
+			new_context->request_info.host = InternString( context->header_info.url_location.host );	// We retrieved this on port 21.
 		}
 		else
 		{
-			new_context->request_info.host = GlobalStrDupA( context->request_info.host );
+			new_context->request_info.host = InternString( context->request_info.host );
 		}
 		new_context->request_info.port = context->header_info.url_location.port;	// We retrieved this on port 21.
 		new_context->request_info.resource = GlobalStrDupA( context->request_info.resource );
@@ -627,6 +629,8 @@ char MakeDataRequest( SOCKET_CONTEXT *context )
 
 		DLL_AddNode( &g_context_list, &new_context->context_node, 0 );
 
+		AddContextTimer( new_context );
+
 		LeaveCriticalSection( &context_list_cs );
 
 		if ( !CreateConnection( new_context, new_context->request_info.host, new_context->request_info.port ) )
@@ -1815,7 +1819,7 @@ char GetFTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, unsi
 					//context->header_info.range_info->content_offset += response_buffer_length;	// The true amount that was downloaded. Allows us to resume if we stop the download.
 					//context->header_info.range_info->file_write_offset += output_buffer_length;	// The size of the non-encoded/decoded data that we're writing to the file.
 
-					BOOL bRet = WriteFile( context->download_info->hFile, context->write_wsabuf.buf, context->write_wsabuf.len, NULL, ( OVERLAPPED * )&context->overlapped );
+					BOOL bRet = WriteFileCached( context, &context->overlapped );
 					if ( bRet == FALSE && ( GetLastError() != ERROR_IO_PENDING ) )
 					{
 						InterlockedDecrement( &context->pending_operations );
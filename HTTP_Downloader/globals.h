@@ -52,6 +52,7 @@
 #define WM_ALERT			WM_APP + 6
 
 #define WM_RESET_PROGRESS	WM_APP + 7
+#define WM_RELEASE_RANGES	WM_APP + 8	// wParam is the id of a completed download.
 
 #define FILETIME_TICKS_PER_SECOND	10000000LL
 
@@ -135,6 +136,12 @@ struct ICON_INFO
 	unsigned int count;
 };
 
+struct SHARED_STRING
+{
+	void *string;	// A char or wchar_t string, depending on the pool.
+	unsigned int count;
+};
+
 struct SEARCH_INFO
 {
 	wchar_t *text;
@@ -214,6 +221,9 @@ extern HFONT g_hFont;
 
 extern dllrbt_tree *g_icon_handles;
 
+extern dllrbt_tree *g_string_pool;
+extern dllrbt_tree *g_wide_string_pool;
+
 extern dllrbt_tree *g_login_info;
 
 extern bool	g_can_fast_allocate;			// Prevent the pre-allocation from zeroing the file.
@@ -241,6 +251,8 @@ extern CRITICAL_SECTION session_totals_cs;
 
 extern CRITICAL_SECTION icon_cache_cs;
 
+extern CRITICAL_SECTION string_pool_cs;
+
 extern wchar_t *base_directory;
 extern unsigned int base_directory_length;
 
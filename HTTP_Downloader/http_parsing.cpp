@@ -17,6 +17,7 @@
 */
 
 #include "http_parsing.h"
+#include "server_api.h"
 
 #include "globals.h"
 #include "utilities.h"
@@ -24,9 +25,16 @@
 
 #include "lite_ole32.h"
 #include "lite_zlib1.h"
+#include "lite_brotlidec.h"
+#include "lite_zstd.h"
 
 #include "cmessagebox.h"
 
+#ifdef _WIN64
+	#include <emmintrin.h>
+	#include <intrin.h>
+#endif
+
 // This basically skips past an expression string when searching for a particular character.
 // end is set if the end of the string is reached and the character is not found.
 char *FindCharExcludeExpression( char *start, char **end, char character )
@@ -160,6 +168,212 @@ char *GetHeaderValue( char *header, char *field_name, unsigned long field_name_l
 	return NULL;
 }
 
+#define HEADER_HASH_SEED	2166136261
+
+// Case-insensitive FNV-1a hash of a field name. Collisions are fine since matches are confirmed with _StrCmpNIA.
+unsigned long HashFieldName( char *field_name, unsigned long field_name_length )
+{
+	unsigned long hash = HEADER_HASH_SEED;
+
+	for ( unsigned long i = 0; i < field_name_length; ++i )
+	{
+		hash = ( hash ^ ( unsigned char )( field_name[ i ] | 0x20 ) ) * 16777619;
+	}
+
+	return hash;
+}
+
+#ifdef _WIN64
+// Returns the first '\r' or NULL character at or after str. Every x64 processor has SSE2, so 16 bytes are checked at a time.
+// The loads are aligned so that they never cross into the next page. Reading past the NULL terminator is safe.
+char *FindCarriageReturn( char *str )
+{
+	const __m128i carriage_return = _mm_set1_epi8( '\r' );
+	const __m128i null_character = _mm_setzero_si128();
+
+	unsigned int offset = ( unsigned int )( ( ULONG_PTR )str & 15 );
+	__m128i *block = ( __m128i * )( str - offset );
+
+	__m128i chunk = _mm_load_si128( block );
+	unsigned long mask = ( unsigned long )_mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( chunk, carriage_return ), _mm_cmpeq_epi8( chunk, null_character ) ) );
+
+	// Ignore the bytes in front of str.
+	mask >>= offset;
+
+	unsigned long index;
+	if ( _BitScanForward( &index, mask ) )
+	{
+		return str + index;
+	}
+
+	while ( true )
+	{
+		++block;
+
+		chunk = _mm_load_si128( block );
+		mask = ( unsigned long )_mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( chunk, carriage_return ), _mm_cmpeq_epi8( chunk, null_character ) ) );
+
+		if ( _BitScanForward( &index, mask ) )
+		{
+			return ( char * )block + index;
+		}
+	}
+}
+#endif
+
+// Returns the first "\r\n" or NULL character at or after str.
+char *FindFieldEnd( char *str )
+{
+	while ( true )
+	{
+#ifdef _WIN64
+		str = FindCarriageReturn( str );
+#else
+		while ( *str != 0 && *str != '\r' )
+		{
+			++str;
+		}
+#endif
+		if ( *str == 0 || str[ 1 ] == '\n' )
+		{
+			return str;
+		}
+
+		++str;	// A lone '\r' is part of the field.
+	}
+}
+
+// Walk the header once and record where each field's name and value are.
+// The fields are split and trimmed the same way GetHeaderValue does it.
+// The header must be NULL terminated and must not be moved while the index is in use.
+void IndexHeader( HEADER_INDEX *header_index, char *header )
+{
+	header_index->unindexed = NULL;
+	header_index->field_count = 0;
+
+	char *itr_field = header;
+
+	while ( true )
+	{
+		char *field_start = itr_field;
+
+		// Skip whitespace that might appear before the field name.
+		while ( *itr_field == ' ' || *itr_field == '\t' || *itr_field == '\f' )
+		{
+			++itr_field;
+		}
+
+		char *field_name_start = itr_field;
+		char *field_name_end = NULL;
+
+		unsigned long hash = HEADER_HASH_SEED;
+
+		// Hash the field name. It will end with a colon.
+		while ( *itr_field != 0 && *itr_field != ':' && !( itr_field[ 0 ] == '\r' && itr_field[ 1 ] == '\n' ) )
+		{
+			hash = ( hash ^ ( unsigned char )( *itr_field | 0x20 ) ) * 16777619;
+
+			++itr_field;
+		}
+
+		// Find the end of the field. The value is usually the longest part of it.
+		if ( *itr_field == ':' )
+		{
+			field_name_end = itr_field;
+
+			itr_field = FindFieldEnd( itr_field + 1 );
+		}
+
+		// A complete field end was not found, or we reached the end of the header.
+		if ( *itr_field == 0 || itr_field == field_start )
+		{
+			break;
+		}
+
+		// Fields without a colon are ignored.
+		if ( field_name_end != NULL )
+		{
+			if ( header_index->field_count == HEADER_INDEX_FIELDS )
+			{
+				header_index->unindexed = field_start;
+
+				break;
+			}
+
+			char *value_start = field_name_end + 1;
+			char *value_end = itr_field;
+
+			// Skip whitespace that might appear before the field value.
+			while ( *value_start == ' ' || *value_start == '\t' || *value_start == '\f' )
+			{
+				++value_start;
+			}
+
+			// Skip whitespace that could appear before the "\r\n", but after the field value.
+			while ( ( value_end - 1 ) >= value_start )
+			{
+				if ( *( value_end - 1 ) != ' ' && *( value_end - 1 ) != '\t' && *( value_end - 1 ) != '\f' )
+				{
+					break;
+				}
+
+				--value_end;
+			}
+
+			HEADER_FIELD *header_field = &header_index->fields[ header_index->field_count++ ];
+			header_field->name = field_name_start;
+			header_field->name_length = ( unsigned int )( field_name_end - field_name_start );
+			header_field->hash = hash;
+			header_field->value = value_start;
+			header_field->value_end = value_end;
+		}
+
+		itr_field += 2;
+	}
+}
+
+// Find the next indexed field with the given name, starting at position. position is moved past the field that's found.
+// Fields that didn't fit in the index are not searched.
+char *FindHeaderField( HEADER_INDEX *header_index, unsigned int &position, char *field_name, unsigned long field_name_length, char **value_start, char **value_end )
+{
+	unsigned long hash = HashFieldName( field_name, field_name_length );
+
+	for ( ; position < header_index->field_count; ++position )
+	{
+		HEADER_FIELD *header_field = &header_index->fields[ position ];
+
+		if ( header_field->hash == hash &&
+			 header_field->name_length == field_name_length &&
+			 _StrCmpNIA( header_field->name, field_name, field_name_length ) == 0 )
+		{
+			*value_start = header_field->value;
+			*value_end = header_field->value_end;
+
+			++position;
+
+			return header_field->name;
+		}
+	}
+
+	return NULL;
+}
+
+// Get the first field with the given name.
+char *GetHeaderField( HEADER_INDEX *header_index, char *field_name, unsigned long field_name_length, char **value_start, char **value_end )
+{
+	unsigned int position = 0;
+
+	char *field = FindHeaderField( header_index, position, field_name, field_name_length, value_start, value_end );
+
+	// Fall back to scanning the fields that didn't fit in the index.
+	if ( field == NULL && header_index->unindexed != NULL )
+	{
+		field = GetHeaderValue( header_index->unindexed, field_name, field_name_length, value_start, value_end );
+	}
+
+	return field;
+}
+
 char *GetDigestValue( char *digest_value, char *digest_value_name, unsigned long digest_value_name_length, char **value_start, char **value_end )
 {
 	char *digest_value_name_start = NULL;
@@ -525,13 +739,27 @@ bool ParseCookieValues( char *cookie_list, dllrbt_tree **cookie_tree, char **coo
 }
 
 // Modifies decoded_buffer
-bool ParseCookies( char *header, dllrbt_tree **cookie_tree, char **cookies, char *end_of_header = 0 )
+bool ParseCookies( HEADER_INDEX *header_index, dllrbt_tree **cookie_tree, char **cookies, char *end_of_header = 0 )
 {
 	char *set_cookie_header = NULL;
-	char *set_cookie_header_end = header;
+	char *set_cookie_header_end = NULL;
 
-	while ( GetHeaderValue( set_cookie_header_end, "Set-Cookie", 10, &set_cookie_header, &set_cookie_header_end ) != NULL )
+	unsigned int position = 0;
+	char *unindexed = header_index->unindexed;
+
+	while ( true )
 	{
+		if ( FindHeaderField( header_index, position, "Set-Cookie", 10, &set_cookie_header, &set_cookie_header_end ) == NULL )
+		{
+			// Scan any fields that didn't fit in the index.
+			if ( unindexed == NULL || GetHeaderValue( unindexed, "Set-Cookie", 10, &set_cookie_header, &set_cookie_header_end ) == NULL )
+			{
+				break;
+			}
+
+			unindexed = set_cookie_header_end + 2;
+		}
+
 		char *cookie_name_end = _StrChrA( set_cookie_header, '=' );
 		if ( cookie_name_end != NULL && cookie_name_end < set_cookie_header_end )
 		{
@@ -613,8 +841,6 @@ bool ParseCookies( char *header, dllrbt_tree **cookie_tree, char **cookies, char
 				GlobalFree( cc );
 			}
 		}
-
-		set_cookie_header_end += 2;
 	}
 
 	ConstructCookie( *cookie_tree, cookies );
@@ -1053,40 +1279,42 @@ bool ParseURL_W( wchar_t *url, wchar_t *original_resource,
 	return true;
 }
 
-unsigned int DecompressStream( SOCKET_CONTEXT *context, char *buffer, unsigned int buffer_size )
+bool CanDecompress( unsigned char content_encoding )
 {
-	int stream_ret = Z_OK;
-	unsigned int total_data_length = 0;
-
-	if ( context->decompressed_buf == NULL )
+	if ( content_encoding == CONTENT_ENCODING_GZIP || content_encoding == CONTENT_ENCODING_DEFLATE )
 	{
-		context->decompressed_buf_size = ZLIB_CHUNK;
-		context->decompressed_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * context->decompressed_buf_size );	// Allocate 16 kilobytes.
-
-		_memzero( &context->stream, sizeof( z_stream ) );
-		context->stream.zalloc = zGlobalAlloc;
-		context->stream.zfree = zGlobalFree;
-
-		// -MAX_WBITS		= deflate
-		// MAX_WBITS		= zlib
-		// MAX_WBITS + 16	= gzip
-		// MAX_WBITS + 32	= Detects gzip or zlib
-		stream_ret = _inflateInit2( &context->stream, ( context->header_info.content_encoding == CONTENT_ENCODING_GZIP ? MAX_WBITS + 16 : ( context->header_info.content_encoding == CONTENT_ENCODING_DEFLATE ? -MAX_WBITS : MAX_WBITS ) ) );	// 1 = gzip, 2 = deflate, everything else = default
+		return ( zlib1_state == ZLIB1_STATE_RUNNING );
 	}
-
-	context->stream.next_in = ( Bytef * )buffer;
-	context->stream.avail_in = buffer_size;
-	if ( context->stream.avail_in == 0 )
+	else if ( content_encoding == CONTENT_ENCODING_BROTLI )
 	{
-		stream_ret = Z_DATA_ERROR;
+		return ( brotlidec_state == BROTLIDEC_STATE_RUNNING );
 	}
+	else if ( content_encoding == CONTENT_ENCODING_ZSTD )
+	{
+		return ( libzstd_state == LIBZSTD_STATE_RUNNING );
+	}
+
+	return false;
+}
+
+// Each of these decodes context->stream.next_in into output and returns false if nothing more can be decoded from the input.
+
+bool InflateStream( SOCKET_CONTEXT *context, char *output, unsigned int output_size, unsigned int &output_length )
+{
+	int stream_ret = Z_OK;
+
+	// Used if we need to retry the input as a zlib wrapped stream.
+	Bytef *next_in = context->stream.next_in;
+	uInt avail_in = context->stream.avail_in;
 
 	bool retry = false;
 
-	while ( stream_ret == Z_OK && context->stream.avail_in > 0 )
+	output_length = 0;
+
+	while ( stream_ret == Z_OK && output_length < output_size )
 	{
-		context->stream.next_out = ( Bytef * )context->decompressed_buf + total_data_length;
-		context->stream.avail_out = context->decompressed_buf_size - total_data_length;
+		context->stream.next_out = ( Bytef * )output + output_length;
+		context->stream.avail_out = output_size - output_length;
 
 		stream_ret = _inflate( &context->stream, Z_NO_FLUSH );
 		if ( stream_ret == Z_NEED_DICT )
@@ -1104,8 +1332,8 @@ unsigned int DecompressStream( SOCKET_CONTEXT *context, char *buffer, unsigned i
 			context->stream.zalloc = zGlobalAlloc;
 			context->stream.zfree = zGlobalFree;
 
-			context->stream.next_in = ( Bytef * )buffer;
-			context->stream.avail_in = buffer_size;
+			context->stream.next_in = next_in;
+			context->stream.avail_in = avail_in;
 
 			// See if it's a zlib wrapped compression.
 			stream_ret = _inflateInit2( &context->stream, MAX_WBITS );
@@ -1115,18 +1343,166 @@ unsigned int DecompressStream( SOCKET_CONTEXT *context, char *buffer, unsigned i
 			continue;
 		}
 
-		total_data_length = ( context->decompressed_buf_size - context->stream.avail_out );
+		output_length = output_size - context->stream.avail_out;
+
+		// inflate is only called without input to get any output that didn't fit last time.
+		if ( context->stream.avail_in == 0 )
+		{
+			break;
+		}
+	}
+
+	// Z_BUF_ERROR just means that no progress could be made.
+	return ( stream_ret == Z_OK || stream_ret == Z_BUF_ERROR );
+}
+
+bool BrotliDecodeStream( SOCKET_CONTEXT *context, char *output, unsigned int output_size, unsigned int &output_length )
+{
+	output_length = 0;
+
+	if ( context->brotli_decoder == NULL )
+	{
+		return false;
+	}
+
+	size_t available_in = context->stream.avail_in;
+	const unsigned char *next_in = context->stream.next_in;
+	size_t available_out = output_size;
+	unsigned char *next_out = ( unsigned char * )output;
+
+	// Decodes until the input is used up or the output is full.
+	BrotliDecoderResult result = _BrotliDecoderDecompressStream( ( BrotliDecoderState * )context->brotli_decoder, &available_in, &next_in, &available_out, &next_out, NULL );
+
+	context->stream.next_in = ( Bytef * )next_in;
+	context->stream.avail_in = ( uInt )available_in;
+
+	output_length = output_size - ( unsigned int )available_out;
+
+	return ( result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT || result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT );
+}
+
+bool ZstdDecodeStream( SOCKET_CONTEXT *context, char *output, unsigned int output_size, unsigned int &output_length )
+{
+	output_length = 0;
+
+	if ( context->zstd_decoder == NULL )
+	{
+		return false;
+	}
+
+	ZSTD_outBuffer out_buffer;
+	out_buffer.dst = output;
+	out_buffer.size = output_size;
+	out_buffer.pos = 0;
+
+	while ( true )
+	{
+		ZSTD_inBuffer in_buffer;
+		in_buffer.src = context->stream.next_in;
+		in_buffer.size = context->stream.avail_in;
+		in_buffer.pos = 0;
+
+		size_t last_pos = out_buffer.pos;
+
+		// Stops at the end of each frame, so keep going if there's more than one.
+		size_t ret = _ZSTD_decompressStream( ( ZSTD_DStream * )context->zstd_decoder, &out_buffer, &in_buffer );
+
+		context->stream.next_in += in_buffer.pos;
+		context->stream.avail_in -= ( uInt )in_buffer.pos;
+
+		output_length = ( unsigned int )out_buffer.pos;
+
+		if ( _ZSTD_isError( ret ) )
+		{
+			return false;
+		}
+
+		if ( context->stream.avail_in == 0 || out_buffer.pos == out_buffer.size || ( in_buffer.pos == 0 && out_buffer.pos == last_pos ) )
+		{
+			break;
+		}
+	}
+
+	return true;
+}
+
+// Decode the input into context->decompressed_buf, starting at output_offset. Returns the number of bytes that were decompressed.
+// The output is limited to DECOMPRESS_BUFFER_SIZE. If context->decompress_more is set, then the rest can be decoded by passing a NULL buffer.
+unsigned int DecompressStream( SOCKET_CONTEXT *context, char *buffer, unsigned int buffer_size, unsigned int output_offset )
+{
+	unsigned int total_data_length = 0;
+
+	context->decompress_more = false;
+
+	if ( context->decompressed_buf == NULL )
+	{
+		context->decompressed_buf_size = DECOMPRESS_BUFFER_SIZE;
+		context->decompressed_buf = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * context->decompressed_buf_size );
+		if ( context->decompressed_buf == NULL )
+		{
+			return 0;
+		}
+
+		_memzero( &context->stream, sizeof( z_stream ) );
+		context->stream.zalloc = zGlobalAlloc;
+		context->stream.zfree = zGlobalFree;
 
-		// Allocate more memory if we have any remaining data in our buffer to decompress.
-		if ( stream_ret == Z_OK && context->stream.avail_in > 0 )
+		if ( context->header_info.content_encoding == CONTENT_ENCODING_BROTLI )
+		{
+			context->brotli_decoder = _BrotliDecoderCreateInstance( NULL, NULL, NULL );
+		}
+		else if ( context->header_info.content_encoding == CONTENT_ENCODING_ZSTD )
 		{
-			context->decompressed_buf_size += ZLIB_CHUNK;
-			char *realloc_buffer = ( char * )GlobalReAlloc( context->decompressed_buf, sizeof( char ) * context->decompressed_buf_size, GMEM_MOVEABLE );
-			if ( realloc_buffer != NULL )
+			context->zstd_decoder = _ZSTD_createDStream();
+			if ( context->zstd_decoder != NULL )
 			{
-				context->decompressed_buf = realloc_buffer;
+				_ZSTD_initDStream( ( ZSTD_DStream * )context->zstd_decoder );
 			}
 		}
+		else
+		{
+			// -MAX_WBITS		= deflate
+			// MAX_WBITS		= zlib
+			// MAX_WBITS + 16	= gzip
+			// MAX_WBITS + 32	= Detects gzip or zlib
+			_inflateInit2( &context->stream, ( context->header_info.content_encoding == CONTENT_ENCODING_GZIP ? MAX_WBITS + 16 : ( context->header_info.content_encoding == CONTENT_ENCODING_DEFLATE ? -MAX_WBITS : MAX_WBITS ) ) );	// 1 = gzip, 2 = deflate, everything else = default
+		}
+	}
+
+	// stream.next_in and stream.avail_in keep track of the input for every encoding.
+	if ( buffer != NULL )
+	{
+		context->stream.next_in = ( Bytef * )buffer;
+		context->stream.avail_in = buffer_size;
+	}
+
+	char *output = context->decompressed_buf + output_offset;
+	unsigned int output_size = context->decompressed_buf_size - output_offset;
+
+	bool decoding;
+
+	if ( context->header_info.content_encoding == CONTENT_ENCODING_BROTLI )
+	{
+		decoding = BrotliDecodeStream( context, output, output_size, total_data_length );
+	}
+	else if ( context->header_info.content_encoding == CONTENT_ENCODING_ZSTD )
+	{
+		decoding = ZstdDecodeStream( context, output, output_size, total_data_length );
+	}
+	else
+	{
+		decoding = InflateStream( context, output, output_size, total_data_length );
+	}
+
+	if ( decoding )
+	{
+		// A full buffer means the decoder may still be holding output even if there's no input left.
+		context->decompress_more = ( context->stream.avail_in > 0 || total_data_length == output_size );
+	}
+	else	// Nothing more can be decompressed from this input. Skip past it.
+	{
+		context->stream.next_in += context->stream.avail_in;
+		context->stream.avail_in = 0;
 	}
 
 	return total_data_length;
@@ -1221,12 +1597,12 @@ unsigned char GetHTTPMethod( char *header )
 	return method_type;
 }
 
-bool GetTransferEncoding( char *header )
+bool GetTransferEncoding( HEADER_INDEX *header_index )
 {
 	char *transfer_encoding_header = NULL;
 	char *transfer_encoding_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Transfer-Encoding", 17, &transfer_encoding_header, &transfer_encoding_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Transfer-Encoding", 17, &transfer_encoding_header, &transfer_encoding_header_end ) != NULL )
 	{
 		if ( ( transfer_encoding_header_end - transfer_encoding_header ) == 7 && _StrCmpNIA( transfer_encoding_header, "chunked", 7 ) == 0 )
 		{
@@ -1237,12 +1613,12 @@ bool GetTransferEncoding( char *header )
 	return false;
 }
 
-unsigned long long GetContentLength( char *header )
+unsigned long long GetContentLength( HEADER_INDEX *header_index )
 {
 	char *content_length_header = NULL;
 	char *content_length_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Content-Length", 14, &content_length_header, &content_length_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Content-Length", 14, &content_length_header, &content_length_header_end ) != NULL )
 	{
 		int content_length_length = ( int )( content_length_header_end - content_length_header );
 		if ( content_length_length > 20 )
@@ -1261,12 +1637,12 @@ unsigned long long GetContentLength( char *header )
 	return 0;
 }
 
-void GetContentRange( char *header, RANGE_INFO *range_info )
+void GetContentRange( HEADER_INDEX *header_index, RANGE_INFO *range_info )
 {
 	char *content_range_header = NULL;
 	char *content_range_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Content-Range", 13, &content_range_header, &content_range_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Content-Range", 13, &content_range_header, &content_range_header_end ) != NULL )
 	{
 		char *content_range_value = _StrStrIA( content_range_header, "bytes" );
 		if ( content_range_value != NULL )
@@ -1378,12 +1754,12 @@ void GetContentRange( char *header, RANGE_INFO *range_info )
 	}
 }
 
-void GetLocation( char *header, char *resource, URL_LOCATION *url_location )
+void GetLocation( HEADER_INDEX *header_index, char *resource, URL_LOCATION *url_location )
 {
 	char *location_header = NULL;
 	char *location_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Location", 8, &location_header, &location_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Location", 8, &location_header, &location_header_end ) != NULL )
 	{
 		// Temporary string terminator.
 		char tmp_end = *location_header_end;
@@ -1432,14 +1808,14 @@ void GetLocation( char *header, char *resource, URL_LOCATION *url_location )
 	}
 }
 
-unsigned char GetConnection( char *header )
+unsigned char GetConnection( HEADER_INDEX *header_index )
 {
 	unsigned char connection_type = CONNECTION_NONE;
 
 	char *connection_header = NULL;
 	char *connection_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Connection", 10, &connection_header, &connection_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Connection", 10, &connection_header, &connection_header_end ) != NULL )
 	{
 		char tmp_end = *connection_header_end;
 		*connection_header_end = 0;	// Sanity
@@ -1465,12 +1841,12 @@ unsigned char GetConnection( char *header )
 	return connection_type;
 }
 
-unsigned char GetContentEncoding( char *header )
+unsigned char GetContentEncoding( HEADER_INDEX *header_index )
 {
 	char *content_encoding_header = NULL;
 	char *content_encoding_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Content-Encoding", 16, &content_encoding_header, &content_encoding_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Content-Encoding", 16, &content_encoding_header, &content_encoding_header_end ) != NULL )
 	{
 		if ( ( content_encoding_header_end - content_encoding_header ) == 4 && _StrCmpNIA( content_encoding_header, "gzip", 4 ) == 0 )
 		{
@@ -1480,6 +1856,14 @@ unsigned char GetContentEncoding( char *header )
 		{
 			return CONTENT_ENCODING_DEFLATE;
 		}
+		else if ( ( content_encoding_header_end - content_encoding_header ) == 2 && _StrCmpNIA( content_encoding_header, "br", 2 ) == 0 )
+		{
+			return CONTENT_ENCODING_BROTLI;
+		}
+		else if ( ( content_encoding_header_end - content_encoding_header ) == 4 && _StrCmpNIA( content_encoding_header, "zstd", 4 ) == 0 )
+		{
+			return CONTENT_ENCODING_ZSTD;
+		}
 		else
 		{
 			return CONTENT_ENCODING_UNHANDLED;	// Unhandled.
@@ -1489,12 +1873,12 @@ unsigned char GetContentEncoding( char *header )
 	return CONTENT_ENCODING_NONE;
 }
 
-void GetAuthorization( char *header, AUTH_INFO *auth_info )
+void GetAuthorization( HEADER_INDEX *header_index, AUTH_INFO *auth_info )
 {
 	char *authorization_header = NULL;
 	char *authorization_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Authorization", 13, &authorization_header, &authorization_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Authorization", 13, &authorization_header, &authorization_header_end ) != NULL )
 	{
 		if ( _StrStrIA( authorization_header, "Basic " ) != NULL )	// The protocol doesn't specify whether "Basic" is case-sensitive or not. Note that the protocol requires a single space (SP) after "Basic".
 		{
@@ -1790,7 +2174,7 @@ void GetAuthorization( char *header, AUTH_INFO *auth_info )
 	}
 }
 
-void GetAuthenticate( char *header, unsigned char auth_header_type, AUTH_INFO *auth_info )
+void GetAuthenticate( HEADER_INDEX *header_index, unsigned char auth_header_type, AUTH_INFO *auth_info )
 {
 	char *authenticate_header = NULL;
 	char *authenticate_header_end = NULL;
@@ -1799,11 +2183,11 @@ void GetAuthenticate( char *header, unsigned char auth_header_type, AUTH_INFO *a
 
 	if ( auth_header_type == 1 )
 	{
-		authentication_field = GetHeaderValue( header, "WWW-Authenticate", 16, &authenticate_header, &authenticate_header_end );
+		authentication_field = GetHeaderField( header_index, "WWW-Authenticate", 16, &authenticate_header, &authenticate_header_end );
 	}
 	else if ( auth_header_type == 2 )
 	{
-		authentication_field = GetHeaderValue( header, "Proxy-Authenticate", 18, &authenticate_header, &authenticate_header_end );
+		authentication_field = GetHeaderField( header_index, "Proxy-Authenticate", 18, &authenticate_header, &authenticate_header_end );
 	}
 
 	if ( authentication_field != NULL )
@@ -1996,12 +2380,12 @@ void GetAuthenticate( char *header, unsigned char auth_header_type, AUTH_INFO *a
 	}
 }
 
-char *GetContentDisposition( char *header, unsigned int &filename_length )
+char *GetContentDisposition( HEADER_INDEX *header_index, unsigned int &filename_length )
 {
 	char *content_disposition_header = NULL;
 	char *content_disposition_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Content-Disposition", 19, &content_disposition_header, &content_disposition_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Content-Disposition", 19, &content_disposition_header, &content_disposition_header_end ) != NULL )
 	{
 		// Case insensitive. The RFC doesn't mention anything about it.
 		content_disposition_header = _StrStrIA( content_disposition_header, "filename" );
@@ -2088,7 +2472,7 @@ char *GetContentDisposition( char *header, unsigned int &filename_length )
 	return NULL;
 }
 
-bool GetLastModified( char *header, SYSTEMTIME &date_time )
+bool GetLastModified( HEADER_INDEX *header_index, SYSTEMTIME &date_time )
 {
 	bool ret = false;
 
@@ -2097,7 +2481,7 @@ bool GetLastModified( char *header, SYSTEMTIME &date_time )
 	char *last_modified_header = NULL;
 	char *last_modified_header_end = NULL;
 
-	if ( GetHeaderValue( header, "Last-Modified", 13, &last_modified_header, &last_modified_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "Last-Modified", 13, &last_modified_header, &last_modified_header_end ) != NULL )
 	{
 		char tmp_end = *last_modified_header_end;
 		*last_modified_header_end = 0;	// Sanity
@@ -2297,12 +2681,12 @@ bool GetLastModified( char *header, SYSTEMTIME &date_time )
 	return ret;
 }
 /*
-char *GetETag( char *header )
+char *GetETag( HEADER_INDEX *header_index )
 {
 	char *etag_header = NULL;
 	char *etag_header_end = NULL;
 
-	if ( GetHeaderValue( header, "ETag", 4, &etag_header, &etag_header_end ) != NULL )
+	if ( GetHeaderField( header_index, "ETag", 4, &etag_header, &etag_header_end ) != NULL )
 	{
 		int etag_length = etag_header_end - etag_header;
 
@@ -2439,6 +2823,10 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 	if ( end_of_header != NULL )
 	{
+		// Index the fields once so that the values below don't each need to rescan the header.
+		HEADER_INDEX header_index;
+		IndexHeader( &header_index, header_buffer );
+
 		if ( !request )
 		{
 			if ( context->header_info.http_status == 0 )
@@ -2461,6 +2849,8 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 				{
 					return CONTENT_STATUS_FAILED;
 				}
+
+				ParseAPIRequest( context, header_buffer );
 			}
 
 			if ( context->header_info.digest_info == NULL )
@@ -2471,14 +2861,14 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 			if ( context->header_info.digest_info != NULL &&
 				 context->header_info.digest_info->auth_type == AUTH_TYPE_NONE )
 			{
-				GetAuthorization( header_buffer, context->header_info.digest_info );
+				GetAuthorization( &header_index, context->header_info.digest_info );
 			}
 		}
 
 		char *new_cookies = NULL;
 
 		// This value will be saved
-		if ( !ParseCookies( header_buffer, &context->header_info.cookie_tree, &new_cookies, end_of_header ) )
+		if ( !ParseCookies( &header_index, &context->header_info.cookie_tree, &new_cookies, end_of_header ) )
 		{
 			GlobalFree( new_cookies );
 			new_cookies = NULL;
@@ -2494,8 +2884,8 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 				{
 					EnterCriticalSection( &context->download_info->shared_cs );
 
-					GlobalFree( context->download_info->cookies );
-					context->download_info->cookies = GlobalStrDupA( new_cookies );
+					ReleaseString( context->download_info->cookies );
+					context->download_info->cookies = InternString( new_cookies );
 
 					LeaveCriticalSection( &context->download_info->shared_cs );
 				}
@@ -2512,14 +2902,14 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 		if ( !context->header_info.chunked_transfer )
 		{
-			context->header_info.chunked_transfer = GetTransferEncoding( header_buffer );
+			context->header_info.chunked_transfer = GetTransferEncoding( &header_index );
 		}
 
 		if ( context->header_info.range_info->content_length == 0 )
 		{
-			content_length = GetContentLength( header_buffer );
+			content_length = GetContentLength( &header_index );
 
-			GetContentRange( header_buffer, context->header_info.range_info );
+			GetContentRange( &header_index, context->header_info.range_info );
 
 			// Set the content_length and range content_length to the same value. (Use the greater of the two values.)
 			if ( content_length > context->header_info.range_info->content_length )
@@ -2530,7 +2920,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 		if ( context->header_info.url_location.host == NULL )
 		{
-			GetLocation( header_buffer, context->request_info.resource, &context->header_info.url_location );
+			GetLocation( &header_index, context->request_info.resource, &context->header_info.url_location );
 
 			// This is so stupid. Match the relative URI protocol/port with the request URI protocol/port.
 			if ( context->header_info.url_location.protocol == PROTOCOL_RELATIVE )
@@ -2547,7 +2937,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 		if ( context->header_info.connection == CONNECTION_NONE )
 		{
-			context->header_info.connection = GetConnection( header_buffer );
+			context->header_info.connection = GetConnection( &header_index );
 
 			// If the Connection header field does not exist, then by default, it'll be keep-alive.
 			if ( context->header_info.connection == CONNECTION_NONE )
@@ -2558,7 +2948,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 		if ( context->header_info.content_encoding == CONTENT_ENCODING_NONE )
 		{
-			context->header_info.content_encoding = GetContentEncoding( header_buffer );
+			context->header_info.content_encoding = GetContentEncoding( &header_index );
 		}
 
 		if ( context->header_info.http_status == 401 )
@@ -2571,7 +2961,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 			if ( context->header_info.digest_info != NULL &&
 				 context->header_info.digest_info->auth_type == AUTH_TYPE_NONE )
 			{
-				GetAuthenticate( header_buffer, 1, context->header_info.digest_info );
+				GetAuthenticate( &header_index, 1, context->header_info.digest_info );
 			}
 		}
 
@@ -2588,7 +2978,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 				if ( context->header_info.proxy_digest_info != NULL &&
 					 context->header_info.proxy_digest_info->auth_type == AUTH_TYPE_NONE )
 				{
-					GetAuthenticate( header_buffer, 2, context->header_info.proxy_digest_info );
+					GetAuthenticate( &header_index, 2, context->header_info.proxy_digest_info );
 				}
 			}
 		}
@@ -2597,7 +2987,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 		{
 			unsigned int filename_length = 0;
 
-			char *filename = GetContentDisposition( header_buffer, filename_length );
+			char *filename = GetContentDisposition( &header_index, filename_length );
 			if ( filename != NULL )
 			{
 				// Remove directory paths.
@@ -2621,7 +3011,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 					EnterCriticalSection( &icon_cache_cs );
 					// Find the icon info
-					dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( context->download_info->file_path + context->download_info->file_extension_offset ), false );
+					dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( context->download_info->filename + context->download_info->file_extension_offset ), false );
 
 					// Free its values and remove it from the tree if there are no other items using it.
 					if ( itr != NULL )
@@ -2647,15 +3037,15 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 					EnterCriticalSection( &context->download_info->shared_cs );
 
-					int w_filename_length = MultiByteToWideChar( CP_UTF8, 0, tmp_filename, -1, context->download_info->file_path + context->download_info->filename_offset, MAX_PATH - context->download_info->filename_offset - 1 ) - 1;
+					int w_filename_length = MultiByteToWideChar( CP_UTF8, 0, tmp_filename, -1, context->download_info->filename, MAX_PATH - context->download_info->filename_offset - 1 ) - 1;
 					if ( w_filename_length == -1 && GetLastError() == ERROR_INSUFFICIENT_BUFFER )
 					{
 						w_filename_length = MAX_PATH - context->download_info->filename_offset - 1;
 					}
 
-					EscapeFilename( context->download_info->file_path + context->download_info->filename_offset );
+					EscapeFilename( context->download_info->filename );
 
-					context->download_info->file_extension_offset = context->download_info->filename_offset + get_file_extension_offset( context->download_info->file_path + context->download_info->filename_offset, w_filename_length );
+					context->download_info->file_extension_offset = get_file_extension_offset( context->download_info->filename, w_filename_length );
 
 					// Make sure any existing file hasn't started downloading.
 					if ( !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) && context->download_info->downloaded == 0 )
@@ -2663,11 +3053,11 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 						wchar_t file_path[ MAX_PATH ];
 						if ( cfg_use_temp_download_directory )
 						{
-							//int filename_length = lstrlenW( context->download_info->file_path + context->download_info->filename_offset );
+							//int filename_length = lstrlenW( context->download_info->filename );
 
 							_wmemcpy_s( file_path, MAX_PATH, cfg_temp_download_directory, g_temp_download_directory_length );
 							file_path[ g_temp_download_directory_length ] = L'\\';	// Replace the download directory NULL terminator with a directory slash.
-							_wmemcpy_s( file_path + ( g_temp_download_directory_length + 1 ), MAX_PATH - ( g_temp_download_directory_length - 1 ), context->download_info->file_path + context->download_info->filename_offset, w_filename_length );
+							_wmemcpy_s( file_path + ( g_temp_download_directory_length + 1 ), MAX_PATH - ( g_temp_download_directory_length - 1 ), context->download_info->filename, w_filename_length );
 							file_path[ g_temp_download_directory_length + w_filename_length + 1 ] = 0;	// Sanity.
 						}
 						else
@@ -2718,7 +3108,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 					SYSTEMTIME date_time;
 					_memzero( &date_time, sizeof( SYSTEMTIME ) );
 
-					if ( GetLastModified( header_buffer, date_time ) )
+					if ( GetLastModified( &header_index, date_time ) )
 					{
 						SystemTimeToFileTime( &date_time, &context->header_info.last_modified );
 
@@ -2751,7 +3141,7 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 
 		/*if ( !context->header_info.etag )
 		{
-			char *etag = GetETag( header_buffer );
+			char *etag = GetETag( &header_index );
 			if ( etag != NULL )
 			{
 				if ( context->download_info != NULL )
@@ -2895,7 +3285,7 @@ char GetHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int h
 
 						EnterCriticalSection( &icon_cache_cs );
 						// Find the icon info
-						dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( context->download_info->file_path + context->download_info->file_extension_offset ), false );
+						dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( context->download_info->filename + context->download_info->file_extension_offset ), false );
 
 						// Free its values and remove it from the tree if there are no other items using it.
 						if ( itr != NULL )
@@ -2921,15 +3311,15 @@ char GetHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int h
 
 						EnterCriticalSection( &context->download_info->shared_cs );
 
-						int w_filename_length = MultiByteToWideChar( CP_UTF8, 0, current_directory, -1, context->download_info->file_path + context->download_info->filename_offset, MAX_PATH - context->download_info->filename_offset - 1 ) - 1;
+						int w_filename_length = MultiByteToWideChar( CP_UTF8, 0, current_directory, -1, context->download_info->filename, MAX_PATH - context->download_info->filename_offset - 1 ) - 1;
 						if ( w_filename_length == -1 && GetLastError() == ERROR_INSUFFICIENT_BUFFER )
 						{
 							w_filename_length = MAX_PATH - context->download_info->filename_offset - 1;
 						}
 
-						EscapeFilename( context->download_info->file_path + context->download_info->filename_offset );
+						EscapeFilename( context->download_info->filename );
 
-						context->download_info->file_extension_offset = context->download_info->filename_offset + get_file_extension_offset( context->download_info->file_path + context->download_info->filename_offset, w_filename_length );
+						context->download_info->file_extension_offset = get_file_extension_offset( context->download_info->filename, w_filename_length );
 
 						// Make sure any existing file hasn't started downloading.
 						if ( !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) && context->download_info->downloaded == 0 )
@@ -2937,11 +3327,11 @@ char GetHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int h
 							wchar_t file_path[ MAX_PATH ];
 							if ( cfg_use_temp_download_directory )
 							{
-								//int filename_length = lstrlenW( context->download_info->file_path + context->download_info->filename_offset );
+								//int filename_length = lstrlenW( context->download_info->filename );
 
 								_wmemcpy_s( file_path, MAX_PATH, cfg_temp_download_directory, g_temp_download_directory_length );
 								file_path[ g_temp_download_directory_length ] = L'\\';	// Replace the download directory NULL terminator with a directory slash.
-								_wmemcpy_s( file_path + ( g_temp_download_directory_length + 1 ), MAX_PATH - ( g_temp_download_directory_length - 1 ), context->download_info->file_path + context->download_info->filename_offset, w_filename_length );
+								_wmemcpy_s( file_path + ( g_temp_download_directory_length + 1 ), MAX_PATH - ( g_temp_download_directory_length - 1 ), context->download_info->filename, w_filename_length );
 								file_path[ g_temp_download_directory_length + w_filename_length + 1 ] = 0;	// Sanity.
 							}
 							else
@@ -3178,7 +3568,7 @@ char HandleRedirect( SOCKET_CONTEXT *context )
 
 		if ( context->header_info.url_location.host != NULL )	// Handle absolute URIs.
 		{
-			redirect_context->request_info.host = context->header_info.url_location.host;
+			redirect_context->request_info.host = InternString( context->header_info.url_location.host, true );
 			redirect_context->request_info.port = context->header_info.url_location.port;
 			redirect_context->request_info.resource = context->header_info.url_location.resource;
 			redirect_context->request_info.protocol = context->header_info.url_location.protocol;
@@ -3249,6 +3639,8 @@ char HandleRedirect( SOCKET_CONTEXT *context )
 
 		DLL_AddNode( &g_context_list, &redirect_context->context_node, 0 );
 
+		AddContextTimer( redirect_context );
+
 		LeaveCriticalSection( &context_list_cs );
 
 		if ( context->download_info != NULL )
@@ -3280,7 +3672,7 @@ char HandleRedirect( SOCKET_CONTEXT *context )
 
 		context->overlapped.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-		PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+		PostCompletion( 0, context, &context->overlapped );
 
 		content_status = CONTENT_STATUS_NONE;
 	}
@@ -3371,7 +3763,7 @@ char MakeRangeRequest( SOCKET_CONTEXT *context )
 				new_context->got_last_modified = context->got_last_modified;	// No need to get the date/time again.
 				new_context->show_file_size_prompt = context->show_file_size_prompt;	// No need to prompt again.
 
-				new_context->request_info.host = GlobalStrDupA( context->request_info.host );
+				new_context->request_info.host = InternString( context->request_info.host );
 				new_context->request_info.port = context->request_info.port;
 				new_context->request_info.resource = GlobalStrDupA( context->request_info.resource );
 				new_context->request_info.protocol = context->request_info.protocol;
@@ -3439,6 +3831,8 @@ char MakeRangeRequest( SOCKET_CONTEXT *context )
 				
 				DLL_AddNode( &g_context_list, &new_context->context_node, 0 );
 
+				AddContextTimer( new_context );
+
 				LeaveCriticalSection( &context_list_cs );
 
 				// Add to the parts list.
@@ -3495,7 +3889,7 @@ char MakeRequest( SOCKET_CONTEXT *context, IO_OPERATION next_operation, bool use
 			context->header_info.content_encoding = CONTENT_ENCODING_NONE;
 			context->header_info.chunked_transfer = false;
 			//context->header_info.etag = false;
-			context->header_info.got_chunk_start = false;
+			context->header_info.chunk_state = CHUNK_STATE_SIZE_START;
 			context->header_info.got_chunk_terminator = false;
 
 			context->header_info.range_info->content_length = 0;	// We must reset this to get the real request length (not the length of the 401/407 request).
@@ -3532,7 +3926,7 @@ char MakeRequest( SOCKET_CONTEXT *context, IO_OPERATION next_operation, bool use
 				{
 					context->overlapped.current_operation = IO_Shutdown;
 
-					PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+					PostCompletion( 0, context, &context->overlapped );
 				}
 			}
 			else
@@ -3544,7 +3938,7 @@ char MakeRequest( SOCKET_CONTEXT *context, IO_OPERATION next_operation, bool use
 				{
 					context->overlapped.current_operation = IO_Close;
 
-					PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+					PostCompletion( 0, context, &context->overlapped );
 				}
 			}
 		}
@@ -3613,6 +4007,8 @@ char MakeRequest( SOCKET_CONTEXT *context, IO_OPERATION next_operation, bool use
 
 			DLL_AddNode( &g_context_list, &new_context->context_node, 0 );
 
+			AddContextTimer( new_context );
+
 			LeaveCriticalSection( &context_list_cs );
 
 			// Add to the parts list.
@@ -3645,7 +4041,7 @@ char MakeRequest( SOCKET_CONTEXT *context, IO_OPERATION next_operation, bool use
 
 			context->overlapped.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-			PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+			PostCompletion( 0, context, &context->overlapped );
 		}
 
 		content_status = CONTENT_STATUS_NONE;
@@ -3654,6 +4050,37 @@ char MakeRequest( SOCKET_CONTEXT *context, IO_OPERATION next_operation, bool use
 	return content_status;
 }
 
+// Clears the request that we've responded to so that the next request on the keep-alive connection starts fresh.
+void ResetServerRequest( SOCKET_CONTEXT *context )
+{
+	context->content_status = CONTENT_STATUS_NONE;
+
+	context->header_info.chunk_length = 0;
+	context->header_info.end_of_header = NULL;
+	context->header_info.http_status = 0;
+	context->header_info.http_method = METHOD_NONE;
+	context->header_info.connection = CONNECTION_NONE;
+	context->header_info.chunked_transfer = false;
+
+	context->header_info.range_info->content_length = 0;
+	context->header_info.range_info->content_offset = 0;
+
+	if ( context->header_info.chunk_buffer != NULL )
+	{
+		GlobalFree( context->header_info.chunk_buffer );
+		context->header_info.chunk_buffer = NULL;
+	}
+
+	// Every request needs to be authenticated.
+	FreeAuthInfo( &context->header_info.digest_info );
+
+	FreePOSTInfo( &context->post_info );
+
+	FreeAPIInfo( &context->api_info );
+
+	context->keep_alive_idle = true;
+}
+
 char MakeResponse( SOCKET_CONTEXT *context )
 {
 	char content_status = CONTENT_STATUS_FAILED;
@@ -3666,15 +4093,12 @@ char MakeResponse( SOCKET_CONTEXT *context )
 
 		bool use_keep_alive = false;
 
+		unsigned char api_status = API_RESPONSE_DONE;
+
 		if ( cfg_use_authentication && ( context->header_info.digest_info == NULL ||
 										 context->header_info.digest_info != NULL && context->header_info.digest_info->nc > 0 ) )
 		{
-			if ( context->header_info.connection == CONNECTION_KEEP_ALIVE )
-			{
-				context->content_status = CONTENT_STATUS_READ_MORE_HEADER;
-
-				use_keep_alive = true;
-			}
+			use_keep_alive = ( context->header_info.connection == CONNECTION_KEEP_ALIVE );
 
 			if ( cfg_authentication_type == AUTH_TYPE_DIGEST )
 			{
@@ -3702,10 +4126,19 @@ char MakeResponse( SOCKET_CONTEXT *context )
 					"<!DOCTYPE html><html><head><title>401 Unauthorized</title></head><body><h1>401 Unauthorized</h1></body></html>", ( use_keep_alive ? "keep-alive" : "close" ) );
 			}
 		}
+		else if ( context->api_info != NULL )
+		{
+			api_status = BuildAPIResponse( context );
+
+			// The request's Connection header was sent back with the first chunk.
+			use_keep_alive = ( api_status == API_RESPONSE_DONE && context->header_info.connection == CONNECTION_KEEP_ALIVE );
+		}
 		else if ( context->header_info.http_method == METHOD_GET ||
 				  context->header_info.http_method == METHOD_HEAD ||
 				  context->header_info.http_method == METHOD_POST )
 		{
+			use_keep_alive = ( context->header_info.connection == CONNECTION_KEEP_ALIVE );
+
 			if ( context->header_info.http_status == 200 )
 			{
 				context->header_info.http_status = 0;	// Reset.
@@ -3714,14 +4147,14 @@ char MakeResponse( SOCKET_CONTEXT *context )
 					"HTTP/1.1 200 OK\r\n" \
 					"Content-Type: text/plain\r\n" \
 					"Content-Length: 11\r\n" \
-					"Connection: close\r\n\r\n" \
-					"DOWNLOADING" );
+					"Connection: %s\r\n\r\n" \
+					"DOWNLOADING", ( use_keep_alive ? "keep-alive" : "close" ) );
 			}
 			else
 			{
 				context->wsabuf.len = __snprintf( context->wsabuf.buf, context->buffer_size,
 					"HTTP/1.1 204 No Content\r\n" \
-					"Connection: close\r\n\r\n" );
+					"Connection: %s\r\n\r\n", ( use_keep_alive ? "keep-alive" : "close" ) );
 			}
 		}
 		else
@@ -3734,49 +4167,67 @@ char MakeResponse( SOCKET_CONTEXT *context )
 				"<!DOCTYPE html><html><head><title>501 Not Implemented</title></head><body><h1>501 Not Implemented</h1></body></html>" );
 		}
 
+		// The next request on the connection will be read once the response has been sent.
+		if ( use_keep_alive )
+		{
+			ResetServerRequest( context );
+		}
+
 		bool sent = false;
 		int nRet = 0;
 		DWORD dwFlags = 0;
 
-		if ( context->ssl != NULL )
+		// A WAIT response has parked the context until the event stream has something to send.
+		if ( api_status != API_RESPONSE_WAIT )
 		{
-			if ( use_keep_alive )
-			{
-				context->overlapped.next_operation = IO_GetRequest;
-			}
-			else
+			if ( context->ssl != NULL )
 			{
-				context->overlapped.next_operation = IO_Shutdown;
-			}
-
-			SSL_WSASend( context, &context->overlapped, &context->wsabuf, sent );
-			if ( !sent )
-			{
-				context->overlapped.current_operation = IO_Shutdown;
+				if ( api_status == API_RESPONSE_SEND_MORE )
+				{
+					context->overlapped.next_operation = IO_APIResponse;
+				}
+				else if ( use_keep_alive )
+				{
+					context->overlapped.next_operation = IO_GetRequest;
+				}
+				else
+				{
+					context->overlapped.next_operation = IO_Shutdown;
+				}
 
-				PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
-			}
-		}
-		else
-		{
-			context->overlapped.current_operation = IO_Write;
+				SSL_WSASend( context, &context->overlapped, &context->wsabuf, sent );
+				if ( !sent )
+				{
+					context->overlapped.current_operation = IO_Shutdown;
 
-			if ( use_keep_alive )
-			{
-				context->overlapped.next_operation = IO_GetRequest;
+					PostCompletion( 0, context, &context->overlapped );
+				}
 			}
 			else
 			{
-				context->overlapped.next_operation = IO_Close;
-			}
+				context->overlapped.current_operation = IO_Write;
 
-			// We do a regular WSASend here since the connection was not encrypted.
-			nRet = _WSASend( context->socket, &context->wsabuf, 1, NULL, dwFlags, ( OVERLAPPED * )&context->overlapped, NULL );
-			if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
-			{
-				context->overlapped.current_operation = IO_Close;
+				if ( api_status == API_RESPONSE_SEND_MORE )
+				{
+					context->overlapped.next_operation = IO_APIResponse;
+				}
+				else if ( use_keep_alive )
+				{
+					context->overlapped.next_operation = IO_GetRequest;
+				}
+				else
+				{
+					context->overlapped.next_operation = IO_Close;
+				}
 
-				PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
+				// We do a regular WSASend here since the connection was not encrypted.
+				nRet = _WSASend( context->socket, &context->wsabuf, 1, NULL, dwFlags, ( OVERLAPPED * )&context->overlapped, NULL );
+				if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
+				{
+					context->overlapped.current_operation = IO_Close;
+
+					PostCompletion( 0, context, &context->overlapped );
+				}
 			}
 		}
 
@@ -3829,8 +4280,7 @@ char AllocateFile( SOCKET_CONTEXT *context )
 							SetFileTime( context->download_info->hFile, &context->header_info.last_modified, &context->header_info.last_modified, &context->header_info.last_modified );
 						}
 
-						g_hIOCP = CreateIoCompletionPort( context->download_info->hFile, g_hIOCP, 0, 0 );
-						if ( g_hIOCP != NULL )
+						if ( AssociateCompletionQueue( context->download_info->hFile, NULL ) )
 						{
 //							context->overlapped.context = context;
 
@@ -3854,8 +4304,7 @@ char AllocateFile( SOCKET_CONTEXT *context )
 							SetFileTime( context->download_info->hFile, &context->header_info.last_modified, &context->header_info.last_modified, &context->header_info.last_modified );
 						}
 
-						g_hIOCP = CreateIoCompletionPort( context->download_info->hFile, g_hIOCP, 0, 0 );
-						if ( g_hIOCP != NULL )
+						if ( AssociateCompletionQueue( context->download_info->hFile, NULL ) )
 						{
 //							context->overlapped.context = context;
 
@@ -3928,6 +4377,10 @@ char AllocateFile( SOCKET_CONTEXT *context )
 					context->download_info->status = STATUS_FILE_IO_ERROR;
 					context->status = STATUS_FILE_IO_ERROR;
 				}
+				else if ( context->header_info.content_encoding == 0 )	// Decoded data isn't written at the offsets it's downloaded at, so its ranges can't be resumed.
+				{
+					OpenRangeCheckpoint( context->download_info );
+				}
 			}
 		}
 		else
@@ -4149,6 +4602,224 @@ char HandleLastModifiedPrompt( SOCKET_CONTEXT *context )
 	return content_status;
 }
 
+#define CHUNK_DECODE_FAILED	-1
+#define CHUNK_DECODE_MORE	0	// The buffer was used up.
+#define CHUNK_DECODE_DATA	1	// A span of chunk data was found.
+#define CHUNK_DECODE_DONE	2	// The last chunk and any trailer fields were read.
+
+// Step through the chunk framing until a span of chunk data is found, or the buffer is used up.
+// The decoder's state is kept in header_info so the stream can be split anywhere. Nothing is copied and the buffer doesn't need to be NULL terminated.
+// buffer and buffer_length are moved past everything that was decoded. data points into the buffer.
+char DecodeChunkedTransfer( HEADER_INFO *header_info, char **buffer, unsigned int *buffer_length, char **data, unsigned int *data_length )
+{
+	char *itr = *buffer;
+	char *end = *buffer + *buffer_length;
+
+	char decode_status = CHUNK_DECODE_MORE;
+
+	// Anything after the last chunk is ignored.
+	if ( header_info->chunk_state == CHUNK_STATE_DONE )
+	{
+		return CHUNK_DECODE_DONE;
+	}
+
+	while ( itr < end && decode_status == CHUNK_DECODE_MORE )
+	{
+		char c = *itr;
+
+		switch ( header_info->chunk_state )
+		{
+			case CHUNK_STATE_SIZE_START:
+			case CHUNK_STATE_SIZE:
+			{
+				unsigned char value;
+
+				if ( c >= '0' && c <= '9' )
+				{
+					value = c - '0';
+				}
+				else if ( c >= 'a' && c <= 'f' )
+				{
+					value = c - 'a' + 10;
+				}
+				else if ( c >= 'A' && c <= 'F' )
+				{
+					value = c - 'A' + 10;
+				}
+				else if ( header_info->chunk_state == CHUNK_STATE_SIZE_START )	// The chunk size needs at least one digit.
+				{
+					decode_status = CHUNK_DECODE_FAILED;
+
+					break;
+				}
+				else
+				{
+					// Ignore any chunk extensions.
+					if ( c == ';' || c == ' ' || c == '\t' )
+					{
+						header_info->chunk_state = CHUNK_STATE_EXTENSION;
+					}
+					else if ( c == '\r' )
+					{
+						header_info->chunk_state = CHUNK_STATE_SIZE_LF;
+					}
+					else
+					{
+						decode_status = CHUNK_DECODE_FAILED;
+					}
+
+					break;
+				}
+
+				// Don't let the chunk size overflow.
+				if ( header_info->chunk_length > ( 0xFFFFFFFFFFFFFFFF >> 4 ) )
+				{
+					decode_status = CHUNK_DECODE_FAILED;
+
+					break;
+				}
+
+				if ( header_info->chunk_state == CHUNK_STATE_SIZE_START )
+				{
+					header_info->chunk_length = 0;
+					header_info->chunk_state = CHUNK_STATE_SIZE;
+				}
+
+				header_info->chunk_length = ( header_info->chunk_length << 4 ) | value;
+			}
+			break;
+
+			case CHUNK_STATE_EXTENSION:
+			{
+				if ( c == '\r' )
+				{
+					header_info->chunk_state = CHUNK_STATE_SIZE_LF;
+				}
+			}
+			break;
+
+			case CHUNK_STATE_SIZE_LF:
+			{
+				if ( c == '\n' )
+				{
+					// A zero length chunk is the last one. It can be followed by trailer fields.
+					header_info->chunk_state = ( header_info->chunk_length == 0 ? CHUNK_STATE_TRAILER_START : CHUNK_STATE_DATA );
+				}
+				else
+				{
+					decode_status = CHUNK_DECODE_FAILED;
+				}
+			}
+			break;
+
+			case CHUNK_STATE_DATA:
+			{
+				unsigned int length = ( unsigned int )( end - itr );
+				if ( header_info->chunk_length < length )
+				{
+					length = ( unsigned int )header_info->chunk_length;
+				}
+
+				*data = itr;
+				*data_length = length;
+
+				header_info->chunk_length -= length;
+				if ( header_info->chunk_length == 0 )
+				{
+					header_info->chunk_state = CHUNK_STATE_DATA_CR;
+				}
+
+				itr += ( length - 1 );	// The last byte is stepped past below.
+
+				decode_status = CHUNK_DECODE_DATA;
+			}
+			break;
+
+			case CHUNK_STATE_DATA_CR:
+			{
+				if ( c == '\r' )
+				{
+					header_info->chunk_state = CHUNK_STATE_DATA_LF;
+				}
+				else
+				{
+					decode_status = CHUNK_DECODE_FAILED;
+				}
+			}
+			break;
+
+			case CHUNK_STATE_DATA_LF:
+			{
+				if ( c == '\n' )
+				{
+					header_info->chunk_state = CHUNK_STATE_SIZE_START;
+				}
+				else
+				{
+					decode_status = CHUNK_DECODE_FAILED;
+				}
+			}
+			break;
+
+			case CHUNK_STATE_TRAILER_START:
+			{
+				// An empty line ends the trailer.
+				header_info->chunk_state = ( c == '\r' ? CHUNK_STATE_END_LF : CHUNK_STATE_TRAILER );
+			}
+			break;
+
+			case CHUNK_STATE_TRAILER:
+			{
+				if ( c == '\r' )
+				{
+					header_info->chunk_state = CHUNK_STATE_TRAILER_LF;
+				}
+			}
+			break;
+
+			case CHUNK_STATE_TRAILER_LF:
+			{
+				if ( c == '\n' )
+				{
+					header_info->chunk_state = CHUNK_STATE_TRAILER_START;
+				}
+				else
+				{
+					decode_status = CHUNK_DECODE_FAILED;
+				}
+			}
+			break;
+
+			case CHUNK_STATE_END_LF:
+			{
+				if ( c == '\n' )
+				{
+					header_info->chunk_state = CHUNK_STATE_DONE;
+
+					decode_status = CHUNK_DECODE_DONE;
+				}
+				else
+				{
+					decode_status = CHUNK_DECODE_FAILED;
+				}
+			}
+			break;
+		}
+
+		if ( decode_status == CHUNK_DECODE_FAILED )
+		{
+			break;
+		}
+
+		++itr;
+	}
+
+	*buffer_length -= ( unsigned int )( itr - *buffer );
+	*buffer = itr;
+
+	return decode_status;
+}
+
 char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, unsigned int response_buffer_length )
 {
 	if ( context == NULL )
@@ -4158,6 +4829,9 @@ char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, uns
 
 	char content_status;
 
+	// The last write was full and there's still received data left to decompress.
+	bool decompress_more = context->decompress_more;
+
 	if ( context->content_status != CONTENT_STATUS_GET_CONTENT )
 	{
 		content_status = CONTENT_STATUS_GET_CONTENT;	// Assume we're now getting the content.
@@ -4241,203 +4915,105 @@ char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, uns
 	// Now we need to decode the buffer in case it was a chunked transfer. Boo!!!
 	if ( context->header_info.chunked_transfer )
 	{
-		if ( context->download_info != NULL && !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
-		{
-			if ( context->header_info.chunk_buffer == NULL )
-			{
-				context->header_info.chunk_buffer = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * context->buffer_size );
-			}
-		}
+		bool decompress = CanDecompress( context->header_info.content_encoding );
+		bool save_data = ( context->download_info != NULL && !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) );
 
-		context->write_wsabuf.buf = context->header_info.chunk_buffer;
+		// Decompressed data is inflated straight into the decompression buffer and written from there.
+		// Otherwise, the chunk data is moved down over the chunk framing so that it can be written straight from our receive buffer.
+		context->write_wsabuf.buf = NULL;
 		context->write_wsabuf.len = 0;
 
 		content_status = CONTENT_STATUS_READ_MORE_CONTENT;
 
-		// Offset past the chunk terminating token.
-		if ( response_buffer_length >= 2 && response_buffer[ 0 ] == '\r' && response_buffer[ 1 ] == '\n' )
+		// Finish decompressing the chunk that didn't fit in the last write before decoding the rest of the received data.
+		if ( decompress_more )
 		{
-			response_buffer_length -= 2;
-			response_buffer += 2;
+			char *remaining_buffer = ( char * )( context->stream.next_in + context->stream.avail_in );
 
-			context->header_info.got_chunk_start = false;
-		}
+			context->write_wsabuf.buf = context->decompressed_buf;
+			context->write_wsabuf.len = DecompressStream( context, NULL, 0, 0 );
 
-		while ( response_buffer_length > 0 )
-		{
-			if ( !context->header_info.got_chunk_start )
+			if ( context->decompress_more )
 			{
-				// End of chunk value.
-				char *end_chunk = _StrStrA( response_buffer, "\r\n" );
-				if ( end_chunk == NULL )
-				{
-					if ( response_buffer > context->buffer )
-					{
-						_memmove( context->buffer, response_buffer, response_buffer_length );
-
-						context->wsabuf.buf += response_buffer_length;
-						context->wsabuf.len -= response_buffer_length;
-
-						content_status = CONTENT_STATUS_READ_MORE_CONTENT;	// Read more content data.
-						break;
-					}
-					else	// Buffer is too small.
-					{
-						content_status = CONTENT_STATUS_FAILED;
-						break;
-					}
-				}
-
-				// Get the chunk value (including any extensions).
-				char chunk[ 32 ];
-				_memzero( chunk, 32 );
-				_memcpy_s( chunk, 32, response_buffer, ( ( end_chunk - response_buffer ) > 32 ? 32 : ( end_chunk - response_buffer ) ) );
-				chunk[ 31 ] = 0; // Sanity
-
-				// Find any chunked extension and ignore it.
-				char *find_extension = _StrChrA( chunk, ';' );
-				if ( find_extension != NULL )
-				{
-					*find_extension = NULL;
-				}
-
-				end_chunk += 2;
-
-				// Convert the hexidecimal chunk value into an integer. Stupid...
-				context->header_info.chunk_length = strtoull( chunk, true );
-
-				if ( context->header_info.chunk_length == 0 )
-				{
-					// Make sure the chunk terminator looks like "0\r\n\r\n" before we exit. We need to flush all the data if it's not complete.
-					if ( ( response_buffer_length - ( end_chunk - response_buffer ) ) < 2 )
-					{
-						_memmove( context->buffer, response_buffer, response_buffer_length );
+				content_status = CONTENT_STATUS_DECOMPRESS_MORE;
 
-						context->wsabuf.buf = context->buffer + response_buffer_length;
-						context->wsabuf.len = context->buffer_size - response_buffer_length;
-
-						content_status = CONTENT_STATUS_READ_MORE_CONTENT;	// Read more content data.
-						break;
-					}
-					else
-					{
-						context->header_info.got_chunk_terminator = true;
-
-						content_status = ( !context->processed_header ? CONTENT_STATUS_HANDLE_RESPONSE : CONTENT_STATUS_READ_MORE_CONTENT );	// We're done reading the chunked transfer stream.
-						break;
-					}
-				}
-
-				response_buffer_length -= ( unsigned int )( end_chunk - response_buffer );
-				response_buffer = end_chunk;
-
-				context->header_info.got_chunk_start = true;
+				response_buffer_length = 0;
 			}
-			
-			if ( context->header_info.chunk_length > response_buffer_length )	// The chunk is too large, dump our response buffer.
+			else
 			{
-				char *output_buffer = response_buffer;
-				unsigned int output_buffer_length = response_buffer_length;
-
-				if ( zlib1_state == ZLIB1_STATE_RUNNING )
-				{
-					if ( context->header_info.content_encoding == CONTENT_ENCODING_GZIP || context->header_info.content_encoding == CONTENT_ENCODING_DEFLATE )
-					{
-						unsigned int total_data_length = DecompressStream( context, output_buffer, output_buffer_length );
+				response_buffer_length -= ( unsigned int )( remaining_buffer - response_buffer );
+				response_buffer = remaining_buffer;
+			}
+		}
 
-						if ( context->decompressed_buf != NULL )
-						{
-							output_buffer = context->decompressed_buf;
-							output_buffer_length = total_data_length;
-						}
-					}
-				}
+		while ( response_buffer_length > 0 )
+		{
+			char *data = NULL;
+			unsigned int data_length = 0;
 
-				context->content_offset += response_buffer_length;	// The remainder length of our response. The true amount that was downloaded. Allows us to resume if we stop the download.
-				//context->header_info.range_info->content_offset += response_buffer_length;	// The remainder length of our response. The true amount that was downloaded. Allows us to resume if we stop the download.
-				context->header_info.chunk_length -= response_buffer_length;				// Exclude the remainder length from the content length.
+			char decode_status = DecodeChunkedTransfer( &context->header_info, &response_buffer, &response_buffer_length, &data, &data_length );
 
-				if ( context->download_info != NULL )
-				{
-					if ( !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
-					{
-						_memcpy_s( context->write_wsabuf.buf + context->write_wsabuf.len, context->buffer_size - context->write_wsabuf.len, output_buffer, output_buffer_length );
-					}
-
-					context->write_wsabuf.len += output_buffer_length;
-				}
+			if ( decode_status == CHUNK_DECODE_FAILED )	// Bad chunk framing. Can't continue.
+			{
+				content_status = CONTENT_STATUS_FAILED;
+				break;
+			}
+			else if ( decode_status == CHUNK_DECODE_DONE )
+			{
+				context->header_info.got_chunk_terminator = true;
 
-				content_status = CONTENT_STATUS_READ_MORE_CONTENT;
+				content_status = ( !context->processed_header ? CONTENT_STATUS_HANDLE_RESPONSE : CONTENT_STATUS_READ_MORE_CONTENT );	// We're done reading the chunked transfer stream.
 				break;
 			}
-			else	// We have a complete chunk(s) in our response buffer.
+			else if ( decode_status == CHUNK_DECODE_DATA )
 			{
-				char *output_buffer = response_buffer;
-				unsigned int output_buffer_length = ( unsigned int )context->header_info.chunk_length;
+				context->content_offset += data_length;	// The true amount that was downloaded. Allows us to resume if we stop the download.
 
-				if ( zlib1_state == ZLIB1_STATE_RUNNING )
+				if ( decompress )
 				{
-					if ( context->header_info.content_encoding == CONTENT_ENCODING_GZIP || context->header_info.content_encoding == CONTENT_ENCODING_DEFLATE )
+					// Simulated downloads only need the decompressed size, so their output can be overwritten.
+					unsigned int total_data_length = DecompressStream( context, data, data_length, ( save_data ? context->write_wsabuf.len : 0 ) );
+
+					if ( context->decompressed_buf != NULL )
 					{
-						unsigned int total_data_length = DecompressStream( context, output_buffer, output_buffer_length );
+						context->write_wsabuf.buf = context->decompressed_buf;
+						context->write_wsabuf.len += total_data_length;
 
-						if ( context->decompressed_buf != NULL )
+						if ( context->decompress_more )
 						{
-							output_buffer = context->decompressed_buf;
-							output_buffer_length = total_data_length;
-						}
-					}
-				}
-
-				context->content_offset += context->header_info.chunk_length;	// The true amount that was downloaded. Allows us to resume if we stop the download.
-				//context->header_info.range_info->content_offset += context->header_info.chunk_length;	// The true amount that was downloaded. Allows us to resume if we stop the download.
-
-				response_buffer_length -= ( unsigned int )context->header_info.chunk_length;
-				response_buffer += ( unsigned int )context->header_info.chunk_length;
+							// The decompression buffer is full. Write it and continue from here once it's done.
+							if ( save_data )
+							{
+								content_status = CONTENT_STATUS_DECOMPRESS_MORE;
+								break;
+							}
 
-				context->header_info.chunk_length = 0;	// Reset the length of the new chunk.
+							do
+							{
+								context->write_wsabuf.len += DecompressStream( context, NULL, 0, 0 );
+							}
+							while ( context->decompress_more );
+						}
 
-				if ( context->download_info != NULL )
-				{
-					if ( !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
-					{
-						_memcpy_s( context->write_wsabuf.buf + context->write_wsabuf.len, context->buffer_size - context->write_wsabuf.len, output_buffer, output_buffer_length );
+						continue;
 					}
-
-					context->write_wsabuf.len += output_buffer_length;
 				}
 
-				// See if we have more chunks.
-				if ( response_buffer_length >=2 )
-				{
-					// Move to the next chunk.
-					if ( response_buffer[ 0 ] == '\r' && response_buffer[ 1 ] == '\n' )
-					{
-						response_buffer_length -= 2;
-						response_buffer += 2;
-
-						context->header_info.got_chunk_start = false;	// Get the new chunk length.
-
-						content_status = CONTENT_STATUS_READ_MORE_CONTENT;
-					}
-					else	// Bad terminator. Can't continue.
-					{
-						content_status = CONTENT_STATUS_FAILED;
-						break;
-					}
-				}
-				else	// Incomplete chunk terminator. Request more data to complete the chunk.
+				if ( context->download_info != NULL )
 				{
-					if ( response_buffer_length >= 1 )
+					if ( save_data )
 					{
-						_memmove( context->buffer, response_buffer, response_buffer_length );
-
-						context->wsabuf.buf += response_buffer_length;
-						context->wsabuf.len -= response_buffer_length;
+						if ( context->write_wsabuf.buf == NULL )	// The first span is written from where it is.
+						{
+							context->write_wsabuf.buf = data;
+						}
+						else	// Any other spans come after it in the buffer.
+						{
+							_memmove( context->write_wsabuf.buf + context->write_wsabuf.len, data, data_length );
+						}
 					}
 
-					content_status = CONTENT_STATUS_READ_MORE_CONTENT;
-					break;
+					context->write_wsabuf.len += data_length;
 				}
 			}
 		}
@@ -4476,7 +5052,7 @@ char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, uns
 
 						//context->header_info.range_info->file_write_offset += context->write_wsabuf.len;	// The size of the non-encoded/decoded data that we're writing to the file.
 
-						BOOL bRet = WriteFile( context->download_info->hFile, context->write_wsabuf.buf, context->write_wsabuf.len, NULL, ( OVERLAPPED * )&context->overlapped );
+						BOOL bRet = WriteFileCached( context, &context->overlapped );
 						if ( bRet == FALSE && ( GetLastError() != ERROR_IO_PENDING ) )
 						{
 							InterlockedDecrement( &context->pending_operations );
@@ -4536,27 +5112,39 @@ char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, uns
 	}
 	else	// Non-chunked transfer
 	{
+		// Another part can take over the end of our range while we're downloading it. Make sure we handle only what we need and no more.
+		if ( context->parts > 1 && context->header_info.content_encoding == CONTENT_ENCODING_NONE )
+		{
+			if ( context->header_info.range_info->content_offset + response_buffer_length > ( ( context->header_info.range_info->range_end - context->header_info.range_info->range_start ) + 1 ) )
+			{
+				response_buffer_length = ( unsigned int )( ( ( context->header_info.range_info->range_end - context->header_info.range_info->range_start ) + 1 ) - context->header_info.range_info->content_offset );
+			}
+		}
+
 		char *output_buffer = response_buffer;
 		unsigned int output_buffer_length = response_buffer_length;
 
 		// Write buffer to file.
 
+		// The received data was accounted for when we started decompressing it.
+		unsigned int content_offset = ( decompress_more ? 0 : response_buffer_length );
+
 		if ( context->download_info != NULL )
 		{
-			if ( zlib1_state == ZLIB1_STATE_RUNNING )
+			if ( CanDecompress( context->header_info.content_encoding ) )
 			{
-				if ( context->header_info.content_encoding == CONTENT_ENCODING_GZIP || context->header_info.content_encoding == CONTENT_ENCODING_DEFLATE )
-				{
-					unsigned int total_data_length = DecompressStream( context, output_buffer, output_buffer_length );
+				// Continue with the data that didn't fit in the last write before starting on the new data.
+				unsigned int total_data_length = DecompressStream( context, ( decompress_more ? NULL : output_buffer ), output_buffer_length, 0 );
 
-					if ( context->decompressed_buf != NULL )
-					{
-						output_buffer = context->decompressed_buf;
-						output_buffer_length = total_data_length;
-					}
+				if ( context->decompressed_buf != NULL )
+				{
+					output_buffer = context->decompressed_buf;
+					output_buffer_length = total_data_length;
 				}
 			}
 
+			decompress_more = context->decompress_more;
+
 			if ( !( context->download_info->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
 			{
 				if ( context->download_info->hFile != INVALID_HANDLE_VALUE )
@@ -4582,15 +5170,22 @@ char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, uns
 
 //					context->overlapped.context = context;
 
-					context->content_status = ( !context->processed_header ? CONTENT_STATUS_HANDLE_RESPONSE : CONTENT_STATUS_READ_MORE_CONTENT );
+					if ( decompress_more )
+					{
+						context->content_status = CONTENT_STATUS_DECOMPRESS_MORE;
+					}
+					else
+					{
+						context->content_status = ( !context->processed_header ? CONTENT_STATUS_HANDLE_RESPONSE : CONTENT_STATUS_READ_MORE_CONTENT );
+					}
 
 					content_status = CONTENT_STATUS_NONE;	// Exits IO_GetContent.
 
-					context->content_offset = response_buffer_length;	// The true amount that was downloaded. Allows us to resume if we stop the download.
+					context->content_offset = content_offset;	// The true amount that was downloaded. Allows us to resume if we stop the download.
 					//context->header_info.range_info->content_offset += response_buffer_length;	// The true amount that was downloaded. Allows us to resume if we stop the download.
 					//context->header_info.range_info->file_write_offset += output_buffer_length;	// The size of the non-encoded/decoded data that we're writing to the file.
 
-					BOOL bRet = WriteFile( context->download_info->hFile, context->write_wsabuf.buf, context->write_wsabuf.len, NULL, ( OVERLAPPED * )&context->overlapped );
+					BOOL bRet = WriteFileCached( context, &context->overlapped );
 					if ( bRet == FALSE && ( GetLastError() != ERROR_IO_PENDING ) )
 					{
 						InterlockedDecrement( &context->pending_operations );
@@ -4621,6 +5216,14 @@ char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, uns
 			}
 			else	// Simulated download. Get the decompressed size of the stream.
 			{
+				// Nothing is written, so the rest of the data can be decompressed right away.
+				while ( decompress_more )
+				{
+					output_buffer_length += DecompressStream( context, NULL, 0, 0 );
+
+					decompress_more = context->decompress_more;
+				}
+
 				EnterCriticalSection( &context->download_info->shared_cs );
 				context->download_info->downloaded += output_buffer_length;					// The total amount of data (decoded) that was saved/simulated.
 				LeaveCriticalSection( &context->download_info->shared_cs );
@@ -4834,6 +5437,78 @@ bool SanitizePOSTHeaders( char *post_headers, char **sanitized_headers )
 	return false;
 }
 
+// Holds onto the data that follows the request that we're responding to. It's the beginning of the next pipelined request.
+// Our response is built in the receive buffer so the data needs to be copied out until the response has been sent.
+void SavePipelinedRequest( SOCKET_CONTEXT *context, char *next_request, unsigned int next_request_length )
+{
+	context->pipeline_length = 0;
+
+	// A server API request can still be kept alive if it's answered with a 401.
+	if ( next_request_length == 0 || context->header_info.connection != CONNECTION_KEEP_ALIVE )
+	{
+		return;
+	}
+
+	if ( next_request_length > context->pipeline_buffer_size )
+	{
+		if ( context->pipeline_buffer != NULL )
+		{
+			GlobalFree( context->pipeline_buffer );
+		}
+
+		context->pipeline_buffer = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * next_request_length );
+		context->pipeline_buffer_size = ( context->pipeline_buffer != NULL ? next_request_length : 0 );
+	}
+
+	if ( context->pipeline_buffer != NULL )
+	{
+		_memcpy_s( context->pipeline_buffer, context->pipeline_buffer_size, next_request, next_request_length );
+
+		context->pipeline_length = next_request_length;
+	}
+	else	// We won't be able to find the next request.
+	{
+		context->header_info.connection = CONNECTION_CLOSE;
+	}
+}
+
+// We're responding to a request as soon as its header has been handled.
+// The connection can't be kept alive if the request has content since we won't know where the next request begins.
+char EndRequestAtHeader( SOCKET_CONTEXT *context, char *request_buffer, unsigned int request_buffer_length )
+{
+	if ( context->header_info.range_info->content_length > 0 || context->header_info.chunked_transfer )
+	{
+		context->header_info.connection = CONNECTION_CLOSE;
+	}
+	else
+	{
+		SavePipelinedRequest( context, context->header_info.end_of_header, request_buffer_length - ( unsigned int )( context->header_info.end_of_header - request_buffer ) );
+	}
+
+	return CONTENT_STATUS_HANDLE_REQUEST;	// Send a response back.
+}
+
+// Limits the content that we handle to the length of the request. Anything after it is the next pipelined request.
+unsigned int GetRequestContentLength( SOCKET_CONTEXT *context, char *request_buffer, unsigned int request_buffer_length )
+{
+	RANGE_INFO *ri = context->header_info.range_info;
+
+	if ( request_buffer_length > ri->content_length - ri->content_offset )
+	{
+		unsigned int content_length = ( unsigned int )( ri->content_length - ri->content_offset );
+
+		SavePipelinedRequest( context, request_buffer + content_length, request_buffer_length - content_length );
+
+		request_buffer[ content_length ] = 0;	// The content values are searched for as strings.
+
+		request_buffer_length = content_length;
+	}
+
+	ri->content_offset += request_buffer_length;
+
+	return request_buffer_length;
+}
+
 char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsigned int request_buffer_length )
 {
 	if ( context == NULL )
@@ -4857,6 +5532,8 @@ char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsig
 			return content_status;
 		}
 
+		context->keep_alive_idle = false;
+
 		if ( context->header_info.end_of_header != NULL )
 		{
 			if ( cfg_use_authentication )
@@ -4900,7 +5577,7 @@ char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsig
 						++context->header_info.digest_info->nc;	// We're using nc to determine success or failure. 0 = success, > 0 = failure.
 					}
 
-					return CONTENT_STATUS_HANDLE_REQUEST;
+					return EndRequestAtHeader( context, request_buffer, request_buffer_length );
 				}
 				else
 				{
@@ -4911,8 +5588,16 @@ char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsig
 				}
 			}
 
-			if ( context->header_info.http_method == METHOD_POST )
+			// Server API requests don't use their content, except for URL submissions.
+			if ( context->header_info.http_method == METHOD_POST &&
+			   ( context->api_info == NULL || context->api_info->request == API_REQUEST_ADD_URLS ) )
 			{
+				// A URL submission is only read up to its Content-Length. We can't find the next request after a chunked body.
+				if ( context->api_info != NULL && context->header_info.chunked_transfer )
+				{
+					context->header_info.connection = CONNECTION_CLOSE;
+				}
+
 				// Offset our buffer to the content and adjust the new length.
 				request_buffer_length -= ( unsigned int )( context->header_info.end_of_header - request_buffer );
 				request_buffer = context->header_info.end_of_header;
@@ -4921,7 +5606,7 @@ char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsig
 			}
 			else	// Send a response back.
 			{
-				return CONTENT_STATUS_HANDLE_REQUEST;
+				return EndRequestAtHeader( context, request_buffer, request_buffer_length );
 			}
 		}
 		else
@@ -4930,10 +5615,23 @@ char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsig
 		}
 	}
 
+	// URL submissions are added in batches as the body arrives.
+	if ( context->api_info != NULL )
+	{
+		if ( context->header_info.range_info->content_length > 0 && context->header_info.range_info->content_offset < context->header_info.range_info->content_length )
+		{
+			request_buffer_length = GetRequestContentLength( context, request_buffer, request_buffer_length );
+
+			return IngestAPIURLs( context, request_buffer, request_buffer_length );
+		}
+
+		return CONTENT_STATUS_HANDLE_REQUEST;	// Send a response back.
+	}
+
 	// We need a content length value.
 	if ( context->header_info.range_info->content_length > 0 && context->header_info.range_info->content_offset < context->header_info.range_info->content_length )
 	{
-		context->header_info.range_info->content_offset += request_buffer_length;
+		request_buffer_length = GetRequestContentLength( context, request_buffer, request_buffer_length );
 
 		// Creates context->post_info and fills its data.
 		// Returns either CONTENT_STATUS_READ_MORE_CONTENT, CONTENT_STATUS_FAILED, or CONTENT_STATUS_NONE.
@@ -5035,7 +5733,7 @@ char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsig
 
 				context->header_info.http_status = 200;	// Let our MakeResponse() know that we want to send an HTTP 200 back.
 
-				ADD_INFO *ai = ( ADD_INFO * )GlobalAlloc( GMEM_FIXED, sizeof( ADD_INFO ) );
+				ADD_INFO *ai = ( ADD_INFO * )GlobalAlloc( GPTR, sizeof( ADD_INFO ) );
 				ai->method = method;
 				if ( parts == 0 )
 				{
@@ -21,6 +21,24 @@
 
 #include "connection.h"
 
+#define HEADER_INDEX_FIELDS		64	// Fields after this many are scanned for instead of being indexed.
+
+struct HEADER_FIELD
+{
+	char *name;
+	char *value;
+	char *value_end;
+	unsigned long hash;
+	unsigned int name_length;
+};
+
+struct HEADER_INDEX
+{
+	HEADER_FIELD fields[ HEADER_INDEX_FIELDS ];
+	char *unindexed;			// The first field that didn't fit in the index.
+	unsigned int field_count;
+};
+
 struct COOKIE_CONTAINER
 {
 	char *cookie_name;
@@ -30,6 +48,9 @@ struct COOKIE_CONTAINER
 };
 
 char *GetHeaderValue( char *header, char *field_name, unsigned long field_name_length, char **value_start, char **value_end );
+void IndexHeader( HEADER_INDEX *header_index, char *header );
+char *FindHeaderField( HEADER_INDEX *header_index, unsigned int &position, char *field_name, unsigned long field_name_length, char **value_start, char **value_end );
+char *GetHeaderField( HEADER_INDEX *header_index, char *field_name, unsigned long field_name_length, char **value_start, char **value_end );
 bool ParseURL_A( char *url, char *original_resource,
 				 PROTOCOL &protocol, char **host, unsigned int &host_length, unsigned short &port, char **resource, unsigned int &resource_length,
 				 char **username, unsigned int *username_length, char **password, unsigned int *password_length );
@@ -39,16 +60,17 @@ bool ParseURL_W( wchar_t *url, wchar_t *original_resource,
 bool ParseCookieValues( char *cookie_list, dllrbt_tree **cookie_tree, char **cookies );
 
 unsigned short GetHTTPStatus( char *header );
-void GetAuthorization( char *header, AUTH_INFO *auth_info );
-void GetAuthenticate( char *header, unsigned char auth_header_type, AUTH_INFO *auth_info );
-bool GetTransferEncoding( char *header );
-unsigned long long GetContentLength( char *header );
-void GetContentRange( char *header, RANGE_INFO *range_info );
-void GetLocation( char *header, URL_LOCATION *url_location );
-unsigned char GetConnection( char *header );
-unsigned char GetContentEncoding( char *header );
-char *GetContentDisposition( char *header, unsigned int &filename_length );
-//char *GetETag( char *header );
+void GetAuthorization( HEADER_INDEX *header_index, AUTH_INFO *auth_info );
+void GetAuthenticate( HEADER_INDEX *header_index, unsigned char auth_header_type, AUTH_INFO *auth_info );
+bool GetTransferEncoding( HEADER_INDEX *header_index );
+unsigned long long GetContentLength( HEADER_INDEX *header_index );
+void GetContentRange( HEADER_INDEX *header_index, RANGE_INFO *range_info );
+void GetLocation( HEADER_INDEX *header_index, char *resource, URL_LOCATION *url_location );
+unsigned char GetConnection( HEADER_INDEX *header_index );
+unsigned char GetContentEncoding( HEADER_INDEX *header_index );
+bool CanDecompress( unsigned char content_encoding );
+char *GetContentDisposition( HEADER_INDEX *header_index, unsigned int &filename_length );
+//char *GetETag( HEADER_INDEX *header_index );
 
 dllrbt_tree *CopyCookieTree( dllrbt_tree *cookie_tree );
 
@@ -56,7 +78,11 @@ char ParseHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int
 char GetHTTPHeader( SOCKET_CONTEXT *context, char *header_buffer, unsigned int header_buffer_length );
 char GetHTTPResponseContent( SOCKET_CONTEXT *context, char *response_buffer, unsigned int response_buffer_length );
 char GetHTTPRequestContent( SOCKET_CONTEXT *context, char *request_buffer, unsigned int request_buffer_length );
+void SavePipelinedRequest( SOCKET_CONTEXT *context, char *next_request, unsigned int next_request_length );
+char EndRequestAtHeader( SOCKET_CONTEXT *context, char *request_buffer, unsigned int request_buffer_length );
+unsigned int GetRequestContentLength( SOCKET_CONTEXT *context, char *request_buffer, unsigned int request_buffer_length );
 
+void ResetServerRequest( SOCKET_CONTEXT *context );
 char MakeResponse( SOCKET_CONTEXT *context );
 char MakeRequest( SOCKET_CONTEXT *context, IO_OPERATION next_operation, bool use_connect );
 char MakeRangeRequest( SOCKET_CONTEXT *context );
@@ -27,6 +27,7 @@
 
 #include "list_operations.h"
 #include "file_operations.h"
+#include "download_observer.h"
 
 #include "utilities.h"
 
@@ -36,6 +37,7 @@
 
 void ProcessingList( bool processing )
 {
+#ifndef HEADLESS_BUILD
 	if ( processing )
 	{
 		//_SetWindowTextW( g_hWnd_main, L"HTTP Downloader - Please wait..." );	// Update the window title.
@@ -50,16 +52,22 @@ void ProcessingList( bool processing )
 		_SetFocus( g_hWnd_files );									// Give focus back to the listview to allow shortcut keys.
 		//_SetWindowTextW( g_hWnd_main, PROGRAM_CAPTION );			// Reset the window title.
 	}
+#endif
 }
 
 void ResetDownload( DOWNLOAD_INFO *di, bool from_beginning, bool check_if_file_exists )
 {
 	if ( di != NULL )
 	{
+		// The ranges that are freed below mustn't be read afterward.
+		load_deferred_history_entry( di );
+
 		if ( from_beginning )
 		{
 			_SendMessageW( g_hWnd_main, WM_RESET_PROGRESS, 0, ( LPARAM )di );
 
+			CloseRangeCheckpoint( di, true );
+
 			while ( di->range_list != NULL )
 			{
 				DoublyLinkedList *range_node = di->range_list;
@@ -116,6 +124,8 @@ void SetContextStatus( SOCKET_CONTEXT *context, unsigned int status )
 					_shutdown( s, SD_BOTH );
 					_closesocket( s );	// Saves us from having to post if there's already a pending IO operation. Should force the operation to complete.
 				}
+
+				CancelConnectAttempts( context );
 			}
 		}
 		else
@@ -134,7 +144,7 @@ void SetContextStatus( SOCKET_CONTEXT *context, unsigned int status )
 
 				context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-				PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
+				PostCompletion( 0, context, &context->overlapped_close );
 			}
 		}
 
@@ -142,12 +152,198 @@ void SetContextStatus( SOCKET_CONTEXT *context, unsigned int status )
 	}
 }
 
+// Removes the download from the download list and frees it.
+// A download that still has active parts is freed by the connection cleanup once its parts are set to be removed.
+// The observer's item needs to have been removed first.
+// Returns the error from deleting the file, or ERROR_SUCCESS.
+// This should be done in the cleanup_cs critical section.
+DWORD FreeDownload( DOWNLOAD_INFO *di, bool delete_file )
+{
+	DWORD error = ERROR_SUCCESS;
+
+	unsigned int status = ( delete_file ? STATUS_DELETE : STATUS_NONE );
+
+	RemoveDownload( di );
+
+	EnterCriticalSection( &di->shared_cs );
+
+	DoublyLinkedList *context_node = di->parts_list;
+
+	// If there are still active connections.
+	if ( di->download_node.data != NULL )
+	{
+		di->status = STATUS_STOPPED | STATUS_REMOVE | status;
+
+		LeaveCriticalSection( &di->shared_cs );
+
+		// The connection cleanup frees the download once its parts are set to be removed.
+		// Saving the history locks history_journal_cs before shared_cs, so this can't be done in shared_cs.
+		remove_download_history_entry( di );
+
+		while ( context_node != NULL )
+		{
+			SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )context_node->data;
+
+			context_node = context_node->next;
+
+			SetContextStatus( context, STATUS_STOPPED | STATUS_REMOVE | status );
+		}
+	}
+	else	// No active parts.
+	{
+		if ( di->queue_node.data != NULL )
+		{
+			EnterCriticalSection( &download_queue_cs );
+
+			DLL_RemoveNode( &download_queue, &di->queue_node );
+
+			LeaveCriticalSection( &download_queue_cs );
+		}
+
+		LeaveCriticalSection( &di->shared_cs );
+
+		// di->icon is stored in the g_icon_handles tree. We'll destory it in the tree.
+
+		EnterCriticalSection( &icon_cache_cs );
+		// Find the icon info
+		dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( di->filename + di->file_extension_offset ), false );
+
+		// Free its values and remove it from the tree if there are no other items using it.
+		if ( itr != NULL )
+		{
+			ICON_INFO *ii = ( ICON_INFO * )( ( node_type * )itr )->val;
+			if ( ii != NULL )
+			{
+				if ( --ii->count == 0 )
+				{
+					DestroyIcon( ii->icon );
+					GlobalFree( ii->file_extension );
+					GlobalFree( ii );
+
+					dllrbt_remove( g_icon_handles, itr );
+				}
+			}
+			else
+			{
+				dllrbt_remove( g_icon_handles, itr );
+			}
+		}
+		LeaveCriticalSection( &icon_cache_cs );
+
+		GlobalFree( di->url );
+		GlobalFree( di->w_add_time );
+		ReleaseString( di->cookies );
+		ReleaseString( di->headers );
+		ReleaseString( di->data );
+		//GlobalFree( di->etag );
+		GlobalFree( di->auth_info.username );
+		GlobalFree( di->auth_info.password );
+
+		if ( di->hFile != INVALID_HANDLE_VALUE )
+		{
+			CloseHandle( di->hFile );
+		}
+
+		FreeWriteCache( di );
+
+		CloseRangeCheckpoint( di, true );
+
+		while ( di->range_list != NULL )
+		{
+			DoublyLinkedList *range_node = di->range_list;
+			di->range_list = di->range_list->next;
+
+			GlobalFree( range_node->data );
+			GlobalFree( range_node );
+		}
+
+		if ( delete_file )
+		{
+			if ( !( di->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
+			{
+				wchar_t file_path[ MAX_PATH ];
+				if ( cfg_use_temp_download_directory && di->status != STATUS_COMPLETED )
+				{
+					GetTemporaryFilePath( di, file_path );
+				}
+				else
+				{
+					GetDownloadFilePath( di, file_path );
+				}
+
+				if ( DeleteFileW( file_path ) == FALSE )
+				{
+					error = GetLastError();
+				}
+			}
+		}
+
+		remove_download_history_entry( di );
+
+		DeleteCriticalSection( &di->shared_cs );
+
+		ReleaseString( di->download_directory );
+		GlobalFree( di->filename );
+		GlobalFree( di->packed_filename );
+		GlobalFree( di );
+	}
+
+	return error;
+}
+
+// Removes a download that was requested through the server API.
+THREAD_RETURN remove_download_by_id( void *pArguments )
+{
+	unsigned int id = ( unsigned int )( ULONG_PTR )pArguments;
+
+	// This will block every other thread from entering until the first thread is complete.
+	// No other thread can remove the download while we're in here.
+	EnterCriticalSection( &worker_cs );
+
+	in_worker_thread = true;
+
+	EnterCriticalSection( &download_list_cs );
+
+	DOWNLOAD_INFO *di = FindDownload( id );
+
+	LeaveCriticalSection( &download_list_cs );
+
+	if ( di != NULL && !kill_worker_thread_flag )
+	{
+		// The GUI observer sends messages to the main thread, so this can't be done in cleanup_cs.
+		g_download_observer->RemoveItem( di );
+
+		// Wait, specifically for CleanupConnection to do its thing.
+		EnterCriticalSection( &cleanup_cs );
+
+		FreeDownload( di, false );
+
+		download_history_changed = true;
+
+		LeaveCriticalSection( &cleanup_cs );
+	}
+
+	// Release the semaphore if we're killing the thread.
+	if ( worker_semaphore != NULL )
+	{
+		ReleaseSemaphore( worker_semaphore, 1, NULL );
+	}
+
+	in_worker_thread = false;
+
+	// We're done. Let other threads continue.
+	LeaveCriticalSection( &worker_cs );
+
+	_ExitThread( 0 );
+	return 0;
+}
+
+#ifndef HEADLESS_BUILD
+
 THREAD_RETURN remove_items( void *pArguments )
 {
 	unsigned char handle_type = ( unsigned char )pArguments;	// 0 = remove, 1 = remove and delete
 
-	unsigned int status = ( handle_type == 1 ? STATUS_DELETE : STATUS_NONE );
-
 	// This will block every other thread from entering until the first thread is complete.
 	EnterCriticalSection( &worker_cs );
 
@@ -242,131 +438,19 @@ THREAD_RETURN remove_items( void *pArguments )
 
 			_SendMessageW( g_hWnd_main, WM_RESET_PROGRESS, 0, ( LPARAM )di );
 
-			EnterCriticalSection( &di->shared_cs );
-
-			DoublyLinkedList *context_node = di->parts_list;
-
-			// If there are still active connections.
-			if ( di->download_node.data != NULL )
+			DWORD error = FreeDownload( di, ( handle_type == 1 ) );
+			if ( error != ERROR_SUCCESS )
 			{
-				di->status = STATUS_STOPPED | STATUS_REMOVE | status;
-
-				LeaveCriticalSection( &di->shared_cs );
-
-				while ( context_node != NULL )
-				{
-					SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )context_node->data;
-
-					context_node = context_node->next;
+				delete_success = false;
 
-					SetContextStatus( context, STATUS_STOPPED | STATUS_REMOVE | status );
-				}
-			}
-			else	// No active parts.
-			{
-				if ( di->queue_node.data != NULL )
+				if ( error == ERROR_ACCESS_DENIED )
 				{
-					EnterCriticalSection( &download_queue_cs );
-
-					DLL_RemoveNode( &download_queue, &di->queue_node );
-
-					LeaveCriticalSection( &download_queue_cs );
+					error_type |= 1;
 				}
-
-				LeaveCriticalSection( &di->shared_cs );
-
-				// di->icon is stored in the g_icon_handles tree. We'll destory it in the tree.
-
-				EnterCriticalSection( &icon_cache_cs );
-				// Find the icon info
-				dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( di->file_path + di->file_extension_offset ), false );
-
-				// Free its values and remove it from the tree if there are no other items using it.
-				if ( itr != NULL )
+				else if ( error == ERROR_FILE_NOT_FOUND )
 				{
-					ICON_INFO *ii = ( ICON_INFO * )( ( node_type * )itr )->val;
-					if ( ii != NULL )
-					{
-						if ( --ii->count == 0 )
-						{
-							DestroyIcon( ii->icon );
-							GlobalFree( ii->file_extension );
-							GlobalFree( ii );
-
-							dllrbt_remove( g_icon_handles, itr );
-						}
-					}
-					else
-					{
-						dllrbt_remove( g_icon_handles, itr );
-					}
-				}
-				LeaveCriticalSection( &icon_cache_cs );
-
-				GlobalFree( di->url );
-				GlobalFree( di->w_add_time );
-				GlobalFree( di->cookies );
-				GlobalFree( di->headers );
-				GlobalFree( di->data );
-				//GlobalFree( di->etag );
-				GlobalFree( di->auth_info.username );
-				GlobalFree( di->auth_info.password );
-
-				if ( di->hFile != INVALID_HANDLE_VALUE )
-				{
-					CloseHandle( di->hFile );
-				}
-
-				while ( di->range_list != NULL )
-				{
-					DoublyLinkedList *range_node = di->range_list;
-					di->range_list = di->range_list->next;
-
-					GlobalFree( range_node->data );
-					GlobalFree( range_node );
-				}
-
-				if ( handle_type == 1 )
-				{
-					if ( !( di->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
-					{
-						wchar_t *file_path_delete;
-
-						wchar_t file_path[ MAX_PATH ];
-						if ( cfg_use_temp_download_directory && di->status != STATUS_COMPLETED )
-						{
-							GetTemporaryFilePath( di, file_path );
-
-							file_path_delete = file_path;
-						}
-						else
-						{
-							// We're freeing this anyway so it's safe to modify.
-							di->file_path[ di->filename_offset - 1 ] = L'\\';	// Replace the download directory NULL terminator with a directory slash.
-
-							file_path_delete = di->file_path;
-						}
-
-						if ( DeleteFileW( file_path_delete ) == FALSE )
-						{
-							delete_success = false;
-
-							int error = GetLastError();
-							if ( error == ERROR_ACCESS_DENIED )
-							{
-								error_type |= 1;
-							}
-							else if ( error == ERROR_FILE_NOT_FOUND )
-							{
-								error_type |= 2;
-							}
-						}
-					}
+					error_type |= 2;
 				}
-
-				DeleteCriticalSection( &di->shared_cs );
-
-				GlobalFree( di );
 			}
 		}
 
@@ -467,6 +551,8 @@ THREAD_RETURN handle_download_list( void *pArguments )
 				{
 					di->status |= STATUS_PAUSED;
 
+					MarkDownloadChanged( di );
+
 					context_node = di->parts_list;
 					status = di->status;
 
@@ -522,6 +608,8 @@ THREAD_RETURN handle_download_list( void *pArguments )
 
 				di->status = STATUS_STOPPED;
 
+				MarkDownloadChanged( di );
+
 				LeaveCriticalSection( &di->shared_cs );
 
 				// Remove the item from the download queue.
@@ -580,6 +668,8 @@ THREAD_RETURN handle_download_list( void *pArguments )
 						{
 							di->status = STATUS_STOPPED;
 
+							MarkDownloadChanged( di );
+
 							EnterCriticalSection( &download_queue_cs );
 
 							// Remove the item from the download queue.
@@ -643,58 +733,7 @@ THREAD_RETURN handle_download_list( void *pArguments )
 				{
 					_SendMessageW( g_hWnd_files, LVM_DELETEITEM, lvi.iItem, 0 );
 
-					EnterCriticalSection( &icon_cache_cs );
-					// Find the icon info
-					dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( di->file_path + di->file_extension_offset ), false );
-
-					// Free its values and remove it from the tree if there are no other items using it.
-					if ( itr != NULL )
-					{
-						ICON_INFO *ii = ( ICON_INFO * )( ( node_type * )itr )->val;
-						if ( ii != NULL )
-						{
-							if ( --ii->count == 0 )
-							{
-								DestroyIcon( ii->icon );
-								GlobalFree( ii->file_extension );
-								GlobalFree( ii );
-
-								dllrbt_remove( g_icon_handles, itr );
-							}
-						}
-						else
-						{
-							dllrbt_remove( g_icon_handles, itr );
-						}
-					}
-					LeaveCriticalSection( &icon_cache_cs );
-
-					GlobalFree( di->url );
-					GlobalFree( di->w_add_time );
-					GlobalFree( di->cookies );
-					GlobalFree( di->headers );
-					GlobalFree( di->data );
-					//GlobalFree( di->etag );
-					GlobalFree( di->auth_info.username );
-					GlobalFree( di->auth_info.password );
-
-					if ( di->hFile != INVALID_HANDLE_VALUE )
-					{
-						CloseHandle( di->hFile );
-					}
-
-					while ( di->range_list != NULL )
-					{
-						DoublyLinkedList *range_node = di->range_list;
-						di->range_list = di->range_list->next;
-
-						GlobalFree( range_node->data );
-						GlobalFree( range_node );
-					}
-
-					DeleteCriticalSection( &di->shared_cs );
-
-					GlobalFree( di );
+					FreeDownload( di, false );
 				}
 			}
 		}
@@ -749,426 +788,445 @@ THREAD_RETURN handle_download_list( void *pArguments )
 	return 0;
 }
 
-THREAD_RETURN handle_connection( void *pArguments )
-{
-	unsigned int status = ( unsigned int )pArguments;
-
-	EnterCriticalSection( &worker_cs );
-
-	in_worker_thread = true;
-
-	ProcessingList( true );
-
-	LVITEM lvi;
-	_memzero( &lvi, sizeof( LVITEM ) );
-	lvi.mask = LVIF_PARAM;
-	lvi.iItem = -1;
-
-	int sel_count = ( int )_SendMessageW( g_hWnd_files, LVM_GETSELECTEDCOUNT, 0, 0 );
-
-	int *index_array = ( int * )GlobalAlloc( GMEM_FIXED, sizeof( int ) * sel_count );
-
-	lvi.iItem = -1;	// Set this to -1 so that the LVM_GETNEXTITEM call can go through the list correctly.
-
-	_EnableWindow( g_hWnd_files, FALSE );	// Prevent any interaction with the listview while we're processing.
+#endif
 
-	for ( int i = 0; i < sel_count; ++i )
-	{
-		lvi.iItem = index_array[ i ] = ( int )_SendMessageW( g_hWnd_files, LVM_GETNEXTITEM, lvi.iItem, LVNI_SELECTED );
-	}
+// If check_if_file_exists is set, then a skipped download will prompt before its file is overwritten.
+// This should be done in the cleanup_cs critical section.
+void SetDownloadStatus( DOWNLOAD_INFO *di, unsigned int status, bool check_if_file_exists )
+{
+	unsigned int tmp_status;
 
-	_EnableWindow( g_hWnd_files, TRUE );	// Allow the listview to be interactive.
+	EnterCriticalSection( &di->shared_cs );
 
-	for ( int i = 0; i < sel_count; ++i )
+	// Make sure we're not already in the process of shutting down or closing the connection.
+	if ( di->status != status )
 	{
-		// Stop processing and exit the thread.
-		if ( kill_worker_thread_flag )
-		{
-			break;
-		}
-
-		EnterCriticalSection( &cleanup_cs );
-
-		lvi.iItem = index_array[ i ];
-
-		_SendMessageW( g_hWnd_files, LVM_GETITEM, 0, ( LPARAM )&lvi );
-
-		DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )lvi.lParam;
-		if ( di != NULL )
+		if ( di->status != STATUS_COMPLETED )
 		{
-			unsigned int tmp_status;
-
-			EnterCriticalSection( &di->shared_cs );
+			DoublyLinkedList *context_node = di->parts_list;
+			SOCKET_CONTEXT *context;
 
-			// Make sure we're not already in the process of shutting down or closing the connection.
-			if ( di->status != status )
+			// Make sure the status is exclusively connecting or downloading.
+			if ( di->status == STATUS_CONNECTING ||
+				 di->status == STATUS_DOWNLOADING )
 			{
-				if ( di->status != STATUS_COMPLETED )
+				if ( status == STATUS_STOPPED )	// Stop (close) the active connection.
 				{
-					DoublyLinkedList *context_node = di->parts_list;
-					SOCKET_CONTEXT *context;
+					LeaveCriticalSection( &di->shared_cs );
 
-					// Make sure the status is exclusively connecting or downloading.
-					if ( di->status == STATUS_CONNECTING ||
-						 di->status == STATUS_DOWNLOADING )
+					// di->status will be set to STATUS_STOPPED in CleanupConnection().
+					while ( context_node != NULL )
 					{
-						if ( status == STATUS_STOPPED )	// Stop (close) the active connection.
-						{
-							LeaveCriticalSection( &di->shared_cs );
-
-							// di->status will be set to STATUS_STOPPED in CleanupConnection().
-							while ( context_node != NULL )
-							{
-								context = ( SOCKET_CONTEXT * )context_node->data;
-
-								context_node = context_node->next;
+						context = ( SOCKET_CONTEXT * )context_node->data;
 
-								if ( context != NULL )
-								{
-									EnterCriticalSection( &context->context_cs );
+						context_node = context_node->next;
 
-									context->status = STATUS_STOPPED;
+						if ( context != NULL )
+						{
+							EnterCriticalSection( &context->context_cs );
 
-									if ( context->cleanup == 0 )
-									{
-										context->cleanup = 2;	// Force the cleanup.
+							context->status = STATUS_STOPPED;
 
-										InterlockedIncrement( &context->pending_operations );
+							if ( context->cleanup == 0 )
+							{
+								context->cleanup = 2;	// Force the cleanup.
 
-										context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
+								InterlockedIncrement( &context->pending_operations );
 
-										PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped_close );
-									}
+								context->overlapped_close.current_operation = ( context->ssl != NULL ? IO_Shutdown : IO_Close );
 
-									LeaveCriticalSection( &context->context_cs );
-								}
+								PostCompletion( 0, context, &context->overlapped_close );
 							}
+
+							LeaveCriticalSection( &context->context_cs );
 						}
-						else if ( status == STATUS_PAUSED ||
-								  status == STATUS_RESTART )
-						{
-							if ( status == STATUS_RESTART )
-							{
-								di->status = STATUS_STOPPED | STATUS_RESTART;
-							}
-							else
-							{
-								di->status |= STATUS_PAUSED;
-							}
+					}
+				}
+				else if ( status == STATUS_PAUSED ||
+						  status == STATUS_RESTART )
+				{
+					if ( status == STATUS_RESTART )
+					{
+						di->status = STATUS_STOPPED | STATUS_RESTART;
+					}
+					else
+					{
+						di->status |= STATUS_PAUSED;
+					}
 
-							tmp_status = di->status;
+					MarkDownloadChanged( di );
 
-							LeaveCriticalSection( &di->shared_cs );
+					tmp_status = di->status;
 
-							while ( context_node != NULL )
-							{
-								context = ( SOCKET_CONTEXT * )context_node->data;
+					LeaveCriticalSection( &di->shared_cs );
 
-								context_node = context_node->next;
+					while ( context_node != NULL )
+					{
+						context = ( SOCKET_CONTEXT * )context_node->data;
 
-								if ( context != NULL )
-								{
-									EnterCriticalSection( &context->context_cs );
+						context_node = context_node->next;
 
-									context->is_paused = false;	// Set to true when last IO operation has completed.
+						if ( context != NULL )
+						{
+							EnterCriticalSection( &context->context_cs );
 
-									context->status = tmp_status;
+							context->is_paused = false;	// Set to true when last IO operation has completed.
 
-									LeaveCriticalSection( &context->context_cs );
-								}
-							}
-						}
-						else
-						{
-							LeaveCriticalSection( &di->shared_cs );
+							context->status = tmp_status;
+
+							LeaveCriticalSection( &context->context_cs );
 						}
-						/*else
-						{
-							di->status = status;
+					}
+				}
+				else
+				{
+					LeaveCriticalSection( &di->shared_cs );
+				}
+				/*else
+				{
+					di->status = status;
 
-							LeaveCriticalSection( &di->shared_cs );
+					LeaveCriticalSection( &di->shared_cs );
 
-							while ( context_node != NULL )
-							{
-								context = ( SOCKET_CONTEXT * )context_node->data;
+					while ( context_node != NULL )
+					{
+						context = ( SOCKET_CONTEXT * )context_node->data;
 
-								context_node = context_node->next;
+						context_node = context_node->next;
 
-								if ( context != NULL )
-								{
-									EnterCriticalSection( &context->context_cs );
+						if ( context != NULL )
+						{
+							EnterCriticalSection( &context->context_cs );
 
-									context->status = status;
+							context->status = status;
 
-									LeaveCriticalSection( &context->context_cs );
-								}
-							}
-						}*/
+							LeaveCriticalSection( &context->context_cs );
+						}
 					}
-					else if ( IS_STATUS( di->status,
-								 STATUS_PAUSED |
-								 STATUS_QUEUED ) )	// The download is currently paused, or queued.
+				}*/
+			}
+			else if ( IS_STATUS( di->status,
+						 STATUS_PAUSED |
+						 STATUS_QUEUED ) )	// The download is currently paused, or queued.
+			{
+				if ( status == STATUS_DOWNLOADING ||
+					 status == STATUS_RESTART )	// Resume downloading or restart download.
+				{
+					// Download is active, continue where we left off.
+					if ( di->download_node.data != NULL )
 					{
-						if ( status == STATUS_DOWNLOADING ||
-							 status == STATUS_RESTART )	// Resume downloading or restart download.
+						if ( status == STATUS_RESTART )
 						{
-							// Download is active, continue where we left off.
-							if ( di->download_node.data != NULL )
-							{
-								if ( status == STATUS_RESTART )
-								{
-									di->status = STATUS_STOPPED | STATUS_RESTART;
-								}
-								else
-								{
-									di->status &= ~STATUS_PAUSED;
-								}
-
-								tmp_status = di->status;
-
-								LeaveCriticalSection( &di->shared_cs );
+							di->status = STATUS_STOPPED | STATUS_RESTART;
+						}
+						else
+						{
+							di->status &= ~STATUS_PAUSED;
+						}
 
-								// Run through our parts list and connect to each context.
-								while ( context_node != NULL )
-								{
-									context = ( SOCKET_CONTEXT * )context_node->data;
+						MarkDownloadChanged( di );
 
-									context_node = context_node->next;
+						tmp_status = di->status;
 
-									if ( context != NULL )
-									{
-										EnterCriticalSection( &context->context_cs );
+						LeaveCriticalSection( &di->shared_cs );
 
-										context->status = tmp_status;
+						// Run through our parts list and connect to each context.
+						while ( context_node != NULL )
+						{
+							context = ( SOCKET_CONTEXT * )context_node->data;
 
-										// The paused operation has not completed or it has and is_paused is waiting to be set (when the completion fails).
-										// We'll fall through in IOCPConnection.
-										//if ( !( context->status == STATUS_CONNECTING && !context->is_paused ) )
-										if ( context->is_paused )
-										{
-											context->is_paused = false;	// Reset.
+							context_node = context_node->next;
 
-											InterlockedIncrement( &context->pending_operations );
+							if ( context != NULL )
+							{
+								EnterCriticalSection( &context->context_cs );
 
-											// Post a completion status to the completion port that we're going to continue with whatever it left off at.
-											PostQueuedCompletionStatus( g_hIOCP, context->current_bytes_read, ( ULONG_PTR )context, ( OVERLAPPED * )&context->overlapped );
-										}
+								context->status = tmp_status;
 
-										LeaveCriticalSection( &context->context_cs );
-									}
-								}
-							}
-							else
-							{
-								if ( di->queue_node.data != NULL )	// Download is not active, attempt to resume or queue.
+								// The paused operation has not completed or it has and is_paused is waiting to be set (when the completion fails).
+								// We'll fall through in IOCPConnection.
+								//if ( !( context->status == STATUS_CONNECTING && !context->is_paused ) )
+								if ( context->is_paused )
 								{
-									if ( total_downloading < cfg_max_downloads )
-									{
-										EnterCriticalSection( &download_queue_cs );
-
-										if ( download_queue != NULL )
-										{
-											DLL_RemoveNode( &download_queue, &di->queue_node );
-											di->queue_node.data = NULL;
+									context->is_paused = false;	// Reset.
 
-											ResetDownload( di, ( status == STATUS_RESTART ? true : false ), false );
-										}
+									InterlockedIncrement( &context->pending_operations );
 
-										LeaveCriticalSection( &download_queue_cs );
-									}
-									/*else
-									{
-										di->status |= STATUS_QUEUED;	// Queued.
-									}*/
+									// Post a completion status to the completion port that we're going to continue with whatever it left off at.
+									PostCompletion( context->current_bytes_read, context, &context->overlapped );
 								}
 
-								LeaveCriticalSection( &di->shared_cs );
+								LeaveCriticalSection( &context->context_cs );
 							}
 						}
-						else if ( status == STATUS_STOPPED )	// Stop (close) the active connection.
+					}
+					else
+					{
+						if ( di->queue_node.data != NULL )	// Download is not active, attempt to resume or queue.
 						{
-							// Download is active, close the connection.
-							if ( di->download_node.data != NULL )
+							if ( total_downloading < cfg_max_downloads )
 							{
-								LeaveCriticalSection( &di->shared_cs );
+								EnterCriticalSection( &download_queue_cs );
 
-								// di->status will be set to STATUS_STOPPED in CleanupConnection().
-								while ( context_node != NULL )
+								if ( download_queue != NULL )
 								{
-									context = ( SOCKET_CONTEXT * )context_node->data;
-
-									context_node = context_node->next;
-
-									SetContextStatus( context, STATUS_STOPPED );
-								}
-							}
-							else
-							{
-								if ( di->queue_node.data != NULL )	// Download is queued.
-								{
-									di->status = STATUS_STOPPED;
-
-									EnterCriticalSection( &download_queue_cs );
-
-									// Remove the item from the download queue.
 									DLL_RemoveNode( &download_queue, &di->queue_node );
 									di->queue_node.data = NULL;
 
-									LeaveCriticalSection( &download_queue_cs );
+									ResetDownload( di, ( status == STATUS_RESTART ? true : false ), false );
 								}
 
-								LeaveCriticalSection( &di->shared_cs );
+								LeaveCriticalSection( &download_queue_cs );
 							}
-						}
-						else
-						{
-							LeaveCriticalSection( &di->shared_cs );
-						}
-						/*else
-						{
-							di->status = status;
-
-							LeaveCriticalSection( &di->shared_cs );
-
-							while ( context_node != NULL )
+							/*else
 							{
-								context = ( SOCKET_CONTEXT * )context_node->data;
+								di->status |= STATUS_QUEUED;	// Queued.
+							}*/
+						}
 
-								context_node = context_node->next;
+						LeaveCriticalSection( &di->shared_cs );
+					}
+				}
+				else if ( status == STATUS_STOPPED )	// Stop (close) the active connection.
+				{
+					// Download is active, close the connection.
+					if ( di->download_node.data != NULL )
+					{
+						LeaveCriticalSection( &di->shared_cs );
 
-								if ( context != NULL )
-								{
-									EnterCriticalSection( &context->context_cs );
+						// di->status will be set to STATUS_STOPPED in CleanupConnection().
+						while ( context_node != NULL )
+						{
+							context = ( SOCKET_CONTEXT * )context_node->data;
 
-									context->status = status;
+							context_node = context_node->next;
 
-									LeaveCriticalSection( &context->context_cs );
-								}
-							}
-						}*/
+							SetContextStatus( context, STATUS_STOPPED );
+						}
 					}
-					else if ( IS_STATUS( di->status,
-								 STATUS_STOPPED |
-								 STATUS_TIMED_OUT |
-								 STATUS_FAILED |
-								 STATUS_FILE_IO_ERROR |
-								 STATUS_SKIPPED |
-								 STATUS_AUTH_REQUIRED |
-								 STATUS_PROXY_AUTH_REQUIRED ) )	// The download is currently stopped.
+					else
 					{
-						// If this is true, then we've attempted to restart before a connection operation has completed.
-						if ( IS_STATUS( di->status, STATUS_RESTART ) && status == STATUS_STOPPED )
+						if ( di->queue_node.data != NULL )	// Download is queued.
 						{
-							di->status = status;
+							di->status = STATUS_STOPPED;
 
-							LeaveCriticalSection( &di->shared_cs );
+							MarkDownloadChanged( di );
 
-							while ( context_node != NULL )
-							{
-								context = ( SOCKET_CONTEXT * )context_node->data;
+							EnterCriticalSection( &download_queue_cs );
 
-								context_node = context_node->next;
+							// Remove the item from the download queue.
+							DLL_RemoveNode( &download_queue, &di->queue_node );
+							di->queue_node.data = NULL;
 
-								if ( context != NULL )
-								{
-									EnterCriticalSection( &context->context_cs );
+							LeaveCriticalSection( &download_queue_cs );
+						}
 
-									context->status = status;
+						LeaveCriticalSection( &di->shared_cs );
+					}
+				}
+				else
+				{
+					LeaveCriticalSection( &di->shared_cs );
+				}
+				/*else
+				{
+					di->status = status;
 
-									if ( context->cleanup == 0 )
-									{
-										context->cleanup = 1;	// Auto cleanup.
-									}
+					LeaveCriticalSection( &di->shared_cs );
 
-									// The operation is probably stuck (server isn't responding). Force close the socket it to release the operation.
-									if ( context->pending_operations > 0 )
-									{
-										if ( context->socket != INVALID_SOCKET )
-										{
-											SOCKET s = context->socket;
-											context->socket = INVALID_SOCKET;
-											_shutdown( s, SD_BOTH );
-											_closesocket( s );	// Saves us from having to post if there's already a pending IO operation. Should force the operation to complete.
-										}
-									}
+					while ( context_node != NULL )
+					{
+						context = ( SOCKET_CONTEXT * )context_node->data;
+
+						context_node = context_node->next;
 
-									LeaveCriticalSection( &context->context_cs );
-								}
-							}
-						}
-						else if ( IS_STATUS_NOT( status, STATUS_PAUSED | STATUS_STOPPED ) )
+						if ( context != NULL )
 						{
-							// Ensure that the download is actually stopped and that there are no active parts downloading.
-							if ( di->active_parts == 0 )
-							{
-								download_history_changed = true;
+							EnterCriticalSection( &context->context_cs );
 
-								ResetDownload( di, ( status == STATUS_RESTART ? true : false ), ( di->status == STATUS_SKIPPED ? true : false ) );
-							}
+							context->status = status;
 
-							LeaveCriticalSection( &di->shared_cs );
-						}
-						else
-						{
-							LeaveCriticalSection( &di->shared_cs );
+							LeaveCriticalSection( &context->context_cs );
 						}
 					}
-					else if ( di->status == STATUS_MOVING_FILE )
-					{
-						if ( status == STATUS_STOPPED )
-						{
-							di->moving_state = 2;	// Cancel.
-						}
+				}*/
+			}
+			else if ( IS_STATUS( di->status,
+						 STATUS_STOPPED |
+						 STATUS_TIMED_OUT |
+						 STATUS_FAILED |
+						 STATUS_FILE_IO_ERROR |
+						 STATUS_SKIPPED |
+						 STATUS_AUTH_REQUIRED |
+						 STATUS_PROXY_AUTH_REQUIRED ) )	// The download is currently stopped.
+			{
+				// If this is true, then we've attempted to restart before a connection operation has completed.
+				if ( IS_STATUS( di->status, STATUS_RESTART ) && status == STATUS_STOPPED )
+				{
+					di->status = status;
 
-						LeaveCriticalSection( &di->shared_cs );
-					}
-					else
-					{
-						LeaveCriticalSection( &di->shared_cs );
-					}
-					/*else
+					MarkDownloadChanged( di );
+
+					LeaveCriticalSection( &di->shared_cs );
+
+					while ( context_node != NULL )
 					{
-						di->status = status;
+						context = ( SOCKET_CONTEXT * )context_node->data;
 
-						LeaveCriticalSection( &di->shared_cs );
+						context_node = context_node->next;
 
-						while ( context_node != NULL )
+						if ( context != NULL )
 						{
-							context = ( SOCKET_CONTEXT * )context_node->data;
+							EnterCriticalSection( &context->context_cs );
 
-							context_node = context_node->next;
+							context->status = status;
 
-							if ( context != NULL )
+							if ( context->cleanup == 0 )
 							{
-								EnterCriticalSection( &context->context_cs );
-
-								context->status = status;
+								context->cleanup = 1;	// Auto cleanup.
+							}
 
-								LeaveCriticalSection( &context->context_cs );
+							// The operation is probably stuck (server isn't responding). Force close the socket it to release the operation.
+							if ( context->pending_operations > 0 )
+							{
+								if ( context->socket != INVALID_SOCKET )
+								{
+									SOCKET s = context->socket;
+									context->socket = INVALID_SOCKET;
+									_shutdown( s, SD_BOTH );
+									_closesocket( s );	// Saves us from having to post if there's already a pending IO operation. Should force the operation to complete.
+								}
 							}
+
+							LeaveCriticalSection( &context->context_cs );
 						}
-					}*/
+					}
 				}
-				else
+				else if ( IS_STATUS_NOT( status, STATUS_PAUSED | STATUS_STOPPED ) )
 				{
-					if ( status == STATUS_RESTART )
+					// Ensure that the download is actually stopped and that there are no active parts downloading.
+					if ( di->active_parts == 0 )
 					{
-						// Ensure that there are no active parts downloading.
-						if ( di->active_parts == 0 )
-						{
-							download_history_changed = true;
+						download_history_changed = true;
 
-							ResetDownload( di, true, false );
-						}
+						ResetDownload( di, ( status == STATUS_RESTART ? true : false ), ( check_if_file_exists && di->status == STATUS_SKIPPED ? true : false ) );
 					}
 
 					LeaveCriticalSection( &di->shared_cs );
 				}
+				else
+				{
+					LeaveCriticalSection( &di->shared_cs );
+				}
+			}
+			else if ( di->status == STATUS_MOVING_FILE )
+			{
+				if ( status == STATUS_STOPPED )
+				{
+					di->moving_state = 2;	// Cancel.
+				}
+
+				LeaveCriticalSection( &di->shared_cs );
 			}
 			else
 			{
 				LeaveCriticalSection( &di->shared_cs );
 			}
+			/*else
+			{
+				di->status = status;
+
+				LeaveCriticalSection( &di->shared_cs );
+
+				while ( context_node != NULL )
+				{
+					context = ( SOCKET_CONTEXT * )context_node->data;
+
+					context_node = context_node->next;
+
+					if ( context != NULL )
+					{
+						EnterCriticalSection( &context->context_cs );
+
+						context->status = status;
+
+						LeaveCriticalSection( &context->context_cs );
+					}
+				}
+			}*/
+		}
+		else
+		{
+			if ( status == STATUS_RESTART )
+			{
+				// Ensure that there are no active parts downloading.
+				if ( di->active_parts == 0 )
+				{
+					download_history_changed = true;
+
+					ResetDownload( di, true, false );
+				}
+			}
+
+			LeaveCriticalSection( &di->shared_cs );
+		}
+	}
+	else
+	{
+		LeaveCriticalSection( &di->shared_cs );
+	}
+}
+
+#ifndef HEADLESS_BUILD
+
+THREAD_RETURN handle_connection( void *pArguments )
+{
+	unsigned int status = ( unsigned int )pArguments;
+
+	EnterCriticalSection( &worker_cs );
+
+	in_worker_thread = true;
+
+	ProcessingList( true );
+
+	LVITEM lvi;
+	_memzero( &lvi, sizeof( LVITEM ) );
+	lvi.mask = LVIF_PARAM;
+	lvi.iItem = -1;
+
+	int sel_count = ( int )_SendMessageW( g_hWnd_files, LVM_GETSELECTEDCOUNT, 0, 0 );
+
+	int *index_array = ( int * )GlobalAlloc( GMEM_FIXED, sizeof( int ) * sel_count );
+
+	lvi.iItem = -1;	// Set this to -1 so that the LVM_GETNEXTITEM call can go through the list correctly.
+
+	_EnableWindow( g_hWnd_files, FALSE );	// Prevent any interaction with the listview while we're processing.
+
+	for ( int i = 0; i < sel_count; ++i )
+	{
+		lvi.iItem = index_array[ i ] = ( int )_SendMessageW( g_hWnd_files, LVM_GETNEXTITEM, lvi.iItem, LVNI_SELECTED );
+	}
+
+	_EnableWindow( g_hWnd_files, TRUE );	// Allow the listview to be interactive.
+
+	for ( int i = 0; i < sel_count; ++i )
+	{
+		// Stop processing and exit the thread.
+		if ( kill_worker_thread_flag )
+		{
+			break;
+		}
+
+		EnterCriticalSection( &cleanup_cs );
+
+		lvi.iItem = index_array[ i ];
+
+		_SendMessageW( g_hWnd_files, LVM_GETITEM, 0, ( LPARAM )&lvi );
+
+		DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )lvi.lParam;
+		if ( di != NULL )
+		{
+			SetDownloadStatus( di, status );
 		}
 
 		LeaveCriticalSection( &cleanup_cs );
@@ -1196,122 +1254,132 @@ THREAD_RETURN handle_connection( void *pArguments )
 	return 0;
 }
 
-THREAD_RETURN handle_download_queue( void *pArguments )
-{
-	unsigned char handle_type = ( unsigned char )pArguments;
-
-	EnterCriticalSection( &worker_cs );
-
-	in_worker_thread = true;
-
-	ProcessingList( true );
-
-	EnterCriticalSection( &cleanup_cs );
-
-	// Retrieve the lParam value from the selected listview item.
-	LVITEM lvi;
-	_memzero( &lvi, sizeof( LVITEM ) );
-	lvi.mask = LVIF_PARAM;
-	lvi.iItem = ( int )_SendMessageW( g_hWnd_files, LVM_GETNEXTITEM, -1, LVNI_FOCUSED | LVNI_SELECTED );
+#endif
 
-	if ( lvi.iItem != -1 )
+// This should be done in the cleanup_cs critical section.
+void MoveQueuedDownload( DOWNLOAD_INFO *di, unsigned char handle_type )
+{
+	// Make sure the item is queued.
+	if ( di != NULL && IS_STATUS( di->status, STATUS_QUEUED ) )
 	{
-		_SendMessageW( g_hWnd_files, LVM_GETITEM, 0, ( LPARAM )&lvi );
-		DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )lvi.lParam;
+		CRITICAL_SECTION *cs;
+		DoublyLinkedList **queue;
 
-		// Make sure the item is queued.
-		if ( di != NULL && IS_STATUS( di->status, STATUS_QUEUED ) )
+		if ( IS_STATUS( di->status, STATUS_MOVING_FILE ) )
 		{
-			CRITICAL_SECTION *cs;
-			DoublyLinkedList **queue;
-
-			if ( IS_STATUS( di->status, STATUS_MOVING_FILE ) )
-			{
-				cs = &move_file_queue_cs;
-				queue = &move_file_queue;
-			}
-			else
-			{
-				cs = &download_queue_cs;
-				queue = &download_queue;
-			}
+			cs = &move_file_queue_cs;
+			queue = &move_file_queue;
+		}
+		else
+		{
+			cs = &download_queue_cs;
+			queue = &download_queue;
+		}
 
-			EnterCriticalSection( cs );
+		EnterCriticalSection( cs );
 
-			if ( di->queue_node.data != NULL )
+		if ( di->queue_node.data != NULL )
+		{
+			if ( handle_type == 0 )			// Move to the beginning of the queue.
 			{
-				if ( handle_type == 0 )			// Move to the beginning of the queue.
-				{
-					// Make sure we're not the head.
-					if ( &di->queue_node != *queue )
-					{
-						DLL_RemoveNode( queue, &di->queue_node );
-						DLL_AddNode( queue, &di->queue_node, 0 );
-					}
-				}
-				else if ( handle_type == 1 )	// Move forward one position in the queue.
+				// Make sure we're not the head.
+				if ( &di->queue_node != *queue )
 				{
-					// Make sure we're not the head.
-					if ( &di->queue_node != *queue )
-					{
-						DoublyLinkedList *prev = di->queue_node.prev;
-						if ( prev != NULL )
-						{
-							DLL_RemoveNode( queue, &di->queue_node );
-
-							// If the node we're replacing is the head.
-							if ( prev == *queue )
-							{
-								DLL_AddNode( queue, &di->queue_node, 0 );
-							}
-							else
-							{
-								di->queue_node.next = prev;
-								di->queue_node.prev = prev->prev;
-
-								if ( prev->prev != NULL )
-								{
-									prev->prev->next = &di->queue_node;
-								}
-								prev->prev = &di->queue_node;
-							}
-						}
-					}
+					DLL_RemoveNode( queue, &di->queue_node );
+					DLL_AddNode( queue, &di->queue_node, 0 );
 				}
-				else if ( handle_type == 2 )	// Move back one position in the queue.
+			}
+			else if ( handle_type == 1 )	// Move forward one position in the queue.
+			{
+				// Make sure we're not the head.
+				if ( &di->queue_node != *queue )
 				{
-					DoublyLinkedList *next = di->queue_node.next;
-					if ( next != NULL )
+					DoublyLinkedList *prev = di->queue_node.prev;
+					if ( prev != NULL )
 					{
 						DLL_RemoveNode( queue, &di->queue_node );
 
-						// If the node we're replacing is the tail.
-						if ( next->next == NULL )
+						// If the node we're replacing is the head.
+						if ( prev == *queue )
 						{
-							DLL_AddNode( queue, &di->queue_node, -1 );
+							DLL_AddNode( queue, &di->queue_node, 0 );
 						}
 						else
 						{
-							di->queue_node.prev = next;
-							di->queue_node.next = next->next;
+							di->queue_node.next = prev;
+							di->queue_node.prev = prev->prev;
 
-							if ( next->next != NULL )
+							if ( prev->prev != NULL )
 							{
-								next->next->prev = &di->queue_node;
+								prev->prev->next = &di->queue_node;
 							}
-							next->next = &di->queue_node;
+							prev->prev = &di->queue_node;
 						}
 					}
 				}
-				else if ( handle_type == 3 )	// Move to the end of the queue.
+			}
+			else if ( handle_type == 2 )	// Move back one position in the queue.
+			{
+				DoublyLinkedList *next = di->queue_node.next;
+				if ( next != NULL )
 				{
 					DLL_RemoveNode( queue, &di->queue_node );
-					DLL_AddNode( queue, &di->queue_node, -1 );
+
+					// If the node we're replacing is the tail.
+					if ( next->next == NULL )
+					{
+						DLL_AddNode( queue, &di->queue_node, -1 );
+					}
+					else
+					{
+						di->queue_node.prev = next;
+						di->queue_node.next = next->next;
+
+						if ( next->next != NULL )
+						{
+							next->next->prev = &di->queue_node;
+						}
+						next->next = &di->queue_node;
+					}
 				}
 			}
-
-			LeaveCriticalSection( cs );
+			else if ( handle_type == 3 )	// Move to the end of the queue.
+			{
+				DLL_RemoveNode( queue, &di->queue_node );
+				DLL_AddNode( queue, &di->queue_node, -1 );
+			}
 		}
+
+		LeaveCriticalSection( cs );
+	}
+}
+
+#ifndef HEADLESS_BUILD
+
+THREAD_RETURN handle_download_queue( void *pArguments )
+{
+	unsigned char handle_type = ( unsigned char )pArguments;
+
+	EnterCriticalSection( &worker_cs );
+
+	in_worker_thread = true;
+
+	ProcessingList( true );
+
+	EnterCriticalSection( &cleanup_cs );
+
+	// Retrieve the lParam value from the selected listview item.
+	LVITEM lvi;
+	_memzero( &lvi, sizeof( LVITEM ) );
+	lvi.mask = LVIF_PARAM;
+	lvi.iItem = ( int )_SendMessageW( g_hWnd_files, LVM_GETNEXTITEM, -1, LVNI_FOCUSED | LVNI_SELECTED );
+
+	if ( lvi.iItem != -1 )
+	{
+		_SendMessageW( g_hWnd_files, LVM_GETITEM, 0, ( LPARAM )&lvi );
+		DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )lvi.lParam;
+
+		MoveQueuedDownload( di, handle_type );
 	}
 
 	LeaveCriticalSection( &cleanup_cs );
@@ -1350,6 +1418,8 @@ THREAD_RETURN handle_download_update( void *pArguments )
 		DOWNLOAD_INFO *di = g_update_download_info;
 		if ( di != NULL )
 		{
+			load_deferred_history_entry( di );
+
 			EnterCriticalSection( &di->shared_cs );
 
 			di->download_speed_limit = ai->download_speed_limit;
@@ -1364,19 +1434,20 @@ THREAD_RETURN handle_download_update( void *pArguments )
 				 di->ssl_version != ai->ssl_version ||
 				 di->method != ai->method )
 			{
-				// Swap values and free below.
+				// The pooled strings are replaced here. ai's copies are freed below.
 				char *tmp_ptr = di->headers;
-				di->headers = ai->utf8_headers;
-				ai->utf8_headers = tmp_ptr;
+				di->headers = InternString( ai->utf8_headers );
+				ReleaseString( tmp_ptr );
 
 				tmp_ptr = di->cookies;
-				di->cookies = ai->utf8_cookies;
-				ai->utf8_cookies = tmp_ptr;
+				di->cookies = InternString( ai->utf8_cookies );
+				ReleaseString( tmp_ptr );
 
 				tmp_ptr = di->data;
-				di->data = ai->utf8_data;
-				ai->utf8_data = tmp_ptr;
+				di->data = InternString( ai->utf8_data );
+				ReleaseString( tmp_ptr );
 
+				// Swap values and free below.
 				tmp_ptr = di->auth_info.username;
 				di->auth_info.username = ai->auth_info.username;
 				ai->auth_info.username = tmp_ptr;
@@ -1423,6 +1494,8 @@ THREAD_RETURN handle_download_update( void *pArguments )
 				LeaveCriticalSection( &di->shared_cs );
 			}
 
+			MarkDownloadChanged( di );
+
 			// Sort only the values that can be updated.
 			if ( cfg_sort_added_and_updating_items &&
 			   ( cfg_sorted_column_index == COLUMN_ACTIVE_PARTS ||
@@ -1528,6 +1601,8 @@ THREAD_RETURN copy_urls( void *pArguments )
 
 		if ( di != NULL )
 		{
+			load_deferred_history_entry( di );
+
 			// We don't really need to do this since the URL will never change.
 			EnterCriticalSection( &di->shared_cs );
 
@@ -1640,6 +1715,8 @@ THREAD_RETURN rename_file( void *pArguments )
 			{
 				if ( di->filename_offset > 0 )
 				{
+					PromoteDownload( di );
+
 					bool renamed = true;
 
 					if ( !( di->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
@@ -1661,8 +1738,7 @@ THREAD_RETURN rename_file( void *pArguments )
 								}
 								else
 								{
-									_wmemcpy_s( fri->FileName, MAX_PATH, di->file_path, di->filename_offset );
-									fri->FileName[ di->filename_offset - 1 ] = L'\\';
+									GetDownloadFilePath( di, fri->FileName );
 									_wmemcpy_s( fri->FileName + di->filename_offset, MAX_PATH - di->filename_offset, ri->filename, ri->filename_length );
 									fri->FileName[ di->filename_offset + ri->filename_length ] = 0;	// Sanity.
 									fri->FileNameLength = di->filename_offset + ri->filename_length;
@@ -1703,8 +1779,7 @@ THREAD_RETURN rename_file( void *pArguments )
 							{
 								GetDownloadFilePath( di, old_file_path );
 
-								_wmemcpy_s( new_file_path, MAX_PATH, di->file_path, MAX_PATH - di->filename_offset );
-								new_file_path[ di->filename_offset - 1 ] = L'\\';
+								GetDownloadFilePath( di, new_file_path );
 								_wmemcpy_s( new_file_path + di->filename_offset, MAX_PATH - di->filename_offset, ri->filename, ri->filename_length );
 								new_file_path[ di->filename_offset + ri->filename_length ] = 0;	// Sanity.
 							}
@@ -1721,11 +1796,11 @@ THREAD_RETURN rename_file( void *pArguments )
 
 					if ( renamed )
 					{
-						_wmemcpy_s( di->file_path + di->filename_offset, MAX_PATH - di->filename_offset, ri->filename, ri->filename_length );
-						di->file_path[ di->filename_offset + ri->filename_length ] = 0;	// Sanity.
+						_wmemcpy_s( di->filename, MAX_PATH - di->filename_offset, ri->filename, ri->filename_length );
+						di->filename[ ri->filename_length ] = 0;	// Sanity.
 
 						// Get the new file extension offset.
-						di->file_extension_offset = di->filename_offset + get_file_extension_offset( di->file_path + di->filename_offset, lstrlenW( di->file_path + di->filename_offset ) );
+						di->file_extension_offset = get_file_extension_offset( di->filename, lstrlenW( di->filename ) );
 
 						DoublyLinkedList *context_node;
 
@@ -1754,7 +1829,7 @@ THREAD_RETURN rename_file( void *pArguments )
 
 						EnterCriticalSection( &icon_cache_cs );
 						// Find the icon info
-						dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( di->file_path + di->file_extension_offset ), false );
+						dllrbt_iterator *itr = dllrbt_find( g_icon_handles, ( void * )( di->filename + di->file_extension_offset ), false );
 
 						// Free its values and remove it from the tree if there are no other items using it.
 						if ( itr != NULL )
@@ -1791,7 +1866,7 @@ THREAD_RETURN rename_file( void *pArguments )
 
 						GlobalFree( sfi );
 
-						download_history_changed = true;
+						MarkDownloadChanged( di );
 					}
 					else
 					{
@@ -1911,6 +1986,8 @@ THREAD_RETURN export_list( void *pArguments )
 	return 0;
 }
 
+#endif
+
 THREAD_RETURN import_list( void *pArguments )
 {
 	importexportinfo *iei = ( importexportinfo * )pArguments;
@@ -1946,7 +2023,8 @@ THREAD_RETURN import_list( void *pArguments )
 
 				_wmemcpy_s( file_path + iei->file_offset, MAX_PATH - iei->file_offset, filename, filename_length );
 
-				if ( read_download_history( file_path ) == -2 )
+				// The program's download history is loaded with its journal during startup.
+				if ( read_download_history( file_path, ( iei->type == 0 ) ) == -2 )
 				{
 					bad_format = true;
 				}
@@ -1961,7 +2039,9 @@ THREAD_RETURN import_list( void *pArguments )
 				filename = filename + filename_length;
 			}
 
+#ifndef HEADLESS_BUILD
 			_InvalidateRect( g_hWnd_files, NULL, TRUE );
+#endif
 
 			GlobalFree( iei->file_paths );
 
@@ -1992,6 +2072,8 @@ THREAD_RETURN import_list( void *pArguments )
 	return 0;
 }
 
+#ifndef HEADLESS_BUILD
+
 THREAD_RETURN delete_files( void *pArguments )
 {
 	// This will block every other thread from entering until the first thread is complete.
@@ -2219,7 +2301,12 @@ THREAD_RETURN search_list( void *pArguments )
 				{
 					bool found_match = false;
 
-					wchar_t *text = ( si->type == 1 ? di->url : ( di->file_path + di->filename_offset ) );
+					if ( si->type == 1 )
+					{
+						load_deferred_history_entry( di );
+					}
+
+					wchar_t *text = ( si->type == 1 ? di->url : ( di->filename ) );
 
 					if ( si->search_flag == 0x04 )	// Regular expression search.
 					{
@@ -2446,6 +2533,8 @@ THREAD_RETURN filter_urls( void *pArguments )
 	return 0;
 }
 
+#endif
+
 THREAD_RETURN process_command_line_args( void *pArguments )
 {
 	CL_ARGS *cla = ( CL_ARGS * )pArguments;
@@ -2659,14 +2748,16 @@ THREAD_RETURN save_session( void *pArguments )
 
 	if ( cfg_enable_download_history && download_history_changed )
 	{
+		// Changes that are marked during the save will set this again.
+		download_history_changed = false;
+
 		wchar_t t_base_directory[ MAX_PATH ];
 
 		_wmemcpy_s( t_base_directory, MAX_PATH, base_directory, base_directory_length );
 		_wmemcpy_s( t_base_directory + base_directory_length, MAX_PATH - base_directory_length, L"\\download_history\0", 18 );
 		t_base_directory[ base_directory_length + 17 ] = 0;	// Sanity.
 
-		save_download_history( t_base_directory );
-		download_history_changed = false;
+		update_download_history( t_base_directory );
 	}
 
 	// Release the semaphore if we're killing the thread.
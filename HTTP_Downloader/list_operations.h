@@ -19,6 +19,8 @@
 #ifndef _LIST_OPERATIONS_H
 #define _LIST_OPERATIONS_H
 
+struct DOWNLOAD_INFO;
+
 struct importexportinfo
 {
 	wchar_t *file_paths;
@@ -28,7 +30,13 @@ struct importexportinfo
 
 void ProcessingList( bool processing );
 
+DWORD FreeDownload( DOWNLOAD_INFO *di, bool delete_file );
+
 THREAD_RETURN remove_items( void *pArguments );
+THREAD_RETURN remove_download_by_id( void *pArguments );
+
+void SetDownloadStatus( DOWNLOAD_INFO *di, unsigned int status, bool check_if_file_exists = true );
+void MoveQueuedDownload( DOWNLOAD_INFO *di, unsigned char handle_type );
 
 THREAD_RETURN handle_download_list( void *pArguments );
 THREAD_RETURN handle_connection( void *pArguments );
@@ -0,0 +1,67 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lite_dlls.h"
+#include "lite_brotlidec.h"
+
+#ifndef BROTLIDEC_USE_STATIC_LIB
+
+	pBrotliDecoderCreateInstance	_BrotliDecoderCreateInstance;
+	pBrotliDecoderDecompressStream	_BrotliDecoderDecompressStream;
+	pBrotliDecoderDestroyInstance	_BrotliDecoderDestroyInstance;
+
+	HMODULE hModule_brotlidec = NULL;
+
+	unsigned char brotlidec_state = 0;	// 0 = Not running, 1 = running.
+
+	bool InitializeBrotliDec()
+	{
+		if ( brotlidec_state != BROTLIDEC_STATE_SHUTDOWN )
+		{
+			return true;
+		}
+
+		hModule_brotlidec = LoadLibraryDEMW( L"brotlidec.dll" );
+
+		if ( hModule_brotlidec == NULL )
+		{
+			return false;
+		}
+
+		VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_brotlidec, ( void ** )&_BrotliDecoderCreateInstance, "BrotliDecoderCreateInstance" ) )
+		VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_brotlidec, ( void ** )&_BrotliDecoderDecompressStream, "BrotliDecoderDecompressStream" ) )
+		VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_brotlidec, ( void ** )&_BrotliDecoderDestroyInstance, "BrotliDecoderDestroyInstance" ) )
+
+		brotlidec_state = BROTLIDEC_STATE_RUNNING;
+
+		return true;
+	}
+
+	bool UnInitializeBrotliDec()
+	{
+		if ( brotlidec_state != BROTLIDEC_STATE_SHUTDOWN )
+		{
+			brotlidec_state = BROTLIDEC_STATE_SHUTDOWN;
+
+			return ( FreeLibrary( hModule_brotlidec ) == FALSE ? false : true );
+		}
+
+		return true;
+	}
+
+#endif
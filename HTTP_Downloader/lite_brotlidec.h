@@ -0,0 +1,71 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LITE_BROTLIDEC_H
+#define _LITE_BROTLIDEC_H
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+//#define BROTLIDEC_USE_STATIC_LIB
+
+#ifdef BROTLIDEC_USE_STATIC_LIB
+
+	//__pragma( comment( lib, "brotlidec.lib" ) )
+
+	#include <brotli/decode.h>
+
+	#define _BrotliDecoderCreateInstance	BrotliDecoderCreateInstance
+	#define _BrotliDecoderDecompressStream	BrotliDecoderDecompressStream
+	#define _BrotliDecoderDestroyInstance	BrotliDecoderDestroyInstance
+
+#else
+
+	#define BROTLIDEC_STATE_SHUTDOWN	0
+	#define BROTLIDEC_STATE_RUNNING		1
+
+	typedef struct BrotliDecoderStateStruct BrotliDecoderState;
+
+	typedef enum
+	{
+		BROTLI_DECODER_RESULT_ERROR = 0,
+		BROTLI_DECODER_RESULT_SUCCESS = 1,
+		BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT = 2,
+		BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT = 3
+	} BrotliDecoderResult;
+
+	typedef void * ( __cdecl *brotli_alloc_func )( void *opaque, size_t size );
+	typedef void ( __cdecl *brotli_free_func )( void *opaque, void *address );
+
+	typedef BrotliDecoderState * ( __cdecl *pBrotliDecoderCreateInstance )( brotli_alloc_func alloc_func, brotli_free_func free_func, void *opaque );
+	typedef BrotliDecoderResult ( __cdecl *pBrotliDecoderDecompressStream )( BrotliDecoderState *state, size_t *available_in, const unsigned char **next_in, size_t *available_out, unsigned char **next_out, size_t *total_out );
+	typedef void ( __cdecl *pBrotliDecoderDestroyInstance )( BrotliDecoderState *state );
+
+	extern pBrotliDecoderCreateInstance		_BrotliDecoderCreateInstance;
+	extern pBrotliDecoderDecompressStream	_BrotliDecoderDecompressStream;
+	extern pBrotliDecoderDestroyInstance	_BrotliDecoderDestroyInstance;
+
+	extern unsigned char brotlidec_state;
+
+	bool InitializeBrotliDec();
+	bool UnInitializeBrotliDec();
+
+#endif
+
+#endif
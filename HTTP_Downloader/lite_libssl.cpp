@@ -0,0 +1,134 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "lite_dlls.h"
+#include "lite_libssl.h"
+
+#ifdef _WIN64
+	#define LIBCRYPTO_DLL_NAME	L"libcrypto-3-x64.dll"
+	#define LIBSSL_DLL_NAME		L"libssl-3-x64.dll"
+#else
+	#define LIBCRYPTO_DLL_NAME	L"libcrypto-3.dll"
+	#define LIBSSL_DLL_NAME		L"libssl-3.dll"
+#endif
+
+pBIO_new					_BIO_new;
+pBIO_free					_BIO_free;
+pBIO_s_mem					_BIO_s_mem;
+pBIO_read					_BIO_read;
+pBIO_write					_BIO_write;
+pBIO_ctrl_pending			_BIO_ctrl_pending;
+
+pTLS_client_method			_TLS_client_method;
+pSSL_CTX_new				_SSL_CTX_new;
+pSSL_CTX_free				_SSL_CTX_free;
+pSSL_new					_SSL_new;
+pSSL_free					_SSL_free;
+pSSL_set_bio				_SSL_set_bio;
+pSSL_set_connect_state		_SSL_set_connect_state;
+pSSL_do_handshake			_SSL_do_handshake;
+pSSL_read					_SSL_read;
+pSSL_write					_SSL_write;
+pSSL_shutdown				_SSL_shutdown;
+pSSL_get_error				_SSL_get_error;
+pSSL_ctrl					_SSL_ctrl;
+pSSL_pending				_SSL_pending;
+pSSL_set_session			_SSL_set_session;
+pSSL_get1_session			_SSL_get1_session;
+pSSL_session_reused			_SSL_session_reused;
+pSSL_SESSION_is_resumable	_SSL_SESSION_is_resumable;
+pSSL_SESSION_free			_SSL_SESSION_free;
+
+HMODULE hModule_libcrypto = NULL;
+HMODULE hModule_libssl = NULL;
+
+unsigned char libssl_state = 0;	// 0 = Not running, 1 = running.
+
+bool InitializeLibSSL()
+{
+	if ( libssl_state != LIBSSL_STATE_SHUTDOWN )
+	{
+		return true;
+	}
+
+	// libssl depends on libcrypto.
+	hModule_libcrypto = LoadLibraryDEMW( LIBCRYPTO_DLL_NAME );
+
+	if ( hModule_libcrypto == NULL )
+	{
+		return false;
+	}
+
+	hModule_libssl = LoadLibraryDEMW( LIBSSL_DLL_NAME );
+
+	if ( hModule_libssl == NULL )
+	{
+		FreeLibrary( hModule_libcrypto );
+		hModule_libcrypto = NULL;
+
+		return false;
+	}
+
+	// Both modules are freed in UnInitializeLibSSL if any of these fail.
+	libssl_state = LIBSSL_STATE_RUNNING;
+
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libcrypto, ( void ** )&_BIO_new, "BIO_new" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libcrypto, ( void ** )&_BIO_free, "BIO_free" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libcrypto, ( void ** )&_BIO_s_mem, "BIO_s_mem" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libcrypto, ( void ** )&_BIO_read, "BIO_read" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libcrypto, ( void ** )&_BIO_write, "BIO_write" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libcrypto, ( void ** )&_BIO_ctrl_pending, "BIO_ctrl_pending" ) )
+
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_TLS_client_method, "TLS_client_method" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_CTX_new, "SSL_CTX_new" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_CTX_free, "SSL_CTX_free" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_new, "SSL_new" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_free, "SSL_free" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_set_bio, "SSL_set_bio" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_set_connect_state, "SSL_set_connect_state" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_do_handshake, "SSL_do_handshake" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_read, "SSL_read" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_write, "SSL_write" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_shutdown, "SSL_shutdown" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_get_error, "SSL_get_error" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_ctrl, "SSL_ctrl" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_pending, "SSL_pending" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_set_session, "SSL_set_session" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_get1_session, "SSL_get1_session" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_session_reused, "SSL_session_reused" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_SESSION_is_resumable, "SSL_SESSION_is_resumable" ) )
+	VALIDATE_FUNCTION_POINTER( SetFunctionPointer( hModule_libssl, ( void ** )&_SSL_SESSION_free, "SSL_SESSION_free" ) )
+
+	return true;
+}
+
+bool UnInitializeLibSSL()
+{
+	if ( libssl_state != LIBSSL_STATE_SHUTDOWN )
+	{
+		libssl_state = LIBSSL_STATE_SHUTDOWN;
+
+		BOOL ret = FreeLibrary( hModule_libssl );
+		ret &= FreeLibrary( hModule_libcrypto );
+
+		return ( ret == FALSE ? false : true );
+	}
+
+	return true;
+}
@@ -0,0 +1,115 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _LITE_LIBSSL_H
+#define _LITE_LIBSSL_H
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// OpenSSL's headers declare an SSL type that conflicts with ours, so the libraries are always loaded at runtime.
+
+#define LIBSSL_STATE_SHUTDOWN	0
+#define LIBSSL_STATE_RUNNING	1
+
+#define SSL_ERROR_NONE					0
+#define SSL_ERROR_WANT_READ				2
+#define SSL_ERROR_WANT_WRITE			3
+#define SSL_ERROR_ZERO_RETURN			6
+
+#define SSL_CTRL_SET_TLSEXT_HOSTNAME	55
+#define SSL_CTRL_SET_MIN_PROTO_VERSION	123
+
+#define TLSEXT_NAMETYPE_host_name		0
+
+#define SSL3_VERSION					0x0300
+#define TLS1_VERSION					0x0301
+#define TLS1_1_VERSION					0x0302
+#define TLS1_2_VERSION					0x0303
+
+typedef void OSSL_SSL;
+typedef void OSSL_SSL_CTX;
+typedef void OSSL_SSL_METHOD;
+typedef void OSSL_SSL_SESSION;
+typedef void OSSL_BIO;
+typedef void OSSL_BIO_METHOD;
+
+// libcrypto
+typedef OSSL_BIO * ( __cdecl *pBIO_new )( const OSSL_BIO_METHOD *type );
+typedef int ( __cdecl *pBIO_free )( OSSL_BIO *a );
+typedef const OSSL_BIO_METHOD * ( __cdecl *pBIO_s_mem )( void );
+typedef int ( __cdecl *pBIO_read )( OSSL_BIO *b, void *data, int dlen );
+typedef int ( __cdecl *pBIO_write )( OSSL_BIO *b, const void *data, int dlen );
+typedef size_t ( __cdecl *pBIO_ctrl_pending )( OSSL_BIO *b );
+
+// libssl
+typedef const OSSL_SSL_METHOD * ( __cdecl *pTLS_client_method )( void );
+typedef OSSL_SSL_CTX * ( __cdecl *pSSL_CTX_new )( const OSSL_SSL_METHOD *method );
+typedef void ( __cdecl *pSSL_CTX_free )( OSSL_SSL_CTX *ctx );
+typedef OSSL_SSL * ( __cdecl *pSSL_new )( OSSL_SSL_CTX *ctx );
+typedef void ( __cdecl *pSSL_free )( OSSL_SSL *ssl );
+typedef void ( __cdecl *pSSL_set_bio )( OSSL_SSL *ssl, OSSL_BIO *rbio, OSSL_BIO *wbio );
+typedef void ( __cdecl *pSSL_set_connect_state )( OSSL_SSL *ssl );
+typedef int ( __cdecl *pSSL_do_handshake )( OSSL_SSL *ssl );
+typedef int ( __cdecl *pSSL_read )( OSSL_SSL *ssl, void *buf, int num );
+typedef int ( __cdecl *pSSL_write )( OSSL_SSL *ssl, const void *buf, int num );
+typedef int ( __cdecl *pSSL_shutdown )( OSSL_SSL *ssl );
+typedef int ( __cdecl *pSSL_get_error )( const OSSL_SSL *ssl, int ret );
+typedef long ( __cdecl *pSSL_ctrl )( OSSL_SSL *ssl, int cmd, long larg, void *parg );
+typedef int ( __cdecl *pSSL_pending )( const OSSL_SSL *ssl );
+typedef int ( __cdecl *pSSL_set_session )( OSSL_SSL *ssl, OSSL_SSL_SESSION *session );
+typedef OSSL_SSL_SESSION * ( __cdecl *pSSL_get1_session )( OSSL_SSL *ssl );
+typedef int ( __cdecl *pSSL_session_reused )( const OSSL_SSL *ssl );
+typedef int ( __cdecl *pSSL_SESSION_is_resumable )( const OSSL_SSL_SESSION *session );
+typedef void ( __cdecl *pSSL_SESSION_free )( OSSL_SSL_SESSION *session );
+
+extern pBIO_new						_BIO_new;
+extern pBIO_free					_BIO_free;
+extern pBIO_s_mem					_BIO_s_mem;
+extern pBIO_read					_BIO_read;
+extern pBIO_write					_BIO_write;
+extern pBIO_ctrl_pending			_BIO_ctrl_pending;
+
+extern pTLS_client_method			_TLS_client_method;
+extern pSSL_CTX_new					_SSL_CTX_new;
+extern pSSL_CTX_free				_SSL_CTX_free;
+extern pSSL_new						_SSL_new;
+extern pSSL_free					_SSL_free;
+extern pSSL_set_bio					_SSL_set_bio;
+extern pSSL_set_connect_state		_SSL_set_connect_state;
+extern pSSL_do_handshake			_SSL_do_handshake;
+extern pSSL_read					_SSL_read;
+extern pSSL_write					_SSL_write;
+extern pSSL_shutdown				_SSL_shutdown;
+extern pSSL_get_error				_SSL_get_error;
+extern pSSL_ctrl					_SSL_ctrl;
+extern pSSL_pending					_SSL_pending;
+extern pSSL_set_session				_SSL_set_session;
+extern pSSL_get1_session			_SSL_get1_session;
+extern pSSL_session_reused			_SSL_session_reused;
+extern pSSL_SESSION_is_resumable	_SSL_SESSION_is_resumable;
+extern pSSL_SESSION_free			_SSL_SESSION_free;
+
+extern unsigned char libssl_state;
+
+bool InitializeLibSSL();
+bool UnInitializeLibSSL();
+
+#endif
@@ -0,0 +1,80 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LITE_ZSTD_H
+#define _LITE_ZSTD_H
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+//#define LIBZSTD_USE_STATIC_LIB
+
+#ifdef LIBZSTD_USE_STATIC_LIB
+
+	//__pragma( comment( lib, "libzstd.lib" ) )
+
+	#include <zstd.h>
+
+	#define _ZSTD_createDStream		ZSTD_createDStream
+	#define _ZSTD_initDStream		ZSTD_initDStream
+	#define _ZSTD_decompressStream	ZSTD_decompressStream
+	#define _ZSTD_freeDStream		ZSTD_freeDStream
+	#define _ZSTD_isError			ZSTD_isError
+
+#else
+
+	#define LIBZSTD_STATE_SHUTDOWN	0
+	#define LIBZSTD_STATE_RUNNING	1
+
+	typedef struct ZSTD_DCtx_s ZSTD_DStream;
+
+	typedef struct ZSTD_inBuffer_s
+	{
+		const void *src;
+		size_t size;
+		size_t pos;
+	} ZSTD_inBuffer;
+
+	typedef struct ZSTD_outBuffer_s
+	{
+		void *dst;
+		size_t size;
+		size_t pos;
+	} ZSTD_outBuffer;
+
+	typedef ZSTD_DStream * ( __cdecl *pZSTD_createDStream )( void );
+	typedef size_t ( __cdecl *pZSTD_initDStream )( ZSTD_DStream *zds );
+	typedef size_t ( __cdecl *pZSTD_decompressStream )( ZSTD_DStream *zds, ZSTD_outBuffer *output, ZSTD_inBuffer *input );
+	typedef size_t ( __cdecl *pZSTD_freeDStream )( ZSTD_DStream *zds );
+	typedef unsigned ( __cdecl *pZSTD_isError )( size_t code );
+
+	extern pZSTD_createDStream		_ZSTD_createDStream;
+	extern pZSTD_initDStream		_ZSTD_initDStream;
+	extern pZSTD_decompressStream	_ZSTD_decompressStream;
+	extern pZSTD_freeDStream		_ZSTD_freeDStream;
+	extern pZSTD_isError			_ZSTD_isError;
+
+	extern unsigned char libzstd_state;
+
+	bool InitializeLibZstd();
+	bool UnInitializeLibZstd();
+
+#endif
+
+#endif
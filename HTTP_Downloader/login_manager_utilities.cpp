@@ -424,6 +424,8 @@ char save_login_info()
 	return ret_status;
 }
 
+#ifndef HEADLESS_BUILD
+
 THREAD_RETURN load_login_list( void *pArguments )
 {
 	// This will block every other thread from entering until the first thread is complete.
@@ -696,3 +698,5 @@ THREAD_RETURN handle_login_list( void *pArguments )
 	_ExitThread( 0 );
 	return 0;
 }
+
+#endif
@@ -38,6 +38,8 @@
 #include "lite_ole32.h"
 #include "lite_winmm.h"
 #include "lite_zlib1.h"
+#include "lite_brotlidec.h"
+#include "lite_zstd.h"
 #include "lite_powrprof.h"
 #include "lite_normaliz.h"
 #include "lite_pcre2.h"
@@ -46,8 +48,11 @@
 
 #include "connection.h"
 #include "ftp_parsing.h"
+#include "server_api.h"
 
 #include "login_manager_utilities.h"
+#include "list_operations.h"
+#include "download_observer.h"
 
 //#define USE_DEBUG_DIRECTORY
 
@@ -67,6 +72,8 @@ CRITICAL_SECTION session_totals_cs;
 
 CRITICAL_SECTION icon_cache_cs;
 
+CRITICAL_SECTION string_pool_cs;
+
 // Object variables
 HWND g_hWnd_main = NULL;		// Handle to our main window.
 
@@ -87,6 +94,9 @@ unsigned int base_directory_length = 0;
 
 dllrbt_tree *g_icon_handles = NULL;
 
+dllrbt_tree *g_string_pool = NULL;
+dllrbt_tree *g_wide_string_pool = NULL;
+
 dllrbt_tree *g_login_info = NULL;
 
 bool g_can_fast_allocate = false;
@@ -112,20 +122,23 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 	#ifndef NTDLL_USE_STATIC_LIB
 		if ( !InitializeNTDLL() ){ goto UNLOAD_DLLS; }
 	#endif
-	#ifndef GDI32_USE_STATIC_LIB
-		if ( !InitializeGDI32() ){ goto UNLOAD_DLLS; }
-	#endif
 	#ifndef SHELL32_USE_STATIC_LIB
 		if ( !InitializeShell32() ){ goto UNLOAD_DLLS; }
 	#endif
 	#ifndef ADVAPI32_USE_STATIC_LIB
 		if ( !InitializeAdvApi32() ){ goto UNLOAD_DLLS; }
 	#endif
-	#ifndef COMDLG32_USE_STATIC_LIB
-		if ( !InitializeComDlg32() ){ goto UNLOAD_DLLS; }
-	#endif
-	#ifndef COMCTL32_USE_STATIC_LIB
-		if ( !InitializeComCtl32() ){ goto UNLOAD_DLLS; }
+	// The headless build doesn't create any windows or draw anything.
+	#ifndef HEADLESS_BUILD
+		#ifndef GDI32_USE_STATIC_LIB
+			if ( !InitializeGDI32() ){ goto UNLOAD_DLLS; }
+		#endif
+		#ifndef COMDLG32_USE_STATIC_LIB
+			if ( !InitializeComDlg32() ){ goto UNLOAD_DLLS; }
+		#endif
+		#ifndef COMCTL32_USE_STATIC_LIB
+			if ( !InitializeComCtl32() ){ goto UNLOAD_DLLS; }
+		#endif
 	#endif
 	#ifndef CRYPT32_USE_STATIC_LIB
 		if ( !InitializeCrypt32() ){ goto UNLOAD_DLLS; }
@@ -159,6 +172,19 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 			}
 		}
 	#endif
+	// Brotli and Zstandard encoded downloads will be saved as they are if these can't be loaded.
+	#ifndef BROTLIDEC_USE_STATIC_LIB
+		if ( !InitializeBrotliDec() )
+		{
+			UnInitializeBrotliDec();
+		}
+	#endif
+	#ifndef LIBZSTD_USE_STATIC_LIB
+		if ( !InitializeLibZstd() )
+		{
+			UnInitializeLibZstd();
+		}
+	#endif
 	#ifndef POWRPROF_USE_STATIC_LIB
 		if ( !InitializePowrProf() )
 		{
@@ -208,6 +234,8 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 
 	CL_ARGS *cla = NULL;
 
+	bool stop_headless = false;
+
 	base_directory = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * MAX_PATH );
 
 	// Get the new base directory if the user supplied a path.
@@ -258,6 +286,75 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 
 					default_directory = false;
 				}
+				else if ( ( arg + 1 ) < argCount &&
+						  arg_name_length == 11 && _StrCmpNIW( arg_name, L"tls-backend", 11 ) == 0 )	// The SSL / TLS provider for outgoing connections.
+				{
+					++arg;
+
+					if ( lstrlenW( szArgList[ arg ] ) == 7 && _StrCmpNIW( szArgList[ arg ], L"openssl", 7 ) == 0 )
+					{
+						g_ssl_backend_type = SSL_BACKEND_OPENSSL;
+					}
+					else
+					{
+						g_ssl_backend_type = SSL_BACKEND_SCHANNEL;
+					}
+				}
+				else if ( arg_name_length == 8 && _StrCmpNIW( arg_name, L"headless", 8 ) == 0 )	// Run without a window. Downloads are added through the web server and the command-line.
+				{
+					g_headless = true;
+				}
+				else if ( arg_name_length == 13 && _StrCmpNIW( arg_name, L"stop-headless", 13 ) == 0 )	// Tell a running headless instance to exit.
+				{
+					stop_headless = true;
+				}
+				else if ( ( arg + 1 ) < argCount &&
+						  arg_name_length == 14 && _StrCmpNIW( arg_name, L"on-file-exists", 14 ) == 0 )	// Headless answer to the rename prompt: rename, overwrite, or skip.
+				{
+					++arg;
+
+					int value_length = lstrlenW( szArgList[ arg ] );
+
+					if ( value_length == 9 && _StrCmpNIW( szArgList[ arg ], L"overwrite", 9 ) == 0 )
+					{
+						g_headless_rename_policy = HEADLESS_POLICY_OVERWRITE;
+					}
+					else if ( value_length == 4 && _StrCmpNIW( szArgList[ arg ], L"skip", 4 ) == 0 )
+					{
+						g_headless_rename_policy = HEADLESS_POLICY_SKIP;
+					}
+					else
+					{
+						g_headless_rename_policy = HEADLESS_POLICY_RENAME;
+					}
+				}
+				else if ( ( arg + 1 ) < argCount &&
+						  arg_name_length == 13 && _StrCmpNIW( arg_name, L"on-large-file", 13 ) == 0 )	// Headless answer to the file size prompt: download, or skip.
+				{
+					++arg;
+
+					g_headless_file_size_policy = ( lstrlenW( szArgList[ arg ] ) == 8 && _StrCmpNIW( szArgList[ arg ], L"download", 8 ) == 0 ? HEADLESS_POLICY_DOWNLOAD : HEADLESS_POLICY_SKIP );
+				}
+				else if ( ( arg + 1 ) < argCount &&
+						  arg_name_length == 11 && _StrCmpNIW( arg_name, L"on-modified", 11 ) == 0 )	// Headless answer to the last modified prompt: continue, restart, or skip.
+				{
+					++arg;
+
+					int value_length = lstrlenW( szArgList[ arg ] );
+
+					if ( value_length == 8 && _StrCmpNIW( szArgList[ arg ], L"continue", 8 ) == 0 )
+					{
+						g_headless_last_modified_policy = HEADLESS_POLICY_CONTINUE;
+					}
+					else if ( value_length == 7 && _StrCmpNIW( szArgList[ arg ], L"restart", 7 ) == 0 )
+					{
+						g_headless_last_modified_policy = HEADLESS_POLICY_RESTART;
+					}
+					else
+					{
+						g_headless_last_modified_policy = HEADLESS_POLICY_SKIP;
+					}
+				}
 				else if ( ( arg + 1 ) < argCount &&
 						  arg_name_length == 5 && _StrCmpNIW( arg_name, L"parts", 5 ) == 0 )	// Split download into parts.
 				{
@@ -498,17 +595,29 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 
 	InitializeCriticalSection( &icon_cache_cs );
 
+	InitializeCriticalSection( &string_pool_cs );
+
 	InitializeCriticalSection( &ftp_listen_info_cs );
 
 	InitializeCriticalSection( &context_list_cs );
 	InitializeCriticalSection( &active_download_list_cs );
 	InitializeCriticalSection( &download_queue_cs );
+#ifndef HEADLESS_BUILD
 	InitializeCriticalSection( &cmessagebox_prompt_cs );
+#endif
 	InitializeCriticalSection( &file_size_prompt_list_cs );
 	InitializeCriticalSection( &rename_file_prompt_list_cs );
 	InitializeCriticalSection( &last_modified_prompt_list_cs );
 	InitializeCriticalSection( &move_file_queue_cs );
 	InitializeCriticalSection( &cleanup_cs );
+	InitializeCriticalSection( &rate_limit_cs );
+	InitializeCriticalSection( &range_checkpoint_cs );
+	InitializeCriticalSection( &connection_pool_cs );
+	InitializeCriticalSection( &dns_cache_cs );
+	InitializeCriticalSection( &download_list_cs );
+	InitializeCriticalSection( &api_poll_cs );
+	InitializeCriticalSection( &history_journal_cs );
+	InitializeCriticalSection( &history_view_cs );
 
 	// Get the default message system font.
 	NONCLIENTMETRICS ncm;
@@ -519,6 +628,7 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 	//g_default_log_font = ncm.lfMessageFont;
 	_memcpy_s( &g_default_log_font, sizeof( LOGFONT ), &ncm.lfMessageFont, sizeof( LOGFONT ) );
 
+#ifndef HEADLESS_BUILD
 	// Set our global font to the LOGFONT value obtained from the system.
 	g_hFont = _CreateFontIndirectW( &ncm.lfMessageFont );
 
@@ -537,6 +647,7 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 	{
 		g_default_row_height = icon_height;
 	}
+#endif
 
 	SetDefaultAppearance();
 
@@ -562,11 +673,26 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 
 	read_config();
 
+#ifndef HEADLESS_BUILD
 	// Once we read in our font settings, we can measure their heights to set the row height of our listview control.
 	AdjustRowHeight();
+#endif
 
 	// See if there's an instance of the program running.
 	HANDLE app_instance_mutex = OpenMutexW( MUTEX_ALL_ACCESS, 0, PROGRAM_CAPTION );
+
+	if ( stop_headless )
+	{
+		HANDLE exit_event = OpenEventW( EVENT_MODIFY_STATE, FALSE, HEADLESS_EXIT_EVENT );
+		if ( exit_event != NULL )
+		{
+			SetEvent( exit_event );
+			CloseHandle( exit_event );
+		}
+
+		goto CLEANUP;
+	}
+
 	if ( app_instance_mutex == NULL )
 	{
 		app_instance_mutex = CreateMutexW( NULL, 0, PROGRAM_CAPTION );
@@ -955,10 +1081,21 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 
 	g_icon_handles = dllrbt_create( dllrbt_compare_w );
 
+	g_download_list = dllrbt_create( dllrbt_compare_ui );
+
+	g_string_pool = dllrbt_create( dllrbt_compare_ordinal_a );
+	g_wide_string_pool = dllrbt_create( dllrbt_compare_ordinal_w );
+
 	g_login_info = dllrbt_create( dllrbt_compare_login_info );
 
 	read_login_info();
 
+	// The web server can add downloads as soon as IOCPDownloader starts it.
+	if ( g_headless )
+	{
+		InitializeHeadlessObserver();
+	}
+
 	downloader_ready_semaphore = CreateSemaphore( NULL, 0, 1, NULL );
 
 	CloseHandle( _CreateThread( NULL, 0, IOCPDownloader, NULL, 0, NULL ) );
@@ -968,6 +1105,69 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 	CloseHandle( downloader_ready_semaphore );
 	downloader_ready_semaphore = NULL;
 
+	if ( g_headless )
+	{
+		HANDLE exit_event = CreateEventW( NULL, TRUE, FALSE, HEADLESS_EXIT_EVENT );
+
+		wchar_t history_file_path[ MAX_PATH ];
+		_wmemcpy_s( history_file_path, MAX_PATH, base_directory, base_directory_length );
+		_wmemcpy_s( history_file_path + base_directory_length, MAX_PATH - base_directory_length, L"\\download_history\0", 18 );
+		history_file_path[ base_directory_length + 17 ] = 0;	// Sanity.
+
+		if ( cfg_enable_download_history )
+		{
+			read_download_history( history_file_path, true );
+		}
+
+		if ( cla != NULL )
+		{
+			// There's no Add URL(s) window to show.
+			cla->download_immediately = 1;
+
+			// cla values will be freed here.
+			HANDLE thread = ( HANDLE )_CreateThread( NULL, 0, process_command_line_args, ( void * )cla, 0, NULL );
+			if ( thread != NULL )
+			{
+				CloseHandle( thread );
+
+				cla = NULL;
+			}
+		}
+
+		// Downloads are added through the web server until another instance is run with --stop-headless.
+		if ( exit_event != NULL )
+		{
+			WaitForSingleObject( exit_event, INFINITE );
+			CloseHandle( exit_event );
+		}
+
+		g_end_program = true;
+
+		kill_worker_thread();
+
+		if ( ws2_32_state == WS2_32_STATE_RUNNING )
+		{
+			downloader_ready_semaphore = CreateSemaphore( NULL, 0, 1, NULL );
+
+			_WSASetEvent( g_cleanup_event[ 0 ] );
+
+			// Wait for IOCPDownloader to clean up. 10 second timeout in case we miss the release.
+			WaitForSingleObject( downloader_ready_semaphore, 10000 );
+			CloseHandle( downloader_ready_semaphore );
+			downloader_ready_semaphore = NULL;
+		}
+
+		if ( cfg_enable_download_history && download_history_changed )
+		{
+			download_history_changed = false;
+
+			update_download_history( history_file_path );
+		}
+
+		goto CLEANUP;
+	}
+
+#ifndef HEADLESS_BUILD
 	// Initialize our window class.
 	WNDCLASSEX wcex;
 	_memzero( &wcex, sizeof( WNDCLASSEX ) );
@@ -1186,6 +1386,7 @@ int APIENTRY WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 			_DispatchMessageW( &msg );
 		}
 	}
+#endif
 
 CLEANUP:
 
@@ -1280,6 +1481,41 @@ CLEANUP:
 
 	dllrbt_delete_recursively( g_icon_handles );
 
+	// Does not free the DOWNLOAD_INFO values. The main window frees them when it's destroyed.
+	dllrbt_delete_recursively( g_download_list );
+
+	node = dllrbt_get_head( g_string_pool );
+	while ( node != NULL )
+	{
+		SHARED_STRING *ss = ( SHARED_STRING * )node->val;
+
+		if ( ss != NULL )
+		{
+			GlobalFree( ss->string );
+			GlobalFree( ss );
+		}
+
+		node = node->next;
+	}
+
+	dllrbt_delete_recursively( g_string_pool );
+
+	node = dllrbt_get_head( g_wide_string_pool );
+	while ( node != NULL )
+	{
+		SHARED_STRING *ss = ( SHARED_STRING * )node->val;
+
+		if ( ss != NULL )
+		{
+			GlobalFree( ss->string );
+			GlobalFree( ss );
+		}
+
+		node = node->next;
+	}
+
+	dllrbt_delete_recursively( g_wide_string_pool );
+
 	node = dllrbt_get_head( g_login_info );
 	while ( node != NULL )
 	{
@@ -1301,11 +1537,13 @@ CLEANUP:
 
 	dllrbt_delete_recursively( g_login_info );
 
+#ifndef HEADLESS_BUILD
 	if ( cfg_even_row_font_settings.font != NULL ){ _DeleteObject( cfg_even_row_font_settings.font ); }
 	if ( cfg_odd_row_font_settings.font != NULL ){ _DeleteObject( cfg_odd_row_font_settings.font ); }
 
 	// Delete our font.
 	_DeleteObject( g_hFont );
+#endif
 
 	if ( fail_type == 1 )
 	{
@@ -1321,17 +1559,35 @@ CLEANUP:
 	DeleteCriticalSection( &context_list_cs );
 	DeleteCriticalSection( &active_download_list_cs );
 	DeleteCriticalSection( &download_queue_cs );
+#ifndef HEADLESS_BUILD
 	DeleteCriticalSection( &cmessagebox_prompt_cs );
+#endif
 	DeleteCriticalSection( &file_size_prompt_list_cs );
 	DeleteCriticalSection( &rename_file_prompt_list_cs );
 	DeleteCriticalSection( &last_modified_prompt_list_cs );
 	DeleteCriticalSection( &move_file_queue_cs );
 	DeleteCriticalSection( &cleanup_cs );
+	DeleteCriticalSection( &rate_limit_cs );
+	DeleteCriticalSection( &range_checkpoint_cs );
+	DeleteCriticalSection( &connection_pool_cs );
+	DeleteCriticalSection( &dns_cache_cs );
+	DeleteCriticalSection( &download_list_cs );
+	DeleteCriticalSection( &api_poll_cs );
+
+	// The entries have been freed.
+	unmap_download_history( false );
+
+	DeleteCriticalSection( &history_journal_cs );
+	DeleteCriticalSection( &history_view_cs );
+
+	free_removed_history_keys();
 
 	DeleteCriticalSection( &ftp_listen_info_cs );
 
 	DeleteCriticalSection( &icon_cache_cs );
 
+	DeleteCriticalSection( &string_pool_cs );
+
 	DeleteCriticalSection( &session_totals_cs );
 
 	DeleteCriticalSection( &worker_cs );
@@ -1389,8 +1645,10 @@ CLEANUP:
 	#ifndef WINMM_USE_STATIC_LIB
 		UnInitializeWinMM();
 	#endif
-	#ifndef UXTHEME_USE_STATIC_LIB
-		UnInitializeUXTheme();
+	#ifndef HEADLESS_BUILD
+		#ifndef UXTHEME_USE_STATIC_LIB
+			UnInitializeUXTheme();
+		#endif
 	#endif
 
 UNLOAD_DLLS:
@@ -1407,17 +1665,28 @@ UNLOAD_DLLS:
 	#ifndef ZLIB1_USE_STATIC_LIB
 		UnInitializeZLib1();
 	#endif
+	#ifndef BROTLIDEC_USE_STATIC_LIB
+		UnInitializeBrotliDec();
+	#endif
+	#ifndef LIBZSTD_USE_STATIC_LIB
+		UnInitializeLibZstd();
+	#endif
 	#ifndef KERNEL32_USE_STATIC_LIB
 		UnInitializeKernel32();
 	#endif
 	#ifndef CRYPT32_USE_STATIC_LIB
 		UnInitializeCrypt32();
 	#endif
-	#ifndef COMCTL32_USE_STATIC_LIB
-		UnInitializeComCtl32();
-	#endif
-	#ifndef COMDLG32_USE_STATIC_LIB
-		UnInitializeComDlg32();
+	#ifndef HEADLESS_BUILD
+		#ifndef COMCTL32_USE_STATIC_LIB
+			UnInitializeComCtl32();
+		#endif
+		#ifndef COMDLG32_USE_STATIC_LIB
+			UnInitializeComDlg32();
+		#endif
+		#ifndef GDI32_USE_STATIC_LIB
+			UnInitializeGDI32();
+		#endif
 	#endif
 	#ifndef ADVAPI32_USE_STATIC_LIB
 		UnInitializeAdvApi32();
@@ -1425,9 +1694,6 @@ UNLOAD_DLLS:
 	#ifndef SHELL32_USE_STATIC_LIB
 		UnInitializeShell32();
 	#endif
-	#ifndef GDI32_USE_STATIC_LIB
-		UnInitializeGDI32();
-	#endif
 	#ifndef NTDLL_USE_STATIC_LIB
 		UnInitializeNTDLL();
 	#endif
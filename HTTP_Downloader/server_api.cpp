@@ -0,0 +1,1372 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server_api.h"
+#include "list_operations.h"
+#include "file_operations.h"
+#include "utilities.h"
+
+#define API_CHUNK_HEADER_LENGTH		6	// "%04x\r\n". A chunk is never larger than BUFFER_SIZE (0x4000).
+#define API_CHUNK_TRAILER_LENGTH	7	// "\r\n" and the "0\r\n\r\n" last chunk.
+
+CRITICAL_SECTION api_poll_cs;
+
+HANDLE g_api_poll_semaphore = NULL;
+
+DoublyLinkedList *api_poll_list = NULL;
+
+volatile LONG g_api_url_batches = 0;
+
+char *api_actions[] = { "pause", "resume", "stop", "restart", "top", "up", "down", "bottom", "remove" };
+
+struct API_BUFFER
+{
+	char			*buf;
+	unsigned int	size;
+	unsigned int	length;
+	bool			full;	// Something didn't fit. The caller should discard the partially written item.
+};
+
+void WriteAPI( API_BUFFER *ab, const char *str, unsigned int str_length )
+{
+	if ( !ab->full )
+	{
+		if ( str_length <= ab->size - ab->length )
+		{
+			_memcpy_s( ab->buf + ab->length, ab->size - ab->length, str, str_length );
+			ab->length += str_length;
+		}
+		else
+		{
+			ab->full = true;
+		}
+	}
+}
+
+// Writes a JSON string of at most limit characters.
+void WriteAPIString( API_BUFFER *ab, wchar_t *str, int limit )
+{
+	char utf8_str[ ( API_URL_LIMIT * 3 ) + 1 ];
+	int utf8_length = 0;
+
+	if ( str != NULL )
+	{
+		int str_length = lstrlenW( str );
+		if ( str_length > limit )
+		{
+			str_length = limit;
+
+			// Don't split a surrogate pair.
+			if ( str[ str_length - 1 ] >= 0xD800 && str[ str_length - 1 ] <= 0xDBFF )
+			{
+				--str_length;
+			}
+		}
+
+		utf8_length = WideCharToMultiByte( CP_UTF8, 0, str, str_length, utf8_str, sizeof( utf8_str ), NULL, NULL );
+	}
+
+	WriteAPI( ab, "\"", 1 );
+
+	int start = 0;
+	for ( int i = 0; i < utf8_length; ++i )
+	{
+		unsigned char c = ( unsigned char )utf8_str[ i ];
+		if ( c == '\"' || c == '\\' || c < 0x20 )
+		{
+			WriteAPI( ab, utf8_str + start, i - start );
+
+			if ( c == '\"' )
+			{
+				WriteAPI( ab, "\\\"", 2 );
+			}
+			else if ( c == '\\' )
+			{
+				WriteAPI( ab, "\\\\", 2 );
+			}
+			else
+			{
+				char escape[ 8 ];
+				__snprintf( escape, 8, "\\u%04x", c );
+				WriteAPI( ab, escape, 6 );
+			}
+
+			start = i + 1;
+		}
+	}
+
+	WriteAPI( ab, utf8_str + start, utf8_length - start );
+
+	WriteAPI( ab, "\"", 1 );
+}
+
+char *GetAPIStatusName( unsigned int status )
+{
+	char *status_name;
+
+	if ( status == STATUS_CONNECTING )						{ status_name = "connecting"; }
+	else if ( IS_STATUS( status, STATUS_RESTART ) )			{ status_name = "restarting"; }
+	else if ( IS_STATUS( status, STATUS_PAUSED ) )			{ status_name = "paused"; }
+	else if ( IS_STATUS( status, STATUS_QUEUED ) )			{ status_name = "queued"; }
+	else if ( status == STATUS_COMPLETED )					{ status_name = "completed"; }
+	else if ( status == STATUS_STOPPED )					{ status_name = "stopped"; }
+	else if ( status == STATUS_TIMED_OUT )					{ status_name = "timed_out"; }
+	else if ( status == STATUS_FAILED )						{ status_name = "failed"; }
+	else if ( status == STATUS_FILE_IO_ERROR )				{ status_name = "file_io_error"; }
+	else if ( status == STATUS_SKIPPED )					{ status_name = "skipped"; }
+	else if ( status == STATUS_AUTH_REQUIRED )				{ status_name = "auth_required"; }
+	else if ( status == STATUS_PROXY_AUTH_REQUIRED )		{ status_name = "proxy_auth_required"; }
+	else if ( status == STATUS_ALLOCATING_FILE )			{ status_name = "allocating_file"; }
+	else if ( IS_STATUS( status, STATUS_MOVING_FILE ) )		{ status_name = "moving_file"; }
+	else if ( IS_STATUS( status, STATUS_UPDATING ) )		{ status_name = "updating"; }
+	else													{ status_name = "downloading"; }
+
+	return status_name;
+}
+
+// Writes the download's fields without the closing brace.
+// This should be done in the download_list_cs critical section.
+void WriteAPIDownloadFields( API_BUFFER *ab, DOWNLOAD_INFO *di )
+{
+	char fields[ 256 ];
+	int fields_length;
+
+	load_deferred_history_entry( di );
+
+	EnterCriticalSection( &di->shared_cs );
+
+	fields_length = __snprintf( fields, 256, "{\"id\":%lu,\"filename\":", di->id );
+	WriteAPI( ab, fields, fields_length );
+	WriteAPIString( ab, di->filename, MAX_PATH );
+	WriteAPI( ab, ",\"url\":", 7 );
+	WriteAPIString( ab, di->url, API_URL_LIMIT );
+
+	fields_length = __snprintf( fields, 256, ",\"status\":\"%s\",\"downloaded\":%I64u,\"file_size\":%I64u,\"speed\":%I64u,\"parts\":%lu,\"active_parts\":%lu",
+								GetAPIStatusName( di->status ), di->downloaded, di->file_size, di->speed, di->parts, di->active_parts );
+
+	LeaveCriticalSection( &di->shared_cs );
+
+	WriteAPI( ab, fields, fields_length );
+}
+
+// Returns the download that comes after the one with the cursor's id, or the first download if the cursor is 0.
+// This should be done in the download_list_cs critical section.
+node_type *GetAPINextDownload( unsigned int cursor )
+{
+	node_type *node = dllrbt_get_head( g_download_list );
+
+	if ( cursor != 0 )
+	{
+		node_type *cursor_node = ( node_type * )dllrbt_find( g_download_list, ( void * )&cursor, false );
+		if ( cursor_node != NULL )
+		{
+			return cursor_node->next;
+		}
+
+		// The download was removed since the last chunk was sent. The list is ordered by id, so skip to the first one that's larger.
+		while ( node != NULL && ( ( DOWNLOAD_INFO * )node->val )->id <= cursor )
+		{
+			node = node->next;
+		}
+	}
+
+	return node;
+}
+
+API_SNAPSHOT *FindAPISnapshot( API_INFO *api_info, unsigned int id )
+{
+	if ( api_info->snapshot_hint < api_info->snapshot_count && api_info->snapshots[ api_info->snapshot_hint ].id == id )
+	{
+		return &api_info->snapshots[ api_info->snapshot_hint++ ];
+	}
+
+	for ( unsigned int i = 0; i < api_info->snapshot_count; ++i )
+	{
+		if ( api_info->snapshots[ i ].id == id )
+		{
+			api_info->snapshot_hint = i + 1;
+
+			return &api_info->snapshots[ i ];
+		}
+	}
+
+	return NULL;
+}
+
+API_SNAPSHOT *AddAPISnapshot( API_INFO *api_info )
+{
+	if ( api_info->snapshot_count == api_info->snapshot_capacity )
+	{
+		unsigned int capacity = ( api_info->snapshot_capacity > 0 ? api_info->snapshot_capacity * 2 : 64 );
+
+		API_SNAPSHOT *snapshots;
+		if ( api_info->snapshots == NULL )
+		{
+			snapshots = ( API_SNAPSHOT * )GlobalAlloc( GMEM_FIXED, sizeof( API_SNAPSHOT ) * capacity );
+		}
+		else
+		{
+			snapshots = ( API_SNAPSHOT * )GlobalReAlloc( api_info->snapshots, sizeof( API_SNAPSHOT ) * capacity, GMEM_MOVEABLE );
+		}
+
+		if ( snapshots == NULL )
+		{
+			return NULL;
+		}
+
+		api_info->snapshots = snapshots;
+		api_info->snapshot_capacity = capacity;
+	}
+
+	return &api_info->snapshots[ api_info->snapshot_count++ ];
+}
+
+// Writes the fields that have changed since the last time the download was sent.
+// Returns false if the event didn't fit.
+// This should be done in the download_list_cs critical section.
+bool WriteAPIEvent( API_INFO *api_info, API_BUFFER *ab, DOWNLOAD_INFO *di )
+{
+	API_SNAPSHOT current;
+
+	EnterCriticalSection( &di->shared_cs );
+
+	current.id = di->id;
+	current.status = di->status;
+	current.downloaded = di->downloaded;
+	current.file_size = di->file_size;
+	current.speed = di->speed;
+	current.active_parts = di->active_parts;
+	current.seen = true;
+
+	LeaveCriticalSection( &di->shared_cs );
+
+	API_SNAPSHOT *snapshot = FindAPISnapshot( api_info, current.id );
+	if ( snapshot == NULL )
+	{
+		// New downloads are sent in full.
+		WriteAPIDownloadFields( ab, di );
+		WriteAPI( ab, "}\n", 2 );
+
+		if ( ab->full )
+		{
+			return false;
+		}
+
+		snapshot = AddAPISnapshot( api_info );
+		if ( snapshot != NULL )
+		{
+			*snapshot = current;
+		}
+	}
+	else
+	{
+		char fields[ 256 ];
+		int fields_length = __snprintf( fields, 256, "{\"id\":%lu", current.id );
+
+		if ( current.status != snapshot->status )
+		{
+			fields_length += __snprintf( fields + fields_length, 256 - fields_length, ",\"status\":\"%s\"", GetAPIStatusName( current.status ) );
+		}
+
+		if ( current.downloaded != snapshot->downloaded )
+		{
+			fields_length += __snprintf( fields + fields_length, 256 - fields_length, ",\"downloaded\":%I64u", current.downloaded );
+		}
+
+		if ( current.file_size != snapshot->file_size )
+		{
+			fields_length += __snprintf( fields + fields_length, 256 - fields_length, ",\"file_size\":%I64u", current.file_size );
+		}
+
+		if ( current.speed != snapshot->speed )
+		{
+			fields_length += __snprintf( fields + fields_length, 256 - fields_length, ",\"speed\":%I64u", current.speed );
+		}
+
+		if ( current.active_parts != snapshot->active_parts )
+		{
+			fields_length += __snprintf( fields + fields_length, 256 - fields_length, ",\"active_parts\":%lu", current.active_parts );
+		}
+
+		// Something has changed.
+		if ( current.status != snapshot->status ||
+			 current.downloaded != snapshot->downloaded ||
+			 current.file_size != snapshot->file_size ||
+			 current.speed != snapshot->speed ||
+			 current.active_parts != snapshot->active_parts )
+		{
+			WriteAPI( ab, fields, fields_length );
+			WriteAPI( ab, "}\n", 2 );
+
+			if ( ab->full )
+			{
+				return false;
+			}
+		}
+
+		*snapshot = current;
+	}
+
+	return true;
+}
+
+unsigned char WriteAPIList( API_INFO *api_info, API_BUFFER *ab )
+{
+	if ( !api_info->started )
+	{
+		WriteAPI( ab, "[", 1 );
+
+		api_info->started = true;
+	}
+
+	EnterCriticalSection( &download_list_cs );
+
+	node_type *node = GetAPINextDownload( api_info->cursor );
+	while ( node != NULL )
+	{
+		DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )node->val;
+
+		unsigned int length = ab->length;
+
+		if ( api_info->first_written )
+		{
+			WriteAPI( ab, ",", 1 );
+		}
+
+		WriteAPIDownloadFields( ab, di );
+		WriteAPI( ab, "}", 1 );
+
+		if ( ab->full )
+		{
+			ab->length = length;
+			ab->full = false;
+
+			// Skip a download that can't fit in an empty chunk.
+			if ( length > 0 )
+			{
+				break;
+			}
+		}
+		else
+		{
+			api_info->first_written = true;
+		}
+
+		api_info->cursor = di->id;
+
+		node = node->next;
+	}
+
+	LeaveCriticalSection( &download_list_cs );
+
+	if ( node == NULL )
+	{
+		WriteAPI( ab, "]\n", 2 );
+
+		if ( !ab->full )
+		{
+			return API_RESPONSE_DONE;
+		}
+
+		ab->full = false;
+	}
+
+	return API_RESPONSE_SEND_MORE;
+}
+
+unsigned char WriteAPIDetails( API_INFO *api_info, API_BUFFER *ab )
+{
+	unsigned char api_status = API_RESPONSE_SEND_MORE;
+
+	EnterCriticalSection( &download_list_cs );
+
+	// The download may have been removed since the last chunk was sent.
+	DOWNLOAD_INFO *di = FindDownload( api_info->id );
+	if ( di != NULL )
+	{
+		if ( !api_info->started )
+		{
+			WriteAPIDownloadFields( ab, di );
+			WriteAPI( ab, ",\"ranges\":[", 11 );
+
+			api_info->started = true;
+		}
+
+		EnterCriticalSection( &di->shared_cs );
+
+		unsigned int index = 0;
+		DoublyLinkedList *range_node = di->range_list;
+
+		// Skip the ranges that have already been sent.
+		while ( range_node != NULL && index < api_info->cursor )
+		{
+			range_node = range_node->next;
+			++index;
+		}
+
+		while ( range_node != NULL )
+		{
+			RANGE_INFO *ri = ( RANGE_INFO * )range_node->data;
+			if ( ri != NULL )
+			{
+				char range[ 128 ];
+				int range_length = __snprintf( range, 128, "%s{\"start\":%I64u,\"end\":%I64u,\"offset\":%I64u}",
+											   ( api_info->cursor > 0 ? "," : "" ), ri->range_start, ri->range_end, ri->content_offset );
+
+				WriteAPI( ab, range, range_length );
+
+				if ( ab->full )
+				{
+					break;
+				}
+			}
+
+			range_node = range_node->next;
+			++api_info->cursor;
+		}
+
+		LeaveCriticalSection( &di->shared_cs );
+	}
+
+	LeaveCriticalSection( &download_list_cs );
+
+	if ( !api_info->started )
+	{
+		api_status = API_RESPONSE_DONE;
+	}
+	else if ( !ab->full )
+	{
+		WriteAPI( ab, "]}\n", 3 );
+
+		if ( !ab->full )
+		{
+			api_status = API_RESPONSE_DONE;
+		}
+	}
+
+	ab->full = false;
+
+	return api_status;
+}
+
+// Returns false if the download doesn't exist.
+// This runs on an IOCP worker thread, so it can't wait on a prompt.
+bool ControlAPIDownload( API_INFO *api_info )
+{
+	if ( api_info->action == API_ACTION_REMOVE )
+	{
+		EnterCriticalSection( &download_list_cs );
+
+		bool found = ( FindDownload( api_info->id ) != NULL ? true : false );
+
+		LeaveCriticalSection( &download_list_cs );
+
+		// The observer's item has to be removed outside of cleanup_cs, and the list's worker threads need to finish first.
+		if ( found )
+		{
+			HANDLE thread = ( HANDLE )_CreateThread( NULL, 0, remove_download_by_id, ( void * )( ULONG_PTR )api_info->id, 0, NULL );
+			if ( thread != NULL )
+			{
+				CloseHandle( thread );
+			}
+			else
+			{
+				found = false;
+			}
+		}
+
+		return found;
+	}
+
+	// The download is only freed in cleanup_cs.
+	EnterCriticalSection( &cleanup_cs );
+
+	EnterCriticalSection( &download_list_cs );
+
+	DOWNLOAD_INFO *di = FindDownload( api_info->id );
+
+	LeaveCriticalSection( &download_list_cs );
+
+	if ( di != NULL )
+	{
+		if ( api_info->action == API_ACTION_PAUSE )
+		{
+			SetDownloadStatus( di, STATUS_PAUSED, false );
+		}
+		else if ( api_info->action == API_ACTION_RESUME )
+		{
+			SetDownloadStatus( di, STATUS_DOWNLOADING, false );
+		}
+		else if ( api_info->action == API_ACTION_STOP )
+		{
+			SetDownloadStatus( di, STATUS_STOPPED, false );
+		}
+		else if ( api_info->action == API_ACTION_RESTART )
+		{
+			SetDownloadStatus( di, STATUS_RESTART, false );
+		}
+		else	// Move the queued download.
+		{
+			MoveQueuedDownload( di, api_info->action - API_ACTION_TOP );
+		}
+	}
+
+	LeaveCriticalSection( &cleanup_cs );
+
+	return ( di != NULL ? true : false );
+}
+
+unsigned char WriteAPIControl( API_INFO *api_info, API_BUFFER *ab )
+{
+	if ( api_info->action == API_ACTION_REMOVE )
+	{
+		char removed[ 64 ];
+		int removed_length = __snprintf( removed, 64, "{\"id\":%lu,\"removed\":true}\n", api_info->id );
+
+		WriteAPI( ab, removed, removed_length );
+
+		return API_RESPONSE_DONE;
+	}
+
+	EnterCriticalSection( &download_list_cs );
+
+	DOWNLOAD_INFO *di = FindDownload( api_info->id );
+	if ( di != NULL )
+	{
+		WriteAPIDownloadFields( ab, di );
+		WriteAPI( ab, "}\n", 2 );
+	}
+
+	LeaveCriticalSection( &download_list_cs );
+
+	return API_RESPONSE_DONE;
+}
+
+unsigned char WriteAPIEvents( API_INFO *api_info, API_BUFFER *ab )
+{
+	if ( !api_info->removing )
+	{
+		EnterCriticalSection( &download_list_cs );
+
+		node_type *node = GetAPINextDownload( api_info->cursor );
+		while ( node != NULL )
+		{
+			DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )node->val;
+
+			unsigned int length = ab->length;
+
+			if ( !WriteAPIEvent( api_info, ab, di ) )
+			{
+				ab->length = length;
+				ab->full = false;
+
+				// Skip a download that can't fit in an empty chunk.
+				if ( length > 0 )
+				{
+					break;
+				}
+			}
+
+			api_info->cursor = di->id;
+
+			node = node->next;
+		}
+
+		LeaveCriticalSection( &download_list_cs );
+
+		if ( node == NULL )
+		{
+			api_info->removing = true;
+		}
+	}
+
+	if ( api_info->removing )
+	{
+		// Report the downloads that weren't found during this pass.
+		unsigned int i = 0;
+		while ( i < api_info->snapshot_count )
+		{
+			if ( !api_info->snapshots[ i ].seen )
+			{
+				char event[ 64 ];
+				int event_length = __snprintf( event, 64, "{\"id\":%lu,\"removed\":true}\n", api_info->snapshots[ i ].id );
+
+				WriteAPI( ab, event, event_length );
+
+				if ( ab->full )
+				{
+					ab->full = false;
+
+					break;
+				}
+
+				api_info->snapshots[ i ] = api_info->snapshots[ --api_info->snapshot_count ];
+			}
+			else
+			{
+				++i;
+			}
+		}
+
+		// The pass is complete. Start the next one.
+		if ( i >= api_info->snapshot_count )
+		{
+			for ( i = 0; i < api_info->snapshot_count; ++i )
+			{
+				api_info->snapshots[ i ].seen = false;
+			}
+
+			api_info->cursor = 0;
+			api_info->snapshot_hint = 0;
+			api_info->removing = false;
+
+			if ( ab->length == 0 )
+			{
+				if ( ++api_info->idle_polls < API_HEARTBEAT_POLLS )
+				{
+					return API_RESPONSE_WAIT;
+				}
+
+				WriteAPI( ab, "\n", 1 );
+			}
+		}
+	}
+
+	api_info->idle_polls = 0;
+
+	return API_RESPONSE_SEND_MORE;
+}
+
+// The parked context keeps a pending operation until APIPoller() or ReleaseAPIURLBatch() posts it.
+// This should be done in the context's critical section.
+void ParkAPIContext( SOCKET_CONTEXT *context )
+{
+	context->overlapped.current_operation = IO_APIResponse;
+
+	EnterCriticalSection( &api_poll_cs );
+
+	bool wake_poller = ( api_poll_list == NULL );
+
+	context->api_info->poll_node.data = context;
+	DLL_AddNode( &api_poll_list, &context->api_info->poll_node, -1 );
+
+	if ( wake_poller && g_api_poll_semaphore != NULL )
+	{
+		ReleaseSemaphore( g_api_poll_semaphore, 1, NULL );
+	}
+
+	LeaveCriticalSection( &api_poll_cs );
+}
+
+// Reads the options of a URL submission from its query string.
+void ParseAPIIngestOptions( API_INGEST *ingest, char *query, char *query_end )
+{
+	while ( query < query_end )
+	{
+		char *name_end = query;
+		while ( name_end < query_end && *name_end != '=' && *name_end != '&' )
+		{
+			++name_end;
+		}
+
+		unsigned int name_length = ( unsigned int )( name_end - query );
+
+		unsigned long long value = 0;
+
+		char *value_end = name_end;
+		if ( value_end < query_end && *value_end == '=' )
+		{
+			++value_end;
+
+			while ( value_end < query_end && *value_end >= '0' && *value_end <= '9' )
+			{
+				value = ( value * 10 ) + ( *value_end - '0' );
+
+				++value_end;
+			}
+		}
+
+		if ( name_length == 5 && _StrCmpNA( query, "parts", 5 ) == 0 )
+		{
+			ingest->parts = ( unsigned char )( value > 100 ? 100 : value );
+		}
+		else if ( name_length == 20 && _StrCmpNA( query, "download_speed_limit", 20 ) == 0 )
+		{
+			ingest->download_speed_limit = value;
+		}
+		else if ( name_length == 19 && _StrCmpNA( query, "download_operations", 19 ) == 0 )
+		{
+			ingest->download_operations = ( unsigned char )value;
+		}
+
+		// Skip to the next parameter.
+		query = value_end;
+		while ( query < query_end && *query != '&' )
+		{
+			++query;
+		}
+
+		++query;
+	}
+}
+
+// Adds the line that's been received to the batch.
+void AddAPIURL( API_INGEST *ingest )
+{
+	char *url = ingest->line;
+	unsigned int url_length = ingest->line_length;
+
+	ingest->line_length = 0;
+
+	// Trim the whitespace and line endings.
+	while ( url_length > 0 && ( *url == ' ' || *url == '\t' || *url == '\r' ) )
+	{
+		++url;
+		--url_length;
+	}
+
+	while ( url_length > 0 && ( url[ url_length - 1 ] == ' ' || url[ url_length - 1 ] == '\t' || url[ url_length - 1 ] == '\r' ) )
+	{
+		--url_length;
+	}
+
+	if ( url_length == 0 )
+	{
+		return;
+	}
+
+	// AddURL() skips anything that doesn't look like an HTTP(S) or FTP(S) URL. Count them here so that they can be reported.
+	if ( !( ( url_length > 7 && _StrCmpNIA( url, "http://", 7 ) == 0 ) ||
+			( url_length > 8 && _StrCmpNIA( url, "https://", 8 ) == 0 ) ||
+			( url_length > 6 && _StrCmpNIA( url, "ftp://", 6 ) == 0 ) ||
+			( url_length > 7 && _StrCmpNIA( url, "ftps://", 7 ) == 0 ) ||
+			( url_length > 8 && _StrCmpNIA( url, "ftpes://", 8 ) == 0 ) ) )
+	{
+		++ingest->rejected;
+
+		return;
+	}
+
+	// A UTF-8 string never has fewer bytes than it has wide characters. Leave room for the "\r\n" and the NULL terminator.
+	unsigned int batch_length = ingest->batch_length + url_length + 3;
+	if ( batch_length > ingest->batch_capacity )
+	{
+		unsigned int capacity = ( ingest->batch_capacity > 0 ? ingest->batch_capacity * 2 : 16384 );
+		if ( capacity < batch_length )
+		{
+			capacity = batch_length;
+		}
+
+		wchar_t *batch;
+		if ( ingest->batch == NULL )
+		{
+			batch = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * capacity );
+		}
+		else
+		{
+			batch = ( wchar_t * )GlobalReAlloc( ingest->batch, sizeof( wchar_t ) * capacity, GMEM_MOVEABLE );
+		}
+
+		if ( batch == NULL )
+		{
+			++ingest->rejected;
+
+			return;
+		}
+
+		ingest->batch = batch;
+		ingest->batch_capacity = capacity;
+	}
+
+	int length = MultiByteToWideChar( CP_UTF8, 0, url, url_length, ingest->batch + ingest->batch_length, ingest->batch_capacity - ingest->batch_length );
+	if ( length <= 0 )
+	{
+		++ingest->rejected;
+
+		return;
+	}
+
+	ingest->batch_length += length;
+	ingest->batch[ ingest->batch_length++ ] = L'\r';
+	ingest->batch[ ingest->batch_length++ ] = L'\n';
+	ingest->batch[ ingest->batch_length ] = 0;	// Sanity.
+
+	++ingest->batch_count;
+	++ingest->accepted;
+}
+
+// Returns false if there are too many batches waiting to be added.
+bool AddAPIURLBatch( API_INGEST *ingest )
+{
+	if ( InterlockedIncrement( &g_api_url_batches ) > API_URL_BATCH_LIMIT )
+	{
+		InterlockedDecrement( &g_api_url_batches );
+
+		return false;
+	}
+
+	wchar_t *download_directory = ( wchar_t * )GlobalAlloc( GMEM_FIXED, sizeof( wchar_t ) * MAX_PATH );
+	_wmemcpy_s( download_directory, MAX_PATH, cfg_default_download_directory, g_default_download_directory_length );
+	download_directory[ g_default_download_directory_length ] = 0;	// Sanity.
+
+	unsigned char download_operations = ingest->download_operations & ( DOWNLOAD_OPERATION_SIMULATE | DOWNLOAD_OPERATION_ADD_STOPPED );	// Ensure we can only simulate and/or add stopped.
+	if ( !( download_operations & DOWNLOAD_OPERATION_ADD_STOPPED ) )
+	{
+		download_operations |= DOWNLOAD_OPERATION_OVERRIDE_PROMPTS;
+	}
+
+	ADD_INFO *ai = ( ADD_INFO * )GlobalAlloc( GPTR, sizeof( ADD_INFO ) );
+	ai->method = METHOD_GET;
+	ai->parts = ( ingest->parts > 0 ? ingest->parts : cfg_default_download_parts );
+	ai->download_speed_limit = ingest->download_speed_limit;
+	ai->ssl_version = cfg_default_ssl_version;
+	ai->download_operations = download_operations;
+	ai->urls = ingest->batch;
+	ai->download_directory = download_directory;
+	ai->api_batch = true;
+
+	// ai is freed in AddURL.
+	HANDLE thread = ( HANDLE )_CreateThread( NULL, 0, AddURL, ( void * )ai, 0, NULL );
+	if ( thread != NULL )
+	{
+		CloseHandle( thread );
+
+		++ingest->batches;
+	}
+	else
+	{
+		InterlockedDecrement( &g_api_url_batches );
+
+		ingest->accepted -= ingest->batch_count;
+		ingest->rejected += ingest->batch_count;
+
+		GlobalFree( ai->download_directory );
+		GlobalFree( ai->urls );
+		GlobalFree( ai );
+	}
+
+	ingest->batch = NULL;
+	ingest->batch_length = 0;
+	ingest->batch_capacity = 0;
+	ingest->batch_count = 0;
+
+	return true;
+}
+
+// Hands the batch to AddURL() once it's full, or once the whole body has been received.
+// Returns CONTENT_STATUS_READ_MORE_CONTENT, CONTENT_STATUS_HANDLE_REQUEST once every URL has been handed off, or CONTENT_STATUS_NONE if the context has been parked.
+// This should be done in the context's critical section.
+char ResumeAPIIngest( SOCKET_CONTEXT *context )
+{
+	API_INGEST *ingest = context->api_info->ingest;
+
+	if ( ingest->batch_count > 0 && ( ingest->batch_count >= API_URL_BATCH_SIZE || ingest->finished ) )
+	{
+		if ( !AddAPIURLBatch( ingest ) )
+		{
+			// Stop receiving until one of the batches has been added.
+			InterlockedIncrement( &context->pending_operations );
+
+			ParkAPIContext( context );
+
+			return CONTENT_STATUS_NONE;
+		}
+	}
+
+	return ( ingest->finished ? CONTENT_STATUS_HANDLE_REQUEST : CONTENT_STATUS_READ_MORE_CONTENT );
+}
+
+// Splits the part of the body that was just received into lines.
+// The header's content_offset must already include data_length.
+// This should be done in the context's critical section.
+char IngestAPIURLs( SOCKET_CONTEXT *context, char *data, unsigned int data_length )
+{
+	API_INGEST *ingest = context->api_info->ingest;
+	RANGE_INFO *ri = context->header_info.range_info;
+
+	// Ignore anything past the body.
+	if ( ri->content_offset >= ri->content_length )
+	{
+		unsigned long long extra_length = ri->content_offset - ri->content_length;
+
+		data_length = ( extra_length < data_length ? data_length - ( unsigned int )extra_length : 0 );
+
+		ingest->finished = true;
+	}
+
+	ingest->received += data_length;
+
+	for ( unsigned int i = 0; i < data_length; ++i )
+	{
+		if ( data[ i ] == '\n' )
+		{
+			if ( !ingest->skip_line )
+			{
+				AddAPIURL( ingest );
+			}
+
+			ingest->skip_line = false;
+			ingest->line_length = 0;
+		}
+		else if ( !ingest->skip_line )
+		{
+			if ( ingest->line_length < API_URL_LINE_LIMIT )
+			{
+				ingest->line[ ingest->line_length++ ] = data[ i ];
+			}
+			else
+			{
+				ingest->skip_line = true;
+
+				++ingest->rejected;
+			}
+		}
+	}
+
+	// The last line doesn't need to end with a newline.
+	if ( ingest->finished && !ingest->skip_line )
+	{
+		AddAPIURL( ingest );
+	}
+
+	// The partial line has been copied. Receive into the start of the buffer.
+	context->wsabuf.buf = context->buffer;
+	context->wsabuf.len = context->buffer_size;
+
+	return ResumeAPIIngest( context );
+}
+
+// Called by AddURL() once a submitted batch has been added.
+// Any submissions that stopped receiving are posted so that they can hand off their next batch.
+void ReleaseAPIURLBatch()
+{
+	InterlockedDecrement( &g_api_url_batches );
+
+	EnterCriticalSection( &api_poll_cs );
+
+	DoublyLinkedList *poll_node = api_poll_list;
+	while ( poll_node != NULL )
+	{
+		DoublyLinkedList *del_poll_node = poll_node;
+		poll_node = poll_node->next;
+
+		SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )del_poll_node->data;
+		if ( context->api_info->request == API_REQUEST_ADD_URLS )
+		{
+			DLL_RemoveNode( &api_poll_list, del_poll_node );
+			del_poll_node->data = NULL;
+
+			// pending_operations was incremented when the context was parked.
+			PostCompletion( 0, context, &context->overlapped );
+		}
+	}
+
+	LeaveCriticalSection( &api_poll_cs );
+}
+
+unsigned char WriteAPIIngest( API_INFO *api_info, API_BUFFER *ab )
+{
+	API_INGEST *ingest = api_info->ingest;
+
+	DWORD elapsed = GetTickCount() - ingest->start_time;
+	if ( elapsed == 0 )
+	{
+		elapsed = 1;
+	}
+
+	char stats[ 256 ];
+	int stats_length = __snprintf( stats, 256, "{\"accepted\":%lu,\"rejected\":%lu,\"batches\":%lu,\"bytes\":%I64u,\"elapsed_ms\":%lu,\"urls_per_second\":%I64u,\"bytes_per_second\":%I64u}\n",
+								   ingest->accepted, ingest->rejected, ingest->batches, ingest->received, elapsed,
+								   ( ( unsigned long long )ingest->accepted * 1000 ) / elapsed, ( ingest->received * 1000 ) / elapsed );
+
+	WriteAPI( ab, stats, stats_length );
+
+	return API_RESPONSE_DONE;
+}
+
+// The DNS cache, SSL/TLS session resumption, and decrypted data counters for the session.
+unsigned char WriteAPIStats( API_BUFFER *ab )
+{
+	EnterCriticalSection( &dns_cache_cs );
+
+	unsigned long dns_cache_hits = g_dns_cache_hits;
+	unsigned long dns_cache_misses = g_dns_cache_misses;
+	unsigned long dns_lookups = g_dns_lookups;
+	unsigned long long dns_lookup_time = g_dns_lookup_time;
+
+	LeaveCriticalSection( &dns_cache_cs );
+
+	EnterCriticalSection( &ssl_cs );
+
+	unsigned long ssl_full_handshakes = g_ssl_full_handshakes;
+	unsigned long ssl_resumed_handshakes = g_ssl_resumed_handshakes;
+	unsigned long long ssl_handshake_time = g_ssl_handshake_time;
+	unsigned long long ssl_bytes_decrypted = g_ssl_bytes_decrypted;
+	unsigned long long ssl_bytes_copied = g_ssl_bytes_copied;
+
+	LeaveCriticalSection( &ssl_cs );
+
+	char stats[ 512 ];
+	int stats_length = __snprintf( stats, 512, "{\"dns\":{\"cache_hits\":%lu,\"cache_misses\":%lu,\"lookups\":%lu,\"lookup_ms\":%I64u}," \
+											   "\"ssl\":{\"full_handshakes\":%lu,\"resumed_handshakes\":%lu,\"handshake_ms\":%I64u,\"bytes_decrypted\":%I64u,\"bytes_copied\":%I64u}}\n",
+								   dns_cache_hits, dns_cache_misses, dns_lookups, dns_lookup_time,
+								   ssl_full_handshakes, ssl_resumed_handshakes, ssl_handshake_time, ssl_bytes_decrypted, ssl_bytes_copied );
+
+	WriteAPI( ab, stats, stats_length );
+
+	return API_RESPONSE_DONE;
+}
+
+unsigned char GetAPIAction( char *action, unsigned int action_length )
+{
+	for ( unsigned char i = 0; i < ( sizeof( api_actions ) / sizeof( api_actions[ 0 ] ) ); ++i )
+	{
+		if ( action_length == ( unsigned int )lstrlenA( api_actions[ i ] ) && _StrCmpNA( action, api_actions[ i ], action_length ) == 0 )
+		{
+			return API_ACTION_PAUSE + i;
+		}
+	}
+
+	return API_ACTION_NONE;
+}
+
+// Creates context->api_info if the request line is for a resource in /api.
+void ParseAPIRequest( SOCKET_CONTEXT *context, char *header )
+{
+	// A previous request on a keep-alive connection may have left its info behind.
+	FreeAPIInfo( &context->api_info );
+
+	char *resource = _StrChrA( header, ' ' );
+	if ( resource == NULL )
+	{
+		return;
+	}
+
+	++resource;
+
+	char *resource_end = resource;
+	while ( *resource_end != 0 && *resource_end != ' ' && *resource_end != '?' && *resource_end != '\r' && *resource_end != '\n' )
+	{
+		++resource_end;
+	}
+
+	char *query_end = resource_end;
+	if ( *query_end == '?' )
+	{
+		while ( *query_end != 0 && *query_end != ' ' && *query_end != '\r' && *query_end != '\n' )
+		{
+			++query_end;
+		}
+	}
+
+	unsigned int resource_length = ( unsigned int )( resource_end - resource );
+
+	if ( resource_length < 4 || _StrCmpNA( resource, "/api", 4 ) != 0 || ( resource_length > 4 && resource[ 4 ] != '/' ) )
+	{
+		return;
+	}
+
+	API_INFO *api_info = ( API_INFO * )GlobalAlloc( GPTR, sizeof( API_INFO ) );
+	if ( api_info == NULL )
+	{
+		return;
+	}
+
+	api_info->request = API_REQUEST_NOT_FOUND;
+
+	unsigned char http_method = context->header_info.http_method;
+
+	resource += 4;
+	resource_length -= 4;
+
+	if ( ( resource_length == 10 && _StrCmpNA( resource, "/downloads", 10 ) == 0 ) ||
+		 ( resource_length == 11 && _StrCmpNA( resource, "/downloads/", 11 ) == 0 ) )
+	{
+		if ( http_method == METHOD_GET )
+		{
+			api_info->request = API_REQUEST_LIST;
+		}
+	}
+	else if ( resource_length > 11 && _StrCmpNA( resource, "/downloads/", 11 ) == 0 )
+	{
+		char *id_start = resource + 11;
+		char *id_end = id_start;
+
+		while ( id_end < resource_end && *id_end >= '0' && *id_end <= '9' )
+		{
+			api_info->id = ( api_info->id * 10 ) + ( *id_end - '0' );
+
+			++id_end;
+		}
+
+		if ( id_end > id_start )
+		{
+			if ( id_end == resource_end )
+			{
+				if ( http_method == METHOD_GET )
+				{
+					api_info->request = API_REQUEST_DETAILS;
+				}
+			}
+			else if ( *id_end == '/' && http_method == METHOD_POST )
+			{
+				api_info->action = GetAPIAction( id_end + 1, ( unsigned int )( resource_end - ( id_end + 1 ) ) );
+				if ( api_info->action != API_ACTION_NONE )
+				{
+					api_info->request = API_REQUEST_CONTROL;
+				}
+			}
+		}
+	}
+	else if ( resource_length == 7 && _StrCmpNA( resource, "/events", 7 ) == 0 )
+	{
+		if ( http_method == METHOD_GET )
+		{
+			api_info->request = API_REQUEST_EVENTS;
+		}
+	}
+	else if ( resource_length == 6 && _StrCmpNA( resource, "/stats", 6 ) == 0 )
+	{
+		if ( http_method == METHOD_GET )
+		{
+			api_info->request = API_REQUEST_STATS;
+		}
+	}
+	else if ( resource_length == 5 && _StrCmpNA( resource, "/urls", 5 ) == 0 )
+	{
+		if ( http_method == METHOD_POST )
+		{
+			API_INGEST *ingest = ( API_INGEST * )GlobalAlloc( GPTR, sizeof( API_INGEST ) );
+			if ( ingest != NULL )
+			{
+				ingest->line = ( char * )GlobalAlloc( GMEM_FIXED, sizeof( char ) * API_URL_LINE_LIMIT );
+				ingest->start_time = GetTickCount();
+
+				if ( resource_end < query_end )
+				{
+					ParseAPIIngestOptions( ingest, resource_end + 1, query_end );
+				}
+
+				api_info->ingest = ingest;
+
+				if ( ingest->line != NULL )
+				{
+					api_info->request = API_REQUEST_ADD_URLS;
+				}
+			}
+		}
+	}
+
+	context->api_info = api_info;
+}
+
+// Writes the next part of the response to context->wsabuf.
+// Everything after the HTTP header is sent with the chunked transfer encoding so that large lists never need more than the context's buffer.
+// This should be done in the context's critical section.
+unsigned char BuildAPIResponse( SOCKET_CONTEXT *context )
+{
+	API_INFO *api_info = context->api_info;
+
+	unsigned int buffer_size = min( context->buffer_size, BUFFER_SIZE );	// SSL/TLS sends must fit in one record.
+	unsigned int header_length = 0;
+
+	if ( !api_info->sent_header )
+	{
+		// MakeResponse() keeps the connection open for the next request once the last chunk has been sent.
+		char *connection = ( context->header_info.connection == CONNECTION_KEEP_ALIVE ? "keep-alive" : "close" );
+
+		bool found;
+
+		if ( api_info->request == API_REQUEST_CONTROL )
+		{
+			found = ControlAPIDownload( api_info );
+		}
+		else if ( api_info->request == API_REQUEST_DETAILS )
+		{
+			EnterCriticalSection( &download_list_cs );
+
+			found = ( FindDownload( api_info->id ) != NULL ? true : false );
+
+			LeaveCriticalSection( &download_list_cs );
+		}
+		else
+		{
+			found = ( api_info->request != API_REQUEST_NOT_FOUND ? true : false );
+		}
+
+		if ( !found )
+		{
+			context->wsabuf.len = __snprintf( context->wsabuf.buf, buffer_size,
+				"HTTP/1.1 404 Not Found\r\n" \
+				"Content-Type: application/json\r\n" \
+				"Content-Length: 22\r\n" \
+				"Connection: %s\r\n\r\n" \
+				"{\"error\":\"not found\"}\n", connection );
+
+			return API_RESPONSE_DONE;
+		}
+
+		header_length = __snprintf( context->wsabuf.buf, buffer_size,
+			"HTTP/1.1 200 OK\r\n" \
+			"Content-Type: %s\r\n" \
+			"Cache-Control: no-cache\r\n" \
+			"Transfer-Encoding: chunked\r\n" \
+			"Connection: %s\r\n\r\n", ( api_info->request == API_REQUEST_EVENTS ? "application/x-ndjson" : "application/json" ), connection );
+
+		api_info->sent_header = true;
+	}
+
+	API_BUFFER ab;
+	ab.buf = context->wsabuf.buf + header_length + API_CHUNK_HEADER_LENGTH;
+	ab.size = buffer_size - header_length - API_CHUNK_HEADER_LENGTH - API_CHUNK_TRAILER_LENGTH;
+	ab.length = 0;
+	ab.full = false;
+
+	unsigned char api_status;
+
+	switch ( api_info->request )
+	{
+		case API_REQUEST_LIST: { api_status = WriteAPIList( api_info, &ab ); } break;
+		case API_REQUEST_DETAILS: { api_status = WriteAPIDetails( api_info, &ab ); } break;
+		case API_REQUEST_CONTROL: { api_status = WriteAPIControl( api_info, &ab ); } break;
+		case API_REQUEST_EVENTS: { api_status = WriteAPIEvents( api_info, &ab ); } break;
+		case API_REQUEST_ADD_URLS: { api_status = WriteAPIIngest( api_info, &ab ); } break;
+		case API_REQUEST_STATS: { api_status = WriteAPIStats( &ab ); } break;
+		default: { api_status = API_RESPONSE_DONE; } break;
+	}
+
+	unsigned int length = header_length;
+
+	if ( ab.length > 0 )
+	{
+		char chunk_header[ 8 ];
+		__snprintf( chunk_header, 8, "%04x\r\n", ab.length );
+		_memcpy_s( context->wsabuf.buf + length, buffer_size - length, chunk_header, API_CHUNK_HEADER_LENGTH );
+
+		length += API_CHUNK_HEADER_LENGTH + ab.length;
+
+		_memcpy_s( context->wsabuf.buf + length, buffer_size - length, "\r\n", 2 );
+		length += 2;
+	}
+
+	if ( api_status == API_RESPONSE_DONE )
+	{
+		_memcpy_s( context->wsabuf.buf + length, buffer_size - length, "0\r\n\r\n", 5 );
+		length += 5;
+	}
+	else if ( api_status == API_RESPONSE_WAIT )
+	{
+		// The header still needs to go out before we wait.
+		if ( length > 0 )
+		{
+			api_status = API_RESPONSE_SEND_MORE;
+		}
+		else
+		{
+			ParkAPIContext( context );
+		}
+	}
+
+	context->wsabuf.len = length;
+
+	return api_status;
+}
+
+void FreeAPIInfo( API_INFO **api_info )
+{
+	if ( *api_info != NULL )
+	{
+		EnterCriticalSection( &api_poll_cs );
+
+		if ( ( *api_info )->poll_node.data != NULL )
+		{
+			DLL_RemoveNode( &api_poll_list, &( *api_info )->poll_node );
+			( *api_info )->poll_node.data = NULL;
+		}
+
+		LeaveCriticalSection( &api_poll_cs );
+
+		if ( ( *api_info )->snapshots != NULL )
+		{
+			GlobalFree( ( *api_info )->snapshots );
+		}
+
+		if ( ( *api_info )->ingest != NULL )
+		{
+			if ( ( *api_info )->ingest->line != NULL )
+			{
+				GlobalFree( ( *api_info )->ingest->line );
+			}
+
+			if ( ( *api_info )->ingest->batch != NULL )
+			{
+				GlobalFree( ( *api_info )->ingest->batch );
+			}
+
+			GlobalFree( ( *api_info )->ingest );
+		}
+
+		GlobalFree( *api_info );
+
+		*api_info = NULL;
+	}
+}
+
+DWORD WINAPI APIPoller( LPVOID WorkThreadContext )
+{
+	bool contexts_waiting = false;
+
+	while ( !g_end_program )
+	{
+		// Check the parked event streams at a fixed interval while there are any, or wait indefinitely until one is parked.
+		DWORD wait_status = WaitForSingleObject( g_api_poll_semaphore, ( contexts_waiting ? API_POLL_INTERVAL : INFINITE ) );
+
+		if ( g_end_program )
+		{
+			break;
+		}
+
+		EnterCriticalSection( &api_poll_cs );
+
+		// A release only tells us that the list is no longer empty. Give the downloads a full interval to change.
+		if ( wait_status == WAIT_TIMEOUT )
+		{
+			while ( api_poll_list != NULL )
+			{
+				DoublyLinkedList *poll_node = api_poll_list;
+				SOCKET_CONTEXT *context = ( SOCKET_CONTEXT * )poll_node->data;
+
+				DLL_RemoveNode( &api_poll_list, poll_node );
+				poll_node->data = NULL;
+
+				// pending_operations was incremented when the context was parked.
+				PostCompletion( 0, context, &context->overlapped );
+			}
+		}
+
+		contexts_waiting = ( api_poll_list != NULL ? true : false );
+
+		LeaveCriticalSection( &api_poll_cs );
+	}
+
+	CloseHandle( g_api_poll_semaphore );
+	g_api_poll_semaphore = NULL;
+
+	_ExitThread( 0 );
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SERVER_API_H
+#define _SERVER_API_H
+
+#include "connection.h"
+
+#define API_REQUEST_NONE		0
+#define API_REQUEST_LIST		1	// GET /api/downloads
+#define API_REQUEST_DETAILS		2	// GET /api/downloads/<id>
+#define API_REQUEST_CONTROL		3	// POST /api/downloads/<id>/<action>
+#define API_REQUEST_EVENTS		4	// GET /api/events
+#define API_REQUEST_NOT_FOUND	5
+#define API_REQUEST_STATS		6	// GET /api/stats
+#define API_REQUEST_ADD_URLS	7	// POST /api/urls
+
+#define API_ACTION_NONE			0
+#define API_ACTION_PAUSE		1
+#define API_ACTION_RESUME		2
+#define API_ACTION_STOP			3
+#define API_ACTION_RESTART		4
+#define API_ACTION_TOP			5
+#define API_ACTION_UP			6
+#define API_ACTION_DOWN			7
+#define API_ACTION_BOTTOM		8
+#define API_ACTION_REMOVE		9
+
+#define API_RESPONSE_DONE		0	// The last chunk has been written. Close the connection after it's sent.
+#define API_RESPONSE_SEND_MORE	1	// Send what's been written and then build the next chunk.
+#define API_RESPONSE_WAIT		2	// Nothing has changed. The context has been parked until the next poll.
+
+#define API_POLL_INTERVAL		1000	// Milliseconds between each check of a parked event stream.
+#define API_HEARTBEAT_POLLS		15		// Send an empty line after this many polls without changes so that idle streams stay open.
+#define API_URL_LIMIT			1024	// The most URL characters that are written for each download.
+
+#define API_URL_LINE_LIMIT		8192	// Submitted lines that are longer than this are rejected.
+#define API_URL_BATCH_SIZE		1000	// The number of submitted URLs that are given to each AddURL thread.
+#define API_URL_BATCH_LIMIT		4		// The most batches that can be waiting to be added. Receiving stops until one finishes.
+
+// The last values that an event stream sent for a download.
+struct API_SNAPSHOT
+{
+	unsigned long long	downloaded;
+	unsigned long long	file_size;
+	unsigned long long	speed;
+	unsigned int		id;
+	unsigned int		status;
+	unsigned char		active_parts;
+	bool				seen;		// The download was found during the current pass of the download list.
+};
+
+// A URL list that's being streamed to POST /api/urls.
+// The body is split into lines as it arrives and each batch is handed to AddURL() so that the whole list is never held at once.
+struct API_INGEST
+{
+	unsigned long long	received;				// The number of body bytes that have been read.
+	unsigned long long	download_speed_limit;
+	char				*line;					// The partial line from the last receive.
+	wchar_t				*batch;					// URLs that are waiting to be added. Each ends with "\r\n".
+	DWORD				start_time;
+	unsigned int		line_length;
+	unsigned int		batch_length;
+	unsigned int		batch_capacity;
+	unsigned int		batch_count;
+	unsigned int		accepted;
+	unsigned int		rejected;
+	unsigned int		batches;
+	unsigned char		parts;
+	unsigned char		download_operations;
+	bool				skip_line;				// The current line is too long and is being discarded.
+	bool				finished;				// The whole body has been received.
+};
+
+struct API_INFO
+{
+	DoublyLinkedList	poll_node;	// Self reference to the api_poll_list.
+	API_SNAPSHOT		*snapshots;
+	API_INGEST			*ingest;
+	unsigned int		snapshot_count;
+	unsigned int		snapshot_capacity;
+	unsigned int		snapshot_hint;	// The snapshot that's checked first. They're usually in the same order as the download list.
+	unsigned int		cursor;			// The id of the last download that was written, or the next range that will be written.
+	unsigned int		id;				// The download that the request is for.
+	unsigned char		request;
+	unsigned char		action;
+	unsigned char		idle_polls;
+	bool				sent_header;
+	bool				started;		// The opening of the response body has been written.
+	bool				first_written;	// A download has been written to the list. The next one needs a comma.
+	bool				removing;		// The event stream is reporting the downloads that are no longer in the list.
+};
+
+void ParseAPIRequest( SOCKET_CONTEXT *context, char *header );
+unsigned char BuildAPIResponse( SOCKET_CONTEXT *context );
+char IngestAPIURLs( SOCKET_CONTEXT *context, char *data, unsigned int data_length );
+char ResumeAPIIngest( SOCKET_CONTEXT *context );
+void ReleaseAPIURLBatch();
+void FreeAPIInfo( API_INFO **api_info );
+
+DWORD WINAPI APIPoller( LPVOID WorkThreadContext );
+
+extern CRITICAL_SECTION api_poll_cs;	// Guard access to the api poll list.
+
+extern HANDLE g_api_poll_semaphore;
+
+extern DoublyLinkedList *api_poll_list;	// Event streams that are waiting for a download to change, and URL submissions that are waiting for a batch to finish.
+
+extern volatile LONG g_api_url_batches;	// The number of submitted batches that AddURL() hasn't finished with.
+
+#endif
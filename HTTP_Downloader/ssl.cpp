@@ -34,9 +34,23 @@ pSslEmptyCacheW	_SslEmptyCacheW;
 
 unsigned char ssl_state = SSL_STATE_SHUTDOWN;
 
+unsigned char g_ssl_backend_type = SSL_BACKEND_SCHANNEL;	// The provider used for client connections.
+
 CredHandle g_hCreds_server;
 CredHandle g_hCreds_client;
 
+CRITICAL_SECTION ssl_cs;
+
+// Schannel caches client sessions per credential handle and target name.
+// Every client context shares g_hCreds_client and passes the request's host as its target name,
+// so connections after the first one to a host resume its session with an abbreviated handshake.
+unsigned long g_ssl_full_handshakes = 0;
+unsigned long g_ssl_resumed_handshakes = 0;
+unsigned long long g_ssl_handshake_time = 0;	// The total number of milliseconds spent in client handshakes.
+
+unsigned long long g_ssl_bytes_decrypted = 0;	// The decrypted bytes that were handed to the connection code.
+unsigned long long g_ssl_bytes_copied = 0;		// The part of those bytes that had to be copied out of the IO buffer.
+
 void ResetServerCredentials()
 {
 	if ( SecIsValidHandle( &g_hCreds_server ) )
@@ -97,9 +111,19 @@ int SSL_library_init( void )
 
 	ssl_state = SSL_STATE_RUNNING;
 
+	InitializeCriticalSection( &ssl_cs );
+
 	SecInvalidateHandle( &g_hCreds_server );
 	SecInvalidateHandle( &g_hCreds_client );
 
+	// Fall back to Schannel if the OpenSSL libraries can't be loaded.
+	if ( g_ssl_backend_type == SSL_BACKEND_OPENSSL && !OpenSSL_Init() )
+	{
+		OpenSSL_UnInit();
+
+		g_ssl_backend_type = SSL_BACKEND_SCHANNEL;
+	}
+
 	return 1;
 }
 
@@ -114,6 +138,10 @@ int SSL_library_uninit( void )
 
 		_SslEmptyCacheW( NULL, 0 );
 
+		OpenSSL_UnInit();
+
+		DeleteCriticalSection( &ssl_cs );
+
 		ret = FreeLibrary( g_hSecurity );
 	}
 
@@ -122,26 +150,23 @@ int SSL_library_uninit( void )
 	return ret;
 }
 
-SSL *SSL_new( DWORD protocol, bool is_server )
+bool Schannel_New( SSL *ssl, DWORD protocol )
 {
 	SCHANNEL_CRED SchannelCred;
 	TimeStamp tsExpiry;
 	SECURITY_STATUS scRet;
 
-	if ( g_pSSPI == NULL )
-	{
-		return NULL;
-	}
+	bool ret = true;
 
-	SSL *ssl = ( SSL * )GlobalAlloc( GPTR, sizeof( SSL ) );
-	if ( ssl == NULL )
+	if ( g_pSSPI == NULL )
 	{
-		return NULL;
+		return false;
 	}
 
-	ssl->is_server = is_server;
+	// A second credential handle would have its own session cache. Make sure only one is ever acquired.
+	EnterCriticalSection( &ssl_cs );
 
-	if ( is_server )
+	if ( ssl->is_server )
 	{
 		if ( !SecIsValidHandle( &g_hCreds_server ) )
 		{
@@ -169,9 +194,7 @@ SSL *SSL_new( DWORD protocol, bool is_server )
 			{
 				ResetServerCredentials();
 
-				GlobalFree( ssl );
-
-				return NULL;
+				ret = false;
 			}
 		}
 	}
@@ -201,22 +224,18 @@ SSL *SSL_new( DWORD protocol, bool is_server )
 			{
 				ResetClientCredentials();
 
-				GlobalFree( ssl ); 
-				ssl = NULL;
+				ret = false;
 			}
 		}
 	}
 
-	return ssl;
+	LeaveCriticalSection( &ssl_cs );
+
+	return ret;
 }
 
-void SSL_free( SSL *ssl )
+void Schannel_Free( SSL *ssl )
 {
-	if ( ssl == NULL )
-	{
-		return;
-	}
-
 	if ( g_pSSPI != NULL )
 	{
 		if ( ssl->sdd.OutBuffers[ 0 ].pvBuffer != NULL )
@@ -249,17 +268,45 @@ void SSL_free( SSL *ssl )
 			SecInvalidateHandle( &ssl->hContext );
 		}
 	}
+}
 
-	if ( ssl->sd.pbDataBuffer != NULL )
+SSL *SSL_new( DWORD protocol, bool is_server )
+{
+	// The OpenSSL backend only handles client connections. The web server always uses Schannel and the loaded certificate.
+	SSL_BACKEND *backend = ( !is_server && g_ssl_backend_type == SSL_BACKEND_OPENSSL ? &g_openssl_backend : &g_schannel_backend );
+
+	SSL *ssl = ( SSL * )GlobalAlloc( GPTR, sizeof( SSL ) );
+	if ( ssl == NULL )
 	{
-		GlobalFree( ssl->sd.pbDataBuffer );
-		ssl->sd.pbDataBuffer = NULL;
+		return NULL;
+	}
+
+	ssl->backend = backend;
+	ssl->is_server = is_server;
+
+	// The backend cleans up anything it allocated if this fails.
+	if ( !backend->New( ssl, protocol ) )
+	{
+		GlobalFree( ssl );
+		ssl = NULL;
+	}
+
+	return ssl;
+}
+
+void SSL_free( SSL *ssl )
+{
+	if ( ssl == NULL )
+	{
+		return;
 	}
 
-	if ( ssl->pbRecDataBuf != NULL )
+	ssl->backend->Free( ssl );
+
+	if ( ssl->sd.pbDataBuffer != NULL )
 	{
-		GlobalFree( ssl->pbRecDataBuf );
-		ssl->pbRecDataBuf = NULL;
+		GlobalFree( ssl->sd.pbDataBuffer );
+		ssl->sd.pbDataBuffer = NULL;
 	}
 
 	if ( ssl->pbIoBuffer != NULL )
@@ -326,7 +373,7 @@ SECURITY_STATUS SSL_WSAAccept( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped
 	return scRet;
 }
 
-SECURITY_STATUS SSL_WSAAccept_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+SECURITY_STATUS Schannel_WSAAccept_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
 {
 	SECURITY_STATUS scRet = SEC_E_INTERNAL_ERROR;
 
@@ -425,7 +472,7 @@ SECURITY_STATUS SSL_WSAAccept_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *over
 						return SEC_E_INTERNAL_ERROR;
 					}
 
-					// ssl->acd.OutBuffers[ 0 ].pvBuffer is freed in SSL_WSAAccept_Response (assuming we get a response).
+					// ssl->acd.OutBuffers[ 0 ].pvBuffer is freed in Schannel_WSAAccept_Response (assuming we get a response).
 
 					return SEC_I_CONTINUE_NEEDED;
 				}
@@ -463,7 +510,7 @@ SECURITY_STATUS SSL_WSAAccept_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *over
 	return scRet;
 }
 
-SECURITY_STATUS SSL_WSAAccept_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+SECURITY_STATUS Schannel_WSAAccept_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
 {
 	SECURITY_STATUS scRet = SEC_E_INTERNAL_ERROR;
 
@@ -594,7 +641,60 @@ SECURITY_STATUS SSL_WSAAccept_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *o
 	return scRet;
 }
 
-SECURITY_STATUS SSL_WSAConnect( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, char *host, bool &sent )
+// Record whether a completed client handshake resumed a cached session.
+void RecordClientHandshake( SSL *ssl, bool resumed )
+{
+	DWORD handshake_time = GetTickCount() - ssl->handshake_start;
+
+	EnterCriticalSection( &ssl_cs );
+
+	if ( resumed )
+	{
+		++g_ssl_resumed_handshakes;
+	}
+	else
+	{
+		++g_ssl_full_handshakes;
+	}
+
+	g_ssl_handshake_time += handshake_time;
+
+	LeaveCriticalSection( &ssl_cs );
+}
+
+void RecordDecryptedData( DWORD bytes_decrypted, bool copied )
+{
+	if ( bytes_decrypted == 0 )
+	{
+		return;
+	}
+
+	EnterCriticalSection( &ssl_cs );
+
+	g_ssl_bytes_decrypted += bytes_decrypted;
+
+	if ( copied )
+	{
+		g_ssl_bytes_copied += bytes_decrypted;
+	}
+
+	LeaveCriticalSection( &ssl_cs );
+}
+
+bool Schannel_IsSessionResumed( SSL *ssl )
+{
+	SecPkgContext_SessionInfo session_info;
+	_memzero( &session_info, sizeof( SecPkgContext_SessionInfo ) );
+
+	if ( g_pSSPI->QueryContextAttributesA( &ssl->hContext, SECPKG_ATTR_SESSION_INFO, ( PVOID )&session_info ) == SEC_E_OK )
+	{
+		return ( session_info.dwFlags & SSL_SESSION_RECONNECT ? true : false );
+	}
+
+	return false;
+}
+
+SECURITY_STATUS Schannel_WSAConnect( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, char *host, bool &sent )
 {
 	SECURITY_STATUS scRet = SEC_E_INTERNAL_ERROR;
 
@@ -641,6 +741,9 @@ SECURITY_STATUS SSL_WSAConnect( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlappe
 		int slen = sizeof( struct sockaddr );
 		_getpeername( ssl->s, ( struct sockaddr * ) &sock, &slen );*/
 
+		ssl->handshake_start = GetTickCount();
+
+		// The target name is also the session cache key. It must be the same for every connection to the host.
 		scRet = g_pSSPI->InitializeSecurityContextA(
 						&g_hCreds_client,
 						NULL,
@@ -691,7 +794,7 @@ SECURITY_STATUS SSL_WSAConnect( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlappe
 	return scRet;
 }
 
-SECURITY_STATUS SSL_WSAConnect_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+SECURITY_STATUS Schannel_WSAConnect_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
 {
 	SECURITY_STATUS scRet = SEC_E_INTERNAL_ERROR;
 
@@ -793,11 +896,13 @@ SECURITY_STATUS SSL_WSAConnect_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *
 				sent = true;
 
 				// Do not post the ssl->cbIoBuffer size.
-				PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+				PostCompletion( 0, context, overlapped );
 			}
 		}
 		else if ( scRet == SEC_E_OK )	// Handshake completed successfully.
 		{
+			RecordClientHandshake( ssl, Schannel_IsSessionResumed( ssl ) );
+
 			// Store remaining data for further use
 			if ( ssl->acd.InBuffers[ 1 ].BufferType == SECBUFFER_EXTRA )
 			{
@@ -828,7 +933,7 @@ SECURITY_STATUS SSL_WSAConnect_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *
 	return scRet;
 }
 
-SECURITY_STATUS SSL_WSAConnect_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+SECURITY_STATUS Schannel_WSAConnect_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
 {
 	SECURITY_STATUS scRet = SEC_E_INTERNAL_ERROR;
 
@@ -928,7 +1033,7 @@ SECURITY_STATUS SSL_WSAConnect_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *ove
 						return SEC_E_INTERNAL_ERROR;
 					}
 
-					// Freed in SSL_WSAConnect_Response (assuming we get a response).
+					// Freed in Schannel_WSAConnect_Response (assuming we get a response).
 					//g_pSSPI->FreeContextBuffer( ssl->acd.OutBuffers[ 0 ].pvBuffer );
 					//ssl->acd.OutBuffers[ 0 ].pvBuffer = NULL;
 
@@ -944,12 +1049,14 @@ SECURITY_STATUS SSL_WSAConnect_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *ove
 
 					sent = true;
 
-					PostQueuedCompletionStatus( g_hIOCP, 0, ( ULONG_PTR )context, ( WSAOVERLAPPED * )overlapped );
+					PostCompletion( 0, context, overlapped );
 
 					return scRet;
 				}
 				else if ( scRet == SEC_E_OK )
 				{
+					RecordClientHandshake( ssl, Schannel_IsSessionResumed( ssl ) );
+
 					// Store remaining data for further use
 					if ( ssl->acd.InBuffers[ 1 ].BufferType == SECBUFFER_EXTRA )
 					{
@@ -982,7 +1089,7 @@ SECURITY_STATUS SSL_WSAConnect_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *ove
 	return scRet;
 }
 
-SECURITY_STATUS SSL_WSAShutdown( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+SECURITY_STATUS Schannel_WSAShutdown( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
 {
 	SECURITY_STATUS scRet = SEC_E_INTERNAL_ERROR;
 
@@ -1099,7 +1206,7 @@ SECURITY_STATUS SSL_WSAShutdown( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapp
 	return scRet;
 }
 
-SECURITY_STATUS SSL_WSASend( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, WSABUF *send_buf, bool &sent )
+SECURITY_STATUS Schannel_WSASend( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, WSABUF *send_buf, bool &sent )
 {
 	SECURITY_STATUS scRet = SEC_E_INTERNAL_ERROR;
 
@@ -1207,7 +1314,23 @@ SECURITY_STATUS SSL_WSARecv( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped,
 
 		if ( ssl->cbIoBuffer == 0 || ssl->rd.scRet == SEC_E_INCOMPLETE_MESSAGE )
 		{
-			if ( ssl->sbIoBuffer <= ssl->cbIoBuffer )
+			// Records are decrypted in place, so the undecrypted data doesn't start at the beginning of the buffer.
+			// Only move it back once the free space behind it gets low rather than after every record.
+			// Nothing can be moved while decrypted data is still waiting to be returned.
+			if ( ssl->cbRecData == 0 )
+			{
+				if ( ssl->cbIoBuffer == 0 )
+				{
+					ssl->ofIoBuffer = 0;
+				}
+				else if ( ssl->ofIoBuffer > 0 && ( ssl->sbIoBuffer - ( ssl->ofIoBuffer + ssl->cbIoBuffer ) ) < ( ssl->sbIoBuffer / 2 ) )
+				{
+					_memmove( ssl->pbIoBuffer, ssl->pbIoBuffer + ssl->ofIoBuffer, ssl->cbIoBuffer );
+					ssl->ofIoBuffer = 0;
+				}
+			}
+
+			if ( ssl->sbIoBuffer <= ( ssl->ofIoBuffer + ssl->cbIoBuffer ) )
 			{
 				ssl->sbIoBuffer += 2048;
 
@@ -1223,8 +1346,8 @@ SECURITY_STATUS SSL_WSARecv( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped,
 
 			sent = true;
 
-			encrypted_buf.buf = ( char * )ssl->pbIoBuffer + ssl->cbIoBuffer;
-			encrypted_buf.len = ssl->sbIoBuffer - ssl->cbIoBuffer;
+			encrypted_buf.buf = ( char * )ssl->pbIoBuffer + ssl->ofIoBuffer + ssl->cbIoBuffer;
+			encrypted_buf.len = ssl->sbIoBuffer - ( ssl->ofIoBuffer + ssl->cbIoBuffer );
 
 			nRet = _WSARecv( ssl->s, &encrypted_buf, 1, NULL, &dwFlags, ( WSAOVERLAPPED * )overlapped, NULL );
 			if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
@@ -1246,47 +1369,21 @@ SECURITY_STATUS SSL_WSARecv( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped,
 	}
 }
 
-SECURITY_STATUS SSL_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumberOfBytesDecrypted )
+// Decrypt the next record in pbIoBuffer. The record is decrypted in place.
+// pDataBuffer and pExtraBuffer point to the record's data and to the start of the next record, if there are any.
+SECURITY_STATUS Schannel_DecryptMessage( SSL *ssl, SecBuffer *&pDataBuffer, SecBuffer *&pExtraBuffer )
 {
-	lpNumberOfBytesDecrypted = 0;
 	SecBufferDesc Message;
-	SecBuffer *pDataBuffer;
-	SecBuffer *pExtraBuffer;
-
-	if ( ssl == NULL || g_pSSPI == NULL )
-	{
-		return -1;
-	}
 
-	if ( ssl->rd.scRet == SEC_I_CONTINUE_NEEDED )
-	{
-		// Handle any remaining data that was already decoded.
-		if ( lpBuffers->buf != NULL && lpBuffers->len > 0 && ssl->cbRecDataBuf > 0 )
-		{
-			lpNumberOfBytesDecrypted = min( ( DWORD )lpBuffers->len, ssl->cbRecDataBuf );
-			_memcpy_s( lpBuffers->buf, lpBuffers->len, ssl->pbRecDataBuf, lpNumberOfBytesDecrypted );
-
-			DWORD rbytes = ssl->cbRecDataBuf - lpNumberOfBytesDecrypted;
-			if ( rbytes > 0 )
-			{
-				_memmove( ssl->pbRecDataBuf, ( ( char * )ssl->pbRecDataBuf ) + lpNumberOfBytesDecrypted, rbytes );
-			}
-			else
-			{
-				ssl->rd.scRet = SEC_E_OK;
-			}
-			ssl->cbRecDataBuf = rbytes;
-		}
-
-		return ssl->rd.scRet;
-	}
+	pDataBuffer = NULL;
+	pExtraBuffer = NULL;
 
 	_memzero( ssl->rd.Buffers, sizeof( SecBuffer ) * 4 );
 
 	//ssl->cbIoBuffer = lpBuffers->len;
 
 	// Attempt to decrypt the received data.
-	ssl->rd.Buffers[ 0 ].pvBuffer = ssl->pbIoBuffer;
+	ssl->rd.Buffers[ 0 ].pvBuffer = ssl->pbIoBuffer + ssl->ofIoBuffer;
 	ssl->rd.Buffers[ 0 ].cbBuffer = ssl->cbIoBuffer;
 	ssl->rd.Buffers[ 0 ].BufferType = SECBUFFER_DATA;
 
@@ -1325,8 +1422,6 @@ SECURITY_STATUS SSL_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumb
 	}
 
 	// Locate data and (optional) extra buffers.
-	pDataBuffer  = NULL;
-	pExtraBuffer = NULL;
 	for ( int i = 1; i < 4; i++ )
 	{
 		if ( pDataBuffer == NULL && ssl->rd.Buffers[ i ].BufferType == SECBUFFER_DATA )
@@ -1340,45 +1435,75 @@ SECURITY_STATUS SSL_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumb
 		}
 	}
 
+	return ssl->rd.scRet;
+}
+
+SECURITY_STATUS Schannel_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumberOfBytesDecrypted )
+{
+	lpNumberOfBytesDecrypted = 0;
+	SecBuffer *pDataBuffer;
+	SecBuffer *pExtraBuffer;
+
+	if ( ssl == NULL || g_pSSPI == NULL )
+	{
+		return -1;
+	}
+
+	if ( ssl->rd.scRet == SEC_I_CONTINUE_NEEDED )
+	{
+		// Handle any remaining data that was already decoded.
+		if ( lpBuffers->buf != NULL && lpBuffers->len > 0 && ssl->cbRecData > 0 )
+		{
+			lpNumberOfBytesDecrypted = min( ( DWORD )lpBuffers->len, ssl->cbRecData );
+			_memcpy_s( lpBuffers->buf, lpBuffers->len, ssl->pbRecData, lpNumberOfBytesDecrypted );
+
+			ssl->pbRecData += lpNumberOfBytesDecrypted;
+			ssl->cbRecData -= lpNumberOfBytesDecrypted;
+
+			if ( ssl->cbRecData == 0 )
+			{
+				ssl->pbRecData = NULL;
+
+				ssl->rd.scRet = SEC_E_OK;
+			}
+		}
+
+		return ssl->rd.scRet;
+	}
+
+	Schannel_DecryptMessage( ssl, pDataBuffer, pExtraBuffer );
+	if ( ssl->rd.scRet != SEC_E_OK && ssl->rd.scRet != SEC_I_RENEGOTIATE )
+	{
+		return ssl->rd.scRet;
+	}
+
 	// Return decrypted data.
 	if ( pDataBuffer != NULL )
 	{
 		lpNumberOfBytesDecrypted = min( ( DWORD )lpBuffers->len, pDataBuffer->cbBuffer );
 		_memcpy_s( lpBuffers->buf, lpBuffers->len, pDataBuffer->pvBuffer, lpNumberOfBytesDecrypted );
 
-		// Remaining bytes.
+		// Remaining bytes. They stay where they were decrypted until the next call.
 		DWORD rbytes = pDataBuffer->cbBuffer - lpNumberOfBytesDecrypted;
 		if ( rbytes > 0 )
 		{
-			if ( ssl->sbRecDataBuf < rbytes ) 
-			{
-				ssl->sbRecDataBuf = rbytes;
-
-				if ( ssl->pbRecDataBuf == NULL )
-				{
-					ssl->pbRecDataBuf = ( PUCHAR )GlobalAlloc( GPTR, ssl->sbRecDataBuf );
-				}
-				else
-				{
-					ssl->pbRecDataBuf = ( PUCHAR )GlobalReAlloc( ssl->pbRecDataBuf, ssl->sbRecDataBuf, GMEM_MOVEABLE );
-				}
-			}
-	
-			_memcpy_s( ssl->pbRecDataBuf, ssl->sbRecDataBuf, ( char * )pDataBuffer->pvBuffer + lpNumberOfBytesDecrypted, rbytes );
-			ssl->cbRecDataBuf = rbytes;
+			ssl->pbRecData = ( BYTE * )pDataBuffer->pvBuffer + lpNumberOfBytesDecrypted;
+			ssl->cbRecData = rbytes;
 
 			ssl->rd.scRet = SEC_I_CONTINUE_NEEDED;
 		}
 	}
 
-	// Move any extra data to the input buffer.
+	// The extra data is the start of the next record. Leave it where it is.
 	if ( pExtraBuffer != NULL )
 	{
-		_memmove( ssl->pbIoBuffer, pExtraBuffer->pvBuffer, pExtraBuffer->cbBuffer );
+		ssl->ofIoBuffer = ( DWORD )( ( BYTE * )pExtraBuffer->pvBuffer - ssl->pbIoBuffer );
 		ssl->cbIoBuffer = pExtraBuffer->cbBuffer;
 	}
 	else
 	{
+		// Nothing can be received over the remaining decrypted data.
+		ssl->ofIoBuffer = ( ssl->cbRecData > 0 ? ( DWORD )( ( ssl->pbRecData + ssl->cbRecData ) - ssl->pbIoBuffer ) : 0 );
 		ssl->cbIoBuffer = 0;
 	}
 
@@ -1395,6 +1520,207 @@ SECURITY_STATUS SSL_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumb
 	return ssl->rd.scRet;
 }
 
+// Decrypt the next record and return its data where it was decrypted instead of copying it.
+// The data stays valid until the next call to SSL_WSARecv, since nothing is received over it before then.
+SECURITY_STATUS Schannel_WSARecv_DecryptInPlace( SSL *ssl, char **data, DWORD &data_length )
+{
+	*data = NULL;
+	data_length = 0;
+
+	SecBuffer *pDataBuffer;
+	SecBuffer *pExtraBuffer;
+
+	if ( ssl == NULL || g_pSSPI == NULL )
+	{
+		return -1;
+	}
+
+	// The rest of a record that Schannel_WSARecv_Decrypt couldn't fit in its caller's buffer.
+	if ( ssl->rd.scRet == SEC_I_CONTINUE_NEEDED )
+	{
+		if ( ssl->cbRecData > 0 )
+		{
+			*data = ( char * )ssl->pbRecData;
+			data_length = ssl->cbRecData;
+
+			ssl->pbRecData = NULL;
+			ssl->cbRecData = 0;
+		}
+
+		ssl->rd.scRet = SEC_E_OK;
+
+		return ssl->rd.scRet;
+	}
+
+	Schannel_DecryptMessage( ssl, pDataBuffer, pExtraBuffer );
+	if ( ssl->rd.scRet != SEC_E_OK && ssl->rd.scRet != SEC_I_RENEGOTIATE )
+	{
+		return ssl->rd.scRet;
+	}
+
+	if ( pDataBuffer != NULL )
+	{
+		*data = ( char * )pDataBuffer->pvBuffer;
+		data_length = pDataBuffer->cbBuffer;
+	}
+
+	// The extra data is the start of the next record. Leave it where it is.
+	if ( pExtraBuffer != NULL )
+	{
+		ssl->ofIoBuffer = ( DWORD )( ( BYTE * )pExtraBuffer->pvBuffer - ssl->pbIoBuffer );
+		ssl->cbIoBuffer = pExtraBuffer->cbBuffer;
+	}
+	else
+	{
+		ssl->ofIoBuffer = 0;
+		ssl->cbIoBuffer = 0;
+	}
+
+	return ssl->rd.scRet;
+}
+
+bool Schannel_HasBufferedData( SSL *ssl )
+{
+	return ( ssl->continue_decrypt || ssl->cbIoBuffer > 0 );
+}
+
+SSL_BACKEND g_schannel_backend =
+{
+	Schannel_New,
+	Schannel_Free,
+	Schannel_WSAAccept_Reply,
+	Schannel_WSAAccept_Response,
+	Schannel_WSAConnect,
+	Schannel_WSAConnect_Response,
+	Schannel_WSAConnect_Reply,
+	Schannel_WSAShutdown,
+	Schannel_WSASend,
+	Schannel_WSARecv_Decrypt,
+	Schannel_WSARecv_DecryptInPlace,
+	Schannel_HasBufferedData
+};
+
+SECURITY_STATUS SSL_WSAAccept_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL || context->ssl->backend->WSAAccept_Reply == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return context->ssl->backend->WSAAccept_Reply( context, overlapped, sent );
+}
+
+SECURITY_STATUS SSL_WSAAccept_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL || context->ssl->backend->WSAAccept_Response == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return context->ssl->backend->WSAAccept_Response( context, overlapped, sent );
+}
+
+SECURITY_STATUS SSL_WSAConnect( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, char *host, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return context->ssl->backend->WSAConnect( context, overlapped, host, sent );
+}
+
+SECURITY_STATUS SSL_WSAConnect_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return context->ssl->backend->WSAConnect_Response( context, overlapped, sent );
+}
+
+SECURITY_STATUS SSL_WSAConnect_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return context->ssl->backend->WSAConnect_Reply( context, overlapped, sent );
+}
+
+SECURITY_STATUS SSL_WSAShutdown( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return context->ssl->backend->WSAShutdown( context, overlapped, sent );
+}
+
+SECURITY_STATUS SSL_WSASend( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, WSABUF *send_buf, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return context->ssl->backend->WSASend( context, overlapped, send_buf, sent );
+}
+
+SECURITY_STATUS SSL_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumberOfBytesDecrypted )
+{
+	lpNumberOfBytesDecrypted = 0;
+
+	if ( ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return ssl->backend->WSARecv_Decrypt( ssl, lpBuffers, lpNumberOfBytesDecrypted );
+}
+
+SECURITY_STATUS SSL_WSARecv_DecryptInPlace( SSL *ssl, char **data, DWORD &data_length )
+{
+	*data = NULL;
+	data_length = 0;
+
+	if ( ssl == NULL || ssl->backend->WSARecv_DecryptInPlace == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return ssl->backend->WSARecv_DecryptInPlace( ssl, data, data_length );
+}
+
+// Determines whether the backend can hand out decrypted data without copying it.
+bool SSL_CanDecryptInPlace( SSL *ssl )
+{
+	return ( ssl != NULL && ssl->backend->WSARecv_DecryptInPlace != NULL );
+}
+
+// Determines whether the SSL/TLS layer is holding any received data that hasn't been returned to the caller.
+bool SSL_HasBufferedData( SSL *ssl )
+{
+	return ( ssl != NULL && ssl->backend->HasBufferedData( ssl ) );
+}
+
 PCCERT_CONTEXT LoadPublicPrivateKeyPair( wchar_t *cer, wchar_t *key )
 {
 	bool failed = false;
@@ -32,6 +32,9 @@
 #define SSL_STATE_SHUTDOWN		0
 #define SSL_STATE_RUNNING		1
 
+#define SSL_BACKEND_SCHANNEL	0
+#define SSL_BACKEND_OPENSSL		1
+
 #define SP_PROT_TLS1_1_SERVER		0x00000100
 #define SP_PROT_TLS1_1_CLIENT		0x00000200
 #define SP_PROT_TLS1_1				( SP_PROT_TLS1_1_SERVER | SP_PROT_TLS1_1_CLIENT )
@@ -39,6 +42,18 @@
 #define SP_PROT_TLS1_2_CLIENT		0x00000800
 #define SP_PROT_TLS1_2				( SP_PROT_TLS1_2_SERVER | SP_PROT_TLS1_2_CLIENT )
 
+#ifndef SECPKG_ATTR_SESSION_INFO
+	#define SECPKG_ATTR_SESSION_INFO	0x5d
+	#define SSL_SESSION_RECONNECT		1
+
+	typedef struct _SecPkgContext_SessionInfo
+	{
+		DWORD dwFlags;
+		DWORD cbSessionId;
+		BYTE  rgbSessionId[ 32 ];
+	} SecPkgContext_SessionInfo, *PSecPkgContext_SessionInfo;
+#endif
+
 /*struct ACCEPT_DATA
 {
 	SecBuffer		InBuffers[ 2 ];
@@ -83,6 +98,7 @@ struct SEND_DATA
 	SecPkgContext_StreamSizes Sizes;
 
 	PUCHAR			pbDataBuffer;
+	DWORD			sbDataBuffer;	// Only used by the OpenSSL backend.
 };
 
 struct SHUTDOWN_DATA
@@ -90,38 +106,91 @@ struct SHUTDOWN_DATA
     SecBuffer		OutBuffers[ 1 ];
 };
 
+struct OPENSSL_DATA
+{
+	void			*ssl;		// The OpenSSL connection object.
+	void			*rbio;		// Memory BIO holding the encrypted data we've received.
+	void			*wbio;		// Memory BIO holding the encrypted data we need to send.
+	char			*host;		// The session cache key.
+	bool			handshake_done;
+	bool			session_cached;
+};
+
+struct SSL_BACKEND;
+
 struct SSL
 {
 	SEND_DATA				sd;
 	ACCEPT_CONNECT_DATA		acd;
 	RECV_DATA				rd;
 	SHUTDOWN_DATA			sdd;
+	OPENSSL_DATA			od;
+
+	SSL_BACKEND *backend;
 
 	CtxtHandle hContext;
 
-	BYTE *pbRecDataBuf;
+	BYTE *pbRecData;	// Decrypted data that hasn't been returned yet. Points into pbIoBuffer.
 	BYTE *pbIoBuffer;
 
 	SOCKET s;
 
 	//DWORD dwProtocol;
 
-	DWORD cbRecDataBuf;
-	DWORD sbRecDataBuf;
+	DWORD cbRecData;
 
+	DWORD ofIoBuffer;	// The offset of the first undecrypted byte in pbIoBuffer.
 	DWORD cbIoBuffer;
 	DWORD sbIoBuffer;
 
+	DWORD handshake_start;	// The tick count when the ClientHello was generated.
+
 	bool is_server;
 	bool continue_decrypt;
 };
 
+struct SOCKET_CONTEXT;
+struct OVERLAPPEDEX;
+
+// A provider for the handshake, encrypt, decrypt, and shutdown steps that connection.cpp drives.
+// Every provider reads encrypted data into pbIoBuffer (see SSL_WSAAccept and SSL_WSARecv) and reports its results with SECURITY_STATUS codes.
+// The accept functions can be NULL for providers that only handle client connections.
+struct SSL_BACKEND
+{
+	bool ( *New )( SSL *ssl, DWORD protocol );
+	void ( *Free )( SSL *ssl );
+
+	SECURITY_STATUS ( *WSAAccept_Reply )( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent );
+	SECURITY_STATUS ( *WSAAccept_Response )( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent );
+
+	SECURITY_STATUS ( *WSAConnect )( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, char *host, bool &sent );
+	SECURITY_STATUS ( *WSAConnect_Response )( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent );
+	SECURITY_STATUS ( *WSAConnect_Reply )( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent );
+
+	SECURITY_STATUS ( *WSAShutdown )( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent );
+
+	SECURITY_STATUS ( *WSASend )( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, WSABUF *send_buf, bool &sent );
+	SECURITY_STATUS ( *WSARecv_Decrypt )( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumberOfBytesDecrypted );
+	SECURITY_STATUS ( *WSARecv_DecryptInPlace )( SSL *ssl, char **data, DWORD &data_length );	// Can be NULL if the decrypted data can't be handed out where it is.
+
+	bool ( *HasBufferedData )( SSL *ssl );
+};
+
 int SSL_library_init( void );
 int SSL_library_uninit( void );
 
 SSL *SSL_new( DWORD protocol, bool is_server );
 void SSL_free( SSL *ssl );
 
+bool SSL_HasBufferedData( SSL *ssl );
+bool SSL_CanDecryptInPlace( SSL *ssl );
+
+void RecordClientHandshake( SSL *ssl, bool resumed );
+void RecordDecryptedData( DWORD bytes_decrypted, bool copied );
+
+bool OpenSSL_Init();
+void OpenSSL_UnInit();
+
 void ResetServerCredentials();
 void ResetClientCredentials();
 
@@ -132,4 +201,18 @@ extern PCCERT_CONTEXT g_pCertContext;
 
 extern unsigned char ssl_state;
 
+extern unsigned char g_ssl_backend_type;
+
+extern SSL_BACKEND g_schannel_backend;
+extern SSL_BACKEND g_openssl_backend;
+
+extern CRITICAL_SECTION ssl_cs;					// Guard access to the credential handles and handshake counters.
+
+extern unsigned long g_ssl_full_handshakes;
+extern unsigned long g_ssl_resumed_handshakes;
+extern unsigned long long g_ssl_handshake_time;
+
+extern unsigned long long g_ssl_bytes_decrypted;
+extern unsigned long long g_ssl_bytes_copied;
+
 #endif
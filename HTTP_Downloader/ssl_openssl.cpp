@@ -0,0 +1,582 @@
+/*
+	HTTP Downloader can download files through HTTP(S) and FTP(S) connections.
+	Copyright (C) 2015-2019 Eric Kutcher
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "ssl.h"
+
+#include "lite_dlls.h"
+#include "lite_libssl.h"
+
+#include "connection.h"
+#include "utilities.h"
+
+// The encrypted data is passed between the socket and OpenSSL through memory BIOs so that the same overlapped IO steps as Schannel can be used.
+
+#define OPENSSL_MAX_MESSAGE_SIZE	16384								// The largest plaintext a TLS record can hold.
+#define OPENSSL_IO_BUFFER_SIZE		( OPENSSL_MAX_MESSAGE_SIZE + 2048 )	// A full record and its overhead.
+
+#define OPENSSL_SESSION_CACHE_LIMIT	64
+
+OSSL_SSL_CTX *g_openssl_ctx = NULL;
+
+dllrbt_tree *g_openssl_session_cache = NULL;	// OSSL_SSL_SESSION values keyed by host. Guarded by ssl_cs.
+unsigned int g_openssl_session_count = 0;
+
+bool OpenSSL_Init()
+{
+	if ( !InitializeLibSSL() )
+	{
+		return false;
+	}
+
+	g_openssl_ctx = _SSL_CTX_new( _TLS_client_method() );
+	if ( g_openssl_ctx == NULL )
+	{
+		return false;
+	}
+
+	g_openssl_session_cache = dllrbt_create( dllrbt_compare_a );
+
+	return true;
+}
+
+void OpenSSL_UnInit()
+{
+	if ( g_openssl_session_cache != NULL )
+	{
+		node_type *node = dllrbt_get_head( g_openssl_session_cache );
+		while ( node != NULL )
+		{
+			GlobalFree( node->key );
+			_SSL_SESSION_free( ( OSSL_SSL_SESSION * )node->val );
+
+			node = node->next;
+		}
+
+		dllrbt_delete_recursively( g_openssl_session_cache );
+		g_openssl_session_cache = NULL;
+
+		g_openssl_session_count = 0;
+	}
+
+	if ( g_openssl_ctx != NULL )
+	{
+		_SSL_CTX_free( g_openssl_ctx );
+		g_openssl_ctx = NULL;
+	}
+
+	UnInitializeLibSSL();
+}
+
+// Store the connection's session so that the next connection to the host can resume it.
+// TLS 1.3 servers send their session tickets after the handshake, so this is tried again when data is first received.
+void OpenSSL_CacheSession( SSL *ssl )
+{
+	if ( ssl->od.host == NULL || ssl->od.session_cached || g_openssl_session_cache == NULL )
+	{
+		return;
+	}
+
+	OSSL_SSL_SESSION *session = _SSL_get1_session( ssl->od.ssl );
+	if ( session == NULL )
+	{
+		return;
+	}
+
+	if ( _SSL_SESSION_is_resumable( session ) == 0 )
+	{
+		_SSL_SESSION_free( session );
+
+		return;
+	}
+
+	ssl->od.session_cached = true;
+
+	EnterCriticalSection( &ssl_cs );
+
+	node_type *node = ( node_type * )dllrbt_find( g_openssl_session_cache, ( void * )ssl->od.host, false );
+	if ( node != NULL )
+	{
+		_SSL_SESSION_free( ( OSSL_SSL_SESSION * )node->val );
+		node->val = ( void * )session;
+	}
+	else
+	{
+		// Make room by removing the first host in the tree.
+		if ( g_openssl_session_count >= OPENSSL_SESSION_CACHE_LIMIT )
+		{
+			node = dllrbt_get_head( g_openssl_session_cache );
+			if ( node != NULL )
+			{
+				char *key = ( char * )node->key;
+				OSSL_SSL_SESSION *old_session = ( OSSL_SSL_SESSION * )node->val;
+
+				dllrbt_remove( g_openssl_session_cache, ( dllrbt_iterator * )node );
+
+				GlobalFree( key );
+				_SSL_SESSION_free( old_session );
+
+				--g_openssl_session_count;
+			}
+		}
+
+		char *key = GlobalStrDupA( ssl->od.host );
+		if ( key != NULL && dllrbt_insert( g_openssl_session_cache, ( void * )key, ( void * )session ) == DLLRBT_STATUS_OK )
+		{
+			++g_openssl_session_count;
+		}
+		else
+		{
+			GlobalFree( key );
+			_SSL_SESSION_free( session );
+		}
+	}
+
+	LeaveCriticalSection( &ssl_cs );
+}
+
+bool OpenSSL_New( SSL *ssl, DWORD protocol )
+{
+	if ( g_openssl_ctx == NULL )
+	{
+		return false;
+	}
+
+	ssl->od.ssl = _SSL_new( g_openssl_ctx );
+	if ( ssl->od.ssl == NULL )
+	{
+		return false;
+	}
+
+	ssl->od.rbio = _BIO_new( _BIO_s_mem() );
+	ssl->od.wbio = _BIO_new( _BIO_s_mem() );
+	ssl->pbIoBuffer = ( PUCHAR )GlobalAlloc( GPTR, OPENSSL_IO_BUFFER_SIZE );
+
+	if ( ssl->od.rbio == NULL || ssl->od.wbio == NULL || ssl->pbIoBuffer == NULL )
+	{
+		if ( ssl->od.rbio != NULL )
+		{
+			_BIO_free( ssl->od.rbio );
+		}
+
+		if ( ssl->od.wbio != NULL )
+		{
+			_BIO_free( ssl->od.wbio );
+		}
+
+		if ( ssl->pbIoBuffer != NULL )
+		{
+			GlobalFree( ssl->pbIoBuffer );
+		}
+
+		_SSL_free( ssl->od.ssl );
+
+		return false;
+	}
+
+	ssl->sbIoBuffer = OPENSSL_IO_BUFFER_SIZE;
+
+	// The SSL object owns the BIOs after this.
+	_SSL_set_bio( ssl->od.ssl, ssl->od.rbio, ssl->od.wbio );
+
+	// Allow the lowest version that was requested.
+	long min_version;
+	if ( protocol & SP_PROT_SSL3 )			{ min_version = SSL3_VERSION; }
+	else if ( protocol & SP_PROT_TLS1 )		{ min_version = TLS1_VERSION; }
+	else if ( protocol & SP_PROT_TLS1_1 )	{ min_version = TLS1_1_VERSION; }
+	else									{ min_version = TLS1_2_VERSION; }
+
+	_SSL_ctrl( ssl->od.ssl, SSL_CTRL_SET_MIN_PROTO_VERSION, min_version, NULL );
+
+	_SSL_set_connect_state( ssl->od.ssl );
+
+	return true;
+}
+
+void OpenSSL_Free( SSL *ssl )
+{
+	if ( ssl->od.ssl != NULL )
+	{
+		_SSL_free( ssl->od.ssl );	// Frees the BIOs.
+		ssl->od.ssl = NULL;
+		ssl->od.rbio = NULL;
+		ssl->od.wbio = NULL;
+	}
+
+	if ( ssl->od.host != NULL )
+	{
+		GlobalFree( ssl->od.host );
+		ssl->od.host = NULL;
+	}
+}
+
+// Send whatever OpenSSL has written to the write BIO.
+// sent is false if there was nothing to send.
+bool OpenSSL_SendPending( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	SSL *ssl = context->ssl;
+
+	sent = false;
+
+	DWORD pending = ( DWORD )_BIO_ctrl_pending( ssl->od.wbio );
+	if ( pending == 0 )
+	{
+		return true;
+	}
+
+	// ssl->sd.pbDataBuffer is freed when we clean up the connection.
+	if ( ssl->sd.sbDataBuffer < pending )
+	{
+		PUCHAR data_buffer;
+		if ( ssl->sd.pbDataBuffer == NULL )
+		{
+			data_buffer = ( PUCHAR )GlobalAlloc( GMEM_FIXED, pending );
+		}
+		else
+		{
+			data_buffer = ( PUCHAR )GlobalReAlloc( ssl->sd.pbDataBuffer, pending, GMEM_MOVEABLE );
+		}
+
+		if ( data_buffer == NULL )
+		{
+			return false;
+		}
+
+		ssl->sd.pbDataBuffer = data_buffer;
+		ssl->sd.sbDataBuffer = pending;
+	}
+
+	int data_length = _BIO_read( ssl->od.wbio, ssl->sd.pbDataBuffer, ( int )pending );
+	if ( data_length <= 0 )
+	{
+		return false;
+	}
+
+	sent = true;
+
+	context->wsabuf.buf = ( char * )ssl->sd.pbDataBuffer;
+	context->wsabuf.len = data_length;
+
+	overlapped->current_operation = IO_Write;
+
+	int nRet = _WSASend( ssl->s, &context->wsabuf, 1, NULL, 0, ( WSAOVERLAPPED * )overlapped, NULL );
+	if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
+	{
+		sent = false;
+
+		return false;
+	}
+
+	return true;
+}
+
+// Advance the handshake with the data in the read BIO and send any reply.
+// Returns SEC_I_CONTINUE_NEEDED if data was sent. ssl->acd.scRet holds the state of the handshake.
+SECURITY_STATUS OpenSSL_Handshake( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	SSL *ssl = context->ssl;
+
+	sent = false;
+
+	int ret = _SSL_do_handshake( ssl->od.ssl );
+	if ( ret == 1 )
+	{
+		ssl->acd.scRet = SEC_E_OK;
+
+		if ( !ssl->od.handshake_done )
+		{
+			ssl->od.handshake_done = true;
+
+			RecordClientHandshake( ssl, ( _SSL_session_reused( ssl->od.ssl ) == 1 ) );
+
+			OpenSSL_CacheSession( ssl );
+		}
+	}
+	else if ( _SSL_get_error( ssl->od.ssl, ret ) == SSL_ERROR_WANT_READ )
+	{
+		ssl->acd.scRet = SEC_I_CONTINUE_NEEDED;
+	}
+	else
+	{
+		ssl->acd.scRet = SEC_E_INTERNAL_ERROR;
+
+		return ssl->acd.scRet;
+	}
+
+	if ( !OpenSSL_SendPending( context, overlapped, sent ) )
+	{
+		ssl->acd.scRet = SEC_E_INTERNAL_ERROR;
+
+		return ssl->acd.scRet;
+	}
+
+	// OpenSSL_WSAConnect_Response will be called when the send completes.
+	if ( sent )
+	{
+		return SEC_I_CONTINUE_NEEDED;
+	}
+
+	return ssl->acd.scRet;
+}
+
+SECURITY_STATUS OpenSSL_WSAConnect( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, char *host, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL || overlapped == NULL || context->ssl->od.ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	SSL *ssl = context->ssl;
+
+	ssl->cbIoBuffer = 0;
+
+	ssl->acd.scRet = SEC_I_CONTINUE_NEEDED;
+
+	ssl->handshake_start = GetTickCount();
+
+	if ( host != NULL && ssl->od.host == NULL )
+	{
+		ssl->od.host = GlobalStrDupA( host );
+
+		_SSL_ctrl( ssl->od.ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, ( void * )host );
+
+		if ( g_openssl_session_cache != NULL )
+		{
+			EnterCriticalSection( &ssl_cs );
+
+			// SSL_set_session takes its own reference.
+			OSSL_SSL_SESSION *session = ( OSSL_SSL_SESSION * )dllrbt_find( g_openssl_session_cache, ( void * )host, true );
+			if ( session != NULL )
+			{
+				_SSL_set_session( ssl->od.ssl, session );
+			}
+
+			LeaveCriticalSection( &ssl_cs );
+		}
+	}
+
+	// Generate and send the ClientHello.
+	return OpenSSL_Handshake( context, overlapped, sent );
+}
+
+SECURITY_STATUS OpenSSL_WSAConnect_Response( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL || overlapped == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	SSL *ssl = context->ssl;
+
+	// Our last handshake message has been sent, or we need to wait for the server.
+	if ( ssl->acd.scRet != SEC_I_CONTINUE_NEEDED )
+	{
+		return ssl->acd.scRet;
+	}
+
+	WSABUF encrypted_buf;
+	encrypted_buf.buf = ( char * )ssl->pbIoBuffer + ssl->cbIoBuffer;
+	encrypted_buf.len = ssl->sbIoBuffer - ssl->cbIoBuffer;
+
+	sent = true;
+
+	DWORD dwFlags = 0;
+	int nRet = _WSARecv( ssl->s, &encrypted_buf, 1, NULL, &dwFlags, ( WSAOVERLAPPED * )overlapped, NULL );
+	if ( nRet == SOCKET_ERROR && ( _WSAGetLastError() != ERROR_IO_PENDING ) )
+	{
+		sent = false;
+
+		ssl->acd.scRet = SEC_E_INTERNAL_ERROR;
+	}
+
+	return ssl->acd.scRet;
+}
+
+SECURITY_STATUS OpenSSL_WSAConnect_Reply( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL || overlapped == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	SSL *ssl = context->ssl;
+
+	// Hand everything we've received to OpenSSL. Anything past the end of the handshake stays in the BIO for OpenSSL_WSARecv_Decrypt.
+	if ( _BIO_write( ssl->od.rbio, ssl->pbIoBuffer, ( int )ssl->cbIoBuffer ) != ( int )ssl->cbIoBuffer )
+	{
+		ssl->cbIoBuffer = 0;
+
+		ssl->acd.scRet = SEC_E_INTERNAL_ERROR;
+
+		return ssl->acd.scRet;
+	}
+
+	ssl->cbIoBuffer = 0;
+
+	SECURITY_STATUS scRet = OpenSSL_Handshake( context, overlapped, sent );
+
+	// There was nothing to send. Have OpenSSL_WSAConnect_Response read more data.
+	if ( scRet == SEC_I_CONTINUE_NEEDED && !sent )
+	{
+		sent = true;
+
+		PostCompletion( 0, context, overlapped );
+	}
+
+	return scRet;
+}
+
+SECURITY_STATUS OpenSSL_WSAShutdown( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL || overlapped == NULL || !context->ssl->od.handshake_done )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	// Write a close notify alert. We don't wait for the server's.
+	_SSL_shutdown( context->ssl->od.ssl );
+
+	if ( !OpenSSL_SendPending( context, overlapped, sent ) )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return SEC_E_OK;
+}
+
+SECURITY_STATUS OpenSSL_WSASend( SOCKET_CONTEXT *context, OVERLAPPEDEX *overlapped, WSABUF *send_buf, bool &sent )
+{
+	sent = false;
+
+	if ( context == NULL || context->ssl == NULL || overlapped == NULL || send_buf->len == 0 )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	// Truncate the message if it's larger than the maximum allowed size (16 KB).
+	int message_length = ( int )min( ( DWORD )OPENSSL_MAX_MESSAGE_SIZE, ( DWORD )send_buf->len );
+
+	int ret = _SSL_write( context->ssl->od.ssl, send_buf->buf, message_length );
+	if ( ret <= 0 )
+	{
+		return SEC_E_ENCRYPT_FAILURE;
+	}
+
+	send_buf->len -= ret;
+	send_buf->buf += ret;
+
+	if ( !OpenSSL_SendPending( context, overlapped, sent ) || !sent )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	return SEC_E_OK;
+}
+
+SECURITY_STATUS OpenSSL_WSARecv_Decrypt( SSL *ssl, LPWSABUF lpBuffers, DWORD &lpNumberOfBytesDecrypted )
+{
+	lpNumberOfBytesDecrypted = 0;
+
+	if ( ssl->od.ssl == NULL )
+	{
+		return SEC_E_INTERNAL_ERROR;
+	}
+
+	if ( ssl->cbIoBuffer > 0 )
+	{
+		if ( _BIO_write( ssl->od.rbio, ssl->pbIoBuffer, ( int )ssl->cbIoBuffer ) != ( int )ssl->cbIoBuffer )
+		{
+			ssl->cbIoBuffer = 0;
+
+			ssl->rd.scRet = SEC_E_INTERNAL_ERROR;
+
+			return ssl->rd.scRet;
+		}
+
+		// The received data is always appended to the start of pbIoBuffer.
+		ssl->cbIoBuffer = 0;
+	}
+
+	// Nothing more fits in the caller's buffer.
+	if ( lpBuffers->len == 0 )
+	{
+		ssl->rd.scRet = ( _SSL_pending( ssl->od.ssl ) > 0 || _BIO_ctrl_pending( ssl->od.rbio ) > 0 ? SEC_I_CONTINUE_NEEDED : SEC_E_INCOMPLETE_MESSAGE );
+
+		return ssl->rd.scRet;
+	}
+
+	int ret = _SSL_read( ssl->od.ssl, lpBuffers->buf, ( int )lpBuffers->len );
+	if ( ret > 0 )
+	{
+		lpNumberOfBytesDecrypted = ret;
+
+		OpenSSL_CacheSession( ssl );
+
+		// Have the caller process its buffer before asking for the rest.
+		if ( ( DWORD )ret == lpBuffers->len && ( _SSL_pending( ssl->od.ssl ) > 0 || _BIO_ctrl_pending( ssl->od.rbio ) > 0 ) )
+		{
+			ssl->rd.scRet = SEC_I_CONTINUE_NEEDED;
+		}
+		else
+		{
+			ssl->rd.scRet = SEC_E_OK;
+		}
+	}
+	else
+	{
+		switch ( _SSL_get_error( ssl->od.ssl, ret ) )
+		{
+			case SSL_ERROR_WANT_READ:	{ ssl->rd.scRet = SEC_E_INCOMPLETE_MESSAGE; } break;	// Only part of a record has been received.
+			case SSL_ERROR_ZERO_RETURN:	{ ssl->rd.scRet = SEC_I_CONTEXT_EXPIRED; } break;		// The server sent a close notify alert.
+			default:					{ ssl->rd.scRet = SEC_E_DECRYPT_FAILURE; } break;
+		}
+	}
+
+	return ssl->rd.scRet;
+}
+
+bool OpenSSL_HasBufferedData( SSL *ssl )
+{
+	return ( ssl->continue_decrypt ||
+			 ssl->cbIoBuffer > 0 ||
+		   ( ssl->od.ssl != NULL && ( _SSL_pending( ssl->od.ssl ) > 0 || _BIO_ctrl_pending( ssl->od.rbio ) > 0 ) ) );
+}
+
+SSL_BACKEND g_openssl_backend =
+{
+	OpenSSL_New,
+	OpenSSL_Free,
+	NULL,	// Client connections only.
+	NULL,
+	OpenSSL_WSAConnect,
+	OpenSSL_WSAConnect_Response,
+	OpenSSL_WSAConnect_Reply,
+	OpenSSL_WSAShutdown,
+	OpenSSL_WSASend,
+	OpenSSL_WSARecv_Decrypt,
+	NULL,	// SSL_read always copies the data out.
+	OpenSSL_HasBufferedData
+};
@@ -18,6 +18,7 @@
 
 #include "globals.h"
 #include "utilities.h"
+#include "http_parsing.h"
 #include "string_tables.h"
 
 #include "lite_gdi32.h"
@@ -335,6 +336,45 @@ int dllrbt_compare_w( void *a, void *b )
 	return lstrcmpW( ( wchar_t * )a, ( wchar_t * )b );
 }
 
+// The keys point to unsigned int values.
+int dllrbt_compare_ui( void *a, void *b )
+{
+	unsigned int i1 = *( unsigned int * )a;
+	unsigned int i2 = *( unsigned int * )b;
+
+	return ( i1 < i2 ? -1 : ( i1 > i2 ? 1 : 0 ) );
+}
+
+// lstrcmpA is locale aware and can treat two different strings as equal. Compare the bytes instead.
+int dllrbt_compare_ordinal_a( void *a, void *b )
+{
+	unsigned char *s1 = ( unsigned char * )a;
+	unsigned char *s2 = ( unsigned char * )b;
+
+	while ( *s1 != 0 && *s1 == *s2 )
+	{
+		++s1;
+		++s2;
+	}
+
+	return ( *s1 > *s2 ) - ( *s1 < *s2 );
+}
+
+// lstrcmpW is also locale aware.
+int dllrbt_compare_ordinal_w( void *a, void *b )
+{
+	wchar_t *s1 = ( wchar_t * )a;
+	wchar_t *s2 = ( wchar_t * )b;
+
+	while ( *s1 != 0 && *s1 == *s2 )
+	{
+		++s1;
+		++s2;
+	}
+
+	return ( *s1 > *s2 ) - ( *s1 < *s2 );
+}
+
 #define ROTATE_LEFT( x, n ) ( ( ( x ) << ( n ) ) | ( ( x ) >> ( 8 - ( n ) ) ) )
 #define ROTATE_RIGHT( x, n ) ( ( ( x ) >> ( n ) ) | ( ( x ) << ( 8 - ( n ) ) ) )
 
@@ -477,6 +517,8 @@ void SetDefaultColumnOrder()
 	cfg_column_order15 = COLUMN_URL;
 }
 
+#ifndef HEADLESS_BUILD
+
 void UpdateColumnOrders()
 {
 	int arr[ NUM_COLUMNS ];
@@ -491,6 +533,8 @@ void UpdateColumnOrders()
 	}
 }
 
+#endif
+
 void CheckColumnOrders( char *column_arr[], unsigned char num_columns )
 {
 	// Make sure the first column is always 0 or -1.
@@ -582,6 +626,8 @@ void SetDefaultAppearance()
 	cfg_color_15b = cfg_odd_row_background_color;
 }
 
+#ifndef HEADLESS_BUILD
+
 void AdjustRowHeight()
 {
 	int height1, height2;
@@ -606,6 +652,8 @@ void AdjustRowHeight()
 	}
 }
 
+#endif
+
 // Must use GlobalFree on this.
 char *GlobalStrDupA( const char *_Str )
 {
@@ -650,6 +698,146 @@ wchar_t *GlobalStrDupW( const wchar_t *_Str )
 	return ret;
 }
 
+// Returns the pooled copy of a string. size is the number of bytes in the string, including the NULL terminator.
+// If take_ownership is set, then the string must have been allocated with GlobalAlloc and it'll be freed if a copy already exists.
+void *InternPooledString( dllrbt_tree *pool, void *string, unsigned int size, bool take_ownership )
+{
+	void *ret = NULL;
+
+	EnterCriticalSection( &string_pool_cs );
+
+	SHARED_STRING *ss = ( SHARED_STRING * )dllrbt_find( pool, string, true );
+	if ( ss == NULL )
+	{
+		ss = ( SHARED_STRING * )GlobalAlloc( GMEM_FIXED, sizeof( SHARED_STRING ) );
+		if ( ss != NULL )
+		{
+			if ( take_ownership )
+			{
+				ss->string = string;
+			}
+			else
+			{
+				ss->string = GlobalAlloc( GMEM_FIXED, size );
+				if ( ss->string != NULL )
+				{
+					_memcpy_s( ss->string, size, string, size );
+				}
+			}
+
+			ss->count = 1;
+
+			if ( ss->string != NULL && dllrbt_insert( pool, ss->string, ( void * )ss ) == DLLRBT_STATUS_OK )
+			{
+				ret = ss->string;
+			}
+			else
+			{
+				GlobalFree( ss->string );
+				GlobalFree( ss );
+			}
+		}
+		else if ( take_ownership )
+		{
+			GlobalFree( string );
+		}
+	}
+	else
+	{
+		++( ss->count );
+
+		ret = ss->string;
+
+		if ( take_ownership )
+		{
+			GlobalFree( string );
+		}
+	}
+
+	LeaveCriticalSection( &string_pool_cs );
+
+	return ret;
+}
+
+// Frees the pooled string once nothing else is using it.
+void ReleasePooledString( dllrbt_tree *pool, void *string )
+{
+	if ( string == NULL )
+	{
+		return;
+	}
+
+	EnterCriticalSection( &string_pool_cs );
+
+	dllrbt_iterator *itr = dllrbt_find( pool, string, false );
+	if ( itr != NULL )
+	{
+		SHARED_STRING *ss = ( SHARED_STRING * )( ( node_type * )itr )->val;
+
+		if ( ss != NULL )
+		{
+			if ( --ss->count == 0 )
+			{
+				dllrbt_remove( pool, itr );
+
+				GlobalFree( ss->string );
+				GlobalFree( ss );
+			}
+		}
+		else
+		{
+			dllrbt_remove( pool, itr );
+		}
+	}
+
+	LeaveCriticalSection( &string_pool_cs );
+}
+
+// Returns the pooled copy of a string. Downloads that share cookies, headers, POST data, or a host point to the same copy.
+// If take_ownership is set, then the string must have been allocated with GlobalAlloc and it'll be freed if a copy already exists.
+// Must use ReleaseString on this.
+char *InternString( char *string, bool take_ownership )
+{
+	if ( string == NULL || string[ 0 ] == 0 )
+	{
+		if ( take_ownership )
+		{
+			GlobalFree( string );
+		}
+
+		return NULL;
+	}
+
+	return ( char * )InternPooledString( g_string_pool, ( void * )string, lstrlenA( string ) + 1, take_ownership );
+}
+
+// Downloads that share a download directory point to the same copy.
+// Must use ReleaseString on this.
+wchar_t *InternString( wchar_t *string, bool take_ownership )
+{
+	if ( string == NULL || string[ 0 ] == 0 )
+	{
+		if ( take_ownership )
+		{
+			GlobalFree( string );
+		}
+
+		return NULL;
+	}
+
+	return ( wchar_t * )InternPooledString( g_wide_string_pool, ( void * )string, ( lstrlenW( string ) + 1 ) * sizeof( wchar_t ), take_ownership );
+}
+
+void ReleaseString( char *string )
+{
+	ReleasePooledString( g_string_pool, ( void * )string );
+}
+
+void ReleaseString( wchar_t *string )
+{
+	ReleasePooledString( g_wide_string_pool, ( void * )string );
+}
+
 char *strnchr( const char *s, int c, int n )
 {
 	if ( s == NULL )
@@ -947,11 +1135,17 @@ void GetDownloadFilePath( DOWNLOAD_INFO *di, wchar_t file_path[] )
 {
 	if ( di != NULL )
 	{
-		_wmemcpy_s( file_path, MAX_PATH, di->file_path, MAX_PATH );
+		if ( di->download_directory != NULL )
+		{
+			_wmemcpy_s( file_path, MAX_PATH, di->download_directory, di->filename_offset );
+		}
+
 		if ( di->filename_offset > 0 )
 		{
 			file_path[ di->filename_offset - 1 ] = L'\\';	// Replace the download directory NULL terminator with a directory slash.
 		}
+
+		_wmemcpy_s( file_path + di->filename_offset, MAX_PATH - di->filename_offset, di->filename, lstrlenW( di->filename ) + 1 );
 	}
 }
 
@@ -961,11 +1155,11 @@ int GetTemporaryFilePath( DOWNLOAD_INFO *di, wchar_t file_path[] )
 
 	if ( di != NULL )
 	{
-		filename_length = lstrlenW( di->file_path + di->filename_offset );
+		filename_length = lstrlenW( di->filename );
 
 		_wmemcpy_s( file_path, MAX_PATH, cfg_temp_download_directory, g_temp_download_directory_length );
 		file_path[ g_temp_download_directory_length ] = L'\\';	// Replace the download directory NULL terminator with a directory slash.
-		_wmemcpy_s( file_path + ( g_temp_download_directory_length + 1 ), MAX_PATH - ( g_temp_download_directory_length - 1 ), di->file_path + di->filename_offset, filename_length );
+		_wmemcpy_s( file_path + ( g_temp_download_directory_length + 1 ), MAX_PATH - ( g_temp_download_directory_length - 1 ), di->filename, filename_length );
 		file_path[ g_temp_download_directory_length + filename_length + 1 ] = 0;	// Sanity.
 	}
 
@@ -2101,6 +2295,38 @@ void ConstructRequest( SOCKET_CONTEXT *context, bool use_connect )
 			_memcpy_s( context->wsabuf.buf + request_length, context->buffer_size - request_length, "Accept-Encoding: deflate\r\n\0", 27 );
 			request_length += 26;
 		}
+		else if ( context->header_info.content_encoding == CONTENT_ENCODING_BROTLI )
+		{
+			_memcpy_s( context->wsabuf.buf + request_length, context->buffer_size - request_length, "Accept-Encoding: br\r\n\0", 22 );
+			request_length += 21;
+		}
+		else if ( context->header_info.content_encoding == CONTENT_ENCODING_ZSTD )
+		{
+			_memcpy_s( context->wsabuf.buf + request_length, context->buffer_size - request_length, "Accept-Encoding: zstd\r\n\0", 24 );
+			request_length += 23;
+		}
+		// A compressed response can only be downloaded in one part from the beginning, so only ask for it if that's what we're doing.
+		else if ( context->parts == 1 &&
+				  context->header_info.range_info->range_start == 0 &&
+				  context->header_info.range_info->range_end == 0 &&
+				( CanDecompress( CONTENT_ENCODING_BROTLI ) || CanDecompress( CONTENT_ENCODING_ZSTD ) ) )
+		{
+			if ( !CanDecompress( CONTENT_ENCODING_BROTLI ) )
+			{
+				_memcpy_s( context->wsabuf.buf + request_length, context->buffer_size - request_length, "Accept-Encoding: zstd, identity\r\n\0", 34 );
+				request_length += 33;
+			}
+			else if ( !CanDecompress( CONTENT_ENCODING_ZSTD ) )
+			{
+				_memcpy_s( context->wsabuf.buf + request_length, context->buffer_size - request_length, "Accept-Encoding: br, identity\r\n\0", 32 );
+				request_length += 31;
+			}
+			else
+			{
+				_memcpy_s( context->wsabuf.buf + request_length, context->buffer_size - request_length, "Accept-Encoding: br, zstd, identity\r\n\0", 38 );
+				request_length += 37;
+			}
+		}
 		else
 		{
 			_memcpy_s( context->wsabuf.buf + request_length, context->buffer_size - request_length, "Accept-Encoding: identity\r\n\0", 28 );
@@ -34,6 +34,9 @@ bool IsWindowsVersionOrGreater( WORD wMajorVersion, WORD wMinorVersion, WORD wSe
 
 int dllrbt_compare_a( void *a, void *b );
 int dllrbt_compare_w( void *a, void *b );
+int dllrbt_compare_ordinal_a( void *a, void *b );
+int dllrbt_compare_ordinal_w( void *a, void *b );
+int dllrbt_compare_ui( void *a, void *b );
 
 void encode_cipher( char *buffer, int buffer_length );
 void decode_cipher( char *buffer, int buffer_length );
@@ -59,6 +62,11 @@ void AdjustRowHeight();
 char *GlobalStrDupA( const char *_Str );
 wchar_t *GlobalStrDupW( const wchar_t *_Str );
 
+char *InternString( char *string, bool take_ownership = false );
+wchar_t *InternString( wchar_t *string, bool take_ownership = false );
+void ReleaseString( char *string );
+void ReleaseString( wchar_t *string );
+
 char *strnchr( const char *s, int c, int n );
 
 void EscapeFilename( wchar_t *filename );
@@ -85,6 +93,7 @@ char *html_entity_decode_a( char *str, unsigned int str_len, unsigned int *dec_l
 
 wchar_t *ParseHTMLClipboard( char *data );
 
+void kill_worker_thread();
 THREAD_RETURN cleanup( void *pArguments );
 
 char *CreateMD5( BYTE *input, DWORD input_len );
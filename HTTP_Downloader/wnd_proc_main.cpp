@@ -65,9 +65,6 @@ int cy = 0;								// Current y (top) position of the main window based on the m
 
 unsigned char g_total_columns = 0;
 
-unsigned long long g_session_total_downloaded = 0;
-unsigned long long g_session_downloaded_speed = 0;
-
 unsigned long long g_session_last_total_downloaded = 0;
 unsigned long long g_session_last_downloaded_speed = 0;
 
@@ -177,10 +174,17 @@ int CALLBACK DMCompareFunc( LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort )
 
 		switch ( arr[ si->column ] )
 		{
-			case COLUMN_DOWNLOAD_DIRECTORY:		{ return _wcsicmp_s( di1->file_path, di2->file_path ); } break;
-			case COLUMN_FILE_TYPE:				{ return _wcsicmp_s( di1->file_path + di1->file_extension_offset, di2->file_path + di2->file_extension_offset ); } break;
-			case COLUMN_FILENAME:				{ return _wcsicmp_s( di1->file_path + di1->filename_offset, di2->file_path + di2->filename_offset ); } break;
-			case COLUMN_URL:					{ return _wcsicmp_s( di1->url, di2->url ); } break;
+			case COLUMN_DOWNLOAD_DIRECTORY:		{ return _wcsicmp_s( di1->download_directory, di2->download_directory ); } break;
+			case COLUMN_FILE_TYPE:				{ return _wcsicmp_s( di1->filename + di1->file_extension_offset, di2->filename + di2->file_extension_offset ); } break;
+			case COLUMN_FILENAME:				{ return _wcsicmp_s( di1->filename, di2->filename ); } break;
+			case COLUMN_URL:
+			{
+				load_deferred_history_entry( di1 );
+				load_deferred_history_entry( di2 );
+
+				return _wcsicmp_s( di1->url, di2->url );
+			}
+			break;
 
 			case COLUMN_DOWNLOAD_SPEED:			{ return ( di1->speed > di2->speed ); } break;
 			case COLUMN_DOWNLOAD_SPEED_LIMIT:	{ return ( di1->download_speed_limit > di2->download_speed_limit ); } break;
@@ -372,8 +376,6 @@ unsigned int FormatSizes( wchar_t *buffer, unsigned int buffer_size, unsigned ch
 
 DWORD WINAPI UpdateWindow( LPVOID WorkThreadContext )
 {
-	QFILETIME current_time, last_update;
-
 	wchar_t title_text[ 128 ];
 	wchar_t sb_downloaded_buf[ 128 ];
 	wchar_t sb_download_speed_buf[ 128 ];
@@ -391,8 +393,6 @@ DWORD WINAPI UpdateWindow( LPVOID WorkThreadContext )
 
 	unsigned char all_paused = 0;	// 0 = No state, 1 = all downloads are paused, 2 = a download is not paused
 
-	last_update.ull = 0;
-
 	unsigned char speed_buf_length = ( ST_L_Download_speed_ > 102 ? 102 : ST_L_Download_speed_ ); // Let's not overflow. 128 - ( ' ' + 22 +  '/' + 's' + NULL ) = 102 remaining bytes for our string.
 	_wmemcpy_s( sb_download_speed_buf, 128, ST_V_Download_speed_, speed_buf_length );
 	sb_download_speed_buf[ speed_buf_length++ ] = ' ';
@@ -418,16 +418,12 @@ DWORD WINAPI UpdateWindow( LPVOID WorkThreadContext )
 		// This will allow the timer to go through at least one loop after it's been disabled (g_timers_running == false).
 		run_timer = g_timers_running;
 
-		g_session_downloaded_speed = 0;
-
 		if ( TryEnterCriticalSection( &worker_cs ) == TRUE )
 		{
 			if ( TryEnterCriticalSection( &active_download_list_cs ) == TRUE )
 			{
 				DoublyLinkedList *active_download_node = active_download_list;
 
-				unsigned long long time_difference = 0;
-
 				if ( g_taskbar != NULL )
 				{
 					g_taskbar->lpVtbl->SetProgressState( g_taskbar, g_hWnd_main, TBPF_NORMAL );
@@ -437,9 +433,7 @@ DWORD WINAPI UpdateWindow( LPVOID WorkThreadContext )
 
 				all_paused = 0;
 
-				GetSystemTimeAsFileTime( &current_time.ft );
-
-				// Calculate the download totals, speed, elapsed time, etc. while we have active connections.
+				// Calculate the download totals while we have active connections. The speeds are calculated by the Timeout thread.
 				while ( active_download_node != NULL && !g_end_program )
 				{
 					DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )active_download_node->data;
@@ -449,50 +443,8 @@ DWORD WINAPI UpdateWindow( LPVOID WorkThreadContext )
 					{
 						if ( TryEnterCriticalSection( &di->shared_cs ) == TRUE )
 						{
-							// If connecting, downloading, paused, or allocating then calculate the elapsed time.
-							if ( IS_STATUS( di->status,
-									STATUS_CONNECTING |
-									STATUS_DOWNLOADING |
-									STATUS_ALLOCATING_FILE ) )
-							{
-								di->time_elapsed = ( current_time.ull - di->start_time.QuadPart ) / FILETIME_TICKS_PER_SECOND;
-							}
-
-							// If downloading, then calculate the speed.
 							if ( di->status == STATUS_DOWNLOADING )
 							{
-								// Determine the difference (in milliseconds) between the current time and our last update time.
-								time_difference = ( current_time.ull - last_update.ull ) / ( FILETIME_TICKS_PER_SECOND / 1000 );	// Use milliseconds.
-
-								// See if at least 1 second has elapsed since we last updated our speed and download time estimate.
-								if ( time_difference >= 1000 )	// Measure in milliseconds for better precision. 1000 milliseconds = 1 second.
-								{
-									// Get the speed.
-									di->speed = ( ( di->downloaded - di->last_downloaded ) * 1000 ) / time_difference;	// Multiply by 1000 to match the millisecond precision. Gives us bytes/second.
-
-									// Get the time remaining.
-									if ( di->speed > 0 )
-									{
-										if ( di->file_size > 0 && di->downloaded <= di->file_size )
-										{
-											// Get the remaining bytes and divide it by the speed.
-											di->time_remaining = ( di->file_size - di->downloaded ) / di->speed;
-										}
-										else
-										{
-											di->time_remaining = 0;
-										}
-
-										g_session_downloaded_speed += di->speed;
-									}
-									else	// The remaining time will be unknown if the download stalls.
-									{
-										di->time_remaining = 0;
-									}
-
-									di->last_downloaded = di->downloaded;
-								}
-
 								g_progress_info.current_total_downloaded += di->downloaded;
 								g_progress_info.current_total_file_size += di->file_size;
 
@@ -500,9 +452,6 @@ DWORD WINAPI UpdateWindow( LPVOID WorkThreadContext )
 							}
 							else if ( IS_STATUS( di->status, STATUS_PAUSED | STATUS_QUEUED ) )
 							{
-								di->time_remaining = 0;
-								di->speed = 0;
-
 								if ( all_paused == 0 )
 								{
 									all_paused = 1;
@@ -516,8 +465,6 @@ DWORD WINAPI UpdateWindow( LPVOID WorkThreadContext )
 					active_download_node = active_download_node->next;
 				}
 
-				last_update = current_time;
-
 				LeaveCriticalSection( &active_download_list_cs );
 			}
 
@@ -868,7 +815,7 @@ wchar_t *GetDownloadInfoString( DOWNLOAD_INFO *di, int column, int item_index, w
 
 		case COLUMN_DATE_AND_TIME_ADDED:
 		{
-			buf = di->w_add_time;
+			buf = GetDownloadAddTime( di );
 		}
 		break;
 
@@ -876,7 +823,7 @@ wchar_t *GetDownloadInfoString( DOWNLOAD_INFO *di, int column, int item_index, w
 		{
 			if ( !( di->download_operations & DOWNLOAD_OPERATION_SIMULATE ) )
 			{
-				buf = di->file_path;
+				buf = di->download_directory;
 			}
 			else
 			{
@@ -958,7 +905,7 @@ wchar_t *GetDownloadInfoString( DOWNLOAD_INFO *di, int column, int item_index, w
 
 		case COLUMN_FILENAME:
 		{
-			buf = di->file_path + di->filename_offset;
+			buf = di->filename;
 		}
 		break;
 
@@ -1191,6 +1138,8 @@ wchar_t *GetDownloadInfoString( DOWNLOAD_INFO *di, int column, int item_index, w
 
 		case COLUMN_URL:
 		{
+			load_deferred_history_entry( di );
+
 			buf = di->url;
 		}
 		break;
@@ -1361,7 +1310,7 @@ void HandleCommand( HWND hWnd, WPARAM wParam, LPARAM lParam )
 						else
 						{
 							// Try opening the folder without selecting any file.
-							hInst = _ShellExecuteW( NULL, L"open", di->file_path, NULL, NULL, SW_SHOWNORMAL );
+							hInst = _ShellExecuteW( NULL, L"open", di->download_directory, NULL, NULL, SW_SHOWNORMAL );
 						}
 
 						// Use this instead of ILFree on Windows 2000 or later.
@@ -2667,7 +2616,7 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 							if ( di != NULL )
 							{
 								/*// The 32-bit version of _snwprintf in ntdll.dll on Windows XP crashes when a %s proceeds two %llu.
-								int tooltip_buffer_offset = __snwprintf( tooltip_buffer, 512, L"%s: %s\r\n%s: %llu / ", ST_V_Filename, di->file_path + di->filename_offset, ST_V_Downloaded, di->downloaded );
+								int tooltip_buffer_offset = __snwprintf( tooltip_buffer, 512, L"%s: %s\r\n%s: %llu / ", ST_V_Filename, di->filename, ST_V_Downloaded, di->downloaded );
 
 								if ( di->file_size > 0 )
 								{
@@ -2682,11 +2631,11 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 
 								if ( di->file_size > 0 )
 								{
-									__snwprintf( tooltip_buffer, 512, L"%s: %s\r\n%s: %I64u / %I64u bytes\r\n%s: %s", ST_V_Filename, di->file_path + di->filename_offset, ST_V_Downloaded, di->downloaded, di->file_size, ST_V_Added, di->w_add_time );
+									__snwprintf( tooltip_buffer, 512, L"%s: %s\r\n%s: %I64u / %I64u bytes\r\n%s: %s", ST_V_Filename, di->filename, ST_V_Downloaded, di->downloaded, di->file_size, ST_V_Added, GetDownloadAddTime( di ) );
 								}
 								else
 								{
-									__snwprintf( tooltip_buffer, 512, L"%s: %s\r\n%s: %I64u / ? bytes\r\n%s: %s", ST_V_Filename, di->file_path + di->filename_offset, ST_V_Downloaded, di->downloaded, ST_V_Added, di->w_add_time );
+									__snwprintf( tooltip_buffer, 512, L"%s: %s\r\n%s: %I64u / ? bytes\r\n%s: %s", ST_V_Filename, di->filename, ST_V_Downloaded, di->downloaded, ST_V_Added, GetDownloadAddTime( di ) );
 								}
 
 								ti.lpszText = tooltip_buffer;
@@ -2758,11 +2707,11 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 						_SetWindowLongPtrW( g_hWnd_lv_edit, GWLP_WNDPROC, ( LONG_PTR )EditSubProc );
 
 						// Set our edit control's text to the list item's text.
-						_SendMessageW( g_hWnd_lv_edit, WM_SETTEXT, NULL, ( LPARAM )( di->file_path + di->filename_offset ) );
+						_SendMessageW( g_hWnd_lv_edit, WM_SETTEXT, NULL, ( LPARAM )( di->filename ) );
 
 						// Get the length of the filename without the extension.
-						int ext_len = lstrlenW( di->file_path + di->filename_offset );
-						while ( ext_len != 0 && ( di->file_path + di->filename_offset )[ --ext_len ] != L'.' );
+						int ext_len = lstrlenW( di->filename );
+						while ( ext_len != 0 && di->filename[ --ext_len ] != L'.' );
 
 						// Select all the text except the file extension (if ext_len = 0, then everything is selected)
 						_SendMessageW( g_hWnd_lv_edit, EM_SETSEL, 0, ext_len );
@@ -3766,11 +3715,12 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 
 			if ( cfg_enable_download_history && download_history_changed )
 			{
+				download_history_changed = false;
+
 				_wmemcpy_s( base_directory + base_directory_length, MAX_PATH - base_directory_length, L"\\download_history\0", 18 );
 				base_directory[ base_directory_length + 17 ] = 0;	// Sanity.
 
-				save_download_history( base_directory );
-				download_history_changed = false;
+				update_download_history( base_directory );
 			}
 
 			// Get the number of items in the listview.
@@ -3791,9 +3741,9 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 					// di->icon is stored in the icon_handles tree and is destroyed in main.
 					GlobalFree( di->url );
 					GlobalFree( di->w_add_time );
-					GlobalFree( di->cookies );
-					GlobalFree( di->headers );
-					GlobalFree( di->data );
+					ReleaseString( di->cookies );
+					ReleaseString( di->headers );
+					ReleaseString( di->data );
 					//GlobalFree( di->etag );
 					GlobalFree( di->auth_info.username );
 					GlobalFree( di->auth_info.password );
@@ -3803,6 +3753,8 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 						CloseHandle( di->hFile );
 					}
 
+					FreeWriteCache( di );
+
 					while ( di->range_list != NULL )
 					{
 						DoublyLinkedList *range_node = di->range_list;
@@ -3814,6 +3766,9 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 
 					DeleteCriticalSection( &di->shared_cs );
 
+					ReleaseString( di->download_directory );
+					GlobalFree( di->filename );
+					GlobalFree( di->packed_filename );
 					GlobalFree( di );
 				}
 			}
@@ -3886,11 +3841,12 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 
 			if ( cfg_enable_download_history && download_history_changed )
 			{
+				download_history_changed = false;
+
 				_wmemcpy_s( base_directory + base_directory_length, MAX_PATH - base_directory_length, L"\\download_history\0", 18 );
 				base_directory[ base_directory_length + 17 ] = 0;	// Sanity.
 
-				save_download_history( base_directory );
-				download_history_changed = false;
+				update_download_history( base_directory );
 			}
 
 			return 0;
@@ -3907,6 +3863,29 @@ LRESULT CALLBACK MainWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam
 		}
 		break;
 
+		case WM_RELEASE_RANGES:
+		{
+			// The download may have been removed, or restarted, since the message was posted.
+			EnterCriticalSection( &download_list_cs );
+
+			DOWNLOAD_INFO *di = FindDownload( ( unsigned int )wParam );
+			if ( di != NULL )
+			{
+				EnterCriticalSection( &di->shared_cs );
+
+				// We're the only thread that draws the ranges.
+				if ( di->status == STATUS_COMPLETED )
+				{
+					ReleaseCompletedRanges( di );
+				}
+
+				LeaveCriticalSection( &di->shared_cs );
+			}
+
+			LeaveCriticalSection( &download_list_cs );
+		}
+		break;
+
 		default:
 		{
 			if ( msg == WM_TASKBARBUTTONCREATED )
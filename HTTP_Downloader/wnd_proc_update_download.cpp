@@ -22,6 +22,7 @@
 #include "utilities.h"
 #include "connection.h"
 #include "list_operations.h"
+#include "file_operations.h"
 #include "string_tables.h"
 
 #include "wnd_proc.h"
@@ -747,6 +748,8 @@ LRESULT CALLBACK UpdateDownloadWndProc( HWND hWnd, UINT msg, WPARAM wParam, LPAR
 			{
 				DOWNLOAD_INFO *di = ( DOWNLOAD_INFO * )lParam;
 
+				load_deferred_history_entry( di );
+
 				g_update_download_info = di;
 
 				current_parts_num = di->parts;